@@ -20,12 +20,22 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <time.h>
+#include <sys/time.h>
 
 #include "yaffsfs.h"
 
 #include "yaffs_guts.h" /* Only for dumping device innards */
+#include "yaffs_yaffs2.h"
+#include "yaffs_tracebuf.h"
+#include "yaffs_nandprof.h"
+#include "yaffs_mmapem2k.h"
+#include "yaffs_record.h"
+#include "yaffs_delta.h"
+#include "yaffs_norif1.h"
+#include "ynorsim.h"
 
 extern int yaffs_trace_mask;
+extern int yaffs_kill_alloc;
 
 void dumpDir(const char *dname);
 
@@ -2727,6 +2737,260 @@ void test_flash_traffic(const char *mountpt)
 
 }
 
+static u32 trace_time_us(struct yaffs_dev *dev)
+{
+	struct timeval tv;
+
+	(void) dev;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+void trace_buf_test(const char *mountpt)
+{
+	char name[100];
+	int size = 1024 * 1024;
+	void *buf;
+	int n;
+	int i;
+	FILE *f;
+	struct yaffs_dev *dev;
+
+	yaffs_trace_mask = 0;
+
+	yaffs_start_up();
+
+	dev = yaffs_getdev(mountpt);
+	dev->param.trace_buf_records = 32 * 1024;
+	dev->param.trace_buf_mask = 0xffffffff;
+	dev->param.trace_time_fn = trace_time_us;
+
+	yaffs_mount(mountpt);
+
+	sprintf(name,"%s/x",mountpt);
+
+	for(i = 0; i < 10; i++)
+		create_file_of_size(name,1024 * 1024);
+
+	yaffs_unlink(name);
+	yaffs_sync(mountpt);
+
+	buf = malloc(size);
+	n = yaffs_dump_trace_buf(mountpt, buf, size, 1);
+	printf("trace dump %d bytes\n", n);
+
+	if(n > 0) {
+		f = fopen("yaffs-trace.bin","wb");
+		fwrite(buf, 1, n, f);
+		fclose(f);
+	}
+	free(buf);
+
+	yaffs_unmount(mountpt);
+}
+
+static double elapsed_since(struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) +
+		(now.tv_usec - start->tv_usec) / 1000000.0;
+}
+
+void emulator_speed_test(int n_mb)
+{
+	static const char *mountpts[] = { "/yaffs2", "/mmap2k" };
+	char name[100];
+	struct timeval start;
+	unsigned i;
+	int j;
+
+	yaffs_trace_mask = 0;
+
+	yaffs_start_up();
+
+	for(i = 0; i < sizeof(mountpts)/sizeof(mountpts[0]); i++){
+		yaffs_mount(mountpts[i]);
+		sprintf(name,"%s/speed",mountpts[i]);
+
+		gettimeofday(&start, NULL);
+		for(j = 0; j < 4; j++)
+			create_file_of_size(name,n_mb * 1024 * 1024);
+		yaffs_unlink(name);
+		yaffs_unmount(mountpts[i]);
+		yaffs_mount(mountpts[i]);
+		yaffs_unmount(mountpts[i]);
+
+		printf("%s: %d x %dMB written and remounted in %.3f s\n",
+			mountpts[i], j, n_mb, elapsed_since(&start));
+	}
+}
+
+/*
+ * Older builds of mkyaffs2image did not store the tags ECC, so set
+ * no_tags_ecc on the mmap2k device in yaffscfg2k.c to load their images.
+ */
+void mmap_image_test(const char *image_file, const char *saved_file)
+{
+	yaffs_trace_mask = 0;
+
+	/* Use a RAM only mapping so the image is not modified */
+	ymmap2_Configure(NULL, 0, YMMAP2_HUGEPAGES);
+
+	yaffs_start_up();
+
+	if(!ymmap2_LoadImage(image_file)){
+		printf("could not load %s\n", image_file);
+		return;
+	}
+
+	yaffs_mount("/mmap2k");
+	dump_directory_tree("/mmap2k");
+	yaffs_unmount("/mmap2k");
+
+	ymmap2_SaveImage(saved_file);
+}
+
+static int record_write(void *ctx, const void *buf, int n)
+{
+	return fwrite(buf, 1, n, (FILE *)ctx);
+}
+
+static u32 record_time_us(void)
+{
+	return trace_time_us(NULL);
+}
+
+/*
+ * Records a small workload to yaffs-record.bin. Replay it with
+ * direct/tests/yaffs_replay.
+ */
+void record_test(const char *mountpt)
+{
+	char dir[100];
+	char name[200];
+	char name2[200];
+	char buf[1000];
+	yaffs_DIR *d;
+	FILE *f;
+	int h;
+	int i;
+
+	yaffs_trace_mask = 0;
+
+	yaffs_start_up();
+
+	f = fopen("yaffs-record.bin","wb");
+	yaffs_rec_start(record_write, f, record_time_us);
+
+	yaffs_rec_mount(mountpt);
+
+	sprintf(dir,"%s/rec",mountpt);
+	yaffs_rec_mkdir(dir, S_IREAD | S_IWRITE | S_IEXEC);
+
+	memset(buf, 0xaa, sizeof(buf));
+	for(i = 0; i < 20; i++){
+		sprintf(name,"%s/f%d",dir,i);
+		h = yaffs_rec_open(name, O_CREAT | O_TRUNC | O_RDWR, S_IREAD | S_IWRITE);
+		yaffs_rec_write(h, buf, sizeof(buf));
+		yaffs_rec_pwrite(h, buf, sizeof(buf), 10000);
+		yaffs_rec_pread(h, buf, sizeof(buf), 500);
+		if(i % 5 == 0)
+			yaffs_rec_fsync(h);
+		yaffs_rec_close(h);
+	}
+
+	for(i = 0; i < 20; i+= 2){
+		sprintf(name,"%s/f%d",dir,i);
+		sprintf(name2,"%s/g%d",dir,i);
+		yaffs_rec_rename(name, name2);
+	}
+
+	d = yaffs_rec_opendir(dir);
+	while(yaffs_rec_readdir(d))
+		;
+	yaffs_rec_closedir(d);
+
+	for(i = 0; i < 20; i++){
+		sprintf(name,"%s/%c%d",dir,(i & 1) ? 'f' : 'g',i);
+		yaffs_rec_unlink(name);
+	}
+	yaffs_rec_rmdir(dir);
+
+	yaffs_rec_unmount(mountpt);
+
+	yaffs_rec_stop();
+	fclose(f);
+}
+
+void nand_prof_test(const char *mountpt)
+{
+	char name[100];
+	void *buf;
+	int n;
+	int i;
+	FILE *f;
+	struct yaffs_dev *dev;
+
+	yaffs_trace_mask = 0;
+
+	yaffs_start_up();
+
+	dev = yaffs_getdev(mountpt);
+	dev->param.nand_prof = 1;
+
+	yaffs_mount(mountpt);
+
+	for(i = 0; i < 20; i++){
+		sprintf(name,"%s/f%d",mountpt, i % 5);
+		create_file_of_size(name,(i + 1) * 100 * 1024);
+	}
+
+	for(i = 0; i < 5; i++){
+		sprintf(name,"%s/f%d",mountpt, i);
+		yaffs_unlink(name);
+	}
+
+	/* Remount from the checkpoint, then write a new one */
+	yaffs_unmount(mountpt);
+	yaffs_mount(mountpt);
+	sprintf(name,"%s/g",mountpt);
+	create_file_of_size(name, 100 * 1024);
+	yaffs_sync(mountpt);
+
+	n = yaffs_dump_nand_prof(mountpt, NULL, 0, 0);
+	buf = malloc(n);
+	n = yaffs_dump_nand_prof(mountpt, buf, n, 1);
+	printf("NAND profile dump %d bytes\n", n);
+
+	if(n > 0) {
+		struct yaffs_np_hdr *hdr = buf;
+		u32 *counts = (u32 *)(hdr + 1);
+		u32 ckpt[YAFFS_NP_N_OPS] = {0};
+		u32 b;
+		u32 op;
+
+		for(b = 0; b < hdr->n_blocks; b++)
+			for(op = 0; op < hdr->n_ops; op++)
+				ckpt[op] += counts[(b * hdr->n_ops + op) *
+						hdr->n_causes +
+						YAFFS_NP_CHECKPT];
+		printf("checkpoint reads %u writes %u erases %u\n",
+			ckpt[YAFFS_NP_READ], ckpt[YAFFS_NP_WRITE],
+			ckpt[YAFFS_NP_ERASE]);
+	}
+
+	if(n > 0) {
+		f = fopen("yaffs-nandprof.bin","wb");
+		fwrite(buf, 1, n, f);
+		fclose(f);
+	}
+	free(buf);
+
+	yaffs_unmount(mountpt);
+}
+
 void link_follow_test(const char *mountpt)
 {
 	char fn[100];
@@ -2755,6 +3019,1564 @@ void link_follow_test(const char *mountpt)
 
 }
 
+/* Builds an update script in memory for delta_test() */
+static u8 delta_script[20000];
+static int delta_len;
+static int delta_pos;
+
+static void delta_add(int op, int flags, const char *path, const char *path2,
+		u32 a0, u32 a1, u32 a2, const void *data, u32 data_len)
+{
+	struct yaffs_delta_rec rec;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.op = op;
+	rec.flags = flags;
+	rec.path_len = path ? strlen(path) : 0;
+	rec.path2_len = path2 ? strlen(path2) : 0;
+	rec.arg[0] = a0;
+	rec.arg[1] = a1;
+	rec.arg[2] = a2;
+	rec.data_len = data_len;
+
+	memcpy(delta_script + delta_len, &rec, sizeof(rec));
+	delta_len += sizeof(rec);
+	memcpy(delta_script + delta_len, path, rec.path_len);
+	delta_len += rec.path_len;
+	memcpy(delta_script + delta_len, path2, rec.path2_len);
+	delta_len += rec.path2_len;
+	memcpy(delta_script + delta_len, data, data_len);
+	delta_len += data_len;
+}
+
+static int delta_read(void *ctx, void *buf, int n)
+{
+	(void)ctx;
+	if(n > delta_len - delta_pos)
+		n = delta_len - delta_pos;
+	/* Dribble it out to exercise the partial reads */
+	if(n > 100)
+		n = 100;
+	memcpy(buf, delta_script + delta_pos, n);
+	delta_pos += n;
+	return n;
+}
+
+static u32 delta_hash(const u8 *buf, int n)
+{
+	u32 h = YAFFS_DELTA_HASH_INIT;
+
+	while(n-- > 0) {
+		h ^= *buf++;
+		h *= YAFFS_DELTA_HASH_PRIME;
+	}
+	return h;
+}
+
+void delta_test(const char *mountpt)
+{
+	struct yaffs_delta_file_hdr fhdr;
+	struct yaffs_delta_stats stats;
+	struct yaffs_stat st;
+	char name[100];
+	char name2[100];
+	u8 old[6000];
+	u8 new[6000];
+	u8 buf[6000];
+	int h;
+	int ret;
+
+	yaffs_trace_mask = 0;
+
+	yaffs_start_up();
+
+	yaffs_mount(mountpt);
+
+	/* The old tree */
+	memset(old, 'a', sizeof(old));
+	sprintf(name,"%s/d",mountpt);
+	yaffs_mkdir(name, 0755);
+	sprintf(name,"%s/d/patched",mountpt);
+	h = yaffs_open(name, O_CREAT | O_TRUNC | O_RDWR, 0644);
+	yaffs_write(h, old, sizeof(old));
+	yaffs_close(h);
+	sprintf(name,"%s/d/moved",mountpt);
+	h = yaffs_open(name, O_CREAT | O_TRUNC | O_RDWR, 0644);
+	yaffs_write(h, old, 100);
+	yaffs_close(h);
+	sprintf(name,"%s/d/gone",mountpt);
+	h = yaffs_open(name, O_CREAT | O_TRUNC | O_RDWR, 0644);
+	yaffs_close(h);
+
+	/* Change the middle chunk, shorten it and move things about */
+	memcpy(new, old, sizeof(new));
+	memset(new + 2048, 'b', 2048);
+
+	fhdr.magic = YAFFS_DELTA_MAGIC;
+	fhdr.version = YAFFS_DELTA_VERSION;
+	fhdr.chunk_size = 2048;
+	fhdr.flags = 0;
+	memcpy(delta_script, &fhdr, sizeof(fhdr));
+	delta_len = sizeof(fhdr);
+
+	delta_add(YAFFS_DELTA_UNLINK, 0, "d/gone", NULL, 0, 0, 0, NULL, 0);
+	delta_add(YAFFS_DELTA_MKDIR, 0, "e", NULL, 0700, 0, 0, NULL, 0);
+	delta_add(YAFFS_DELTA_RENAME, 0, "d/moved", "e/moved", 0, 0, 0, NULL, 0);
+	delta_add(YAFFS_DELTA_OPEN, YAFFS_DELTA_CHECK, "d/patched", NULL,
+		sizeof(old), delta_hash(old, sizeof(old)), 0, NULL, 0);
+	delta_add(YAFFS_DELTA_TRUNCATE, 0, NULL, NULL, 5000, 0, 0, NULL, 0);
+	delta_add(YAFFS_DELTA_WRITE, 0, NULL, NULL, 2048, 0, 0, new + 2048, 1000);
+	delta_add(YAFFS_DELTA_WRITE, 0, NULL, NULL, 3048, 0, 0, new + 3048, 1048);
+	delta_add(YAFFS_DELTA_CLOSE, YAFFS_DELTA_SET_TIMES, NULL, NULL,
+		0, 1000, 2000, NULL, 0);
+	delta_add(YAFFS_DELTA_CREATE, 0, "e/new", NULL, 0600, 0, 0, NULL, 0);
+	delta_add(YAFFS_DELTA_WRITE, 0, NULL, NULL, 0, 0, 0, new, 3000);
+	delta_add(YAFFS_DELTA_CLOSE, 0, NULL, NULL, 0, 0, 0, NULL, 0);
+	delta_add(YAFFS_DELTA_SYMLINK, 0, "moved", "e/sym", 0, 0, 0, NULL, 0);
+	delta_add(YAFFS_DELTA_END, 0, NULL, NULL, 0, 0, 0, NULL, 0);
+
+	delta_pos = 0;
+	ret = yaffs_delta_apply(mountpt, delta_read, NULL, 4096, &stats);
+	printf("delta apply %d: %u records, %u files, %u writes, %u bytes\n",
+		ret, stats.records, stats.files, stats.writes, stats.bytes);
+	if(ret < 0)
+		printf("error %d\n", yaffs_get_error());
+
+	sprintf(name,"%s/d/patched",mountpt);
+	h = yaffs_open(name, O_RDONLY, 0);
+	yaffs_fstat(h, &st);
+	memset(buf, 0, sizeof(buf));
+	yaffs_read(h, buf, sizeof(buf));
+	yaffs_close(h);
+	printf("patched: size %d mtime %d %s\n", (int)st.st_size,
+		(int)st.yst_mtime,
+		memcmp(buf, new, 5000) ? "differs" : "matches");
+
+	sprintf(name,"%s/e/moved",mountpt);
+	sprintf(name2,"%s/d/gone",mountpt);
+	printf("moved %s, gone %s\n",
+		yaffs_access(name, 0) == 0 ? "found" : "missing",
+		yaffs_access(name2, 0) == 0 ? "still there" : "deleted");
+
+	/* d/patched has changed since, so this must fail the check */
+	delta_len = sizeof(fhdr);
+	delta_add(YAFFS_DELTA_OPEN, YAFFS_DELTA_CHECK, "d/patched", NULL,
+		sizeof(old), delta_hash(old, sizeof(old)), 0, NULL, 0);
+	delta_add(YAFFS_DELTA_CLOSE, 0, NULL, NULL, 0, 0, 0, NULL, 0);
+	delta_add(YAFFS_DELTA_END, 0, NULL, NULL, 0, 0, 0, NULL, 0);
+	delta_pos = 0;
+	ret = yaffs_delta_apply(mountpt, delta_read, NULL, 0, &stats);
+	printf("stale apply %d after %u records, error %d\n",
+		ret, stats.records, yaffs_get_error());
+
+	yaffs_unmount(mountpt);
+}
+
+void compact_obj_test(const char *mountpt)
+{
+	char name[100];
+	int h;
+	int i;
+	int n = 200;
+	int bad = 0;
+	struct yaffs_dev *dev;
+	struct yaffs_utimbuf utb;
+	struct yaffs_stat st;
+
+	yaffs_trace_mask = 0;
+
+	yaffs_start_up();
+
+	dev = yaffs_getdev(mountpt);
+#ifdef CONFIG_YAFFS_COMPACT_OBJ
+	dev->param.n_attr_cache = 16;
+#endif
+	yaffs_mount(mountpt);
+
+	printf("sizeof(struct yaffs_obj) %d\n", (int)sizeof(struct yaffs_obj));
+
+	for(i = 0; i < n; i++){
+		sprintf(name,"%s/c%d",mountpt, i);
+		h = yaffs_open(name,O_CREAT | O_TRUNC | O_RDWR, S_IREAD | S_IWRITE);
+		yaffs_close(h);
+		yaffs_chmod(name, 0600 | (i & 0077));
+		utb.actime = 1000 + i;
+		utb.modtime = 2000 + i;
+		yaffs_utime(name, &utb);
+	}
+
+	yaffs_unmount(mountpt);
+	yaffs_mount(mountpt);
+
+	for(i = 0; i < n; i++){
+		sprintf(name,"%s/c%d",mountpt, i);
+		if(yaffs_stat(name, &st) < 0 ||
+		   (st.st_mode & 0777) != (0600 | (i & 0077)) ||
+		   st.yst_atime != 1000 + i ||
+		   st.yst_mtime != 2000 + i)
+			bad++;
+	}
+	printf("%d of %d objects have the wrong attributes, %d objects in use\n",
+		bad, n, dev->n_obj);
+
+#ifdef CONFIG_YAFFS_COMPACT_OBJ
+	printf("attribute records %d, header loads %u\n",
+		dev->n_attr, dev->attr_loads);
+
+	/* Again with no memory for new attribute records */
+	bad = 0;
+	yaffs_kill_alloc = 1;
+	for(i = 0; i < n; i++){
+		sprintf(name,"%s/c%d",mountpt, i);
+		if(yaffs_stat(name, &st) < 0 ||
+		   st.yst_atime != 1000 + i ||
+		   st.yst_mtime != 2000 + i)
+			bad++;
+		utb.actime = 3000 + i;
+		utb.modtime = 4000 + i;
+		yaffs_utime(name, &utb);
+	}
+	yaffs_kill_alloc = 0;
+
+	yaffs_unmount(mountpt);
+	yaffs_mount(mountpt);
+
+	for(i = 0; i < n; i++){
+		sprintf(name,"%s/c%d",mountpt, i);
+		if(yaffs_stat(name, &st) < 0 ||
+		   (st.st_mode & 0777) != (0600 | (i & 0077)) ||
+		   st.yst_atime != 3000 + i ||
+		   st.yst_mtime != 4000 + i)
+			bad++;
+	}
+	printf("%d of %d objects wrong when out of memory\n", bad, n);
+#endif
+
+	for(i = 0; i < n; i++){
+		sprintf(name,"%s/c%d",mountpt, i);
+		yaffs_unlink(name);
+	}
+
+	yaffs_unmount(mountpt);
+}
+
+static int compact_blocks_check(const char *mountpt, int n, int *sizes)
+{
+	char name[100];
+	unsigned char buf[1000];
+	int bad = 0;
+	int h;
+	int i;
+	int j;
+	int pos;
+	int got;
+
+	for(i = 0; i < n; i++){
+		sprintf(name,"%s/b%d",mountpt, i);
+		h = yaffs_open(name, O_RDONLY, 0);
+		if(sizes[i] < 0) {
+			if(h >= 0) {
+				bad++;
+				yaffs_close(h);
+			}
+			continue;
+		}
+		if(h < 0 || yaffs_lseek(h, 0, SEEK_END) != sizes[i]) {
+			bad++;
+			if(h >= 0)
+				yaffs_close(h);
+			continue;
+		}
+		yaffs_lseek(h, 0, SEEK_SET);
+		for(pos = 0; pos < sizes[i]; pos += got) {
+			got = yaffs_read(h, buf, sizeof(buf));
+			if(got <= 0)
+				break;
+			for(j = 0; j < got; j++)
+				if(buf[j] != (unsigned char)((pos + j) * 7 + i))
+					break;
+			if(j < got)
+				break;
+		}
+		if(pos < sizes[i])
+			bad++;
+		yaffs_close(h);
+	}
+	return bad;
+}
+
+void compact_blocks_test(const char *mountpt)
+{
+	char name[100];
+	unsigned char buf[1000];
+	int sizes[40];
+	int n = 40;
+	int round;
+	int h;
+	int i;
+	int j;
+	int pos;
+	struct yaffs_dev *dev;
+
+	yaffs_trace_mask = 0;
+
+	yaffs_start_up();
+
+	dev = yaffs_getdev(mountpt);
+	yaffs_mount(mountpt);
+
+	for(i = 0; i < n; i++)
+		sizes[i] = -1;
+
+	for(round = 0; round < 6; round++){
+		for(i = round % 3; i < n; i += 3){
+			sprintf(name,"%s/b%d",mountpt, i);
+			if(sizes[i] >= 0 && (i + round) % 4 == 0) {
+				/* Delete it */
+				yaffs_unlink(name);
+				sizes[i] = -1;
+				continue;
+			}
+			if(sizes[i] >= 0 && (i + round) % 4 == 1) {
+				/* Chop it */
+				sizes[i] /= 3;
+				yaffs_truncate(name, sizes[i]);
+				continue;
+			}
+			sizes[i] = 5000 + ((i * 37 + round * 101) % 50) * 4000;
+			h = yaffs_open(name, O_CREAT | O_TRUNC | O_RDWR,
+					S_IREAD | S_IWRITE);
+			for(pos = 0; pos < sizes[i]; pos += sizeof(buf)) {
+				for(j = 0; j < (int)sizeof(buf); j++)
+					buf[j] = (pos + j) * 7 + i;
+				yaffs_write(h, buf,
+					sizes[i] - pos < (int)sizeof(buf) ?
+					sizes[i] - pos : (int)sizeof(buf));
+			}
+			yaffs_close(h);
+		}
+		printf("round %d: %d files bad\n",
+			round, compact_blocks_check(mountpt, n, sizes));
+	}
+
+#ifdef CONFIG_YAFFS_COMPACT_BLOCKS
+	printf("%d blocks, %d chunk bitmaps, %d bytes\n",
+		dev->internal_end_block - dev->internal_start_block + 1,
+		dev->n_chunk_bit_slots,
+		dev->n_chunk_bit_groups * YAFFS_CHUNK_BITS_GROUP *
+			dev->chunk_bit_slot_size);
+	yaffs_pack_block_seqs(dev);
+	printf("after packing sequence numbers: %d files bad\n",
+		compact_blocks_check(mountpt, n, sizes));
+#endif
+
+	yaffs_unmount(mountpt);
+	yaffs_mount(mountpt);
+	printf("after remount: %d files bad\n",
+		compact_blocks_check(mountpt, n, sizes));
+
+	yaffs_unmount(mountpt);
+	dev->param.skip_checkpt_rd = 1;
+	yaffs_mount(mountpt);
+	printf("after scan: %d files bad, %d free\n",
+		compact_blocks_check(mountpt, n, sizes),
+		(int)yaffs_freespace(mountpt));
+	dev->param.skip_checkpt_rd = 0;
+
+	for(i = 0; i < n; i++){
+		sprintf(name,"%s/b%d",mountpt, i);
+		yaffs_unlink(name);
+	}
+
+	yaffs_unmount(mountpt);
+}
+
+void tnode_evict_test(const char *mountpt)
+{
+	char name[100];
+	unsigned char buf[1000];
+	int sizes[40];
+	int n = 40;
+	int h;
+	int i;
+	int j;
+	int pos;
+	struct yaffs_dev *dev;
+	struct yaffs_obj *obj;
+
+	yaffs_trace_mask = 0;
+
+	yaffs_start_up();
+
+	dev = yaffs_getdev(mountpt);
+	dev->param.max_tnodes = 50;
+	yaffs_mount(mountpt);
+
+	for(i = 0; i < n; i++){
+		sprintf(name,"%s/b%d",mountpt, i);
+		sizes[i] = 20000 + ((i * 37) % 50) * 8000;
+		h = yaffs_open(name, O_CREAT | O_TRUNC | O_RDWR,
+				S_IREAD | S_IWRITE);
+		for(pos = 0; pos < sizes[i]; pos += sizeof(buf)) {
+			for(j = 0; j < (int)sizeof(buf); j++)
+				buf[j] = (pos + j) * 7 + i;
+			yaffs_write(h, buf,
+				sizes[i] - pos < (int)sizeof(buf) ?
+				sizes[i] - pos : (int)sizeof(buf));
+		}
+		yaffs_close(h);
+	}
+	printf("written: %d tnodes, %d files evicted, %d evictions\n",
+		dev->n_tnodes, dev->n_evicted_files, dev->tnode_evictions);
+
+	/* A file held open must keep its tree while the others are read */
+	sprintf(name,"%s/b1",mountpt);
+	h = yaffs_open(name, O_RDONLY, 0);
+	yaffs_read(h, buf, sizeof(buf));
+	printf("read back: %d files bad\n",
+		compact_blocks_check(mountpt, n, sizes));
+	obj = yaffs_find_by_name(dev->root_dir, "b1");
+	printf("open file evicted: %d\n", obj ? obj->tnodes_evicted : -1);
+	yaffs_close(h);
+	printf("%d rebuilds looked at %d blocks with %d reads\n",
+		dev->tnode_rebuilds, dev->tnode_rebuild_blocks,
+		dev->tnode_rebuild_reads);
+
+	/* Change files that are evicted */
+	for(i = 0; i < n; i += 4){
+		sprintf(name,"%s/b%d",mountpt, i);
+		sizes[i] /= 3;
+		yaffs_truncate(name, sizes[i]);
+		if(i % 8)
+			continue;
+		h = yaffs_open(name, O_RDWR, 0);
+		yaffs_lseek(h, sizes[i], SEEK_SET);
+		for(j = 0; j < (int)sizeof(buf); j++)
+			buf[j] = (sizes[i] + j) * 7 + i;
+		yaffs_write(h, buf, sizeof(buf));
+		sizes[i] += sizeof(buf);
+		yaffs_close(h);
+	}
+	printf("after changes: %d files bad, %d tnodes\n",
+		compact_blocks_check(mountpt, n, sizes), dev->n_tnodes);
+
+	yaffs_unmount(mountpt);
+	yaffs_mount(mountpt);
+	printf("after remount: %d files evicted, %d files bad\n",
+		dev->n_evicted_files, compact_blocks_check(mountpt, n, sizes));
+
+	yaffs_unmount(mountpt);
+	dev->param.skip_checkpt_rd = 1;
+	yaffs_mount(mountpt);
+	printf("after scan: %d tnodes, %d files bad, %d free\n",
+		dev->n_tnodes, compact_blocks_check(mountpt, n, sizes),
+		(int)yaffs_freespace(mountpt));
+	dev->param.skip_checkpt_rd = 0;
+
+	for(i = 0; i < n; i++){
+		sprintf(name,"%s/b%d",mountpt, i);
+		yaffs_unlink(name);
+	}
+
+	yaffs_unmount(mountpt);
+	dev->param.max_tnodes = 0;
+}
+
+/*
+ * Times the oldest dirty block lookup done after the oldest block is
+ * erased against one that has to look at every block again, then the
+ * worst write latency while churning files.
+ */
+void block_index_test(const char *mountpt)
+{
+	char name[100];
+	unsigned char buf[2048];
+	struct timeval start;
+	double t;
+	double worst = 0;
+	int n_loops = 10000;
+	int h;
+	int i;
+	int j;
+	struct yaffs_dev *dev;
+
+	yaffs_trace_mask = 0;
+
+	yaffs_start_up();
+
+	dev = yaffs_getdev(mountpt);
+	yaffs_mount(mountpt);
+
+	memset(buf, 0x55, sizeof(buf));
+	for(i = 0; i < 200; i++){
+		sprintf(name,"%s/f%d",mountpt, i % 20);
+		h = yaffs_open(name, O_CREAT | O_RDWR, S_IREAD | S_IWRITE);
+		yaffs_lseek(h, ((i * 7) % 64) * sizeof(buf), SEEK_SET);
+		for(j = 0; j < 16; j++)
+			yaffs_write(h, buf, sizeof(buf));
+		yaffs_close(h);
+	}
+
+	gettimeofday(&start, NULL);
+	for(i = 0; i < n_loops; i++){
+		dev->oldest_dirty_seq = 0;
+		yaffs2_find_oldest_dirty_seq(dev);
+	}
+	t = elapsed_since(&start);
+	printf("%d blocks: lookup %.3f us",
+		dev->internal_end_block - dev->internal_start_block + 1,
+		t * 1000000 / n_loops);
+
+	gettimeofday(&start, NULL);
+	for(i = 0; i < n_loops; i++){
+		yaffs2_clear_oldest_dirty_seq(dev, NULL);
+		yaffs2_find_oldest_dirty_seq(dev);
+	}
+	t = elapsed_since(&start);
+	printf(", full rescan %.3f us\n", t * 1000000 / n_loops);
+
+	for(i = 0; i < 2000; i++){
+		sprintf(name,"%s/f%d",mountpt, i % 20);
+		h = yaffs_open(name, O_CREAT | O_RDWR, S_IREAD | S_IWRITE);
+		yaffs_lseek(h, ((i * 13) % 64) * sizeof(buf), SEEK_SET);
+		gettimeofday(&start, NULL);
+		yaffs_write(h, buf, sizeof(buf));
+		t = elapsed_since(&start);
+		if(t > worst)
+			worst = t;
+		yaffs_close(h);
+	}
+	printf("worst write %.3f ms, %d gc copies\n",
+		worst * 1000, dev->n_gc_copies);
+
+	for(i = 0; i < 20; i++){
+		sprintf(name,"%s/f%d",mountpt, i);
+		yaffs_unlink(name);
+	}
+
+	yaffs_unmount(mountpt);
+}
+
+/*
+ * Truncates files and writes past their ends so that they get shrink
+ * headers, on a device that is mostly full, and reports how many chunks
+ * were written for each one written by the test.
+ */
+/*
+ * Truncates and extends files on a mostly full device, then checks them
+ * after a scan. With seq_jump set the sequence number is pushed on every
+ * 50 rounds, so that compact block info has to renumber the blocks.
+ */
+static void shrink_gc_run(const char *mountpt, u32 seq_jump)
+{
+	char name[100];
+	unsigned char buf[2048];
+	unsigned char *shadow[20];
+	int sizes[20];
+	int n = 20;
+	int max_size = 256 * 1024;
+	u32 writes_before;
+	u32 n_written = 0;
+	int h;
+	int i;
+	int j;
+	int k;
+	int round;
+	struct yaffs_dev *dev;
+
+	yaffs_trace_mask = 0;
+
+	yaffs_start_up();
+
+	dev = yaffs_getdev(mountpt);
+	yaffs_mount(mountpt);
+
+	sprintf(name,"%s/filler",mountpt);
+	create_file_of_size(name, yaffs_freespace(mountpt) * 7 / 8);
+
+	for(i = 0; i < n; i++){
+		shadow[i] = calloc(max_size, 1);
+		sizes[i] = 0;
+	}
+
+	writes_before = dev->n_page_writes;
+	for(round = 0; round < 1000; round++){
+		i = (round * 7) % n;
+		sprintf(name,"%s/t%d",mountpt, i);
+		h = yaffs_open(name, O_CREAT | O_RDWR, S_IREAD | S_IWRITE);
+		if(sizes[i] > 0){
+			j = (sizes[i] / 3) & ~1023;
+			memset(shadow[i] + j, 0, sizes[i] - j);
+			sizes[i] = j;
+			yaffs_ftruncate(h, sizes[i]);
+		}
+		if(seq_jump && round % 50 == 25)
+			dev->seq_number += seq_jump;
+		/* Leave a hole that needs a shrink header */
+		sizes[i] += 8 * sizeof(buf);
+		yaffs_lseek(h, sizes[i], SEEK_SET);
+		memset(buf, round + 1, sizeof(buf));
+		for(j = 0; j < 16 + round % 16 &&
+		    sizes[i] + (int)sizeof(buf) <= max_size; j++){
+			yaffs_write(h, buf, sizeof(buf));
+			memcpy(shadow[i] + sizes[i], buf, sizeof(buf));
+			sizes[i] += sizeof(buf);
+			n_written++;
+		}
+		yaffs_close(h);
+	}
+
+	printf("%u chunks written for %u, %u gc copies,"
+		" %u blocks with shrink headers collected\n",
+		dev->n_page_writes - writes_before, n_written,
+		dev->n_gc_copies, dev->n_shrink_gcs);
+
+	/* Scan to see that nothing pruned came back */
+	yaffs_unmount(mountpt);
+	dev->param.skip_checkpt_rd = 1;
+	yaffs_mount(mountpt);
+	dev->param.skip_checkpt_rd = 0;
+	for(i = 0; i < n; i++){
+		sprintf(name,"%s/t%d",mountpt, i);
+		h = yaffs_open(name, O_RDONLY, 0);
+		if(yaffs_lseek(h, 0, SEEK_END) != sizes[i])
+			printf("%s is the wrong size\n", name);
+		yaffs_lseek(h, 0, SEEK_SET);
+		for(j = 0; j < sizes[i]; j += sizeof(buf)){
+			k = sizes[i] - j < (int)sizeof(buf) ?
+				sizes[i] - j : (int)sizeof(buf);
+			if(yaffs_read(h, buf, k) != k ||
+			   memcmp(buf, shadow[i] + j, k)){
+				printf("%s differs at %d\n", name, j);
+				break;
+			}
+		}
+		yaffs_close(h);
+		yaffs_unlink(name);
+		free(shadow[i]);
+	}
+	sprintf(name,"%s/filler",mountpt);
+	yaffs_unlink(name);
+
+	yaffs_unmount(mountpt);
+}
+
+void shrink_gc_test(const char *mountpt)
+{
+	shrink_gc_run(mountpt, 0);
+}
+
+/* With compact block info this crosses several renumberings */
+void shrink_rank_test(const char *mountpt)
+{
+	shrink_gc_run(mountpt, 20000);
+}
+
+void sparse_test(const char *mountpt)
+{
+	char name[100];
+	unsigned char buf[2048];
+	unsigned char *data;
+	int size = 4 * 1024 * 1024;
+	int chunk = 2048;
+	u32 writes_before;
+	u32 reads_before;
+	int pass;
+	int h;
+	int i;
+	off_t pos;
+	struct yaffs_dev *dev;
+
+	yaffs_trace_mask = 0;
+
+	yaffs_start_up();
+
+	dev = yaffs_getdev(mountpt);
+	yaffs_mount(mountpt);
+
+	sprintf(name,"%s/sparse",mountpt);
+	data = calloc(size, 1);
+
+	/* Some data, a small hole inside a chunk and big holes */
+	writes_before = dev->n_page_writes;
+	h = yaffs_open(name, O_CREAT | O_TRUNC | O_RDWR, S_IREAD | S_IWRITE);
+	for(i = 0; i < 4; i++){
+		pos = i * (size / 4) + (i ? 100 : 0);
+		memset(buf, i + 1, sizeof(buf));
+		yaffs_lseek(h, pos, SEEK_SET);
+		yaffs_write(h, buf, 1000);
+		yaffs_write(h, buf, 1000);
+		yaffs_lseek(h, pos + 2100, SEEK_SET);
+		yaffs_write(h, buf, sizeof(buf));
+		memset(data + pos, i + 1, 2000);
+		memset(data + pos + 2100, i + 1, sizeof(buf));
+	}
+	yaffs_ftruncate(h, size);
+	yaffs_close(h);
+	printf("%d byte file with 4 bits of data: %u chunks written\n",
+		size, dev->n_page_writes - writes_before);
+
+	for(pass = 0; pass < 2; pass++){
+		h = yaffs_open(name, O_RDONLY, 0);
+		printf("data at 0 %d, hole at 0 %d, data at 5000 %d,"
+			" hole at %d %d, data at %d %d\n",
+			(int)yaffs_lseek(h, 0, SEEK_DATA),
+			(int)yaffs_lseek(h, 0, SEEK_HOLE),
+			(int)yaffs_lseek(h, 5000, SEEK_DATA),
+			size / 4 + 10,
+			(int)yaffs_lseek(h, size / 4 + 10, SEEK_HOLE),
+			size - chunk, (int)yaffs_lseek(h, size - chunk,
+						       SEEK_DATA));
+
+		reads_before = dev->n_page_reads;
+		yaffs_lseek(h, 0, SEEK_SET);
+		for(i = 0; i < size; i += sizeof(buf)){
+			yaffs_read(h, buf, sizeof(buf));
+			if(memcmp(buf, data + i, sizeof(buf))){
+				printf("differs at %d\n", i);
+				break;
+			}
+		}
+		yaffs_close(h);
+		printf("read back with %u chunk reads, %u hole bytes\n",
+			dev->n_page_reads - reads_before,
+			dev->n_hole_bytes_read);
+
+		/* Again after a scan */
+		yaffs_unmount(mountpt);
+		dev->param.skip_checkpt_rd = 1;
+		yaffs_mount(mountpt);
+		dev->param.skip_checkpt_rd = 0;
+	}
+
+	yaffs_unlink(name);
+	free(data);
+	yaffs_unmount(mountpt);
+}
+
+/*
+ * Writes and reads back files on the NOR simulator with each write buffer
+ * size and reports the programming operations it took.
+ */
+void nor_program_test(const char *mountpt)
+{
+	static const int buffers[] = { 0, 32, 64, 512 };
+	char name[100];
+	unsigned char buf[1000];
+	struct ynorsim_stats stats;
+	struct timeval start;
+	int size = 1024 * 1024;
+	unsigned i;
+	int bad;
+	int pos;
+	int h;
+	int j;
+
+	yaffs_trace_mask = 0;
+
+	yaffs_start_up();
+
+	sprintf(name,"%s/nor",mountpt);
+
+	for(i = 0; i < sizeof(buffers)/sizeof(buffers[0]); i++){
+		ynorif1_SetWriteBuffer(buffers[i]);
+		yaffs_mount(mountpt);
+		ynorsim_reset_stats();
+		gettimeofday(&start, NULL);
+
+		h = yaffs_open(name, O_CREAT | O_TRUNC | O_RDWR,
+				S_IREAD | S_IWRITE);
+		for(pos = 0; pos < size; pos += sizeof(buf)){
+			for(j = 0; j < (int)sizeof(buf); j++)
+				buf[j] = pos + j + i;
+			yaffs_write(h, buf, sizeof(buf));
+		}
+		yaffs_close(h);
+		yaffs_unlink(name);
+		yaffs_unmount(mountpt);
+
+		ynorsim_get_stats(&stats);
+		printf("write buffer %d: %u word and %u buffer programs"
+			" (%u words), %u erases, %.3f s\n",
+			buffers[i], stats.word_programs,
+			stats.buffer_programs, stats.buffered_words,
+			stats.erases, elapsed_since(&start));
+
+		/* Write again and check it after a remount */
+		yaffs_mount(mountpt);
+		h = yaffs_open(name, O_CREAT | O_TRUNC | O_RDWR,
+				S_IREAD | S_IWRITE);
+		for(pos = 0; pos < size / 4; pos += sizeof(buf)){
+			for(j = 0; j < (int)sizeof(buf); j++)
+				buf[j] = pos + j + i;
+			yaffs_write(h, buf, sizeof(buf));
+		}
+		yaffs_close(h);
+		yaffs_unmount(mountpt);
+		yaffs_mount(mountpt);
+		h = yaffs_open(name, O_RDONLY, 0);
+		bad = 0;
+		for(pos = 0; pos < size / 4; pos += sizeof(buf)){
+			yaffs_read(h, buf, sizeof(buf));
+			for(j = 0; j < (int)sizeof(buf); j++)
+				if(buf[j] != (unsigned char)(pos + j + i))
+					bad++;
+		}
+		yaffs_close(h);
+		yaffs_unlink(name);
+		yaffs_unmount(mountpt);
+		if(bad)
+			printf("%d bytes wrong\n", bad);
+	}
+	ynorif1_SetWriteBuffer(0);
+}
+
+void xip_test(const char *mountpt)
+{
+	char name[100];
+	static unsigned char buf[64 * 1024];
+	static unsigned char copy[64 * 1024];
+	const void *ptr;
+	struct yaffs_dev *dev;
+	struct timeval start;
+	int size = 500 * 1000 + 123;
+	unsigned erased;
+	int bad = 0;
+	int pos;
+	int h;
+	int n;
+	int i;
+
+	yaffs_trace_mask = 0;
+
+	yaffs_start_up();
+	yaffs_mount(mountpt);
+	dev = yaffs_getdev(mountpt);
+
+	sprintf(name,"%s/xip",mountpt);
+
+	h = yaffs_open(name, O_CREAT | O_TRUNC | O_RDWR, S_IREAD | S_IWRITE);
+	for(pos = 0; pos < size; pos += n){
+		n = size - pos;
+		if(n > (int)sizeof(buf))
+			n = sizeof(buf);
+		for(i = 0; i < n; i++)
+			buf[i] = (pos + i) * 7 + (pos + i) / 1000;
+		yaffs_write(h, buf, n);
+	}
+	yaffs_close(h);
+
+	/* Normal reads, which now copy straight out of the mapped flash */
+	dev->n_xip_bytes_read = 0;
+	gettimeofday(&start, NULL);
+	h = yaffs_open(name, O_RDONLY, 0);
+	for(pos = 0; (n = yaffs_read(h, copy, sizeof(copy))) > 0; pos += n)
+		for(i = 0; i < n; i++)
+			if(copy[i] !=
+				(unsigned char)((pos + i) * 7 + (pos + i) / 1000))
+				bad++;
+	yaffs_close(h);
+	printf("read %d bytes, %u from flash in place, %.3f s\n",
+		pos, dev->n_xip_bytes_read, elapsed_since(&start));
+
+	/* Read it in place */
+	gettimeofday(&start, NULL);
+	h = yaffs_open(name, O_RDONLY, 0);
+	for(pos = 0; (n = yaffs_read_xip(h, &ptr, size)) > 0; pos += n)
+		for(i = 0; i < n; i++)
+			if(((const unsigned char *)ptr)[i] !=
+				(unsigned char)((pos + i) * 7 + (pos + i) / 1000))
+				bad++;
+	if(n < 0)
+		printf("yaffs_read_xip failed at %d, error %d\n",
+			pos, yaffs_get_error());
+	yaffs_close(h);
+	printf("mapped %d bytes, %.3f s\n", pos, elapsed_since(&start));
+
+	/* The mapping keeps its blocks while the file is rewritten and gc runs */
+	h = yaffs_open(name, O_RDWR, 0);
+	n = yaffs_read_xip(h, &ptr, size);
+	memset(buf, 0x55, sizeof(buf));
+	for(pos = 0; pos < size; pos += sizeof(buf))
+		yaffs_pwrite(h, buf, size - pos < (int)sizeof(buf) ?
+				size - pos : (int)sizeof(buf), pos);
+	for(i = 0; i < 20; i++)
+		yaffs_do_background_gc(mountpt, 1);
+	for(i = 0; i < n; i++)
+		if(((const unsigned char *)ptr)[i] !=
+			(unsigned char)(i * 7 + i / 1000))
+			bad++;
+	erased = dev->n_erasures;
+	yaffs_release_xip(h);
+	for(i = 0; i < 20; i++)
+		yaffs_do_background_gc(mountpt, 1);
+	printf("held %d bytes through a rewrite and gc, %u blocks erased after release\n",
+		n, dev->n_erasures - erased);
+	yaffs_pread(h, copy, 100, 0);
+	if(memcmp(buf, copy, 100))
+		bad++;
+	yaffs_close(h);
+
+	/* Dirty data in the cache is not on flash yet */
+	h = yaffs_open(name, O_RDWR, 0);
+	yaffs_write(h, buf, 100);
+	yaffs_lseek(h, 0, SEEK_SET);
+	if(yaffs_read_xip(h, &ptr, 100) >= 0)
+		printf("mapped dirty cached data\n");
+	yaffs_lseek(h, 0, SEEK_SET);
+	yaffs_read(h, copy, 100);
+	if(memcmp(buf, copy, 100))
+		bad++;
+	yaffs_close(h);
+
+	yaffs_unlink(name);
+	yaffs_unmount(mountpt);
+
+	if(bad)
+		printf("%d bytes wrong\n", bad);
+}
+
+static int yaffs1_scan_driver_calls;
+
+static int yaffs1_scan_read_chunk(struct yaffs_dev *dev, int nand_chunk,
+				u8 *data, struct yaffs_spare *spare)
+{
+	yaffs1_scan_driver_calls++;
+	return ynorif1_ReadChunkFromNAND(dev, nand_chunk, data, spare);
+}
+
+static int yaffs1_scan_read_spares(struct yaffs_dev *dev, int nand_chunk,
+				int n_chunks, struct yaffs_spare *spares)
+{
+	yaffs1_scan_driver_calls++;
+	return ynorif1_ReadSpares(dev, nand_chunk, n_chunks, spares);
+}
+
+static int yaffs1_scan_check(const char *mountpt, int n_files)
+{
+	char name[100];
+	unsigned char buf[300];
+	int bad = 0;
+	int h;
+	int i;
+	int j;
+
+	for(i = 0; i < n_files; i++){
+		sprintf(name,"%s/s/%d",mountpt,i);
+		h = yaffs_open(name, O_RDONLY, 0);
+		if(h < 0 || yaffs_read(h, buf, sizeof(buf)) != 100 + i % 200){
+			bad++;
+		} else {
+			for(j = 0; j < 100 + i % 200; j++)
+				if(buf[j] != (unsigned char)(i + j))
+					bad++;
+		}
+		if(h >= 0)
+			yaffs_close(h);
+	}
+	return bad;
+}
+
+void yaffs1_scan_test(const char *mountpt)
+{
+	char name[100];
+	unsigned char buf[300];
+	struct yaffs_dev *dev;
+	struct timeval start;
+	int n_files = 2000;
+	int (*read_spares)(struct yaffs_dev *, int, int, struct yaffs_spare *);
+	int i;
+	int j;
+	int h;
+
+	yaffs_trace_mask = 0;
+
+	yaffs_start_up();
+	yaffs_mount(mountpt);
+	dev = yaffs_getdev(mountpt);
+	read_spares = dev->param.read_spares_fn;
+
+	sprintf(name,"%s/s",mountpt);
+	yaffs_mkdir(name, 0666);
+	for(i = 0; i < n_files; i++){
+		sprintf(name,"%s/s/%d",mountpt,i);
+		h = yaffs_open(name, O_CREAT | O_TRUNC | O_RDWR,
+				S_IREAD | S_IWRITE);
+		for(j = 0; j < 100 + i % 200; j++)
+			buf[j] = i + j;
+		yaffs_write(h, buf, 100 + i % 200);
+		yaffs_close(h);
+	}
+	/* Rewrite some so that there is deleted stuff to scan past */
+	for(i = 0; i < n_files; i += 3){
+		sprintf(name,"%s/s/%d",mountpt,i);
+		h = yaffs_open(name, O_RDWR, 0);
+		for(j = 0; j < 100 + i % 200; j++)
+			buf[j] = i + j;
+		yaffs_write(h, buf, 100 + i % 200);
+		yaffs_close(h);
+	}
+	yaffs_unmount(mountpt);
+
+	/* The NOR sim reads are cheap, so count the driver calls */
+	dev->param.read_chunk_fn = yaffs1_scan_read_chunk;
+	for(i = 0; i < 2; i++){
+		dev->param.read_spares_fn = i ? yaffs1_scan_read_spares : NULL;
+		yaffs1_scan_driver_calls = 0;
+		gettimeofday(&start, NULL);
+		yaffs_mount(mountpt);
+		printf("%s mount: %.3f s, %d driver reads",
+			i ? "batched" : "per chunk", elapsed_since(&start),
+			yaffs1_scan_driver_calls);
+		printf(", %d files wrong\n",
+			yaffs1_scan_check(mountpt, n_files));
+		yaffs_unmount(mountpt);
+	}
+	dev->param.read_chunk_fn = ynorif1_ReadChunkFromNAND;
+	dev->param.read_spares_fn = read_spares;
+
+	yaffs_mount(mountpt);
+	for(i = 0; i < n_files; i++){
+		sprintf(name,"%s/s/%d",mountpt,i);
+		yaffs_unlink(name);
+	}
+	sprintf(name,"%s/s",mountpt);
+	yaffs_rmdir(name);
+	yaffs_unmount(mountpt);
+}
+
+#define DISCARD_TEST_FILES	50
+#define DISCARD_TEST_SIZE	(100 * 1000 + 3000)
+#define DISCARD_TEST_CUT	"/tmp/discard_test_cut.img"
+
+/*
+ * Power is "lost" just before the header that truncates object
+ * discard_cut_obj is written: the flash is saved as it is then.
+ */
+static int discard_cut_obj;
+
+static int discard_cut_write(struct yaffs_dev *dev, int nand_chunk,
+			const u8 *data, const struct yaffs_ext_tags *tags)
+{
+	if(discard_cut_obj && tags->obj_id == (unsigned)discard_cut_obj &&
+	   tags->chunk_id == 0 && tags->extra_length == 0){
+		discard_cut_obj = 0;
+		ymmap2_SaveImage(DISCARD_TEST_CUT);
+	}
+	return ymmap2_WriteChunkWithTagsToNAND(dev, nand_chunk, data, tags);
+}
+
+/*
+ * Truncate a large file and lose power after its chunks are pruned but
+ * before the shrink header is written. Either size is fine after the
+ * scan. If the old one comes back so must the old data, apart from holes
+ * where gc already erased pruned chunks, as happens without discards.
+ */
+static int discard_cut_test(const char *mountpt, int scan)
+{
+	static unsigned char buf[2048];
+	char name[100];
+	struct yaffs_stat st;
+	struct yaffs_dev *dev = yaffs_getdev(mountpt);
+	int n_chunks = 1000;
+	int size;
+	int bad = 0;
+	int h;
+	int i;
+
+	sprintf(name,"%s/cut",mountpt);
+	h = yaffs_open(name, O_CREAT | O_TRUNC | O_RDWR, S_IREAD | S_IWRITE);
+	for(i = 0; i < n_chunks; i++){
+		memset(buf, i, sizeof(buf));
+		yaffs_write(h, buf, sizeof(buf));
+	}
+	yaffs_close(h);
+	yaffs_sync(mountpt);
+	yaffs_stat(name, &st);
+
+	dev->param.write_chunk_tags_fn = discard_cut_write;
+	discard_cut_obj = st.st_ino;
+	yaffs_truncate(name, 0);
+	discard_cut_obj = 0;
+	dev->param.write_chunk_tags_fn = ymmap2_WriteChunkWithTagsToNAND;
+
+	yaffs_unmount(mountpt);
+	if(!ymmap2_LoadImage(DISCARD_TEST_CUT))
+		printf("the truncate wrote no header to lose power at\n");
+	unlink(DISCARD_TEST_CUT);
+	dev->param.skip_checkpt_rd = scan;
+	yaffs_mount(mountpt);
+	dev->param.skip_checkpt_rd = 0;
+
+	h = yaffs_open(name, O_RDONLY, 0);
+	size = yaffs_lseek(h, 0, SEEK_END);
+	if(size != 0 && size != n_chunks * 2048){
+		bad = n_chunks;
+	} else if(size != 0){
+		yaffs_lseek(h, 0, SEEK_SET);
+		for(i = 0; i < n_chunks; i++){
+			if(yaffs_read(h, buf, sizeof(buf)) != sizeof(buf) ||
+			   (buf[0] != (unsigned char)i && buf[0] != 0) ||
+			   buf[sizeof(buf) - 1] != buf[0])
+				bad++;
+		}
+	}
+	yaffs_close(h);
+	yaffs_unlink(name);
+	return bad;
+}
+
+void discard_test(const char *mountpt)
+{
+	static const char *modes[] = { "no discards", "blocks", "chunks" };
+	static unsigned char shadow[DISCARD_TEST_FILES][DISCARD_TEST_SIZE];
+	static unsigned char buf[DISCARD_TEST_SIZE];
+	int size[DISCARD_TEST_FILES];
+	char name[100];
+	struct ymmap2_ftl_stats stats;
+	struct yaffs_dev *dev;
+	int (*discard)(struct yaffs_dev *, int, int);
+	int mode;
+	int scan;
+	int bad;
+	int pos;
+	int f;
+	int h;
+	int i;
+
+	yaffs_trace_mask = 0;
+
+	yaffs_start_up();
+	dev = yaffs_getdev(mountpt);
+	discard = dev->param.discard_fn;
+
+	for(mode = 0; mode < 3; mode++){
+		dev->param.discard_fn = mode ? discard : NULL;
+		dev->param.discard_mode = (mode == 2) ?
+				YAFFS_DISCARD_CHUNKS : YAFFS_DISCARD_BLOCKS;
+		yaffs_mount(mountpt);
+		for(f = 0; f < DISCARD_TEST_FILES; f++){
+			sprintf(name,"%s/d%d",mountpt,f);
+			yaffs_unlink(name);
+			size[f] = 0;
+		}
+		ymmap2_ResetFtlStats();
+
+		/* Random overwrites of a set of files */
+		srand(1);
+		for(i = 0; i < 20000; i++){
+			f = rand() % DISCARD_TEST_FILES;
+			pos = (rand() % 100) * 1000;
+			sprintf(name,"%s/d%d",mountpt,f);
+			memset(buf, i, 3000);
+			h = yaffs_open(name, O_CREAT | O_RDWR,
+					S_IREAD | S_IWRITE);
+			yaffs_lseek(h, pos, SEEK_SET);
+			yaffs_write(h, buf, 3000);
+			yaffs_close(h);
+
+			if(pos > size[f])
+				memset(&shadow[f][size[f]], 0, pos - size[f]);
+			memcpy(&shadow[f][pos], buf, 3000);
+			if(pos + 3000 > size[f])
+				size[f] = pos + 3000;
+		}
+		yaffs_sync(mountpt);
+
+		ymmap2_GetFtlStats(&stats);
+		printf("%s: %u discard calls, %u chunks discarded;"
+			" FTL copied %u pages, avoided %u\n",
+			modes[mode], dev->n_discards, dev->n_discarded_chunks,
+			stats.copies, stats.avoided);
+
+		/*
+		 * Everything still has to read back after a remount from the
+		 * checkpoint and after one that scans the discarded blocks.
+		 */
+		for(scan = 0; scan < 2; scan++){
+			yaffs_unmount(mountpt);
+			dev->param.skip_checkpt_rd = scan;
+			yaffs_mount(mountpt);
+			dev->param.skip_checkpt_rd = 0;
+			bad = 0;
+			for(f = 0; f < DISCARD_TEST_FILES; f++){
+				sprintf(name,"%s/d%d",mountpt,f);
+				h = yaffs_open(name, O_RDONLY, 0);
+				if(yaffs_read(h, buf, sizeof(buf)) != size[f] ||
+				   memcmp(buf, shadow[f], size[f]))
+					bad++;
+				yaffs_close(h);
+			}
+			if(bad)
+				printf("%d files wrong after %s\n", bad,
+					scan ? "a scan" : "a remount");
+		}
+
+		for(scan = 0; scan < 2; scan++){
+			bad = discard_cut_test(mountpt, scan);
+			if(bad)
+				printf("%d chunks wrong after losing power in a"
+					" truncate and %s\n", bad,
+					scan ? "a scan" : "a remount");
+		}
+		yaffs_unmount(mountpt);
+	}
+	dev->param.discard_fn = discard;
+	dev->param.discard_mode = YAFFS_DISCARD_CHUNKS;
+}
+
+void gc_pace_test(const char *mountpt)
+{
+	static const int paces[] = { 0, 4, 8 };
+	static unsigned char buf[2048];
+	char name[100];
+	struct yaffs_dev *dev;
+	struct timeval start;
+	double t;
+	double max_t;
+	int file_chunks = 27 * 1024 * 1024 / 2048;
+	u32 copies;
+	int over_16;
+	unsigned p;
+	int h;
+	int i;
+
+	yaffs_trace_mask = 0;
+
+	yaffs_start_up();
+	dev = yaffs_getdev(mountpt);
+	sprintf(name,"%s/pace",mountpt);
+
+	for(p = 0; p < sizeof(paces)/sizeof(paces[0]); p++){
+		dev->param.gc_pace_copies = paces[p];
+		yaffs_mount(mountpt);
+
+		/* Fill most of the device, then overwrite it at random */
+		h = yaffs_open(name, O_CREAT | O_TRUNC | O_RDWR,
+				S_IREAD | S_IWRITE);
+		for(i = 0; i < file_chunks; i++){
+			memset(buf, i, sizeof(buf));
+			yaffs_write(h, buf, sizeof(buf));
+		}
+
+		dev->gc_stalls = 0;
+		dev->gc_paced = 0;
+		dev->gc_max_write_copies = 0;
+		copies = dev->n_gc_copies;
+		over_16 = 0;
+		max_t = 0;
+		srand(1);
+		for(i = 0; i < 20000; i++){
+			u32 before = dev->n_gc_copies;
+
+			gettimeofday(&start, NULL);
+			yaffs_lseek(h, (rand() % file_chunks) * 2048, SEEK_SET);
+			yaffs_write(h, buf, sizeof(buf));
+			t = elapsed_since(&start);
+			if(t > max_t)
+				max_t = t;
+			if(dev->n_gc_copies - before > 16)
+				over_16++;
+		}
+		yaffs_close(h);
+		yaffs_unlink(name);
+
+		printf("pace %d: %u copies, %u paced, %u stalls,"
+			" %d writes over 16 copies, worst %u copies %.2f ms\n",
+			paces[p], dev->n_gc_copies - copies, dev->gc_paced,
+			dev->gc_stalls, over_16, dev->gc_max_write_copies,
+			max_t * 1000);
+		yaffs_unmount(mountpt);
+	}
+	dev->param.gc_pace_copies = 0;
+}
+
+/*
+ * Builds a deep tree with plenty of files and hard links, then remounts by
+ * scanning and reports how long the post-scan fixups took from the trace
+ * buffer.
+ */
+void mount_fixup_test(const char *mountpt)
+{
+	char dir[200];
+	char name[300];
+	char link[300];
+	struct yaffs_dev *dev;
+	struct yaffs_stat st;
+	struct yaffs_tb_hdr *hdr;
+	struct yaffs_tb_rec *rec;
+	struct timeval start;
+	double mount_t;
+	int size = 4 * 1024 * 1024;
+	u8 *buf;
+	u32 fixup_begin = 0;
+	u32 fixup_end = 0;
+	u32 n_hanging = 0;
+	int bad = 0;
+	int depth;
+	int h;
+	int i;
+	int n;
+
+	yaffs_trace_mask = 0;
+
+	yaffs_start_up();
+	dev = yaffs_getdev(mountpt);
+	yaffs_mount(mountpt);
+
+	sprintf(dir,"%s",mountpt);
+	for(depth = 0; depth < 40; depth++){
+		sprintf(dir + strlen(dir), "/d");
+		yaffs_mkdir(dir, 0666);
+		for(i = 0; i < 50; i++){
+			sprintf(name,"%s/f%d",dir,i);
+			h = yaffs_open(name, O_CREAT | O_TRUNC | O_RDWR,
+					S_IREAD | S_IWRITE);
+			yaffs_close(h);
+			sprintf(link,"%s/l%d",dir,i);
+			yaffs_link(name,link);
+		}
+	}
+	yaffs_unmount(mountpt);
+
+	/* Mount by scanning, with the trace buffer recording mount events */
+	dev->param.skip_checkpt_rd = 1;
+	dev->param.trace_buf_records = 64 * 1024;
+	dev->param.trace_buf_mask = 0xffffffff;
+	dev->param.trace_time_fn = trace_time_us;
+	gettimeofday(&start, NULL);
+	yaffs_mount(mountpt);
+	mount_t = elapsed_since(&start);
+	dev->param.skip_checkpt_rd = 0;
+
+	buf = malloc(size);
+	n = yaffs_dump_trace_buf(mountpt, buf, size, 1);
+	hdr = (struct yaffs_tb_hdr *)buf;
+	rec = (struct yaffs_tb_rec *)(hdr + 1);
+	for(i = 0; n > 0 && i < (int)hdr->n_recs; i++, rec++){
+		if(rec->event == YAFFS_TB_MOUNT_FIXUP_BEGIN)
+			fixup_begin = rec->timestamp;
+		if(rec->event == YAFFS_TB_MOUNT_FIXUP_END){
+			fixup_end = rec->timestamp;
+			n_hanging = rec->args[0];
+		}
+	}
+	free(buf);
+
+	sprintf(dir,"%s",mountpt);
+	for(depth = 0; depth < 40; depth++){
+		sprintf(dir + strlen(dir), "/d");
+		for(i = 0; i < 50; i++){
+			sprintf(link,"%s/l%d",dir,i);
+			if(yaffs_stat(link, &st) < 0 || st.st_nlink != 2)
+				bad++;
+		}
+	}
+
+	printf("mount %.2f ms, fixups %u us, %u hanging, %d bad links\n",
+		mount_t * 1000, fixup_end - fixup_begin, n_hanging, bad);
+
+	dev->param.trace_buf_records = 0;
+	dev->param.trace_buf_mask = 0;
+	dev->param.trace_time_fn = NULL;
+	yaffs_unmount(mountpt);
+}
+
+static int hanging_count(const char *dname)
+{
+	yaffs_DIR *d;
+	int n = 0;
+
+	d = yaffs_opendir(dname);
+	if(!d)
+		return -1;
+	while(yaffs_readdir(d))
+		n++;
+	yaffs_closedir(d);
+	return n;
+}
+
+/*
+ * Moves every copy of a directory's header on /mmap2k into the unlinked
+ * dir, as if it had been removed with a subdirectory and files still in
+ * it, and remounts by scanning. Only the tops of what hangs off it belong
+ * in lost+found, with the subdirectory keeping its files, whatever order
+ * the fixup comes across the objects in.
+ */
+void hanging_test(const char *mountpt)
+{
+	static u8 data[2048];
+	struct yaffs_ext_tags tags;
+	struct yaffs_obj_hdr *oh = (struct yaffs_obj_hdr *)data;
+	struct yaffs_dev *dev;
+	struct yaffs_stat st;
+	char name[200];
+	int n_chunks;
+	int chunk;
+	int h;
+	int i;
+
+	yaffs_trace_mask = 0;
+
+	yaffs_start_up();
+	dev = yaffs_getdev(mountpt);
+	/* The scan has to read the headers rather than the summaries */
+	dev->param.disable_summary = 1;
+	yaffs_mount(mountpt);
+
+	sprintf(name,"%s/h",mountpt);
+	yaffs_mkdir(name, S_IREAD | S_IWRITE | S_IEXEC);
+	sprintf(name,"%s/h/s",mountpt);
+	yaffs_mkdir(name, S_IREAD | S_IWRITE | S_IEXEC);
+	for(i = 0; i < 300; i++){
+		sprintf(name,"%s/h/%s%d",mountpt, (i < 5) ? "f" : "s/f", i);
+		h = yaffs_open(name, O_CREAT | O_RDWR, S_IREAD | S_IWRITE);
+		yaffs_write(h, name, strlen(name));
+		yaffs_close(h);
+	}
+	sprintf(name,"%s/h",mountpt);
+	yaffs_lstat(name, &st);
+	yaffs_unmount(mountpt);
+
+	n_chunks = ymmap2_GetNumberOfBlocks() * dev->param.chunks_per_block;
+	for(chunk = 0; chunk < n_chunks; chunk++){
+		ymmap2_ReadChunkWithTagsFromNAND(dev, chunk, data, &tags);
+		if(!tags.chunk_used || tags.obj_id != st.st_ino ||
+		   tags.chunk_id != 0)
+			continue;
+		oh->parent_obj_id = YAFFS_OBJECTID_UNLINKED;
+		tags.extra_parent_id = YAFFS_OBJECTID_UNLINKED;
+		ymmap2_Discard(dev, chunk, 1);
+		ymmap2_WriteChunkWithTagsToNAND(dev, chunk, data, &tags);
+	}
+
+	dev->param.skip_checkpt_rd = 1;
+	yaffs_mount(mountpt);
+	dev->param.skip_checkpt_rd = 0;
+
+	sprintf(name,"%s/lost+found",mountpt);
+	printf("lost+found has %d entries,", hanging_count(name));
+	sprintf(name,"%s/lost+found/s",mountpt);
+	printf(" its subdirectory %d\n", hanging_count(name));
+
+	yaffs_unmount(mountpt);
+	dev->param.disable_summary = 0;
+}
+
+/*
+ * Leaves a directory's worth of orphans behind, as a crash part way through
+ * deleting it would, then remounts by scanning with lost+found emptied at
+ * mount and in the background. Counts chunk writes during each mount.
+ */
+void bg_lost_n_found_test(const char *mountpt)
+{
+	char dir[100];
+	char name[200];
+	struct yaffs_dev *dev;
+	struct yaffs_obj *d;
+	struct yaffs_obj *obj;
+	struct yaffs_tb_hdr *hdr;
+	struct yaffs_tb_rec *rec;
+	struct timeval start;
+	double mount_t;
+	int size = 4 * 1024 * 1024;
+	u8 *buf;
+	int n_files = 2000;
+	int writes;
+	int rounds;
+	int in_mount;
+	int bg;
+	int h;
+	int i;
+	int n;
+
+	yaffs_trace_mask = 0;
+
+	yaffs_start_up();
+	dev = yaffs_getdev(mountpt);
+	sprintf(dir,"%s/orphans",mountpt);
+	buf = malloc(size);
+
+	for(bg = 0; bg < 2; bg++){
+		yaffs_mount(mountpt);
+		yaffs_mkdir(dir, 0666);
+		for(i = 0; i < n_files; i++){
+			sprintf(name,"%s/f%d",dir,i);
+			h = yaffs_open(name, O_CREAT | O_TRUNC | O_RDWR,
+					S_IREAD | S_IWRITE);
+			yaffs_write(h, name, 100);
+			yaffs_close(h);
+		}
+
+		/*
+		 * Move the files out of the directory in RAM only, so the
+		 * directory can be removed while the files on flash still
+		 * point at it.
+		 */
+		d = yaffs_find_by_name(dev->root_dir, "orphans");
+		while(!list_empty(&d->variant.dir_variant.children)){
+			obj = list_entry(d->variant.dir_variant.children.next,
+					struct yaffs_obj, siblings);
+			yaffs_add_obj_to_dir(dev->lost_n_found, obj);
+		}
+		yaffs_rmdir(dir);
+		dev->param.skip_checkpt_wr = 1;
+		yaffs_unmount(mountpt);
+		dev->param.skip_checkpt_wr = 0;
+
+		dev->param.empty_lost_n_found = 1;
+		dev->param.bg_empty_lost_n_found = bg;
+		dev->param.skip_checkpt_rd = 1;
+		dev->param.trace_buf_records = 64 * 1024;
+		dev->param.trace_buf_mask = 0xffffffff;
+		gettimeofday(&start, NULL);
+		yaffs_mount(mountpt);
+		mount_t = elapsed_since(&start);
+		dev->param.skip_checkpt_rd = 0;
+
+		writes = 0;
+		in_mount = 0;
+		n = yaffs_dump_trace_buf(mountpt, buf, size, 1);
+		hdr = (struct yaffs_tb_hdr *)buf;
+		rec = (struct yaffs_tb_rec *)(hdr + 1);
+		for(i = 0; n > 0 && i < (int)hdr->n_recs; i++, rec++){
+			if(rec->event == YAFFS_TB_MOUNT_BEGIN)
+				in_mount = 1;
+			if(rec->event == YAFFS_TB_MOUNT_END)
+				in_mount = 0;
+			if(in_mount && rec->event == YAFFS_TB_WR_CHUNK)
+				writes++;
+		}
+
+		printf("bg %d: mount %.2f ms, %d writes, %d pending,"
+			" %d in lost+found",
+			bg, mount_t * 1000, writes, dev->n_bg_del_pending,
+			yaffs_is_non_empty_dir(dev->lost_n_found));
+
+		rounds = 0;
+		while(dev->n_bg_del_pending > 0 && rounds < 10000){
+			yaffs_do_background_gc(mountpt, 0);
+			rounds++;
+		}
+		printf(", %d background rounds, %d deleted\n",
+			rounds, dev->n_bg_deletions);
+
+		dev->param.trace_buf_records = 0;
+		dev->param.trace_buf_mask = 0;
+		yaffs_unmount(mountpt);
+
+		/* Nothing should come back */
+		yaffs_mount(mountpt);
+		if(yaffs_is_non_empty_dir(dev->lost_n_found) ||
+		   yaffs_access(dir, 0) == 0)
+			printf("bg %d: orphans came back\n", bg);
+		yaffs_unmount(mountpt);
+	}
+	dev->param.empty_lost_n_found = 0;
+	dev->param.bg_empty_lost_n_found = 0;
+	free(buf);
+}
+
 int random_seed;
 int simulate_power_failure;
 
@@ -2819,7 +4641,28 @@ int main(int argc, char *argv[])
 	 //null_name_test("yaffs2");
 
 	 //test_flash_traffic("yaffs2");
+	 //trace_buf_test("/yaffs2");
+	 //emulator_speed_test(16);
+	 //mmap_image_test("image.yaffs2","saved.yaffs2");
+	 //record_test("/yaffs2");
+	 //nand_prof_test("/yaffs2");
 	 // link_follow_test("/yaffs2");
+	 //delta_test("/yaffs2");
+	 //compact_obj_test("/yaffs2");
+	 //compact_blocks_test("/yaffs2");
+	 //tnode_evict_test("/yaffs2");
+	 //block_index_test("/yaffs2");
+	 //shrink_gc_test("/yaffs2");
+	 //shrink_rank_test("/yaffs2");
+	 //sparse_test("/yaffs2");
+	 //nor_program_test("/M18-1");
+	 //xip_test("/M18-1");
+	 //yaffs1_scan_test("/M18-1");
+	 //discard_test("/mmap2k");
+	 //gc_pace_test("/mmap2k");
+	 //mount_fixup_test("/yaffs2");
+	 //hanging_test("/mmap2k");
+	 //bg_lost_n_found_test("/yaffs2");
 	 basic_utime_test("/yaffs2");
 
 	 return 0;
@@ -0,0 +1,541 @@
+/*
+ * YAFFS: Yet Another Flash File System. A NAND-flash specific file system.
+ *
+ * Copyright (C) 2002-2011 Aleph One Ltd.
+ *   for Toby Churchill Ltd and Brightstar Engineering
+ *
+ * Created by Charles Manning <charles@aleph1.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/*
+ * This provides a YAFFS nand emulation for 2kB pages on a single memory
+ * mapped image file. It behaves like yaffs_fileem2k.c (including power fail
+ * and partial write simulation) but is much faster because each page access
+ * is a memcpy rather than an lseek and read/write.
+ *
+ * The image can be loaded from and saved to a file in mkyaffs2image format.
+ * This is only intended as test code.
+ */
+
+#include "yportenv.h"
+#include "yaffs_trace.h"
+
+#include "yaffs_guts.h"
+#include "yaffs_fileem2k.h"
+#include "yaffs_mmapem2k.h"
+#include "yaffs_packedtags2.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* Hugetlb mappings need to be a multiple of the hugepage size. */
+#define YMMAP2_HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+typedef struct
+{
+	const char *imageName;	/* NULL for an anonymous (RAM only) mapping */
+	int flags;
+	int nBlocks;
+	int handle;
+	u8 *base;
+	size_t size;		/* Size of the NAND array */
+	size_t mapSize;		/* Size of the mapping, >= size */
+} ymmap2_Device;
+
+static ymmap2_Device mmapdisk = {
+	"emfile-2k-mmap", 0, SIZE_IN_BLOCKS, -1, NULL, 0, 0
+};
+
+/*
+ * FTL model, to show what discards are worth. It pretends that the NAND is
+ * really managed flash with a page mapped FTL that collects one of its own
+ * erase units, round robin, every FTL_GC_PERIOD page writes. It counts the
+ * pages that would need copying then. Pages yaffs has discarded don't.
+ */
+#define FTL_GC_PERIOD	PAGES_PER_BLOCK
+
+#define FTL_FREE	0
+#define FTL_LIVE	1
+#define FTL_DISCARDED	2
+
+static u8 *ftlState;		/* One FTL_xxx per page */
+static int ftlNextGc;
+static struct ymmap2_ftl_stats ftlStats;
+
+static void ymmap2_FtlInit(void);
+
+extern int random_seed;
+extern int simulate_power_failure;
+extern int yaffs_test_partial_write;
+static int remaining_ops;
+static int nops_so_far;
+
+static void ymmap2_MaybePowerFail(unsigned int nand_chunk, int failPoint)
+{
+	nops_so_far++;
+
+	remaining_ops--;
+	if(simulate_power_failure &&
+	   remaining_ops < 1){
+		printf("Simulated power failure after %d operations\n",nops_so_far);
+		printf("  power failed on nand_chunk %d, at fail point %d\n",
+			nand_chunk, failPoint);
+		exit(0);
+	}
+}
+
+static int ymmap2_Map(void)
+{
+	struct stat st;
+	size_t oldSize = 0;
+	int mapFlags;
+
+	mmapdisk.size = (size_t)mmapdisk.nBlocks * BLOCK_SIZE;
+	mmapdisk.mapSize = mmapdisk.size;
+
+	if(!mmapdisk.imageName){
+		mapFlags = MAP_PRIVATE | MAP_ANONYMOUS;
+		mmapdisk.base = MAP_FAILED;
+#ifdef MAP_HUGETLB
+		if(mmapdisk.flags & YMMAP2_HUGEPAGES){
+			mmapdisk.mapSize = (mmapdisk.size + YMMAP2_HUGEPAGE_SIZE - 1) &
+					~((size_t)YMMAP2_HUGEPAGE_SIZE - 1);
+			mmapdisk.base = mmap(NULL, mmapdisk.mapSize,
+					PROT_READ | PROT_WRITE,
+					mapFlags | MAP_HUGETLB, -1, 0);
+			if(mmapdisk.base == MAP_FAILED)
+				yaffs_trace(YAFFS_TRACE_ALWAYS,
+					"mmap emulator: no hugepages, using normal pages");
+		}
+#endif
+		if(mmapdisk.base == MAP_FAILED){
+			mmapdisk.mapSize = mmapdisk.size;
+			mmapdisk.base = mmap(NULL, mmapdisk.mapSize,
+					PROT_READ | PROT_WRITE, mapFlags, -1, 0);
+		}
+	} else {
+		mmapdisk.handle = open(mmapdisk.imageName, O_RDWR | O_CREAT,
+					S_IREAD | S_IWRITE);
+		if(mmapdisk.handle < 0 || fstat(mmapdisk.handle, &st) < 0)
+			return YAFFS_FAIL;
+
+		oldSize = st.st_size;
+		if(oldSize < mmapdisk.size &&
+		   ftruncate(mmapdisk.handle, mmapdisk.size) < 0)
+			return YAFFS_FAIL;
+
+		mmapdisk.base = mmap(NULL, mmapdisk.mapSize,
+				PROT_READ | PROT_WRITE, MAP_SHARED,
+				mmapdisk.handle, 0);
+#ifdef MADV_HUGEPAGE
+		if(mmapdisk.base != MAP_FAILED &&
+		   (mmapdisk.flags & YMMAP2_HUGEPAGES))
+			madvise(mmapdisk.base, mmapdisk.mapSize, MADV_HUGEPAGE);
+#endif
+	}
+
+	if(mmapdisk.base == MAP_FAILED){
+		mmapdisk.base = NULL;
+		yaffs_trace(YAFFS_TRACE_ALWAYS,
+			"mmap emulator: could not map %d blocks",
+			mmapdisk.nBlocks);
+		return YAFFS_FAIL;
+	}
+
+	/* Anything the image did not cover starts off erased. */
+	if(oldSize < mmapdisk.size)
+		memset(mmapdisk.base + oldSize, 0xff, mmapdisk.size - oldSize);
+
+	ymmap2_FtlInit();
+
+	return YAFFS_OK;
+}
+
+static int CheckInit(void)
+{
+	static int initialised = 0;
+
+	if(initialised)
+		return mmapdisk.base ? YAFFS_OK : YAFFS_FAIL;
+
+	initialised = 1;
+
+	srand(random_seed);
+	remaining_ops = (rand() % 1000) * 5;
+
+	return ymmap2_Map();
+}
+
+static u8 *ymmap2_Page(int nand_chunk)
+{
+	if(nand_chunk < 0 ||
+	   nand_chunk >= mmapdisk.nBlocks * PAGES_PER_BLOCK){
+		yaffs_trace(YAFFS_TRACE_ALWAYS,
+			"mmap emulator: access to non-existant chunk %d",
+			nand_chunk);
+		return NULL;
+	}
+	return mmapdisk.base + (size_t)nand_chunk * PAGE_SIZE;
+}
+
+static int ymmap2_Erased(const u8 *ptr, size_t n)
+{
+	while(n--)
+		if(*ptr++ != 0xFF)
+			return 0;
+	return 1;
+}
+
+/* NAND programming can only clear bits. */
+static void ymmap2_Program(u8 *dst, const u8 *src, int n)
+{
+	while(n--)
+		*dst++ &= *src++;
+}
+
+static void ymmap2_FtlInit(void)
+{
+	int n = mmapdisk.nBlocks * PAGES_PER_BLOCK;
+	int i;
+
+	if(!ftlState)
+		ftlState = malloc(n);
+	if(!ftlState)
+		return;
+
+	for(i = 0; i < n; i++)
+		ftlState[i] = ymmap2_Erased(mmapdisk.base +
+				(size_t)i * PAGE_SIZE, PAGE_SIZE) ?
+				FTL_FREE : FTL_LIVE;
+}
+
+static void ymmap2_FtlWrite(int nand_chunk)
+{
+	int i;
+
+	if(!ftlState)
+		return;
+
+	ftlState[nand_chunk] = FTL_LIVE;
+	ftlStats.writes++;
+	if(ftlStats.writes % FTL_GC_PERIOD)
+		return;
+
+	/* Collect the next erase unit. Discarded pages are dropped. */
+	for(i = 0; i < PAGES_PER_BLOCK; i++){
+		u8 *s = &ftlState[ftlNextGc * PAGES_PER_BLOCK + i];
+
+		if(*s == FTL_LIVE)
+			ftlStats.copies++;
+		else if(*s == FTL_DISCARDED){
+			ftlStats.avoided++;
+			*s = FTL_FREE;
+		}
+	}
+	ftlStats.gcs++;
+	ftlNextGc = (ftlNextGc + 1) % mmapdisk.nBlocks;
+}
+
+/*
+ * ymmap2_Configure()
+ * Set up the image file (NULL for RAM only), size and flags.
+ * Must be called before the device is first used.
+ */
+int ymmap2_Configure(const char *image_name, int n_blocks, int flags)
+{
+	if(mmapdisk.base)
+		return YAFFS_FAIL;
+
+	mmapdisk.imageName = image_name;
+	if(n_blocks > 0)
+		mmapdisk.nBlocks = n_blocks;
+	mmapdisk.flags = flags;
+	return YAFFS_OK;
+}
+
+/*
+ * ymmap2_LoadImage()
+ * Replace the NAND contents with an image, eg. from mkyaffs2image.
+ * Anything past the end of the image is erased. Don't do this while mounted.
+ */
+int ymmap2_LoadImage(const char *file_name)
+{
+	int h;
+	struct stat st;
+	size_t pos = 0;
+	ssize_t n;
+
+	if(!CheckInit())
+		return YAFFS_FAIL;
+
+	h = open(file_name, O_RDONLY);
+	if(h < 0 || fstat(h, &st) < 0 || (size_t)st.st_size > mmapdisk.size){
+		if(h >= 0)
+			close(h);
+		return YAFFS_FAIL;
+	}
+
+	while(pos < (size_t)st.st_size){
+		n = read(h, mmapdisk.base + pos, st.st_size - pos);
+		if(n <= 0)
+			break;
+		pos += n;
+	}
+	close(h);
+
+	memset(mmapdisk.base + pos, 0xff, mmapdisk.size - pos);
+
+	ymmap2_FtlInit();
+
+	return pos == (size_t)st.st_size ? YAFFS_OK : YAFFS_FAIL;
+}
+
+/*
+ * ymmap2_SaveImage()
+ * Write the NAND contents out, dropping trailing erased pages so that the
+ * result is no bigger than it needs to be.
+ */
+int ymmap2_SaveImage(const char *file_name)
+{
+	int h;
+	size_t end;
+	size_t pos = 0;
+	ssize_t n;
+	u8 *page;
+
+	if(!CheckInit())
+		return YAFFS_FAIL;
+
+	for(end = mmapdisk.size; end > 0; end -= PAGE_SIZE){
+		page = mmapdisk.base + end - PAGE_SIZE;
+		if(!ymmap2_Erased(page, PAGE_SIZE))
+			break;
+	}
+
+	h = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, S_IREAD | S_IWRITE);
+	if(h < 0)
+		return YAFFS_FAIL;
+
+	while(pos < end){
+		n = write(h, mmapdisk.base + pos, end - pos);
+		if(n <= 0)
+			break;
+		pos += n;
+	}
+	close(h);
+
+	return pos == end ? YAFFS_OK : YAFFS_FAIL;
+}
+
+int ymmap2_GetNumberOfBlocks(void)
+{
+	return mmapdisk.nBlocks;
+}
+
+int ymmap2_WriteChunkWithTagsToNAND(struct yaffs_dev *dev, int nand_chunk, const u8 *data, const struct yaffs_ext_tags *tags)
+{
+	u8 *page;
+	u8 localBuffer[PAGE_DATA_SIZE];
+	struct yaffs_packed_tags2 pt;
+	int n_partials;
+	int i;
+
+	yaffs_trace(YAFFS_TRACE_MTD, "write chunk %d data %p tags %p",nand_chunk, data, tags);
+
+	if(!CheckInit())
+		return YAFFS_FAIL;
+
+	page = ymmap2_Page(nand_chunk);
+	if(!page)
+		return YAFFS_FAIL;
+
+	if(dev->param.inband_tags){
+		struct yaffs_packed_tags2_tags_only pt2t;
+
+		/* The caller leaves space for the tags after the data. */
+		yaffs_pack_tags2_tags_only(&pt2t, tags);
+		memcpy((u8 *)data + dev->data_bytes_per_chunk, &pt2t, sizeof(pt2t));
+		ymmap2_Program(page, data, dev->param.total_bytes_per_chunk);
+
+		if(yaffs_test_partial_write)
+			exit(1);
+	} else {
+		if(data && yaffs_test_partial_write){
+			/* Leave a few bits unprogrammed then die. */
+			memcpy(localBuffer, data, dev->data_bytes_per_chunk);
+			n_partials = rand()%20;
+			for(i = 0; i < n_partials; i++)
+				localBuffer[rand() % dev->data_bytes_per_chunk] |=
+					(1 << (rand() & 7));
+			ymmap2_Program(page, localBuffer, dev->data_bytes_per_chunk);
+			exit(1);
+		}
+
+		if(data)
+			ymmap2_Program(page, data, dev->data_bytes_per_chunk);
+
+		if(tags){
+			yaffs_pack_tags2(&pt, tags, !dev->param.no_tags_ecc);
+			ymmap2_Program(page + PAGE_DATA_SIZE, (u8 *)&pt, sizeof(pt));
+		}
+
+		ymmap2_MaybePowerFail(nand_chunk,3);
+	}
+
+	ymmap2_FtlWrite(nand_chunk);
+
+	return YAFFS_OK;
+}
+
+int ymmap2_ReadChunkWithTagsFromNAND(struct yaffs_dev *dev, int nand_chunk, u8 *data, struct yaffs_ext_tags *tags)
+{
+	u8 *page;
+	struct yaffs_packed_tags2 pt;
+
+	yaffs_trace(YAFFS_TRACE_MTD,"read chunk %d data %p tags %p",nand_chunk, data, tags);
+
+	if(!CheckInit())
+		return YAFFS_FAIL;
+
+	page = ymmap2_Page(nand_chunk);
+	if(!page)
+		return YAFFS_FAIL;
+
+	if(dev->param.inband_tags){
+		struct yaffs_packed_tags2_tags_only pt2t;
+
+		if(data)
+			memcpy(data, page, dev->param.total_bytes_per_chunk);
+		if(tags){
+			memcpy(&pt2t, page + dev->data_bytes_per_chunk, sizeof(pt2t));
+			yaffs_unpack_tags2_tags_only(tags, &pt2t);
+		}
+	} else {
+		if(data)
+			memcpy(data, page, dev->data_bytes_per_chunk);
+		if(tags){
+			memcpy(&pt, page + PAGE_DATA_SIZE, sizeof(pt));
+			yaffs_unpack_tags2(tags, &pt, !dev->param.no_tags_ecc);
+		}
+	}
+
+	return YAFFS_OK;
+}
+
+int ymmap2_MarkNANDBlockBad(struct yaffs_dev *dev, int block_no)
+{
+	u8 *page;
+	struct yaffs_packed_tags2 pt;
+
+	if(!CheckInit())
+		return YAFFS_FAIL;
+
+	page = ymmap2_Page(block_no * dev->param.chunks_per_block);
+	if(!page)
+		return YAFFS_FAIL;
+
+	memset(&pt, 0, sizeof(pt));
+	ymmap2_Program(page + PAGE_DATA_SIZE, (u8 *)&pt, sizeof(pt));
+
+	return YAFFS_OK;
+}
+
+int ymmap2_EraseBlockInNAND(struct yaffs_dev *dev, int blockNumber)
+{
+	(void) dev;
+
+	if(!CheckInit())
+		return YAFFS_FAIL;
+
+	if(blockNumber < 0 || blockNumber >= mmapdisk.nBlocks){
+		yaffs_trace(YAFFS_TRACE_ALWAYS,"Attempt to erase non-existant block %d",blockNumber);
+		return YAFFS_FAIL;
+	}
+
+	memset(mmapdisk.base + (size_t)blockNumber * BLOCK_SIZE, 0xff, BLOCK_SIZE);
+	if(ftlState)
+		memset(ftlState + blockNumber * PAGES_PER_BLOCK, FTL_FREE,
+			PAGES_PER_BLOCK);
+
+	return YAFFS_OK;
+}
+
+/*
+ * ymmap2_Discard()
+ * discard_fn. The pages read back erased afterwards, as they might from an
+ * FTL, so anything that still reads them shows up. The FTL model won't copy
+ * them any more.
+ */
+int ymmap2_Discard(struct yaffs_dev *dev, int nand_chunk, int n_chunks)
+{
+	(void) dev;
+
+	if(!CheckInit() || nand_chunk < 0 ||
+	   nand_chunk + n_chunks > mmapdisk.nBlocks * PAGES_PER_BLOCK)
+		return YAFFS_FAIL;
+
+	memset(ymmap2_Page(nand_chunk), 0xff, (size_t)n_chunks * PAGE_SIZE);
+
+	for(; n_chunks > 0; n_chunks--, nand_chunk++){
+		if(ftlState && ftlState[nand_chunk] == FTL_LIVE){
+			ftlState[nand_chunk] = FTL_DISCARDED;
+			ftlStats.discarded++;
+		}
+	}
+
+	return YAFFS_OK;
+}
+
+void ymmap2_GetFtlStats(struct ymmap2_ftl_stats *stats)
+{
+	*stats = ftlStats;
+}
+
+void ymmap2_ResetFtlStats(void)
+{
+	memset(&ftlStats, 0, sizeof(ftlStats));
+}
+
+int ymmap2_QueryNANDBlock(struct yaffs_dev *dev, int block_no, enum yaffs_block_state *state, u32 *seq_number)
+{
+	struct yaffs_ext_tags tags;
+
+	*seq_number = 0;
+
+	ymmap2_ReadChunkWithTagsFromNAND(dev, block_no * dev->param.chunks_per_block,
+					NULL, &tags);
+	if(tags.block_bad)
+		*state = YAFFS_BLOCK_STATE_DEAD;
+	else if(!tags.chunk_used)
+		*state = YAFFS_BLOCK_STATE_EMPTY;
+	else {
+		*state = YAFFS_BLOCK_STATE_NEEDS_SCAN;
+		*seq_number = tags.seq_number;
+	}
+	return YAFFS_OK;
+}
+
+int ymmap2_InitialiseNAND(struct yaffs_dev *dev)
+{
+	(void) dev;
+
+	return CheckInit();
+}
+
+int ymmap2_DeinitialiseNAND(struct yaffs_dev *dev)
+{
+	(void) dev;
+
+	/* Keep the mapping for a later remount, just push it out to the file */
+	if(mmapdisk.base && mmapdisk.imageName)
+		msync(mmapdisk.base, mmapdisk.size, MS_ASYNC);
+
+	return YAFFS_OK;
+}
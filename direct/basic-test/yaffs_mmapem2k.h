@@ -0,0 +1,59 @@
+/*
+ * YAFFS: Yet another Flash File System . A NAND-flash specific file system.
+ *
+ * Copyright (C) 2002-2011 Aleph One Ltd.
+ *   for Toby Churchill Ltd and Brightstar Engineering
+ *
+ * Created by Charles Manning <charles@aleph1.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1 as
+ * published by the Free Software Foundation.
+ *
+ * Note: Only YAFFS headers are LGPL, YAFFS C code is covered by GPL.
+ */
+
+/*
+ * yaffs_mmapem2k.h: mmap based emulation of 2k page NAND.
+ *
+ * The whole NAND array lives in one image file that is memory mapped so that
+ * page accesses are memcpy()s rather than syscalls. Pages are laid out as
+ * PAGE_DATA_SIZE data bytes then PAGE_SPARE_SIZE spare bytes, the same as
+ * the emfile-2k-N files and mkyaffs2image output.
+ */
+
+#ifndef __YAFFS_MMAPEM2K_H__
+#define __YAFFS_MMAPEM2K_H__
+
+#include "yaffs_guts.h"
+
+/* Flags for ymmap2_Configure() */
+#define YMMAP2_HUGEPAGES	0x01	/* Try to back the mapping with hugepages */
+
+/* What the FTL model would have done, see yaffs_mmapem2k.c */
+struct ymmap2_ftl_stats {
+	unsigned writes;
+	unsigned discarded;	/* Live pages discarded */
+	unsigned gcs;		/* FTL erase units collected */
+	unsigned copies;	/* Live pages copied by those */
+	unsigned avoided;	/* Discarded pages they did not copy */
+};
+
+int ymmap2_Configure(const char *image_name, int n_blocks, int flags);
+int ymmap2_LoadImage(const char *file_name);
+int ymmap2_SaveImage(const char *file_name);
+
+int ymmap2_GetNumberOfBlocks(void);
+
+int ymmap2_WriteChunkWithTagsToNAND(struct yaffs_dev *dev, int nand_chunk, const u8 *data, const struct yaffs_ext_tags *tags);
+int ymmap2_ReadChunkWithTagsFromNAND(struct yaffs_dev *dev, int nand_chunk, u8 *data, struct yaffs_ext_tags *tags);
+int ymmap2_EraseBlockInNAND(struct yaffs_dev *dev, int blockNumber);
+int ymmap2_MarkNANDBlockBad(struct yaffs_dev *dev, int block_no);
+int ymmap2_QueryNANDBlock(struct yaffs_dev *dev, int block_no, enum yaffs_block_state *state, u32 *seq_number);
+int ymmap2_Discard(struct yaffs_dev *dev, int nand_chunk, int n_chunks);
+void ymmap2_GetFtlStats(struct ymmap2_ftl_stats *stats);
+void ymmap2_ResetFtlStats(void);
+int ymmap2_InitialiseNAND(struct yaffs_dev *dev);
+int ymmap2_DeinitialiseNAND(struct yaffs_dev *dev);
+
+#endif
@@ -71,6 +71,7 @@ const char *yaffs_norif1_c_version = "$Id: yaffs_norif1.c,v 1.6 2010-02-18 01:18
 #define ynorif1_FlashInit() ynorsim_initialise()
 #define ynorif1_FlashDeinit() ynorsim_shutdown()
 #define ynorif1_FlashWrite32(addr,buf,nwords) ynorsim_wr32(addr,buf,nwords) 
+#define ynorif1_FlashWriteBuffer32(addr,buf,nwords) ynorsim_wr_buf32(addr,buf,nwords)
 #define ynorif1_FlashRead32(addr,buf,nwords) ynorsim_rd32(addr,buf,nwords) 
 #define ynorif1_FlashEraseBlock(addr) ynorsim_erase(addr)
 #define DEVICE_BASE     ynorsim_get_base()
@@ -81,17 +82,21 @@ const char *yaffs_norif1_c_version = "$Id: yaffs_norif1.c,v 1.6 2010-02-18 01:18
 #define ynorif1_FlashInit()  do{} while(0)
 #define ynorif1_FlashDeinit() do {} while(0)
 #define ynorif1_FlashWrite32(addr,buf,nwords) Y_FlashWrite(addr,buf,nwords) 
+#define ynorif1_FlashWriteBuffer32(addr,buf,nwords) Y_FlashWrite(addr,buf,nwords)
 #define ynorif1_FlashRead32(addr,buf,nwords)  Y_FlashRead(addr,buf,nwords) 
 #define ynorif1_FlashEraseBlock(addr)         Y_FlashErase(addr,BLOCK_SIZE_IN_BYTES)
 #define DEVICE_BASE     (32 * 1024 * 1024)
 #endif
 
+/* Bytes programmed at a time, 0 to program a word at a time */
+static int ynorif1_write_buffer;
+
 u32 *Block2Addr(struct yaffs_dev *dev, int blockNumber)
 {
-	u32 addr;
+	u8 *addr;
 	dev=dev;
 	
-	addr = (u32) DEVICE_BASE;
+	addr = (u8 *) DEVICE_BASE;
 	addr += blockNumber * BLOCK_SIZE_IN_BYTES;
 	
 	return (u32 *) addr;
@@ -99,9 +104,9 @@ u32 *Block2Addr(struct yaffs_dev *dev, int blockNumber)
 
 u32 *Block2FormatAddr(struct yaffs_dev *dev,int blockNumber)
 {
-	u32 addr;
+	u8 *addr;
 
-	addr = (u32) Block2Addr(dev,blockNumber);
+	addr = (u8 *) Block2Addr(dev,blockNumber);
 	addr += FORMAT_OFFSET;
 	
 	return (u32 *)addr;
@@ -110,12 +115,12 @@ u32 *Chunk2DataAddr(struct yaffs_dev *dev,int chunk_id)
 {
 	unsigned block;
 	unsigned chunkInBlock;
-	u32  addr;
+	u8 *addr;
 	
 	block = chunk_id/dev->param.chunks_per_block;
 	chunkInBlock = chunk_id % dev->param.chunks_per_block;
 	
-	addr = (u32) Block2Addr(dev,block);
+	addr = (u8 *) Block2Addr(dev,block);
 	addr += chunkInBlock * DATA_BYTES_PER_CHUNK;
 	
 	return (u32 *)addr;
@@ -125,26 +130,93 @@ u32 *Chunk2SpareAddr(struct yaffs_dev *dev,int chunk_id)
 {
 	unsigned block;
 	unsigned chunkInBlock;
-	u32 addr;
+	u8 *addr;
 	
 	block = chunk_id/dev->param.chunks_per_block;
 	chunkInBlock = chunk_id % dev->param.chunks_per_block;
 	
-	addr = (u32) Block2Addr(dev,block);
+	addr = (u8 *) Block2Addr(dev,block);
 	addr += SPARE_AREA_OFFSET;
 	addr += chunkInBlock * (SPARE_BYTES_PER_CHUNK + M18_SKIP);
 	return (u32 *)addr;
 }
 
+/*
+ * Sets how many bytes the part programs at a time. 0 programs a word at a
+ * time, otherwise it is the size of the part's write buffer, a power of 2
+ * from 32 to 512 bytes.
+ */
+int ynorif1_SetWriteBuffer(int nbytes)
+{
+	if(nbytes != 0 &&
+	   (nbytes < 32 || nbytes > 512 || (nbytes & (nbytes - 1))))
+		return YAFFS_FAIL;
+
+	ynorif1_write_buffer = nbytes;
+	return YAFFS_OK;
+}
 
-void ynorif1_AndBytes(u8*target, const u8   *src, int nbytes)
+/* Does programming val over the word old clear any bits? */
+static inline int ynorif1_Changes(u32 old, u32 val)
 {
-        while(nbytes > 0){
-                *target &= *src;
-                target++;
-                src++;
-                nbytes--;
-        }
+	return (old & ~val) != 0;
+}
+
+/*
+ * Programs nwords words, leaving out the ones that would not change.
+ * Those are the words left at 0xFFFFFFFF and the parts of the spare that
+ * are programmed again with a new marker.
+ * With a write buffer each aligned piece of it is programmed in one go.
+ * What is there already is read through the flash read routine, the
+ * flash might not be readable in place.
+ */
+static void ynorif1_Program(u32 *addr, const u32 *buf, int nwords)
+{
+	u32 old[512 / 4];
+	int buf_words = ynorif1_write_buffer / 4;
+	int first;
+	int last;
+	int end;
+	int i;
+
+	if(!buf_words){
+		for(i = 0; i < nwords; i++){
+			ynorif1_FlashRead32(addr + i, old, 1);
+			if(ynorif1_Changes(old[0], buf[i]))
+				ynorif1_FlashWrite32(addr + i, (u32 *)buf + i, 1);
+		}
+		return;
+	}
+
+	while(nwords > 0){
+		/* Up to the end of this write buffer */
+		end = buf_words -
+			(((u8 *)addr - (u8 *)DEVICE_BASE) / 4) % buf_words;
+		if(end > nwords)
+			end = nwords;
+
+		ynorif1_FlashRead32(addr, old, end);
+
+		for(first = 0; first < end; first++)
+			if(ynorif1_Changes(old[first], buf[first]))
+				break;
+		for(last = end - 1; last > first; last--)
+			if(ynorif1_Changes(old[last], buf[last]))
+				break;
+
+		if(first < end){
+			/* Words in between that don't change keep their value */
+			for(i = first; i <= last; i++)
+				if(ynorif1_Changes(old[i], buf[i]))
+					old[i] = buf[i];
+			ynorif1_FlashWriteBuffer32(addr + first, old + first,
+						   last - first + 1);
+		}
+
+		addr += end;
+		buf += end;
+		nwords -= end;
+	}
 }
 
 int ynorif1_WriteChunkToNAND(struct yaffs_dev *dev,int nand_chunk,const u8 *data, const struct yaffs_spare *spare)
@@ -153,6 +225,9 @@ int ynorif1_WriteChunkToNAND(struct yaffs_dev *dev,int nand_chunk,const u8 *data
         u32 *spareAddr = Chunk2SpareAddr(dev,nand_chunk);
         
         struct yaffs_spare tmpSpare;
+        u32 *tmpWords = (u32 *)&tmpSpare;
+        u32 *maskWords = (u32 *)spare;
+        int i;
         
         /* We should only be getting called for one of 3 reasons:
          * Writing a chunk: data and spare will not be NULL
@@ -170,30 +245,31 @@ int ynorif1_WriteChunkToNAND(struct yaffs_dev *dev,int nand_chunk,const u8 *data
                 /* Write a pre-marker */
                 memset(&tmpSpare,0xff,sizeof(tmpSpare));
                 tmpSpare.page_status = YNOR_PREMARKER;
-                ynorif1_FlashWrite32(spareAddr,(u32 *)&tmpSpare,sizeof(struct yaffs_spare)/4);
+                ynorif1_Program(spareAddr,tmpWords,sizeof(struct yaffs_spare)/4);
 
                 /* Write the data */            
-                ynorif1_FlashWrite32(dataAddr,(u32 *)data,dev->param.total_bytes_per_chunk / 4);
+                ynorif1_Program(dataAddr,(const u32 *)data,dev->param.total_bytes_per_chunk / 4);
                 
                 
                 memcpy(&tmpSpare,spare,sizeof(struct yaffs_spare));
                 
                 /* Write the real tags, but override the premarker*/
                 tmpSpare.page_status = YNOR_PREMARKER;
-                ynorif1_FlashWrite32(spareAddr,(u32 *)&tmpSpare,sizeof(struct yaffs_spare)/4);
+                ynorif1_Program(spareAddr,tmpWords,sizeof(struct yaffs_spare)/4);
                 
                 /* Write a post-marker */
                 tmpSpare.page_status = YNOR_POSTMARKER;
-                ynorif1_FlashWrite32(spareAddr,(u32 *)&tmpSpare,sizeof(tmpSpare)/4);  
+                ynorif1_Program(spareAddr,tmpWords,sizeof(tmpSpare)/4);  
 
         } else if(spare){
                 /* This has to be a read-modify-write operation to handle NOR-ness */
 
-                ynorif1_FlashRead32(spareAddr,(u32 *)&tmpSpare,16/ 4);
+                ynorif1_FlashRead32(spareAddr,tmpWords,16/ 4);
                 
-                ynorif1_AndBytes((u8 *)&tmpSpare,(u8 *)spare,sizeof(struct yaffs_spare));
+                for(i = 0; i < 16 / 4; i++)
+                        tmpWords[i] &= maskWords[i];
                 
-                ynorif1_FlashWrite32(spareAddr,(u32 *)&tmpSpare,16/ 4);
+                ynorif1_Program(spareAddr,tmpWords,16/ 4);
         }
         else {
                 BUG();
@@ -234,6 +310,35 @@ int ynorif1_ReadChunkFromNAND(struct yaffs_dev *dev,int nand_chunk, u8 *data, st
 
 }
 
+/*
+ * Reads the spares of a run of chunks, for the scan.
+ */
+int ynorif1_ReadSpares(struct yaffs_dev *dev,int nand_chunk, int n_chunks, struct yaffs_spare *spares)
+{
+	int i;
+
+	for(i = 0; i < n_chunks; i++){
+		ynorif1_FlashRead32(Chunk2SpareAddr(dev,nand_chunk + i),(u32 *)&spares[i],16/ 4);
+
+		/* Same page status fix up as ynorif1_ReadChunkFromNAND() */
+		if(spares[i].page_status == YNOR_POSTMARKER)
+			spares[i].page_status = 0xFF;
+		else if(spares[i].page_status != 0xff &&
+			(spares[i].page_status | YNOR_PREMARKER) != 0xff)
+			spares[i].page_status = YNOR_PREMARKER;
+	}
+
+	return YAFFS_OK;
+}
+
+/*
+ * The flash is memory mapped, so chunk data can be read where it sits.
+ */
+const u8 *ynorif1_MapChunk(struct yaffs_dev *dev, int nand_chunk)
+{
+	return (const u8 *) Chunk2DataAddr(dev,nand_chunk);
+}
+
 static int ynorif1_FormatBlock(struct yaffs_dev *dev, int blockNumber)
 {
 	u32 *blockAddr = Block2Addr(dev,blockNumber);
@@ -21,9 +21,12 @@
 
 int ynorif1_WriteChunkToNAND(struct yaffs_dev *dev,int nand_chunk,const u8 *data, const struct yaffs_spare *spare);
 int ynorif1_ReadChunkFromNAND(struct yaffs_dev *dev,int nand_chunk, u8 *data, struct yaffs_spare *spare);
+int ynorif1_ReadSpares(struct yaffs_dev *dev,int nand_chunk, int n_chunks, struct yaffs_spare *spares);
+const u8 *ynorif1_MapChunk(struct yaffs_dev *dev, int nand_chunk);
 int ynorif1_EraseBlockInNAND(struct yaffs_dev *dev, int blockNumber);
 int ynorif1_InitialiseNAND(struct yaffs_dev *dev);
 int ynorif1_Deinitialise_flash_fn(struct yaffs_dev *dev);
+int ynorif1_SetWriteBuffer(int nbytes);
 
 #endif
 
@@ -79,7 +79,7 @@ u32 yaffsfs_CurrentTime(void)
 }
 
 
-static int yaffs_kill_alloc = 0;
+int yaffs_kill_alloc = 0;	/* Set by tests to make allocations fail */
 static size_t total_malloced = 0;
 static size_t malloc_limit = 0 & 6000000;
 
@@ -22,6 +22,7 @@
 #include "yaffs_guts.h"
 #include "yaffsfs.h"
 #include "yaffs_fileem2k.h"
+#include "yaffs_mmapem2k.h"
 #include "yaffs_nandemul2k.h"
 #include "yaffs_norif1.h"
 #include "yaffs_trace.h"
@@ -54,6 +55,7 @@ unsigned yaffs_trace_mask =
 
 struct yaffs_dev ram1Dev;
 struct yaffs_dev flashDev;
+struct yaffs_dev mmapDev;
 struct yaffs_dev m18_1Dev;
 
 int yaffs_start_up(void)
@@ -94,6 +96,8 @@ int yaffs_start_up(void)
 	m18_1Dev.driver_context = (void *) 1;	// Used to identify the device in fstat.
 	m18_1Dev.param.write_chunk_fn = ynorif1_WriteChunkToNAND;
 	m18_1Dev.param.read_chunk_fn = ynorif1_ReadChunkFromNAND;
+	m18_1Dev.param.read_spares_fn = ynorif1_ReadSpares;
+	m18_1Dev.param.map_chunk_fn = ynorif1_MapChunk;
 	m18_1Dev.param.erase_fn = ynorif1_EraseBlockInNAND;
 	m18_1Dev.param.initialise_flash_fn = ynorif1_InitialiseNAND;
 	m18_1Dev.param.deinitialise_flash_fn = ynorif1_Deinitialise_flash_fn;
@@ -129,6 +133,35 @@ int yaffs_start_up(void)
 
 	yaffs_add_device(&flashDev);
 
+	// /mmap2k  yaffs2 on the mmap emulator
+	// Same geometry as /yaffs2, one memory mapped image file.
+	// Use ymmap2_Configure() before this to change the image or size.
+	memset(&mmapDev,0,sizeof(mmapDev));
+	mmapDev.param.name = "mmap2k";
+	mmapDev.param.total_bytes_per_chunk = 2048;
+	mmapDev.param.chunks_per_block = 64;
+	mmapDev.param.n_reserved_blocks = 5;
+	mmapDev.param.start_block = 0;
+	mmapDev.param.end_block = ymmap2_GetNumberOfBlocks()-1;
+	mmapDev.param.is_yaffs2 = 1;
+	mmapDev.param.use_nand_ecc=1;
+	mmapDev.param.refresh_period = 1000;
+	mmapDev.param.n_caches = 10; // Use caches
+	mmapDev.driver_context = (void *) 3;	// Used to identify the device in fstat.
+	mmapDev.param.write_chunk_tags_fn = ymmap2_WriteChunkWithTagsToNAND;
+	mmapDev.param.read_chunk_tags_fn = ymmap2_ReadChunkWithTagsFromNAND;
+	mmapDev.param.erase_fn = ymmap2_EraseBlockInNAND;
+	mmapDev.param.initialise_flash_fn = ymmap2_InitialiseNAND;
+	mmapDev.param.deinitialise_flash_fn = ymmap2_DeinitialiseNAND;
+	mmapDev.param.bad_block_fn = ymmap2_MarkNANDBlockBad;
+	mmapDev.param.query_block_fn = ymmap2_QueryNANDBlock;
+	mmapDev.param.discard_fn = ymmap2_Discard;
+	mmapDev.param.discard_mode = YAFFS_DISCARD_CHUNKS;
+	mmapDev.param.discard_batch = 64;
+	mmapDev.param.enable_xattr = 1;
+
+	yaffs_add_device(&mmapDev);
+
 // todo	yaffs_initialise(yaffsfs_config);
 	
 	return 0;
@@ -50,6 +50,8 @@
 
 static u32 word[YNORSIM_DEV_SIZE_U32];
 
+static struct ynorsim_stats stats;
+
 extern int random_seed;
 extern int simulate_power_failure;
 
@@ -152,16 +154,61 @@ void ynorsim_wr32(u32 *addr, u32 *buf, int nwords)
 {
   while(nwords >0){
     ynorsim_wr_one_word32(addr,*buf);
+    stats.word_programs++;
     addr++;
     buf++;
     nwords--;
   }
 }
 
+/*
+ * Program up to YNORSIM_MAX_WRITE_BUFFER bytes in one operation, like the
+ * buffered programming of larger NOR parts. The words must not cross a
+ * write buffer boundary. Bits change all over the buffer while it is
+ * being programmed so a power failure can leave any of it half done.
+ */
+void ynorsim_wr_buf32(u32 *addr, u32 *buf, int nwords)
+{
+  int buf_words = YNORSIM_MAX_WRITE_BUFFER / 4;
+  int first = (addr - word) % buf_words;
+  u32 m;
+  int i;
+  int w;
+
+  if(nwords < 1 || first + nwords > buf_words){
+    printf("write buffer program of %d words at word %d\n",nwords,first);
+    NorError();
+  }
+
+  for(i = 0; i < nwords; i++){
+    if(buf[i] & ~addr[i]){
+      printf("attempt to set a zero to one (%x)->(%x)\n",addr[i],buf[i]);
+      NorError();
+    }
+  }
+
+  for(i = 0; i < YNORSIM_BIT_CHANGES; i++){
+    w = rand() % nwords;
+    m = 1 << (rand() & 31);
+    if(!(m & buf[w])){
+      addr[w] &= ~m;
+      ynorsim_maybe_power_fail();
+    }
+  }
+
+  for(i = 0; i < nwords; i++)
+    addr[i] &= buf[i];
+  ynorsim_maybe_power_fail();
+
+  stats.buffer_programs++;
+  stats.buffered_words += nwords;
+}
+
 void ynorsim_erase(u32 *addr)
 {
   /* Todo... bit flipping */
   memset(addr,0xFF,YNORSIM_BLOCK_SIZE_U32 * 4);
+  stats.erases++;
 }
 
 void ynorsim_initialise(void)
@@ -179,3 +226,13 @@ u32 *ynorsim_get_base(void)
 {
   return word;
 }
+
+void ynorsim_get_stats(struct ynorsim_stats *s)
+{
+  *s = stats;
+}
+
+void ynorsim_reset_stats(void)
+{
+  memset(&stats, 0, sizeof(stats));
+}
@@ -18,11 +18,25 @@
 
 #include "yaffs_guts.h"
 
+/* Largest write buffer the simulated part has, in bytes */
+#define YNORSIM_MAX_WRITE_BUFFER 512
+
+/* Programming operations done since the last reset */
+struct ynorsim_stats {
+	unsigned word_programs;		/* Single word programs */
+	unsigned buffer_programs;	/* Write buffer programs */
+	unsigned buffered_words;	/* Words in write buffer programs */
+	unsigned erases;
+};
+
 void ynorsim_rd32(u32 *addr, u32 *data, int nwords);
 void ynorsim_wr32(u32 *addr, u32 *data, int nwords);
+void ynorsim_wr_buf32(u32 *addr, u32 *data, int nwords);
 void ynorsim_erase(u32 *addr);
 void ynorsim_shutdown(void);
 void ynorsim_initialise(void);
 u32 * ynorsim_get_base(void);
+void ynorsim_get_stats(struct ynorsim_stats *stats);
+void ynorsim_reset_stats(void);
 
 #endif
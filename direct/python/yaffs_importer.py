@@ -106,52 +106,18 @@ def create_file(file):
         debug_message(("unlinking", file_path, output), 2)
         check_for_yaffs_errors(output)
     
-    current_handle=yaffs_open(file_path, yaffs_O_CREAT | yaffs_O_TRUNC| yaffs_O_RDWR, yaffs_S_IREAD | yaffs_S_IWRITE)  ##opens a file with mode set to write
-    debug_message(("current_handle", current_handle), 2)
-    data_file=open(file["path"], "r")
-    output=yaffs_lseek(current_handle, 0, 0)
-    if output==-1:
+    ##copies the data, mode and times in one call rather than through python
+    output=yaffs_import_file(file["path"], file_path, 0)
+    if output>=0:
+        debug_message(( "writing to ", file_path," ",  output), 1)
+    else :
+        debug_message(( "error writing file:", output), 0)
         ##if there is no more space in the emfile then this is where it will show up.
         freespace=ctypes.c_longlong
         freespace.value=yaffs_freespace(yaffs_root_dir_path)
         print "yaffs free space:", freespace.value
-
         if freespace.value==0:
-            #print "yaffs free space:", yaffs_freespace(yaffs_root_dir_path)
             print "yaffs is out of space exiting program"
-           #sys.exit() 
-        debug_message("error with yaffs lseeking", 2)
-        
-        check_for_yaffs_errors(output)
-    data_to_be_written= data_file.read()
-    
-    
-    length_of_file=len(data_to_be_written)
-    debug_message (("length of data to be written",length_of_file), 3) 
-    output=yaffs_write(current_handle,data_to_be_written , length_of_file)
-    if output>=0:
-        debug_message(( "writing to ", file_path," ",  output), 1)
-    else :
-        debug_message(( "error writing file:", output), 0)
-        check_for_yaffs_errors(output)
-    output=yaffs_ftruncate(current_handle, length_of_file)
-    if output>=0:
-        debug_message(( "truncating file:", output), 2)
-    else :
-        debug_message(( "error truncating file:", output), 0)
-        check_for_yaffs_errors(output)
-    output=yaffs_close(current_handle)
-    if output>=0:
-        debug_message(( "closing file:", output), 2)
-    else :
-        debug_message(( "error closing file:", output), 0)
-        check_for_yaffs_errors(output)
-    ##changes the mode of the yaffs file to be the same as the scanned file
-    yaffs_chmod(file_path, file["mode"]);
-    if output>=0:
-        debug_message(( "chmoding file:", output), 2)
-    else :
-        debug_message(( "error chmoding file:", output), 0)
         check_for_yaffs_errors(output)
 
 
@@ -20,7 +20,16 @@
  *
  */
  
+#include <dirent.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
 #include "yaffsfs.h"
+#include "yaffs_guts.h"
+#include "yaffs_osglue.h"
 #include "yaffs_trace.h"
 
 int simulate_power_failure;
@@ -56,3 +65,465 @@ int yaffs_S_IWRITE(void){return S_IWRITE;}
 int yaffs_S_IEXEC(void){return S_IEXEC;}
 int yaffs_XATTR_CREATE(void){return XATTR_CREATE;}
 int yaffs_XATTR_REPLACE(void){return XATTR_REPLACE;}
+
+
+/*
+ * Bulk operations.
+ * Going through ctypes one call at a time costs far more than the work
+ * itself, so these copy whole files and trees between the host and yaffs
+ * in one call. They return -1 with the yaffs error set on failure; host
+ * errors are passed on as the matching yaffs error.
+ */
+
+#define YAFFS_PY_BUFFER_SIZE	(64 * 1024)
+
+/* yaffs_import_tree() flags */
+#define YAFFS_PY_SKIP_HIDDEN	1	/* Leave out names starting with '.' */
+
+int yaffs_PY_SKIP_HIDDEN(void) { return YAFFS_PY_SKIP_HIDDEN; }
+
+static int yaffs_py_host_error(void)
+{
+	yaffs_set_error(-errno);
+	return -1;
+}
+
+static char *yaffs_py_get_buffer(int *size)
+{
+	char *buffer;
+
+	if (*size <= 0)
+		*size = YAFFS_PY_BUFFER_SIZE;
+	buffer = malloc(*size);
+	if (!buffer)
+		yaffs_set_error(-ENOMEM);
+	return buffer;
+}
+
+static int yaffs_py_copy_in(int fd, int yfd, char *buffer, int size)
+{
+	int total = 0;
+	int n;
+
+	while ((n = read(fd, buffer, size)) != 0) {
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return yaffs_py_host_error();
+		}
+		if (yaffs_write(yfd, buffer, n) != n)
+			return -1;
+		total += n;
+	}
+	return total;
+}
+
+static int yaffs_py_import_file(const char *host_path, const YCHAR *path,
+				const struct stat *st, char *buffer, int size)
+{
+	struct yaffs_utimbuf t;
+	int fd;
+	int yfd;
+	int ret = -1;
+
+	fd = open(host_path, O_RDONLY);
+	if (fd < 0)
+		return yaffs_py_host_error();
+
+	/* Replace what is there, even if it is read only */
+	if (yaffs_access(path, 0) == 0 && yaffs_unlink(path) < 0)
+		goto out;
+
+	yfd = yaffs_open(path, O_CREAT | O_TRUNC | O_WRONLY,
+			 S_IREAD | S_IWRITE);
+	if (yfd < 0)
+		goto out;
+
+	ret = yaffs_py_copy_in(fd, yfd, buffer, size);
+
+	t.actime = st->st_atime;
+	t.modtime = st->st_mtime;
+	if (ret >= 0 &&
+	    (yaffs_fchmod(yfd, st->st_mode & 0777) < 0 ||
+	     yaffs_futime(yfd, &t) < 0))
+		ret = -1;
+
+	if (yaffs_close(yfd) < 0)
+		ret = -1;
+out:
+	close(fd);
+	return ret;
+}
+
+/*
+ * Copies a host file into yaffs, with its mode and times.
+ * Returns the number of bytes copied.
+ */
+int yaffs_import_file(const char *host_path, const YCHAR *path,
+		      int buffer_size)
+{
+	struct stat st;
+	char *buffer;
+	int ret;
+
+	if (stat(host_path, &st) < 0)
+		return yaffs_py_host_error();
+	if (!S_ISREG(st.st_mode)) {
+		yaffs_set_error(-EINVAL);
+		return -1;
+	}
+
+	buffer = yaffs_py_get_buffer(&buffer_size);
+	if (!buffer)
+		return -1;
+	ret = yaffs_py_import_file(host_path, path, &st, buffer, buffer_size);
+	free(buffer);
+	return ret;
+}
+
+/*
+ * Copies a yaffs file out to the host, with its mode and times.
+ * Returns the number of bytes copied.
+ */
+int yaffs_export_file(const YCHAR *path, const char *host_path,
+		      int buffer_size)
+{
+	struct yaffs_stat st;
+	struct timeval tv[2];
+	char *buffer;
+	int total = 0;
+	int yfd;
+	int fd;
+	int n;
+
+	yfd = yaffs_open(path, O_RDONLY, 0);
+	if (yfd < 0)
+		return -1;
+	if (yaffs_fstat(yfd, &st) < 0)
+		goto err_close;
+
+	buffer = yaffs_py_get_buffer(&buffer_size);
+	if (!buffer)
+		goto err_close;
+
+	fd = open(host_path, O_CREAT | O_TRUNC | O_WRONLY, 0600);
+	if (fd < 0) {
+		yaffs_py_host_error();
+		goto err_free;
+	}
+
+	while ((n = yaffs_read(yfd, buffer, buffer_size)) > 0) {
+		if (write(fd, buffer, n) != n) {
+			yaffs_py_host_error();
+			n = -1;
+			break;
+		}
+		total += n;
+	}
+
+	tv[0].tv_sec = st.yst_atime;
+	tv[0].tv_usec = 0;
+	tv[1].tv_sec = st.yst_mtime;
+	tv[1].tv_usec = 0;
+	if (n == 0 && (fchmod(fd, st.st_mode & 07777) < 0 ||
+		       futimes(fd, tv) < 0)) {
+		yaffs_py_host_error();
+		n = -1;
+	}
+
+	if (close(fd) < 0 && n == 0) {
+		yaffs_py_host_error();
+		n = -1;
+	}
+	free(buffer);
+	yaffs_close(yfd);
+	return n < 0 ? -1 : total;
+
+err_free:
+	free(buffer);
+err_close:
+	yaffs_close(yfd);
+	return -1;
+}
+
+/* Host files with more than one link, so the others become yaffs links */
+#define YAFFS_PY_LINK_BUCKETS	64
+
+struct yaffs_py_link {
+	struct yaffs_py_link *next;
+	dev_t dev;
+	ino_t ino;
+	YCHAR path[1];
+};
+
+struct yaffs_py_import {
+	int flags;
+	char *buffer;
+	int size;
+	int count;
+	char host_path[PATH_MAX];
+	YCHAR path[PATH_MAX];
+	struct yaffs_py_link *links[YAFFS_PY_LINK_BUCKETS];
+};
+
+static struct yaffs_py_link **yaffs_py_link_bucket(struct yaffs_py_import *im,
+						   const struct stat *st)
+{
+	return &im->links[st->st_ino % YAFFS_PY_LINK_BUCKETS];
+}
+
+static const YCHAR *yaffs_py_find_link(struct yaffs_py_import *im,
+				       const struct stat *st)
+{
+	struct yaffs_py_link *l;
+
+	for (l = *yaffs_py_link_bucket(im, st); l; l = l->next)
+		if (l->ino == st->st_ino && l->dev == st->st_dev)
+			return l->path;
+	return NULL;
+}
+
+static int yaffs_py_add_link(struct yaffs_py_import *im,
+			     const struct stat *st)
+{
+	struct yaffs_py_link **bucket = yaffs_py_link_bucket(im, st);
+	struct yaffs_py_link *l;
+
+	l = malloc(sizeof(*l) + strlen(im->path));
+	if (!l) {
+		yaffs_set_error(-ENOMEM);
+		return -1;
+	}
+	l->dev = st->st_dev;
+	l->ino = st->st_ino;
+	strcpy(l->path, im->path);
+	l->next = *bucket;
+	*bucket = l;
+	return 0;
+}
+
+static int yaffs_py_import_dir(struct yaffs_py_import *im);
+
+/* Imports im->host_path as im->path */
+static int yaffs_py_import_one(struct yaffs_py_import *im)
+{
+	struct yaffs_utimbuf t;
+	struct stat st;
+	const YCHAR *link;
+	char target[PATH_MAX];
+	int n;
+
+	if (lstat(im->host_path, &st) < 0)
+		return yaffs_py_host_error();
+
+	if (S_ISDIR(st.st_mode)) {
+		if (yaffs_mkdir(im->path, S_IREAD | S_IWRITE | S_IEXEC) < 0 &&
+		    yaffs_get_error() != -EEXIST)
+			return -1;
+		if (yaffs_py_import_dir(im) < 0)
+			return -1;
+		/* After the contents, so they do not change it again */
+		t.actime = st.st_atime;
+		t.modtime = st.st_mtime;
+		if (yaffs_chmod(im->path, st.st_mode & 0777) < 0 ||
+		    yaffs_utime(im->path, &t) < 0)
+			return -1;
+	} else if (S_ISREG(st.st_mode)) {
+		link = st.st_nlink > 1 ? yaffs_py_find_link(im, &st) : NULL;
+		if (link) {
+			if (yaffs_link(link, im->path) < 0)
+				return -1;
+		} else {
+			if (yaffs_py_import_file(im->host_path, im->path, &st,
+						 im->buffer, im->size) < 0)
+				return -1;
+			if (st.st_nlink > 1 && yaffs_py_add_link(im, &st) < 0)
+				return -1;
+		}
+	} else if (S_ISLNK(st.st_mode)) {
+		n = readlink(im->host_path, target, sizeof(target) - 1);
+		if (n < 0)
+			return yaffs_py_host_error();
+		target[n] = 0;
+		if (yaffs_symlink(target, im->path) < 0)
+			return -1;
+	} else {
+		if (yaffs_mknod(im->path, st.st_mode, st.st_rdev) < 0)
+			return -1;
+	}
+
+	im->count++;
+	return 0;
+}
+
+static int yaffs_py_import_dir(struct yaffs_py_import *im)
+{
+	int host_len = strlen(im->host_path);
+	int len = strlen(im->path);
+	struct dirent *de;
+	DIR *d;
+	int ret = 0;
+
+	d = opendir(im->host_path);
+	if (!d)
+		return yaffs_py_host_error();
+
+	while (ret == 0 && (de = readdir(d)) != NULL) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		if ((im->flags & YAFFS_PY_SKIP_HIDDEN) && de->d_name[0] == '.')
+			continue;
+
+		if (host_len + strlen(de->d_name) + 2 > sizeof(im->host_path) ||
+		    len + strlen(de->d_name) + 2 > sizeof(im->path)) {
+			yaffs_set_error(-ENAMETOOLONG);
+			ret = -1;
+			break;
+		}
+		sprintf(im->host_path + host_len, "/%s", de->d_name);
+		sprintf(im->path + len, "/%s", de->d_name);
+
+		ret = yaffs_py_import_one(im);
+
+		im->host_path[host_len] = 0;
+		im->path[len] = 0;
+	}
+
+	closedir(d);
+	return ret;
+}
+
+/*
+ * Copies the host tree at host_dir into the yaffs directory path, which is
+ * made if need be. Hard links within the tree stay hard links and symlink
+ * targets are copied as they are. Directory header updates are held back
+ * until the end.
+ * Returns the number of objects imported.
+ */
+int yaffs_import_tree(const char *host_dir, const YCHAR *path, int flags)
+{
+	struct yaffs_py_import *im;
+	struct yaffs_py_link *l;
+	struct yaffs_dev *dev;
+	int defered;
+	int ret;
+	int i;
+
+	dev = yaffs_getdev(path);
+	if (!dev) {
+		yaffs_set_error(-ENODEV);
+		return -1;
+	}
+
+	im = calloc(1, sizeof(*im));
+	if (!im || !(im->buffer = yaffs_py_get_buffer(&im->size))) {
+		free(im);
+		yaffs_set_error(-ENOMEM);
+		return -1;
+	}
+	im->flags = flags;
+
+	if (strlen(host_dir) >= sizeof(im->host_path) ||
+	    strlen(path) >= sizeof(im->path)) {
+		yaffs_set_error(-ENAMETOOLONG);
+		ret = -1;
+		goto out;
+	}
+	strcpy(im->host_path, host_dir);
+	strcpy(im->path, path);
+	while (strlen(im->path) > 1 && im->path[strlen(im->path) - 1] == '/')
+		im->path[strlen(im->path) - 1] = 0;
+
+	yaffsfs_Lock();
+	defered = dev->param.defered_dir_update;
+	dev->param.defered_dir_update = 1;
+	yaffsfs_Unlock();
+
+	ret = yaffs_py_import_one(im);
+
+	yaffsfs_Lock();
+	yaffs_update_dirty_dirs(dev);
+	dev->param.defered_dir_update = defered;
+	yaffsfs_Unlock();
+
+	if (ret == 0)
+		ret = im->count;
+out:
+	for (i = 0; i < YAFFS_PY_LINK_BUCKETS; i++) {
+		while ((l = im->links[i]) != NULL) {
+			im->links[i] = l->next;
+			free(l);
+		}
+	}
+	free(im->buffer);
+	free(im);
+	return ret;
+}
+
+/* One entry of yaffs_stat_dir(). Fixed size fields, to keep ctypes simple */
+struct yaffs_py_stat {
+	unsigned mode;
+	unsigned ino;
+	unsigned nlink;
+	unsigned rdev;
+	long long size;
+	unsigned atime;
+	unsigned mtime;
+	unsigned ctime;
+	char name[NAME_MAX + 1];
+};
+
+int yaffs_py_stat_size(void) { return sizeof(struct yaffs_py_stat); }
+
+/*
+ * lstats the entries of a directory, skipping the first start, into
+ * buf[0..max-1]. Returns the number of entries filled in; fewer than max
+ * means the directory has been read to the end.
+ */
+int yaffs_stat_dir(const YCHAR *path, struct yaffs_py_stat *buf, int max,
+		   int start)
+{
+	YCHAR name[PATH_MAX];
+	struct yaffs_dirent *de;
+	struct yaffs_stat st;
+	yaffs_DIR *d;
+	int len = strlen(path);
+	int n = 0;
+
+	if (len + NAME_MAX + 2 > (int)sizeof(name)) {
+		yaffs_set_error(-ENAMETOOLONG);
+		return -1;
+	}
+	strcpy(name, path);
+	if (len > 0 && name[len - 1] != '/')
+		name[len++] = '/';
+
+	d = yaffs_opendir(path);
+	if (!d)
+		return -1;
+
+	while (n < max && (de = yaffs_readdir(d)) != NULL) {
+		if (start > 0) {
+			start--;
+			continue;
+		}
+		strcpy(name + len, de->d_name);
+		if (yaffs_lstat(name, &st) < 0) {
+			n = -1;
+			break;
+		}
+		buf[n].mode = st.st_mode;
+		buf[n].ino = st.st_ino;
+		buf[n].nlink = st.st_nlink;
+		buf[n].rdev = st.st_rdev;
+		buf[n].size = st.st_size;
+		buf[n].atime = st.yst_atime;
+		buf[n].mtime = st.yst_mtime;
+		buf[n].ctime = st.yst_ctime;
+		strcpy(buf[n].name, de->d_name);
+		n++;
+	}
+
+	yaffs_closedir(d);
+	return n;
+}
@@ -296,3 +296,86 @@ yaffs_S_IEXEC=ylib.yaffs_S_IEXEC()
 yaffs_XATTR_CREATE=ylib.yaffs_XATTR_CREATE()
 yaffs_XATTR_REPLACE=ylib.yaffs_XATTR_REPLACE()
 yaffs_S_IEXEC=ylib.yaffs_S_IEXEC()
+
+
+# Bulk operations. These run in C, so a whole file or tree costs one call.
+
+#int yaffs_import_file(const char *host_path, const YCHAR *path, int buffer_size);
+yaffs_import_file = ylib.yaffs_import_file
+yaffs_import_file.argtypes = [c_char_p, c_char_p, c_int]
+yaffs_import_file.restype = c_int
+
+#int yaffs_export_file(const YCHAR *path, const char *host_path, int buffer_size);
+yaffs_export_file = ylib.yaffs_export_file
+yaffs_export_file.argtypes = [c_char_p, c_char_p, c_int]
+yaffs_export_file.restype = c_int
+
+#int yaffs_import_tree(const char *host_dir, const YCHAR *path, int flags);
+yaffs_import_tree = ylib.yaffs_import_tree
+yaffs_import_tree.argtypes = [c_char_p, c_char_p, c_int]
+yaffs_import_tree.restype = c_int
+
+yaffs_PY_SKIP_HIDDEN = ylib.yaffs_PY_SKIP_HIDDEN()
+
+class yaffs_py_stat_struct(Structure):
+    _fields_ = [
+        ("st_mode", c_uint),
+        ("st_ino", c_uint),
+        ("st_nlink", c_uint),
+        ("st_rdev", c_uint),
+        ("st_size", c_longlong),
+        ("yst_atime", c_uint),
+        ("yst_mtime", c_uint),
+        ("yst_ctime", c_uint),
+        ("name", c_char * 257)]
+
+if sizeof(yaffs_py_stat_struct) != ylib.yaffs_py_stat_size():
+    raise ImportError("yaffs_py_stat_struct does not match libyaffsfs.so")
+
+#int yaffs_stat_dir(const YCHAR *path, struct yaffs_py_stat *buf, int max, int start);
+yaffs_stat_dir_raw = ylib.yaffs_stat_dir
+yaffs_stat_dir_raw.argtypes = [c_char_p, POINTER(yaffs_py_stat_struct), c_int, c_int]
+yaffs_stat_dir_raw.restype = c_int
+
+def yaffs_stat_dir(path, batch=64):
+    """lstats every entry of a directory. Returns a list of
+    yaffs_py_stat_struct, or None with the yaffs error set."""
+    result = []
+    while True:
+        buf = (yaffs_py_stat_struct * batch)()
+        n = yaffs_stat_dir_raw(path, buf, batch, len(result))
+        if n < 0:
+            return None
+        result.extend(buf[:n])
+        if n < batch:
+            return result
+        batch *= 2
+
+# Buffer protocol versions of read and write. Writable buffers such as
+# bytearray, array and mmap are handed to yaffs in place; read only ones
+# other than bytes have to be copied once.
+
+def _yaffs_buffer(obj, writable):
+    view = memoryview(obj)
+    if view.readonly:
+        if writable:
+            raise TypeError("buffer is read only")
+        return view.tobytes(), view.nbytes
+    return (c_char * view.nbytes).from_buffer(obj), view.nbytes
+
+def yaffs_read_into(fd, buf, offset=None):
+    """Reads up to len(buf) bytes into buf. Returns the number read."""
+    cbuf, n = _yaffs_buffer(buf, True)
+    if offset is None:
+        return yaffs_read(fd, cbuf, n)
+    return yaffs_pread(fd, cbuf, n, offset)
+
+def yaffs_write_from(fd, buf, offset=None):
+    """Writes all of buf. Returns the number of bytes written."""
+    if isinstance(buf, bytes):
+        cbuf, n = buf, len(buf)
+    else:
+        cbuf, n = _yaffs_buffer(buf, False)
+    if offset is None:
+        return yaffs_write(fd, cbuf, n)
+    return yaffs_pwrite(fd, cbuf, n, offset)
@@ -0,0 +1,438 @@
+/*
+ * YAFFS: Yet another FFS. A NAND-flash specific file system.
+ *
+ * Copyright (C) 2002-2011 Aleph One Ltd.
+ *   for Toby Churchill Ltd and Brightstar Engineering
+ *
+ * Created by Charles Manning <charles@aleph1.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ */
+
+/*
+ * yaffs_replay: re-executes a yaffs_record.h log against a simulated device.
+ *
+ * Every path in the log is rebuilt under the replay mount point from its
+ * component hashes (the first component, the recorded mount point, is
+ * dropped), so the directory structure of the original workload is kept.
+ * Handles are mapped from the recorded values to the ones handed out now.
+ *
+ * By default the log is replayed as fast as possible. With -t the original
+ * start times are kept. The per op counts and times at the end, together
+ * with the recorded times, can be compared between builds to A/B test
+ * changes such as GC or cache tuning.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "yaffsfs.h"
+#include "yaffs_record.h"
+#include "yaffs_trace.h"
+
+int random_seed;
+int simulate_power_failure = 0;
+
+#define MAX_FDS		1024
+#define MAX_DIRS	64
+
+#define SWAP32(x)   ((((x) & 0x000000FF) << 24) | \
+                     (((x) & 0x0000FF00) << 8 ) | \
+                     (((x) & 0x00FF0000) >> 8 ) | \
+                     (((x) & 0xFF000000) >> 24))
+
+static const char *op_names[YAFFS_REC_N_OPS] = {
+	[YAFFS_REC_OPEN] = "open",
+	[YAFFS_REC_CLOSE] = "close",
+	[YAFFS_REC_READ] = "read",
+	[YAFFS_REC_WRITE] = "write",
+	[YAFFS_REC_PREAD] = "pread",
+	[YAFFS_REC_PWRITE] = "pwrite",
+	[YAFFS_REC_LSEEK] = "lseek",
+	[YAFFS_REC_TRUNCATE] = "truncate",
+	[YAFFS_REC_FTRUNCATE] = "ftruncate",
+	[YAFFS_REC_FSYNC] = "fsync",
+	[YAFFS_REC_FDATASYNC] = "fdatasync",
+	[YAFFS_REC_FLUSH] = "flush",
+	[YAFFS_REC_UNLINK] = "unlink",
+	[YAFFS_REC_RENAME] = "rename",
+	[YAFFS_REC_MKDIR] = "mkdir",
+	[YAFFS_REC_RMDIR] = "rmdir",
+	[YAFFS_REC_STAT] = "stat",
+	[YAFFS_REC_LSTAT] = "lstat",
+	[YAFFS_REC_FSTAT] = "fstat",
+	[YAFFS_REC_OPENDIR] = "opendir",
+	[YAFFS_REC_READDIR] = "readdir",
+	[YAFFS_REC_CLOSEDIR] = "closedir",
+	[YAFFS_REC_LINK] = "link",
+	[YAFFS_REC_SYMLINK] = "symlink",
+	[YAFFS_REC_SYNC] = "sync",
+	[YAFFS_REC_MOUNT] = "mount",
+	[YAFFS_REC_UNMOUNT] = "unmount",
+};
+
+struct op_stats {
+	unsigned long count;
+	unsigned long mismatches;
+	unsigned long long recorded_us;
+	unsigned long long replay_us;
+};
+
+static struct op_stats stats[YAFFS_REC_N_OPS];
+
+static const char *mount_point = "/yaffs2";
+static int swap;
+static int keep_timing;
+static int verbose;
+
+static int fd_map[MAX_FDS];
+
+static struct {
+	u32 id;
+	yaffs_DIR *d;
+} dir_map[MAX_DIRS];
+
+static u8 *buffer;
+static unsigned buffer_size;
+
+static unsigned long long now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void build_path(char *out, const u32 *hash, int n)
+{
+	int i;
+
+	strcpy(out, mount_point);
+	/* hash[0] is the recorded mount point. */
+	for (i = 1; i < n; i++) {
+		out += strlen(out);
+		if (hash[i] == YAFFS_REC_HASH_DOT)
+			strcpy(out, "/.");
+		else if (hash[i] == YAFFS_REC_HASH_DOTDOT)
+			strcpy(out, "/..");
+		else
+			sprintf(out, "/h%08x", hash[i]);
+	}
+}
+
+static int map_fd(u32 fd)
+{
+	return fd < MAX_FDS ? fd_map[fd] : -1;
+}
+
+static yaffs_DIR *map_dir(u32 id)
+{
+	int i;
+
+	for (i = 0; i < MAX_DIRS; i++)
+		if (dir_map[i].d && dir_map[i].id == id)
+			return dir_map[i].d;
+	return NULL;
+}
+
+static u8 *get_buffer(unsigned n)
+{
+	if (n > buffer_size) {
+		free(buffer);
+		buffer = malloc(n);
+		if (!buffer) {
+			printf("out of memory for a %u byte buffer\n", n);
+			exit(1);
+		}
+		memset(buffer, 0x5a, n);
+		buffer_size = n;
+	}
+	return buffer;
+}
+
+/* Returns the replay result, normalised like the recorded one. */
+static int replay(const struct yaffs_rec_hdr *h, const u32 *args,
+		  const char *p1, const char *p2)
+{
+	struct yaffs_stat st;
+	yaffs_DIR *d;
+	int ret = -1;
+	int i;
+
+	switch (h->op) {
+	case YAFFS_REC_OPEN:
+		ret = yaffs_open(p1, args[0], args[1]);
+		if (h->result >= 0 && h->result < MAX_FDS)
+			fd_map[h->result] = ret;
+		break;
+	case YAFFS_REC_CLOSE:
+		ret = yaffs_close(map_fd(args[0]));
+		if (args[0] < MAX_FDS)
+			fd_map[args[0]] = -1;
+		break;
+	case YAFFS_REC_READ:
+		ret = yaffs_read(map_fd(args[0]), get_buffer(args[1]), args[1]);
+		break;
+	case YAFFS_REC_WRITE:
+		ret = yaffs_write(map_fd(args[0]), get_buffer(args[1]), args[1]);
+		break;
+	case YAFFS_REC_PREAD:
+		ret = yaffs_pread(map_fd(args[0]), get_buffer(args[1]), args[1],
+				args[2]);
+		break;
+	case YAFFS_REC_PWRITE:
+		ret = yaffs_pwrite(map_fd(args[0]), get_buffer(args[1]), args[1],
+				args[2]);
+		break;
+	case YAFFS_REC_LSEEK:
+		ret = yaffs_lseek(map_fd(args[0]),
+			(off_t)(((unsigned long long)args[2] << 32) | args[1]),
+			args[3]) < 0 ? -1 : 0;
+		break;
+	case YAFFS_REC_TRUNCATE:
+		ret = yaffs_truncate(p1,
+			(off_t)(((unsigned long long)args[1] << 32) | args[0]));
+		break;
+	case YAFFS_REC_FTRUNCATE:
+		ret = yaffs_ftruncate(map_fd(args[0]),
+			(off_t)(((unsigned long long)args[2] << 32) | args[1]));
+		break;
+	case YAFFS_REC_FSYNC:
+		ret = yaffs_fsync(map_fd(args[0]));
+		break;
+	case YAFFS_REC_FDATASYNC:
+		ret = yaffs_fdatasync(map_fd(args[0]));
+		break;
+	case YAFFS_REC_FLUSH:
+		ret = yaffs_flush(map_fd(args[0]));
+		break;
+	case YAFFS_REC_UNLINK:
+		ret = yaffs_unlink(p1);
+		break;
+	case YAFFS_REC_RENAME:
+		ret = yaffs_rename(p1, p2);
+		break;
+	case YAFFS_REC_MKDIR:
+		ret = yaffs_mkdir(p1, args[0]);
+		break;
+	case YAFFS_REC_RMDIR:
+		ret = yaffs_rmdir(p1);
+		break;
+	case YAFFS_REC_STAT:
+		ret = yaffs_stat(p1, &st);
+		break;
+	case YAFFS_REC_LSTAT:
+		ret = yaffs_lstat(p1, &st);
+		break;
+	case YAFFS_REC_FSTAT:
+		ret = yaffs_fstat(map_fd(args[0]), &st);
+		break;
+	case YAFFS_REC_OPENDIR:
+		d = yaffs_opendir(p1);
+		ret = d ? 0 : -1;
+		for (i = 0; d && i < MAX_DIRS; i++)
+			if (!dir_map[i].d) {
+				dir_map[i].id = args[0];
+				dir_map[i].d = d;
+				break;
+			}
+		break;
+	case YAFFS_REC_READDIR:
+		d = map_dir(args[0]);
+		ret = (d && yaffs_readdir(d)) ? 0 : -1;
+		break;
+	case YAFFS_REC_CLOSEDIR:
+		d = map_dir(args[0]);
+		ret = d ? yaffs_closedir(d) : -1;
+		for (i = 0; d && i < MAX_DIRS; i++)
+			if (dir_map[i].d == d)
+				dir_map[i].d = NULL;
+		break;
+	case YAFFS_REC_LINK:
+		ret = yaffs_link(p1, p2);
+		break;
+	case YAFFS_REC_SYMLINK:
+		ret = yaffs_symlink(p1, p2);
+		break;
+	case YAFFS_REC_SYNC:
+		ret = yaffs_sync(p1);
+		break;
+	case YAFFS_REC_MOUNT:
+		ret = yaffs_mount(p1);
+		break;
+	case YAFFS_REC_UNMOUNT:
+		ret = yaffs_unmount(p1);
+		break;
+	}
+	return ret;
+}
+
+static int results_match(const struct yaffs_rec_hdr *h, int ret)
+{
+	switch (h->op) {
+	case YAFFS_REC_OPEN:
+		return (h->result < 0) == (ret < 0);
+	default:
+		return h->result == ret;
+	}
+}
+
+static void usage(const char *prog)
+{
+	printf("Usage: %s [options] log_file\n"
+		"  -d mountpt   mount point to replay onto (default /yaffs2)\n"
+		"  -t           keep the original timing\n"
+		"  -v           print each op as it is replayed\n"
+		"  -h           this help\n", prog);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct yaffs_rec_file_hdr fh;
+	struct yaffs_rec_hdr h;
+	u32 words[YAFFS_REC_MAX_ARGS + 2 * 255];
+	char p1[YAFFS_REC_MAX_DEPTH * 10 + 200];
+	char p2[YAFFS_REC_MAX_DEPTH * 10 + 200];
+	unsigned long long replay_start;
+	unsigned long long start;
+	unsigned long long t;
+	unsigned long n_ops = 0;
+	unsigned long n_mismatches = 0;
+	int n_words;
+	int opt;
+	int ret;
+	int i;
+	FILE *f;
+
+	while ((opt = getopt(argc, argv, "d:tvh")) != -1) {
+		switch (opt) {
+		case 'd':
+			mount_point = optarg;
+			break;
+		case 't':
+			keep_timing = 1;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1)
+		usage(argv[0]);
+
+	f = fopen(argv[optind], "rb");
+	if (!f || fread(&fh, sizeof(fh), 1, f) != 1) {
+		printf("could not read %s\n", argv[optind]);
+		return 1;
+	}
+	if (fh.magic == SWAP32(YAFFS_REC_MAGIC)) {
+		swap = 1;
+		fh.version = SWAP32(fh.version);
+		fh.flags = SWAP32(fh.flags);
+	} else if (fh.magic != YAFFS_REC_MAGIC) {
+		printf("%s is not a yaffs record log\n", argv[optind]);
+		return 1;
+	}
+	if (fh.version != YAFFS_REC_VERSION) {
+		printf("%s is version %u, expected %u\n", argv[optind],
+			fh.version, YAFFS_REC_VERSION);
+		return 1;
+	}
+	if (keep_timing && !(fh.flags & YAFFS_REC_FLAG_TIME_US)) {
+		printf("log has no timing, replaying at full speed\n");
+		keep_timing = 0;
+	}
+
+	for (i = 0; i < MAX_FDS; i++)
+		fd_map[i] = -1;
+
+	yaffs_trace_mask = 0;
+	yaffs_start_up();
+
+	replay_start = now_us();
+
+	while (fread(&h, sizeof(h), 1, f) == 1) {
+		if (swap) {
+			h.time = SWAP32(h.time);
+			h.duration = SWAP32(h.duration);
+			h.result = SWAP32((u32)h.result);
+		}
+		n_words = h.n_args + h.n_path1 + h.n_path2;
+		if (h.n_args > YAFFS_REC_MAX_ARGS ||
+		    fread(words, sizeof(u32), n_words, f) != (size_t)n_words) {
+			printf("log is corrupt or truncated after %lu ops\n",
+				n_ops);
+			break;
+		}
+		if (swap)
+			for (i = 0; i < n_words; i++)
+				words[i] = SWAP32(words[i]);
+
+		/* Logs usually start with the mount, if not do it here. */
+		if (!n_ops && h.op != YAFFS_REC_MOUNT &&
+		    yaffs_mount(mount_point) < 0) {
+			printf("could not mount %s\n", mount_point);
+			return 1;
+		}
+
+		build_path(p1, words + h.n_args, h.n_path1);
+		build_path(p2, words + h.n_args + h.n_path1, h.n_path2);
+
+		if (keep_timing) {
+			t = now_us() - replay_start;
+			if (t < h.time)
+				usleep(h.time - t);
+		}
+
+		start = now_us();
+		ret = replay(&h, words, p1, p2);
+		t = now_us() - start;
+
+		n_ops++;
+		if (h.op < YAFFS_REC_N_OPS) {
+			stats[h.op].count++;
+			stats[h.op].recorded_us += h.duration;
+			stats[h.op].replay_us += t;
+			if (!results_match(&h, ret)) {
+				stats[h.op].mismatches++;
+				n_mismatches++;
+			}
+		}
+
+		if (verbose)
+			printf("%-9s %s%s%s -> %d (recorded %d)\n",
+				h.op < YAFFS_REC_N_OPS && op_names[h.op] ?
+					op_names[h.op] : "?",
+				h.n_path1 ? p1 : "",
+				h.n_path2 ? " " : "", h.n_path2 ? p2 : "",
+				ret, h.result);
+	}
+	fclose(f);
+
+	t = now_us() - replay_start;
+
+	printf("%lu ops replayed in %llu.%06llu s, %lu results differ\n",
+		n_ops, t / 1000000, t % 1000000, n_mismatches);
+	printf("%-10s %8s %8s %12s %12s\n",
+		"op", "count", "differ", "recorded_us", "replay_us");
+	for (i = 0; i < YAFFS_REC_N_OPS; i++)
+		if (stats[i].count)
+			printf("%-10s %8lu %8lu %12llu %12llu\n",
+				op_names[i], stats[i].count,
+				stats[i].mismatches,
+				stats[i].recorded_us, stats[i].replay_us);
+
+	/* Might already have been unmounted by the log. */
+	yaffs_unmount(mount_point);
+
+	return n_mismatches ? 2 : 0;
+}
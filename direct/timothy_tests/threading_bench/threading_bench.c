@@ -0,0 +1,542 @@
+/*
+ * YAFFS: Yet another FFS. A NAND-flash specific file system.
+ *
+ * Copyright (C) 2002-2011 Aleph One Ltd.
+ *   for Toby Churchill Ltd and Brightstar Engineering
+ *
+ * Created by Charles Manning <charles@aleph1.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/*
+ * threading_bench: multi-threaded workload generator for the direct interface.
+ *
+ * For each thread count a set of worker threads is started, each with a role
+ * (reader, appender, metadata churner or fsync-er) and a device. The threads
+ * hammer yaffs for a fixed time and then the throughput and latency for that
+ * thread count is reported, per role and in total. Since everything goes
+ * through yaffsfs_Lock() this shows how well (or badly) the locking scales.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include "yaffsfs.h"
+#include "yaffs_trace.h"
+
+int random_seed;
+int simulate_power_failure = 0;
+
+#define MAX_THREADS	64
+#define MAX_DEVICES	8
+#define MAX_COUNTS	16
+
+/* Latency histogram buckets, bucket n holds latencies < 2^n microseconds. */
+#define N_BUCKETS	32
+
+#define READ_FILE_SIZE	(1024 * 1024)
+#define READ_SIZE	4096
+#define APPEND_SIZE	2048
+#define APPEND_LIMIT	(256 * 1024)
+#define SYNC_SIZE	512
+
+enum role {
+	ROLE_READER,
+	ROLE_APPENDER,
+	ROLE_META,
+	ROLE_FSYNC,
+	N_ROLES
+};
+
+static const char *role_names[N_ROLES] = {
+	"reader", "appender", "meta", "fsync"
+};
+
+struct lat_stats {
+	unsigned long long n_ops;
+	unsigned long long n_errors;
+	unsigned long long total_us;
+	unsigned long long max_us;
+	unsigned long long buckets[N_BUCKETS];
+};
+
+struct worker {
+	pthread_t thread;
+	int id;
+	enum role role;
+	const char *mountpt;
+	unsigned seed;
+	char dir[100];
+	struct lat_stats stats;
+};
+
+static const char *devices[MAX_DEVICES];
+static int n_devices;
+static int thread_counts[MAX_COUNTS];
+static int n_thread_counts;
+static int role_weights[N_ROLES] = {4, 2, 2, 1};
+static int run_seconds = 5;
+
+static int stop_flag;
+static struct worker workers[MAX_THREADS];
+
+static unsigned long long now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int stopping(void)
+{
+	return __atomic_load_n(&stop_flag, __ATOMIC_RELAXED);
+}
+
+static void record(struct lat_stats *s, unsigned long long start, int ok)
+{
+	unsigned long long t = now_us() - start;
+	int b = 0;
+
+	while (b < N_BUCKETS - 1 && (1ULL << b) <= t)
+		b++;
+
+	s->n_ops++;
+	if (!ok)
+		s->n_errors++;
+	s->total_us += t;
+	if (t > s->max_us)
+		s->max_us = t;
+	s->buckets[b]++;
+}
+
+static void add_stats(struct lat_stats *to, const struct lat_stats *from)
+{
+	int i;
+
+	to->n_ops += from->n_ops;
+	to->n_errors += from->n_errors;
+	to->total_us += from->total_us;
+	if (from->max_us > to->max_us)
+		to->max_us = from->max_us;
+	for (i = 0; i < N_BUCKETS; i++)
+		to->buckets[i] += from->buckets[i];
+}
+
+/* Upper bound of the bucket holding the given percentile. */
+static unsigned long long percentile(const struct lat_stats *s, int pc)
+{
+	unsigned long long target = (s->n_ops * pc + 99) / 100;
+	unsigned long long sum = 0;
+	int i;
+
+	for (i = 0; i < N_BUCKETS; i++) {
+		sum += s->buckets[i];
+		if (sum >= target && sum > 0)
+			return 1ULL << i;
+	}
+	return 0;
+}
+
+static void reader(struct worker *w)
+{
+	char path[200];
+	char buf[READ_SIZE];
+	unsigned long long start;
+	unsigned offs;
+	int h;
+	int ok;
+
+	sprintf(path, "%s/bench-read", w->mountpt);
+	h = yaffs_open(path, O_RDONLY, 0);
+
+	while (!stopping()) {
+		start = now_us();
+		offs = (rand_r(&w->seed) % (READ_FILE_SIZE / READ_SIZE)) * READ_SIZE;
+		ok = (yaffs_pread(h, buf, READ_SIZE, offs) == READ_SIZE);
+		record(&w->stats, start, ok);
+	}
+	yaffs_close(h);
+}
+
+static void appender(struct worker *w)
+{
+	char path[200];
+	char buf[APPEND_SIZE];
+	unsigned long long start;
+	int written = 0;
+	int h;
+	int ok;
+
+	memset(buf, w->id, sizeof(buf));
+	sprintf(path, "%s/append", w->dir);
+	h = yaffs_open(path, O_CREAT | O_RDWR | O_APPEND | O_TRUNC,
+			S_IREAD | S_IWRITE);
+
+	while (!stopping()) {
+		start = now_us();
+		if (written >= APPEND_LIMIT) {
+			/* Keep the device from filling up. */
+			ok = (yaffs_ftruncate(h, 0) == 0);
+			written = 0;
+		} else {
+			ok = (yaffs_write(h, buf, sizeof(buf)) == sizeof(buf));
+			written += sizeof(buf);
+		}
+		record(&w->stats, start, ok);
+	}
+	yaffs_close(h);
+}
+
+/* Each "op" is one create, stat, rename or unlink. */
+static void meta_churner(struct worker *w)
+{
+	char a[200];
+	char b[200];
+	struct yaffs_stat st;
+	unsigned long long start;
+	int step = 0;
+	int ok;
+	int h;
+
+	while (!stopping()) {
+		sprintf(a, "%s/m%d", w->dir, rand_r(&w->seed) % 16);
+		sprintf(b, "%s/n%d", w->dir, rand_r(&w->seed) % 16);
+		start = now_us();
+		switch (step) {
+		case 0:
+			h = yaffs_open(a, O_CREAT | O_RDWR, S_IREAD | S_IWRITE);
+			ok = (h >= 0 && yaffs_close(h) == 0);
+			break;
+		case 1:
+			yaffs_stat(a, &st);
+			ok = 1;
+			break;
+		case 2:
+			yaffs_rename(a, b);
+			ok = 1;
+			break;
+		default:
+			yaffs_unlink(b);
+			ok = 1;
+			break;
+		}
+		record(&w->stats, start, ok);
+		step = (step + 1) % 4;
+	}
+}
+
+static void fsyncer(struct worker *w)
+{
+	char path[200];
+	char buf[SYNC_SIZE];
+	unsigned long long start;
+	int h;
+	int ok;
+
+	memset(buf, w->id, sizeof(buf));
+	sprintf(path, "%s/sync", w->dir);
+	h = yaffs_open(path, O_CREAT | O_RDWR | O_TRUNC, S_IREAD | S_IWRITE);
+
+	while (!stopping()) {
+		start = now_us();
+		ok = (yaffs_pwrite(h, buf, sizeof(buf),
+				(rand_r(&w->seed) % 64) * SYNC_SIZE) ==
+						sizeof(buf) &&
+		      yaffs_fsync(h) == 0);
+		record(&w->stats, start, ok);
+	}
+	yaffs_close(h);
+}
+
+static void *worker_fn(void *arg)
+{
+	struct worker *w = arg;
+
+	switch (w->role) {
+	case ROLE_READER:
+		reader(w);
+		break;
+	case ROLE_APPENDER:
+		appender(w);
+		break;
+	case ROLE_META:
+		meta_churner(w);
+		break;
+	default:
+		fsyncer(w);
+		break;
+	}
+	return NULL;
+}
+
+/*
+ * Hand out roles in proportion to the weights, interleaved so that small
+ * thread counts still get a mix, eg. 4:2:2:1 gives ramrframr.
+ */
+static void pick_roles(int n_threads)
+{
+	int count[N_ROLES];
+	int total = 0;
+	int best;
+	int i;
+	int r;
+
+	memset(count, 0, sizeof(count));
+	for (r = 0; r < N_ROLES; r++)
+		total += role_weights[r];
+
+	for (i = 0; i < n_threads; i++) {
+		best = -1;
+		for (r = 0; r < N_ROLES; r++) {
+			if (!role_weights[r])
+				continue;
+			if (best < 0 ||
+			    role_weights[r] * (i + 1) - count[r] * total >
+			    role_weights[best] * (i + 1) - count[best] * total)
+				best = r;
+		}
+		count[best]++;
+		workers[i].role = best;
+	}
+}
+
+static void remove_dir(const char *dir)
+{
+	yaffs_DIR *d;
+	struct yaffs_dirent *de;
+	char path[400];
+
+	d = yaffs_opendir(dir);
+	if (!d)
+		return;
+	while ((de = yaffs_readdir(d)) != NULL) {
+		sprintf(path, "%s/%s", dir, de->d_name);
+		yaffs_unlink(path);
+	}
+	yaffs_closedir(d);
+	yaffs_rmdir(dir);
+}
+
+static void print_stats(const char *name, int n_threads,
+			const struct lat_stats *s, double secs)
+{
+	printf("%7d %-9s %10llu %10.0f %8.1f %8llu %8llu %8llu %6llu\n",
+		n_threads, name, s->n_ops, s->n_ops / secs,
+		s->n_ops ? (double)s->total_us / s->n_ops : 0.0,
+		percentile(s, 50), percentile(s, 99), s->max_us,
+		s->n_errors);
+}
+
+static void run(int n_threads)
+{
+	struct lat_stats per_role[N_ROLES];
+	struct lat_stats total;
+	int role_used[N_ROLES];
+	unsigned long long start;
+	double secs;
+	int i;
+
+	memset(per_role, 0, sizeof(per_role));
+	memset(&total, 0, sizeof(total));
+	memset(role_used, 0, sizeof(role_used));
+
+	for (i = 0; i < n_threads; i++) {
+		struct worker *w = &workers[i];
+
+		memset(w, 0, sizeof(*w));
+		w->id = i;
+		w->mountpt = devices[i % n_devices];
+		w->seed = random_seed + i;
+		sprintf(w->dir, "%s/bench-%d", w->mountpt, i);
+		yaffs_mkdir(w->dir, S_IREAD | S_IWRITE | S_IEXEC);
+	}
+
+	pick_roles(n_threads);
+
+	__atomic_store_n(&stop_flag, 0, __ATOMIC_RELAXED);
+	start = now_us();
+
+	for (i = 0; i < n_threads; i++)
+		if (pthread_create(&workers[i].thread, NULL,
+				worker_fn, &workers[i]) != 0) {
+			printf("failed to create thread %d\n", i);
+			exit(1);
+		}
+
+	sleep(run_seconds);
+	__atomic_store_n(&stop_flag, 1, __ATOMIC_RELAXED);
+
+	for (i = 0; i < n_threads; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	secs = (now_us() - start) / 1000000.0;
+
+	for (i = 0; i < n_threads; i++) {
+		add_stats(&per_role[workers[i].role], &workers[i].stats);
+		add_stats(&total, &workers[i].stats);
+		role_used[workers[i].role] = 1;
+		remove_dir(workers[i].dir);
+	}
+
+	for (i = 0; i < N_ROLES; i++)
+		if (role_used[i])
+			print_stats(role_names[i], n_threads, &per_role[i],
+					secs);
+	print_stats("total", n_threads, &total, secs);
+}
+
+static void setup_device(const char *mountpt)
+{
+	char path[200];
+	char buf[READ_SIZE];
+	int h;
+	int i;
+
+	if (yaffs_mount(mountpt) < 0) {
+		printf("could not mount %s\n", mountpt);
+		exit(1);
+	}
+
+	/* The readers all share one file per device. */
+	sprintf(path, "%s/bench-read", mountpt);
+	h = yaffs_open(path, O_CREAT | O_RDWR | O_TRUNC, S_IREAD | S_IWRITE);
+	for (i = 0; i < READ_FILE_SIZE / READ_SIZE; i++) {
+		memset(buf, i, sizeof(buf));
+		yaffs_write(h, buf, sizeof(buf));
+	}
+	yaffs_close(h);
+}
+
+static void usage(const char *prog)
+{
+	printf("Usage: %s [options]\n"
+		"  -t n[,n...]   thread counts to run (default 1,2,4,8)\n"
+		"  -d dev[,dev]  mount points to spread threads over "
+			"(default /yaffs2)\n"
+		"  -m r:a:m:f    reader:appender:meta:fsync weights "
+			"(default 4:2:2:1)\n"
+		"  -s seconds    run time per thread count (default 5)\n"
+		"  -S seed       random seed\n"
+		"  -h            this help\n", prog);
+	exit(0);
+}
+
+static void parse_counts(char *arg)
+{
+	char *tok;
+
+	n_thread_counts = 0;
+	for (tok = strtok(arg, ","); tok && n_thread_counts < MAX_COUNTS;
+	     tok = strtok(NULL, ",")) {
+		int n = atoi(tok);
+
+		if (n < 1 || n > MAX_THREADS) {
+			printf("thread count must be 1..%d\n", MAX_THREADS);
+			exit(1);
+		}
+		thread_counts[n_thread_counts++] = n;
+	}
+}
+
+static void parse_devices(char *arg)
+{
+	char *tok;
+
+	n_devices = 0;
+	for (tok = strtok(arg, ","); tok && n_devices < MAX_DEVICES;
+	     tok = strtok(NULL, ","))
+		devices[n_devices++] = tok;
+}
+
+static void parse_mix(const char *arg)
+{
+	int total = 0;
+	int i;
+
+	if (sscanf(arg, "%d:%d:%d:%d", &role_weights[0], &role_weights[1],
+			&role_weights[2], &role_weights[3]) != 4) {
+		printf("bad mix \"%s\"\n", arg);
+		exit(1);
+	}
+	for (i = 0; i < N_ROLES; i++) {
+		if (role_weights[i] < 0)
+			role_weights[i] = 0;
+		total += role_weights[i];
+	}
+	if (!total) {
+		printf("mix needs at least one non-zero weight\n");
+		exit(1);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+	int i;
+
+	yaffs_trace_mask = 0;
+	random_seed = time(NULL);
+
+	while ((opt = getopt(argc, argv, "ht:d:m:s:S:")) != -1) {
+		switch (opt) {
+		case 't':
+			parse_counts(optarg);
+			break;
+		case 'd':
+			parse_devices(optarg);
+			break;
+		case 'm':
+			parse_mix(optarg);
+			break;
+		case 's':
+			run_seconds = atoi(optarg);
+			break;
+		case 'S':
+			random_seed = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (!n_thread_counts) {
+		thread_counts[0] = 1;
+		thread_counts[1] = 2;
+		thread_counts[2] = 4;
+		thread_counts[3] = 8;
+		n_thread_counts = 4;
+	}
+	if (!n_devices) {
+		devices[0] = "/yaffs2";
+		n_devices = 1;
+	}
+
+	printf("seed %d, mix %d:%d:%d:%d, %d s per run\n", random_seed,
+		role_weights[0], role_weights[1], role_weights[2],
+		role_weights[3], run_seconds);
+
+	yaffs_start_up();
+	for (i = 0; i < n_devices; i++)
+		setup_device(devices[i]);
+
+	printf("%7s %-9s %10s %10s %8s %8s %8s %8s %6s\n",
+		"threads", "role", "ops", "ops/s", "mean_us", "p50_us",
+		"p99_us", "max_us", "errors");
+
+	for (i = 0; i < n_thread_counts; i++)
+		run(thread_counts[i]);
+
+	for (i = 0; i < n_devices; i++)
+		yaffs_unmount(devices[i]);
+
+	return 0;
+}
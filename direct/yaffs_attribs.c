@@ -16,31 +16,36 @@
 
 void yaffs_load_attribs(struct yaffs_obj *obj, struct yaffs_obj_hdr *oh)
 {
-	obj->yst_uid = oh->yst_uid;
-	obj->yst_gid = oh->yst_gid;
-	obj->yst_atime = oh->yst_atime;
-	obj->yst_mtime = oh->yst_mtime;
-	obj->yst_ctime = oh->yst_ctime;
-	obj->yst_rdev = oh->yst_rdev;
+#ifdef CONFIG_YAFFS_COMPACT_OBJ
+	/* Otherwise they are read from the header when needed */
+	if (!yaffs_obj_attr_loaded(obj))
+		return;
+#endif
+	yaffs_obj_attr(obj)->yst_uid = oh->yst_uid;
+	yaffs_obj_attr(obj)->yst_gid = oh->yst_gid;
+	yaffs_obj_attr(obj)->yst_atime = oh->yst_atime;
+	yaffs_obj_attr(obj)->yst_mtime = oh->yst_mtime;
+	yaffs_obj_attr(obj)->yst_ctime = oh->yst_ctime;
+	yaffs_obj_attr(obj)->yst_rdev = oh->yst_rdev;
 }
 
 
 void yaffs_load_attribs_oh(struct yaffs_obj_hdr *oh, struct yaffs_obj *obj)
 {
 #ifdef CONFIG_YAFFS_WINCE
-		oh->win_atime[0] = obj->win_atime[0];
-		oh->win_ctime[0] = obj->win_ctime[0];
-		oh->win_mtime[0] = obj->win_mtime[0];
-		oh->win_atime[1] = obj->win_atime[1];
-		oh->win_ctime[1] = obj->win_ctime[1];
-		oh->win_mtime[1] = obj->win_mtime[1];
+		oh->win_atime[0] = yaffs_obj_attr(obj)->win_atime[0];
+		oh->win_ctime[0] = yaffs_obj_attr(obj)->win_ctime[0];
+		oh->win_mtime[0] = yaffs_obj_attr(obj)->win_mtime[0];
+		oh->win_atime[1] = yaffs_obj_attr(obj)->win_atime[1];
+		oh->win_ctime[1] = yaffs_obj_attr(obj)->win_ctime[1];
+		oh->win_mtime[1] = yaffs_obj_attr(obj)->win_mtime[1];
 #else
-		oh->yst_uid = obj->yst_uid;
-		oh->yst_gid = obj->yst_gid;
-		oh->yst_atime = obj->yst_atime;
-		oh->yst_mtime = obj->yst_mtime;
-		oh->yst_ctime = obj->yst_ctime;
-		oh->yst_rdev = obj->yst_rdev;
+		oh->yst_uid = yaffs_obj_attr(obj)->yst_uid;
+		oh->yst_gid = yaffs_obj_attr(obj)->yst_gid;
+		oh->yst_atime = yaffs_obj_attr(obj)->yst_atime;
+		oh->yst_mtime = yaffs_obj_attr(obj)->yst_mtime;
+		oh->yst_ctime = yaffs_obj_attr(obj)->yst_ctime;
+		oh->yst_rdev = yaffs_obj_attr(obj)->yst_rdev;
 #endif
 
 }
@@ -49,34 +54,36 @@ void yaffs_attribs_init(struct yaffs_obj *obj, u32 gid, u32 uid, u32 rdev)
 {
 
 #ifdef CONFIG_YAFFS_WINCE
-		yfsd_win_file_time_now(obj->win_atime);
-		obj->win_ctime[0] = obj->win_mtime[0] = obj->win_atime[0];
-		obj->win_ctime[1] = obj->win_mtime[1] = obj->win_atime[1];
+		yaffs_load_current_time(obj, 1, 1);
 
 #else
 	yaffs_load_current_time(obj,1,1);
-	obj->yst_rdev = rdev;
-	obj->yst_uid = uid;
-	obj->yst_gid = gid;
+	yaffs_obj_attr_mod(obj)->yst_rdev = rdev;
+	yaffs_obj_attr_mod(obj)->yst_uid = uid;
+	yaffs_obj_attr_mod(obj)->yst_gid = gid;
 #endif
 }
 
 void yaffs_load_current_time(struct yaffs_obj *obj, int do_a, int do_c)
 {
 #ifdef CONFIG_YAFFS_WINCE
-		yfsd_win_file_time_now(the_obj->win_atime);
-		the_obj->win_ctime[0] = the_obj->win_mtime[0] =
-		    the_obj->win_atime[0];
-		the_obj->win_ctime[1] = the_obj->win_mtime[1] =
-		    the_obj->win_atime[1];
+		u32 *t = yaffs_obj_attr_mod(obj)->win_atime;
+
+		yfsd_win_file_time_now(t);
+		yaffs_obj_attr_mod(obj)->win_ctime[0] = t[0];
+		yaffs_obj_attr_mod(obj)->win_ctime[1] = t[1];
+		yaffs_obj_attr_mod(obj)->win_mtime[0] = t[0];
+		yaffs_obj_attr_mod(obj)->win_mtime[1] = t[1];
 
 #else
 
-        obj->yst_mtime = Y_CURRENT_TIME;
+        yaffs_obj_attr_mod(obj)->yst_mtime = Y_CURRENT_TIME;
         if(do_a)
-                obj->yst_atime = obj->yst_atime;
+                yaffs_obj_attr_mod(obj)->yst_atime =
+				yaffs_obj_attr(obj)->yst_atime;
         if(do_c)
-                obj->yst_ctime = obj->yst_atime;
+                yaffs_obj_attr_mod(obj)->yst_ctime =
+				yaffs_obj_attr(obj)->yst_atime;
 #endif
 }
 
@@ -105,16 +112,19 @@ int yaffs_set_attribs(struct yaffs_obj *obj, struct iattr *attr)
 	if (valid & ATTR_MODE)
 		obj->yst_mode = attr->ia_mode;
 	if (valid & ATTR_UID)
-		obj->yst_uid = attr->ia_uid;
+		yaffs_obj_attr_mod(obj)->yst_uid = attr->ia_uid;
 	if (valid & ATTR_GID)
-		obj->yst_gid = attr->ia_gid;
+		yaffs_obj_attr_mod(obj)->yst_gid = attr->ia_gid;
 
 	if (valid & ATTR_ATIME)
-		obj->yst_atime = Y_TIME_CONVERT(attr->ia_atime);
+		yaffs_obj_attr_mod(obj)->yst_atime =
+			Y_TIME_CONVERT(attr->ia_atime);
 	if (valid & ATTR_CTIME)
-		obj->yst_ctime = Y_TIME_CONVERT(attr->ia_ctime);
+		yaffs_obj_attr_mod(obj)->yst_ctime =
+			Y_TIME_CONVERT(attr->ia_ctime);
 	if (valid & ATTR_MTIME)
-		obj->yst_mtime = Y_TIME_CONVERT(attr->ia_mtime);
+		yaffs_obj_attr_mod(obj)->yst_mtime =
+			Y_TIME_CONVERT(attr->ia_mtime);
 
 	if (valid & ATTR_SIZE)
 		yaffs_resize_file(obj, attr->ia_size);
@@ -131,16 +141,16 @@ int yaffs_get_attribs(struct yaffs_obj *obj, struct iattr *attr)
 
 	attr->ia_mode = obj->yst_mode;
 	valid |= ATTR_MODE;
-	attr->ia_uid = obj->yst_uid;
+	attr->ia_uid = yaffs_obj_attr(obj)->yst_uid;
 	valid |= ATTR_UID;
-	attr->ia_gid = obj->yst_gid;
+	attr->ia_gid = yaffs_obj_attr(obj)->yst_gid;
 	valid |= ATTR_GID;
 
-	Y_TIME_CONVERT(attr->ia_atime) = obj->yst_atime;
+	Y_TIME_CONVERT(attr->ia_atime) = yaffs_obj_attr(obj)->yst_atime;
 	valid |= ATTR_ATIME;
-	Y_TIME_CONVERT(attr->ia_ctime) = obj->yst_ctime;
+	Y_TIME_CONVERT(attr->ia_ctime) = yaffs_obj_attr(obj)->yst_ctime;
 	valid |= ATTR_CTIME;
-	Y_TIME_CONVERT(attr->ia_mtime) = obj->yst_mtime;
+	Y_TIME_CONVERT(attr->ia_mtime) = yaffs_obj_attr(obj)->yst_mtime;
 	valid |= ATTR_MTIME;
 
 	attr->ia_size = yaffs_get_file_size(obj);
@@ -0,0 +1,422 @@
+/*
+ * YAFFS: Yet Another Flash File System. A NAND-flash specific file system.
+ *
+ * Copyright (C) 2002-2011 Aleph One Ltd.
+ *   for Toby Churchill Ltd and Brightstar Engineering
+ *
+ * Created by Charles Manning <charles@aleph1.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/*
+ * Applies update scripts made by utils/yaffs_mkdelta. See yaffs_delta.h.
+ *
+ * Consecutive WRITE records for the same file are gathered in one buffer
+ * and written in whole chunks, so yaffs neither reads back partly
+ * written chunks nor spreads one chunk over several writes. A changed
+ * file's object header is written once, by the futime() at CLOSE, and
+ * the close then finds the file clean. Directory times are only written
+ * once at the end, rather than each time an entry is added or removed.
+ */
+
+#include "yaffs_delta.h"
+#include "yaffsfs.h"
+#include "yaffs_guts.h"
+#include "yaffs_osglue.h"
+#include "yaffs_trace.h"
+
+#define YAFFS_DELTA_BUFFER_SIZE	(32 * 1024)
+
+struct yaffs_delta_ctx {
+	int (*read_fn)(void *ctx, void *buf, int n);
+	void *read_ctx;
+	int swap;
+
+	YCHAR path[YAFFS_DELTA_MAX_PATH];
+	YCHAR path2[YAFFS_DELTA_MAX_PATH];
+	const YCHAR *root;
+	int root_len;
+
+	int fd;			/* File being changed, or -1 */
+	u8 *buffer;
+	int buffer_size;
+	int buffer_used;
+	u32 buffer_offset;	/* File offset of buffer[0] */
+	int chunk_size;
+
+	struct yaffs_delta_stats *stats;
+};
+
+static u32 yaffs_delta_swap32(u32 x)
+{
+	return ((x & 0x000000ff) << 24) | ((x & 0x0000ff00) << 8) |
+	       ((x & 0x00ff0000) >> 8) | ((x & 0xff000000) >> 24);
+}
+
+static u16 yaffs_delta_swap16(u16 x)
+{
+	return (x << 8) | (x >> 8);
+}
+
+static int yaffs_delta_read(struct yaffs_delta_ctx *dc, void *buf, int n)
+{
+	u8 *p = buf;
+	int got;
+
+	while (n > 0) {
+		got = dc->read_fn(dc->read_ctx, p, n);
+		if (got <= 0)
+			return -1;
+		p += got;
+		n -= got;
+	}
+	return 0;
+}
+
+/*
+ * Reads a path from the script into out. Paths are put after the root of
+ * the update; symlink targets are taken as they are.
+ */
+static int yaffs_delta_read_path(struct yaffs_delta_ctx *dc, YCHAR *out,
+				 int len, int under_root)
+{
+	int start = 0;
+
+	if (under_root) {
+		memcpy(out, dc->root, dc->root_len * sizeof(YCHAR));
+		start = dc->root_len;
+		if (len)
+			out[start++] = '/';
+	}
+	if (start + len >= YAFFS_DELTA_MAX_PATH) {
+		yaffsfs_SetError(-ENAMETOOLONG);
+		return -1;
+	}
+	if (yaffs_delta_read(dc, out + start, len) < 0) {
+		yaffsfs_SetError(-ENODATA);
+		return -1;
+	}
+	out[start + len] = 0;
+	return 0;
+}
+
+/*
+ * Writes out the buffer. Unless all is set, a part chunk at the end is
+ * kept back for the next WRITE to fill up.
+ */
+static int yaffs_delta_flush(struct yaffs_delta_ctx *dc, int all)
+{
+	u32 end = dc->buffer_offset + dc->buffer_used;
+	int n = dc->buffer_used;
+	int done;
+
+	if (!all && end % dc->chunk_size &&
+	    end - end % dc->chunk_size > dc->buffer_offset)
+		n = end - end % dc->chunk_size - dc->buffer_offset;
+	if (!n)
+		return 0;
+
+	done = yaffs_pwrite(dc->fd, dc->buffer, n, dc->buffer_offset);
+	if (done != n) {
+		if (done >= 0)
+			yaffsfs_SetError(-ENOSPC);
+		return -1;
+	}
+	dc->stats->writes++;
+	dc->stats->bytes += n;
+
+	memmove(dc->buffer, dc->buffer + n, dc->buffer_used - n);
+	dc->buffer_used -= n;
+	dc->buffer_offset += n;
+	return 0;
+}
+
+static int yaffs_delta_write(struct yaffs_delta_ctx *dc, u32 offset,
+			     u32 len)
+{
+	int n;
+
+	if (dc->buffer_used && offset != dc->buffer_offset + dc->buffer_used &&
+	    yaffs_delta_flush(dc, 1) < 0)
+		return -1;
+	if (!dc->buffer_used)
+		dc->buffer_offset = offset;
+
+	while (len > 0) {
+		if (dc->buffer_used == dc->buffer_size &&
+		    yaffs_delta_flush(dc, 0) < 0)
+			return -1;
+		n = dc->buffer_size - dc->buffer_used;
+		if ((u32)n > len)
+			n = len;
+		if (yaffs_delta_read(dc, dc->buffer + dc->buffer_used, n) < 0) {
+			yaffsfs_SetError(-ENODATA);
+			return -1;
+		}
+		dc->buffer_used += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Checks that the file just opened is the one the script was made for */
+static int yaffs_delta_check(struct yaffs_delta_ctx *dc, u32 size, u32 hash)
+{
+	struct yaffs_stat st;
+	u32 h = YAFFS_DELTA_HASH_INIT;
+	u32 offset = 0;
+	int n;
+	int i;
+
+	if (yaffs_fstat(dc->fd, &st) < 0)
+		return -1;
+	if ((u32)st.st_size != size)
+		goto mismatch;
+
+	while (offset < size) {
+		n = yaffs_pread(dc->fd, dc->buffer, dc->buffer_size, offset);
+		if (n <= 0)
+			return -1;
+		for (i = 0; i < n; i++) {
+			h ^= dc->buffer[i];
+			h *= YAFFS_DELTA_HASH_PRIME;
+		}
+		offset += n;
+	}
+	if (h == hash)
+		return 0;
+
+mismatch:
+	yaffs_trace(YAFFS_TRACE_ERROR, "delta: %s is not the expected file",
+		dc->path);
+	yaffsfs_SetError(-EINVAL);
+	return -1;
+}
+
+static int yaffs_delta_attr(struct yaffs_delta_ctx *dc,
+			    const struct yaffs_delta_rec *rec)
+{
+	struct yaffs_utimbuf times;
+	int ret = 0;
+
+	times.actime = rec->arg[YAFFS_DELTA_ARG_ATIME];
+	times.modtime = rec->arg[YAFFS_DELTA_ARG_MTIME];
+
+	if (rec->op == YAFFS_DELTA_CLOSE) {
+		if (rec->flags & YAFFS_DELTA_SET_MODE)
+			ret = yaffs_fchmod(dc->fd, rec->arg[YAFFS_DELTA_ARG_MODE]);
+		if (ret == 0 && (rec->flags & YAFFS_DELTA_SET_TIMES))
+			ret = yaffs_futime(dc->fd, &times);
+	} else {
+		if (rec->flags & YAFFS_DELTA_SET_MODE)
+			ret = yaffs_chmod(dc->path, rec->arg[YAFFS_DELTA_ARG_MODE]);
+		if (ret == 0 && (rec->flags & YAFFS_DELTA_SET_TIMES))
+			ret = yaffs_utime(dc->path, &times);
+	}
+	return ret;
+}
+
+static int yaffs_delta_do_rec(struct yaffs_delta_ctx *dc,
+			      const struct yaffs_delta_rec *rec)
+{
+	int file_op = rec->op == YAFFS_DELTA_WRITE ||
+		      rec->op == YAFFS_DELTA_TRUNCATE ||
+		      rec->op == YAFFS_DELTA_CLOSE;
+	int ret;
+
+	/* Contents are only changed between an OPEN or CREATE and a CLOSE */
+	if (rec->op >= YAFFS_DELTA_N_OPS || file_op != (dc->fd >= 0) ||
+	    (rec->data_len && rec->op != YAFFS_DELTA_WRITE)) {
+		yaffsfs_SetError(-EINVAL);
+		return -1;
+	}
+
+	if (yaffs_delta_read_path(dc, dc->path, rec->path_len,
+				  rec->op != YAFFS_DELTA_SYMLINK) < 0 ||
+	    yaffs_delta_read_path(dc, dc->path2, rec->path2_len, 1) < 0)
+		return -1;
+
+	switch (rec->op) {
+	case YAFFS_DELTA_MKDIR:
+		return yaffs_mkdir(dc->path, rec->arg[0]);
+
+	case YAFFS_DELTA_CREATE:
+	case YAFFS_DELTA_OPEN:
+		if (rec->op == YAFFS_DELTA_CREATE)
+			dc->fd = yaffs_open(dc->path, O_CREAT | O_TRUNC | O_RDWR,
+					    rec->arg[0]);
+		else
+			dc->fd = yaffs_open(dc->path, O_RDWR, 0);
+		if (dc->fd < 0)
+			return -1;
+		dc->buffer_used = 0;
+		dc->stats->files++;
+		if (rec->flags & YAFFS_DELTA_CHECK)
+			return yaffs_delta_check(dc, rec->arg[0], rec->arg[1]);
+		return 0;
+
+	case YAFFS_DELTA_WRITE:
+		return yaffs_delta_write(dc, rec->arg[0], rec->data_len);
+
+	case YAFFS_DELTA_TRUNCATE:
+		if (yaffs_delta_flush(dc, 1) < 0)
+			return -1;
+		return yaffs_ftruncate(dc->fd, rec->arg[0]);
+
+	case YAFFS_DELTA_CLOSE:
+		ret = yaffs_delta_flush(dc, 1);
+		if (ret == 0)
+			ret = yaffs_delta_attr(dc, rec);
+		if (yaffs_close(dc->fd) < 0)
+			ret = -1;
+		dc->fd = -1;
+		return ret;
+
+	case YAFFS_DELTA_ATTR:
+		return yaffs_delta_attr(dc, rec);
+
+	case YAFFS_DELTA_UNLINK:
+		return yaffs_unlink(dc->path);
+
+	case YAFFS_DELTA_RMDIR:
+		return yaffs_rmdir(dc->path);
+
+	case YAFFS_DELTA_RENAME:
+		return yaffs_rename(dc->path, dc->path2);
+
+	case YAFFS_DELTA_SYMLINK:
+		return yaffs_symlink(dc->path, dc->path2);
+
+	case YAFFS_DELTA_LINK:
+		return yaffs_link(dc->path, dc->path2);
+
+	case YAFFS_DELTA_MKNOD:
+		return yaffs_mknod(dc->path, rec->arg[0], rec->arg[1]);
+
+	default:
+		yaffsfs_SetError(-EINVAL);
+		return -1;
+	}
+}
+
+int yaffs_delta_apply(const YCHAR *dir,
+		      int (*read_fn)(void *ctx, void *buf, int n), void *ctx,
+		      int buffer_size, struct yaffs_delta_stats *stats)
+{
+	struct yaffs_delta_ctx *dc;
+	struct yaffs_delta_file_hdr fhdr;
+	struct yaffs_delta_rec rec;
+	struct yaffs_dev *dev;
+	int defered;
+	int ret = -1;
+	int i;
+
+	if (!dir || !read_fn || !stats) {
+		yaffsfs_SetError(-EFAULT);
+		return -1;
+	}
+	memset(stats, 0, sizeof(*stats));
+
+	dev = yaffs_getdev(dir);
+	if (!dev) {
+		yaffsfs_SetError(-ENODEV);
+		return -1;
+	}
+
+	dc = kmalloc(sizeof(*dc), GFP_NOFS);
+	if (!dc) {
+		yaffsfs_SetError(-ENOMEM);
+		return -1;
+	}
+	memset(dc, 0, sizeof(*dc));
+	dc->read_fn = read_fn;
+	dc->read_ctx = ctx;
+	dc->stats = stats;
+	dc->fd = -1;
+
+	/* Whole chunks, so that flushes stay aligned */
+	dc->chunk_size = dev->data_bytes_per_chunk;
+	if (buffer_size <= 0)
+		buffer_size = YAFFS_DELTA_BUFFER_SIZE;
+	if (buffer_size < dc->chunk_size)
+		buffer_size = dc->chunk_size;
+	dc->buffer_size = buffer_size - buffer_size % dc->chunk_size;
+	dc->buffer = kmalloc(dc->buffer_size, GFP_NOFS);
+	if (!dc->buffer) {
+		yaffsfs_SetError(-ENOMEM);
+		goto out;
+	}
+
+	dc->root_len = strnlen(dir, YAFFS_DELTA_MAX_PATH);
+	while (dc->root_len > 0 && dir[dc->root_len - 1] == '/')
+		dc->root_len--;
+	if (dc->root_len >= YAFFS_DELTA_MAX_PATH / 2) {
+		yaffsfs_SetError(-ENAMETOOLONG);
+		goto out;
+	}
+	dc->root = dir;
+
+	yaffsfs_Lock();
+	defered = dev->param.defered_dir_update;
+	dev->param.defered_dir_update = 1;
+	yaffsfs_Unlock();
+
+	if (yaffs_delta_read(dc, &fhdr, sizeof(fhdr)) < 0) {
+		yaffsfs_SetError(-ENODATA);
+		goto done;
+	}
+	dc->swap = fhdr.magic == yaffs_delta_swap32(YAFFS_DELTA_MAGIC);
+	if (dc->swap)
+		fhdr.version = yaffs_delta_swap32(fhdr.version);
+	if ((fhdr.magic != YAFFS_DELTA_MAGIC && !dc->swap) ||
+	    fhdr.version != YAFFS_DELTA_VERSION) {
+		yaffsfs_SetError(-EINVAL);
+		goto done;
+	}
+
+	while (1) {
+		if (yaffs_delta_read(dc, &rec, sizeof(rec)) < 0) {
+			yaffsfs_SetError(-ENODATA);
+			goto done;
+		}
+		if (dc->swap) {
+			rec.path_len = yaffs_delta_swap16(rec.path_len);
+			rec.path2_len = yaffs_delta_swap16(rec.path2_len);
+			for (i = 0; i < 3; i++)
+				rec.arg[i] = yaffs_delta_swap32(rec.arg[i]);
+			rec.data_len = yaffs_delta_swap32(rec.data_len);
+		}
+		if (rec.op == YAFFS_DELTA_END)
+			break;
+		if (yaffs_delta_do_rec(dc, &rec) < 0) {
+			yaffs_trace(YAFFS_TRACE_ERROR,
+				"delta: record %u (op %d) failed",
+				stats->records, rec.op);
+			goto done;
+		}
+		stats->records++;
+	}
+
+	/* The last file was not closed */
+	if (dc->fd < 0)
+		ret = 0;
+	else
+		yaffsfs_SetError(-EINVAL);
+
+done:
+	if (dc->fd >= 0)
+		yaffs_close(dc->fd);
+
+	yaffsfs_Lock();
+	yaffs_update_dirty_dirs(dev);
+	dev->param.defered_dir_update = defered;
+	yaffsfs_Unlock();
+
+out:
+	kfree(dc->buffer);
+	kfree(dc);
+	return ret;
+}
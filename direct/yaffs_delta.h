@@ -0,0 +1,114 @@
+/*
+ * YAFFS: Yet another Flash File System . A NAND-flash specific file system.
+ *
+ * Copyright (C) 2002-2011 Aleph One Ltd.
+ *   for Toby Churchill Ltd and Brightstar Engineering
+ *
+ * Created by Charles Manning <charles@aleph1.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1 as
+ * published by the Free Software Foundation.
+ *
+ * Note: Only YAFFS headers are LGPL, YAFFS C code is covered by GPL.
+ */
+
+/*
+ * yaffs_delta.h: update scripts that turn one yaffs tree into another.
+ *
+ * utils/yaffs_mkdelta builds a script from two source trees or images and
+ * yaffs_delta_apply() runs it through yaffsfs on the device. Only what
+ * changed is sent: new files, the chunks of changed files that differ,
+ * renames of unchanged files, deletions and attribute changes.
+ *
+ * A script is a yaffs_delta_file_hdr then records, each a yaffs_delta_rec
+ * followed by path_len bytes of path, path2_len bytes of the second path
+ * and data_len bytes of data. Paths are relative to the directory the
+ * script is applied to and are not terminated. The generator writes in its
+ * native byte order; the applier swaps if the magic says it has to.
+ *
+ * File contents are changed between an OPEN or CREATE and a CLOSE: WRITE
+ * and TRUNCATE records apply to the file opened last.
+ */
+
+#ifndef __YAFFS_DELTA_H__
+#define __YAFFS_DELTA_H__
+
+#include "yportenv.h"
+
+#define YAFFS_DELTA_MAGIC	0x544c4459	/* "YDLT" */
+#define YAFFS_DELTA_VERSION	1
+
+#define YAFFS_DELTA_MAX_PATH	512
+
+/* The OPEN check hash is 32 bit FNV-1a over the whole old file */
+#define YAFFS_DELTA_HASH_INIT	2166136261U
+#define YAFFS_DELTA_HASH_PRIME	16777619U
+
+enum yaffs_delta_op {
+	YAFFS_DELTA_END,	/* End of the script */
+	YAFFS_DELTA_MKDIR,	/* path; mode */
+	YAFFS_DELTA_CREATE,	/* path; mode. Creates and opens a file */
+	YAFFS_DELTA_OPEN,	/* path; old size, old hash if CHECK */
+	YAFFS_DELTA_WRITE,	/* offset; data */
+	YAFFS_DELTA_TRUNCATE,	/* size */
+	YAFFS_DELTA_CLOSE,	/* mode if SET_MODE; atime, mtime if SET_TIMES */
+	YAFFS_DELTA_ATTR,	/* path; as CLOSE */
+	YAFFS_DELTA_UNLINK,	/* path */
+	YAFFS_DELTA_RMDIR,	/* path */
+	YAFFS_DELTA_RENAME,	/* path, path2 */
+	YAFFS_DELTA_SYMLINK,	/* path (target), path2 */
+	YAFFS_DELTA_LINK,	/* path (existing), path2 */
+	YAFFS_DELTA_MKNOD,	/* path; mode, rdev */
+	YAFFS_DELTA_N_OPS
+};
+
+/* yaffs_delta_rec flags */
+#define YAFFS_DELTA_SET_MODE	0x01
+#define YAFFS_DELTA_SET_TIMES	0x02
+#define YAFFS_DELTA_CHECK	0x04
+
+/* Argument words of CLOSE and ATTR */
+#define YAFFS_DELTA_ARG_MODE	0
+#define YAFFS_DELTA_ARG_ATIME	1
+#define YAFFS_DELTA_ARG_MTIME	2
+
+struct yaffs_delta_file_hdr {
+	u32 magic;
+	u32 version;
+	u32 chunk_size;		/* WRITE ranges were aligned to this */
+	u32 flags;
+};
+
+struct yaffs_delta_rec {
+	u8 op;
+	u8 flags;
+	u16 path_len;
+	u16 path2_len;
+	u16 reserved;
+	u32 arg[3];
+	u32 data_len;
+};
+
+struct yaffs_delta_stats {
+	u32 records;		/* Records applied */
+	u32 files;		/* Files created or changed */
+	u32 writes;		/* yaffs_pwrite() calls */
+	u32 bytes;		/* Bytes written */
+};
+
+/*
+ * Runs a script against the tree at dir. read_fn is called for the script
+ * and should return the number of bytes it got, 0 at the end or -1.
+ * Writes are gathered in a buffer of buffer_size bytes (0 for a default)
+ * and passed on in whole chunks where possible.
+ *
+ * Returns 0, or -1 with the yaffsfs error set. stats->records then tells
+ * how far it got. A changed file whose old contents are not what the
+ * script expects stops the update with EINVAL before the file is touched.
+ */
+int yaffs_delta_apply(const YCHAR *dir,
+		      int (*read_fn)(void *ctx, void *buf, int n), void *ctx,
+		      int buffer_size, struct yaffs_delta_stats *stats);
+
+#endif
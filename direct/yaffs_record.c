@@ -0,0 +1,461 @@
+/*
+ * YAFFS: Yet Another Flash File System. A NAND-flash specific file system.
+ *
+ * Copyright (C) 2002-2011 Aleph One Ltd.
+ *   for Toby Churchill Ltd and Brightstar Engineering
+ *
+ * Created by Charles Manning <charles@aleph1.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/*
+ * Recording shim around the yaffsfs API. See yaffs_record.h.
+ *
+ * Records are packed into a buffer that is handed to the write function
+ * whenever it fills up. The buffer is protected by the yaffsfs lock, which
+ * is never held across the real call.
+ */
+
+#define YAFFS_RECORD_NO_REDIRECT
+#include "yaffs_record.h"
+#include "yaffs_osglue.h"
+
+#define YAFFS_REC_BUFFER_SIZE	4096
+
+/* Biggest possible record: header, args and two full paths. */
+#define YAFFS_REC_MAX_REC	(sizeof(struct yaffs_rec_hdr) + \
+				 4 * (YAFFS_REC_MAX_ARGS + \
+				      2 * YAFFS_REC_MAX_DEPTH))
+
+static int (*yaffs_rec_write_fn)(void *ctx, const void *buf, int n);
+static void *yaffs_rec_ctx;
+static u32 (*yaffs_rec_time_fn)(void);
+static u32 yaffs_rec_t0;
+static int yaffs_rec_failed;
+
+static u8 yaffs_rec_buffer[YAFFS_REC_BUFFER_SIZE];
+static int yaffs_rec_used;
+
+struct yaffs_rec_path {
+	int n;
+	u32 hash[YAFFS_REC_MAX_DEPTH];
+};
+
+/* FNV-1a */
+u32 yaffs_rec_hash(const YCHAR *name, int len)
+{
+	u32 h = 2166136261U;
+	int i;
+
+	if (len == 1 && name[0] == '.')
+		return YAFFS_REC_HASH_DOT;
+	if (len == 2 && name[0] == '.' && name[1] == '.')
+		return YAFFS_REC_HASH_DOTDOT;
+
+	for (i = 0; i < len; i++) {
+		h ^= (u8)name[i];
+		h *= 16777619U;
+	}
+	return h;
+}
+
+static int yaffs_rec_is_divider(YCHAR ch)
+{
+	const YCHAR *str = YAFFS_PATH_DIVIDERS;
+
+	while (*str) {
+		if (*str == ch)
+			return 1;
+		str++;
+	}
+	return 0;
+}
+
+static void yaffs_rec_hash_path(struct yaffs_rec_path *p, const YCHAR *path)
+{
+	const YCHAR *start;
+
+	p->n = 0;
+	if (!path)
+		return;
+
+	while (*path && p->n < YAFFS_REC_MAX_DEPTH) {
+		while (yaffs_rec_is_divider(*path))
+			path++;
+		if (!*path)
+			break;
+		start = path;
+		while (*path && !yaffs_rec_is_divider(*path))
+			path++;
+		p->hash[p->n++] = yaffs_rec_hash(start, path - start);
+	}
+}
+
+static u32 yaffs_rec_now(void)
+{
+	return yaffs_rec_time_fn ? yaffs_rec_time_fn() - yaffs_rec_t0 : 0;
+}
+
+/* Call with the lock held. */
+static void yaffs_rec_flush_buffer(void)
+{
+	int done = 0;
+	int n;
+
+	while (done < yaffs_rec_used && !yaffs_rec_failed) {
+		n = yaffs_rec_write_fn(yaffs_rec_ctx, yaffs_rec_buffer + done,
+					yaffs_rec_used - done);
+		if (n <= 0)
+			yaffs_rec_failed = 1;
+		else
+			done += n;
+	}
+	yaffs_rec_used = 0;
+}
+
+static void yaffs_rec_add(enum yaffs_rec_op op, u32 start, int result,
+			  const struct yaffs_rec_path *p1,
+			  const struct yaffs_rec_path *p2,
+			  int n_args, u32 a0, u32 a1, u32 a2, u32 a3)
+{
+	struct yaffs_rec_hdr hdr;
+	u32 args[YAFFS_REC_MAX_ARGS];
+	u32 end = yaffs_rec_now();
+	u8 *out;
+
+	if (!yaffs_rec_write_fn)
+		return;
+
+	hdr.op = op;
+	hdr.n_args = n_args;
+	hdr.n_path1 = p1 ? p1->n : 0;
+	hdr.n_path2 = p2 ? p2->n : 0;
+	hdr.time = start;
+	hdr.duration = end - start;
+	hdr.result = result;
+
+	args[0] = a0;
+	args[1] = a1;
+	args[2] = a2;
+	args[3] = a3;
+
+	yaffsfs_Lock();
+
+	if (yaffs_rec_write_fn) {
+		if (yaffs_rec_used + YAFFS_REC_MAX_REC > YAFFS_REC_BUFFER_SIZE)
+			yaffs_rec_flush_buffer();
+
+		out = yaffs_rec_buffer + yaffs_rec_used;
+		memcpy(out, &hdr, sizeof(hdr));
+		out += sizeof(hdr);
+		memcpy(out, args, n_args * sizeof(u32));
+		out += n_args * sizeof(u32);
+		if (hdr.n_path1) {
+			memcpy(out, p1->hash, hdr.n_path1 * sizeof(u32));
+			out += hdr.n_path1 * sizeof(u32);
+		}
+		if (hdr.n_path2) {
+			memcpy(out, p2->hash, hdr.n_path2 * sizeof(u32));
+			out += hdr.n_path2 * sizeof(u32);
+		}
+		yaffs_rec_used = out - yaffs_rec_buffer;
+	}
+
+	yaffsfs_Unlock();
+}
+
+int yaffs_rec_start(int (*write_fn)(void *ctx, const void *buf, int n),
+		void *ctx, u32 (*time_fn)(void))
+{
+	struct yaffs_rec_file_hdr fhdr;
+
+	if (!write_fn) {
+		yaffsfs_SetError(-EINVAL);
+		return -1;
+	}
+
+	yaffs_rec_stop();
+
+	fhdr.magic = YAFFS_REC_MAGIC;
+	fhdr.version = YAFFS_REC_VERSION;
+	fhdr.flags = time_fn ? YAFFS_REC_FLAG_TIME_US : 0;
+
+	yaffsfs_Lock();
+	yaffs_rec_ctx = ctx;
+	yaffs_rec_time_fn = time_fn;
+	yaffs_rec_t0 = time_fn ? time_fn() : 0;
+	yaffs_rec_failed = 0;
+	memcpy(yaffs_rec_buffer, &fhdr, sizeof(fhdr));
+	yaffs_rec_used = sizeof(fhdr);
+	yaffs_rec_write_fn = write_fn;
+	yaffsfs_Unlock();
+
+	return 0;
+}
+
+/* Stop recording and push out what is buffered. */
+int yaffs_rec_stop(void)
+{
+	int failed;
+
+	yaffsfs_Lock();
+	if (yaffs_rec_write_fn)
+		yaffs_rec_flush_buffer();
+	yaffs_rec_write_fn = NULL;
+	failed = yaffs_rec_failed;
+	yaffsfs_Unlock();
+
+	if (failed) {
+		yaffsfs_SetError(-ENOSPC);
+		return -1;
+	}
+	return 0;
+}
+
+/* Wrappers for calls that take a path. */
+#define REC_PATH_CALL(op, path, call, n_args, a0, a1, a2, a3) \
+	do { \
+		struct yaffs_rec_path p; \
+		u32 start; \
+		int ret; \
+		if (!yaffs_rec_write_fn) \
+			return call; \
+		yaffs_rec_hash_path(&p, path); \
+		start = yaffs_rec_now(); \
+		ret = call; \
+		yaffs_rec_add(op, start, ret, &p, NULL, \
+				n_args, a0, a1, a2, a3); \
+		return ret; \
+	} while (0)
+
+#define REC_PATH2_CALL(op, path1, path2, call) \
+	do { \
+		struct yaffs_rec_path p1; \
+		struct yaffs_rec_path p2; \
+		u32 start; \
+		int ret; \
+		if (!yaffs_rec_write_fn) \
+			return call; \
+		yaffs_rec_hash_path(&p1, path1); \
+		yaffs_rec_hash_path(&p2, path2); \
+		start = yaffs_rec_now(); \
+		ret = call; \
+		yaffs_rec_add(op, start, ret, &p1, &p2, 0, 0, 0, 0, 0); \
+		return ret; \
+	} while (0)
+
+/* Wrappers for calls that take a handle. */
+#define REC_FD_CALL(op, call, n_args, a0, a1, a2, a3) \
+	do { \
+		u32 start; \
+		int ret; \
+		if (!yaffs_rec_write_fn) \
+			return call; \
+		start = yaffs_rec_now(); \
+		ret = call; \
+		yaffs_rec_add(op, start, ret, NULL, NULL, \
+				n_args, a0, a1, a2, a3); \
+		return ret; \
+	} while (0)
+
+int yaffs_rec_open(const YCHAR *path, int oflag, int mode)
+{
+	REC_PATH_CALL(YAFFS_REC_OPEN, path, yaffs_open(path, oflag, mode),
+			2, oflag, mode, 0, 0);
+}
+
+int yaffs_rec_close(int fd)
+{
+	REC_FD_CALL(YAFFS_REC_CLOSE, yaffs_close(fd), 1, fd, 0, 0, 0);
+}
+
+int yaffs_rec_read(int fd, void *buf, unsigned int nbyte)
+{
+	REC_FD_CALL(YAFFS_REC_READ, yaffs_read(fd, buf, nbyte),
+			2, fd, nbyte, 0, 0);
+}
+
+int yaffs_rec_write(int fd, const void *buf, unsigned int nbyte)
+{
+	REC_FD_CALL(YAFFS_REC_WRITE, yaffs_write(fd, buf, nbyte),
+			2, fd, nbyte, 0, 0);
+}
+
+int yaffs_rec_pread(int fd, void *buf, unsigned int nbyte,
+			unsigned int offset)
+{
+	REC_FD_CALL(YAFFS_REC_PREAD, yaffs_pread(fd, buf, nbyte, offset),
+			3, fd, nbyte, offset, 0);
+}
+
+int yaffs_rec_pwrite(int fd, const void *buf, unsigned int nbyte,
+			unsigned int offset)
+{
+	REC_FD_CALL(YAFFS_REC_PWRITE, yaffs_pwrite(fd, buf, nbyte, offset),
+			3, fd, nbyte, offset, 0);
+}
+
+off_t yaffs_rec_lseek(int fd, off_t offset, int whence)
+{
+	unsigned long long off = offset;
+	u32 start;
+	off_t ret;
+
+	if (!yaffs_rec_write_fn)
+		return yaffs_lseek(fd, offset, whence);
+
+	start = yaffs_rec_now();
+	ret = yaffs_lseek(fd, offset, whence);
+	/* Only the sign of the result matters for replay. */
+	yaffs_rec_add(YAFFS_REC_LSEEK, start, ret < 0 ? -1 : 0, NULL, NULL,
+			4, fd, (u32)off, (u32)(off >> 32), whence);
+	return ret;
+}
+
+int yaffs_rec_truncate(const YCHAR *path, off_t new_size)
+{
+	unsigned long long size = new_size;
+
+	REC_PATH_CALL(YAFFS_REC_TRUNCATE, path, yaffs_truncate(path, new_size),
+			2, (u32)size, (u32)(size >> 32), 0, 0);
+}
+
+int yaffs_rec_ftruncate(int fd, off_t new_size)
+{
+	unsigned long long size = new_size;
+
+	REC_FD_CALL(YAFFS_REC_FTRUNCATE, yaffs_ftruncate(fd, new_size),
+			3, fd, (u32)size, (u32)(size >> 32), 0);
+}
+
+int yaffs_rec_fsync(int fd)
+{
+	REC_FD_CALL(YAFFS_REC_FSYNC, yaffs_fsync(fd), 1, fd, 0, 0, 0);
+}
+
+int yaffs_rec_fdatasync(int fd)
+{
+	REC_FD_CALL(YAFFS_REC_FDATASYNC, yaffs_fdatasync(fd), 1, fd, 0, 0, 0);
+}
+
+int yaffs_rec_flush(int fd)
+{
+	REC_FD_CALL(YAFFS_REC_FLUSH, yaffs_flush(fd), 1, fd, 0, 0, 0);
+}
+
+int yaffs_rec_unlink(const YCHAR *path)
+{
+	REC_PATH_CALL(YAFFS_REC_UNLINK, path, yaffs_unlink(path),
+			0, 0, 0, 0, 0);
+}
+
+int yaffs_rec_rename(const YCHAR *oldPath, const YCHAR *newPath)
+{
+	REC_PATH2_CALL(YAFFS_REC_RENAME, oldPath, newPath,
+			yaffs_rename(oldPath, newPath));
+}
+
+int yaffs_rec_mkdir(const YCHAR *path, mode_t mode)
+{
+	REC_PATH_CALL(YAFFS_REC_MKDIR, path, yaffs_mkdir(path, mode),
+			1, mode, 0, 0, 0);
+}
+
+int yaffs_rec_rmdir(const YCHAR *path)
+{
+	REC_PATH_CALL(YAFFS_REC_RMDIR, path, yaffs_rmdir(path),
+			0, 0, 0, 0, 0);
+}
+
+int yaffs_rec_stat(const YCHAR *path, struct yaffs_stat *buf)
+{
+	REC_PATH_CALL(YAFFS_REC_STAT, path, yaffs_stat(path, buf),
+			0, 0, 0, 0, 0);
+}
+
+int yaffs_rec_lstat(const YCHAR *path, struct yaffs_stat *buf)
+{
+	REC_PATH_CALL(YAFFS_REC_LSTAT, path, yaffs_lstat(path, buf),
+			0, 0, 0, 0, 0);
+}
+
+int yaffs_rec_fstat(int fd, struct yaffs_stat *buf)
+{
+	REC_FD_CALL(YAFFS_REC_FSTAT, yaffs_fstat(fd, buf), 1, fd, 0, 0, 0);
+}
+
+/*
+ * Directory handles are pointers, so they are logged by the low 32 bits of
+ * the pointer. That is unique among the handles open at any one time, which
+ * is all the replay needs.
+ */
+#define YAFFS_REC_DIR_ID(d)	((u32)(size_t)(d))
+
+yaffs_DIR *yaffs_rec_opendir(const YCHAR *dirname)
+{
+	struct yaffs_rec_path p;
+	yaffs_DIR *ret;
+	u32 start;
+
+	if (!yaffs_rec_write_fn)
+		return yaffs_opendir(dirname);
+
+	yaffs_rec_hash_path(&p, dirname);
+	start = yaffs_rec_now();
+	ret = yaffs_opendir(dirname);
+	yaffs_rec_add(YAFFS_REC_OPENDIR, start, ret ? 0 : -1, &p, NULL,
+			1, YAFFS_REC_DIR_ID(ret), 0, 0, 0);
+	return ret;
+}
+
+struct yaffs_dirent *yaffs_rec_readdir(yaffs_DIR *dirp)
+{
+	struct yaffs_dirent *ret;
+	u32 start;
+
+	if (!yaffs_rec_write_fn)
+		return yaffs_readdir(dirp);
+
+	start = yaffs_rec_now();
+	ret = yaffs_readdir(dirp);
+	yaffs_rec_add(YAFFS_REC_READDIR, start, ret ? 0 : -1, NULL, NULL,
+			1, YAFFS_REC_DIR_ID(dirp), 0, 0, 0);
+	return ret;
+}
+
+int yaffs_rec_closedir(yaffs_DIR *dirp)
+{
+	REC_FD_CALL(YAFFS_REC_CLOSEDIR, yaffs_closedir(dirp),
+			1, YAFFS_REC_DIR_ID(dirp), 0, 0, 0);
+}
+
+int yaffs_rec_link(const YCHAR *oldpath, const YCHAR *newpath)
+{
+	REC_PATH2_CALL(YAFFS_REC_LINK, oldpath, newpath,
+			yaffs_link(oldpath, newpath));
+}
+
+int yaffs_rec_symlink(const YCHAR *oldpath, const YCHAR *newpath)
+{
+	REC_PATH2_CALL(YAFFS_REC_SYMLINK, oldpath, newpath,
+			yaffs_symlink(oldpath, newpath));
+}
+
+int yaffs_rec_sync(const YCHAR *path)
+{
+	REC_PATH_CALL(YAFFS_REC_SYNC, path, yaffs_sync(path), 0, 0, 0, 0, 0);
+}
+
+int yaffs_rec_mount(const YCHAR *path)
+{
+	REC_PATH_CALL(YAFFS_REC_MOUNT, path, yaffs_mount(path), 0, 0, 0, 0, 0);
+}
+
+int yaffs_rec_unmount(const YCHAR *path)
+{
+	REC_PATH_CALL(YAFFS_REC_UNMOUNT, path, yaffs_unmount(path),
+			0, 0, 0, 0, 0);
+}
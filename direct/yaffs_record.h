@@ -0,0 +1,168 @@
+/*
+ * YAFFS: Yet another Flash File System . A NAND-flash specific file system.
+ *
+ * Copyright (C) 2002-2011 Aleph One Ltd.
+ *   for Toby Churchill Ltd and Brightstar Engineering
+ *
+ * Created by Charles Manning <charles@aleph1.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1 as
+ * published by the Free Software Foundation.
+ *
+ * Note: Only YAFFS headers are LGPL, YAFFS C code is covered by GPL.
+ */
+
+/*
+ * yaffs_record.h: optional recording shim around the yaffsfs API.
+ *
+ * The yaffs_rec_xxx() functions call the matching yaffs_xxx() function and
+ * log the call. Build the application with CONFIG_YAFFS_RECORD and include
+ * this header after yaffsfs.h to redirect the yaffs_xxx() calls through the
+ * shim without touching the application code.
+ *
+ * The log is a yaffs_rec_file_hdr then variable length records, each a
+ * yaffs_rec_hdr followed by n_args argument words and the path component
+ * hashes. Paths are not stored: each component is hashed so the directory
+ * structure of a workload can be replayed without giving away any names.
+ * Everything is in native byte order.
+ *
+ * Start and stop recording while no other yaffs calls are in progress.
+ */
+
+#ifndef __YAFFS_RECORD_H__
+#define __YAFFS_RECORD_H__
+
+#include "yaffsfs.h"
+
+#define YAFFS_REC_MAGIC		0x43455259	/* "YREC" */
+#define YAFFS_REC_VERSION	1
+
+#define YAFFS_REC_FLAG_TIME_US	0x01	/* Times are microseconds */
+
+#define YAFFS_REC_MAX_ARGS	4
+#define YAFFS_REC_MAX_DEPTH	32	/* Path components kept per path */
+
+/* Hashes used for "." and ".." so that replay can keep them. */
+#define YAFFS_REC_HASH_DOT	1
+#define YAFFS_REC_HASH_DOTDOT	2
+
+enum yaffs_rec_op {
+	YAFFS_REC_NONE,
+	YAFFS_REC_OPEN,		/* path; oflag, mode. result fd */
+	YAFFS_REC_CLOSE,	/* fd */
+	YAFFS_REC_READ,		/* fd, nbyte */
+	YAFFS_REC_WRITE,	/* fd, nbyte */
+	YAFFS_REC_PREAD,	/* fd, nbyte, offset */
+	YAFFS_REC_PWRITE,	/* fd, nbyte, offset */
+	YAFFS_REC_LSEEK,	/* fd, offset lo, offset hi, whence */
+	YAFFS_REC_TRUNCATE,	/* path; size lo, size hi */
+	YAFFS_REC_FTRUNCATE,	/* fd, size lo, size hi */
+	YAFFS_REC_FSYNC,	/* fd */
+	YAFFS_REC_FDATASYNC,	/* fd */
+	YAFFS_REC_FLUSH,	/* fd */
+	YAFFS_REC_UNLINK,	/* path */
+	YAFFS_REC_RENAME,	/* path, path2 */
+	YAFFS_REC_MKDIR,	/* path; mode */
+	YAFFS_REC_RMDIR,	/* path */
+	YAFFS_REC_STAT,		/* path */
+	YAFFS_REC_LSTAT,	/* path */
+	YAFFS_REC_FSTAT,	/* fd */
+	YAFFS_REC_OPENDIR,	/* path; dir id. result 0 or -1 */
+	YAFFS_REC_READDIR,	/* dir id. result 0 or -1 at the end */
+	YAFFS_REC_CLOSEDIR,	/* dir id */
+	YAFFS_REC_LINK,		/* path, path2 */
+	YAFFS_REC_SYMLINK,	/* path (target), path2 */
+	YAFFS_REC_SYNC,		/* path */
+	YAFFS_REC_MOUNT,	/* path */
+	YAFFS_REC_UNMOUNT,	/* path */
+	YAFFS_REC_N_OPS
+};
+
+struct yaffs_rec_file_hdr {
+	u32 magic;
+	u32 version;
+	u32 flags;
+};
+
+struct yaffs_rec_hdr {
+	u8 op;
+	u8 n_args;
+	u8 n_path1;
+	u8 n_path2;
+	u32 time;	/* Start of the call, relative to yaffs_rec_start() */
+	u32 duration;
+	int result;
+};
+
+/*
+ * Recording. write_fn is handed the log in chunks and should return the
+ * number of bytes it took. time_fn, if given, returns microseconds.
+ */
+int yaffs_rec_start(int (*write_fn)(void *ctx, const void *buf, int n),
+		void *ctx, u32 (*time_fn)(void));
+int yaffs_rec_stop(void);
+
+u32 yaffs_rec_hash(const YCHAR *name, int len);
+
+int yaffs_rec_open(const YCHAR *path, int oflag, int mode);
+int yaffs_rec_close(int fd);
+int yaffs_rec_read(int fd, void *buf, unsigned int nbyte);
+int yaffs_rec_write(int fd, const void *buf, unsigned int nbyte);
+int yaffs_rec_pread(int fd, void *buf, unsigned int nbyte,
+			unsigned int offset);
+int yaffs_rec_pwrite(int fd, const void *buf, unsigned int nbyte,
+			unsigned int offset);
+off_t yaffs_rec_lseek(int fd, off_t offset, int whence);
+int yaffs_rec_truncate(const YCHAR *path, off_t new_size);
+int yaffs_rec_ftruncate(int fd, off_t new_size);
+int yaffs_rec_fsync(int fd);
+int yaffs_rec_fdatasync(int fd);
+int yaffs_rec_flush(int fd);
+int yaffs_rec_unlink(const YCHAR *path);
+int yaffs_rec_rename(const YCHAR *oldPath, const YCHAR *newPath);
+int yaffs_rec_mkdir(const YCHAR *path, mode_t mode);
+int yaffs_rec_rmdir(const YCHAR *path);
+int yaffs_rec_stat(const YCHAR *path, struct yaffs_stat *buf);
+int yaffs_rec_lstat(const YCHAR *path, struct yaffs_stat *buf);
+int yaffs_rec_fstat(int fd, struct yaffs_stat *buf);
+yaffs_DIR *yaffs_rec_opendir(const YCHAR *dirname);
+struct yaffs_dirent *yaffs_rec_readdir(yaffs_DIR *dirp);
+int yaffs_rec_closedir(yaffs_DIR *dirp);
+int yaffs_rec_link(const YCHAR *oldpath, const YCHAR *newpath);
+int yaffs_rec_symlink(const YCHAR *oldpath, const YCHAR *newpath);
+int yaffs_rec_sync(const YCHAR *path);
+int yaffs_rec_mount(const YCHAR *path);
+int yaffs_rec_unmount(const YCHAR *path);
+
+#if defined(CONFIG_YAFFS_RECORD) && !defined(YAFFS_RECORD_NO_REDIRECT)
+#define yaffs_open	yaffs_rec_open
+#define yaffs_close	yaffs_rec_close
+#define yaffs_read	yaffs_rec_read
+#define yaffs_write	yaffs_rec_write
+#define yaffs_pread	yaffs_rec_pread
+#define yaffs_pwrite	yaffs_rec_pwrite
+#define yaffs_lseek	yaffs_rec_lseek
+#define yaffs_truncate	yaffs_rec_truncate
+#define yaffs_ftruncate	yaffs_rec_ftruncate
+#define yaffs_fsync	yaffs_rec_fsync
+#define yaffs_fdatasync	yaffs_rec_fdatasync
+#define yaffs_flush	yaffs_rec_flush
+#define yaffs_unlink	yaffs_rec_unlink
+#define yaffs_rename	yaffs_rec_rename
+#define yaffs_mkdir	yaffs_rec_mkdir
+#define yaffs_rmdir	yaffs_rec_rmdir
+#define yaffs_stat	yaffs_rec_stat
+#define yaffs_lstat	yaffs_rec_lstat
+#define yaffs_fstat	yaffs_rec_fstat
+#define yaffs_opendir	yaffs_rec_opendir
+#define yaffs_readdir	yaffs_rec_readdir
+#define yaffs_closedir	yaffs_rec_closedir
+#define yaffs_link	yaffs_rec_link
+#define yaffs_symlink	yaffs_rec_symlink
+#define yaffs_sync	yaffs_rec_sync
+#define yaffs_mount	yaffs_rec_mount
+#define yaffs_unmount	yaffs_rec_unmount
+#endif
+
+#endif
@@ -16,6 +16,8 @@
 #include "yaffscfg.h"
 #include "yportenv.h"
 #include "yaffs_trace.h"
+#include "yaffs_tracebuf.h"
+#include "yaffs_nandprof.h"
 
 #include <string.h> /* for memset */
 
@@ -76,6 +78,7 @@ typedef struct{
 	int	inodeId:12;	/* Index to corresponding yaffsfs_Inode */
 	int	handleCount:10;	/* Number of handles for this fd */
 	u32 position;		/* current position in file */
+	struct yaffs_xip_pin xip;	/* Blocks the last yaffs_read_xip() holds */
 }yaffsfs_FileDes;
 
 typedef struct {
@@ -233,7 +236,7 @@ static void yaffsfs_ReleaseInode(yaffsfs_Inode *in)
 	if(obj->unlinked)
 		yaffs_del_obj(obj);
 
-	obj->my_inode = NULL;
+	yaffs_obj_set_inode(obj, NULL);
 	in->iObj = NULL;
 
 }
@@ -320,6 +323,19 @@ static int yaffsfs_GetHandle(int handle)
  * ending a read or write.
  */
 
+/* Lets go of the blocks held for the fd's last yaffs_read_xip() */
+static void yaffsfs_ReleaseXip(yaffsfs_FileDes *fd)
+{
+	struct yaffs_obj *obj;
+
+	if(fd->xip.n_blocks > 0 && fd->inodeId >= 0){
+		obj = yaffsfs_inode[fd->inodeId].iObj;
+		if(obj)
+			yaffs_file_unmap(obj->my_dev, &fd->xip);
+	}
+	fd->xip.n_blocks = 0;
+}
+
 static int yaffsfs_PutFileDes(int fdId)
 {
 	yaffsfs_FileDes *fd;
@@ -328,6 +344,7 @@ static int yaffsfs_PutFileDes(int fdId)
 		fd = &yaffsfs_fd[fdId];
 		fd->handleCount--;
 		if(fd->handleCount < 1){
+			yaffsfs_ReleaseXip(fd);
 			if(fd->inodeId >= 0){
 				yaffsfs_PutInode(fd->inodeId);
 				fd->inodeId = -1;
@@ -368,6 +385,7 @@ static void yaffsfs_BreakDeviceHandles(struct yaffs_dev *dev)
 		if(fd && fd->handleCount>0 && obj && obj->my_dev == dev){
 
 			fd->handleCount = 0;
+			yaffsfs_ReleaseXip(fd);
 			yaffsfs_PutInode(fd->inodeId);
 			fd->inodeId = -1;
 		}
@@ -949,7 +967,7 @@ int yaffs_open_sharing(const YCHAR *path, int oflag, int mode, int sharing)
 			fd->shareWrite = shareWrite;
 
 			/* Hook inode to object */
-                        obj->my_inode = (void*) &yaffsfs_inode[inodeId];
+                        yaffs_obj_set_inode(obj, (void*) &yaffsfs_inode[inodeId]);
 
                         if((oflag & O_TRUNC) && fd->writing)
                                 yaffs_resize_file(obj,0);
@@ -1159,6 +1177,78 @@ int yaffs_pread(int handle, void *buf, unsigned int nbyte, unsigned int offset)
 	return yaffsfs_do_read(handle, buf, nbyte, 1, offset);
 }
 
+/*
+ * Execute in place read for devices on memory mapped flash. Points *ptr at
+ * up to nbyte bytes of the file's data in flash and moves past them.
+ * Returns how many, 0 at the end of the file. Fails with ENODATA if the
+ * data can't be read in place, then yaffs_read() has to be used.
+ * The blocks holding the data are kept as they are, whatever gc or writes
+ * to the file do, until the next yaffs_read_xip() on the handle,
+ * yaffs_release_xip() or the handle is closed. *ptr is not valid after that.
+ */
+int yaffs_read_xip(int handle, const void **ptr, unsigned int nbyte)
+{
+	yaffsfs_FileDes *fd = NULL;
+	struct yaffs_obj *obj = NULL;
+	const u8 *data = NULL;
+	int nRead = -1;
+
+	if(!ptr){
+		yaffsfs_SetError(-EFAULT);
+		return -1;
+	}
+
+	yaffsfs_Lock();
+	fd = yaffsfs_HandleToFileDes(handle);
+	obj = yaffsfs_HandleToObject(handle);
+
+	if(fd)
+		yaffsfs_ReleaseXip(fd);
+
+	if(!fd || !obj)
+		yaffsfs_SetError(-EBADF);
+	else if(!fd->reading)
+		yaffsfs_SetError(-EINVAL);
+	else if(fd->position >= yaffs_get_obj_length(obj))
+		nRead = 0;
+	else {
+		if(nbyte > YAFFS_MAX_FILE_SIZE)
+			nbyte = YAFFS_MAX_FILE_SIZE;
+		data = yaffs_file_map(obj, fd->position, nbyte, &nRead,
+					&fd->xip);
+		if(data){
+			*ptr = data;
+			fd->position += nRead;
+		} else {
+			yaffsfs_SetError(-ENODATA);
+			nRead = -1;
+		}
+	}
+
+	yaffsfs_Unlock();
+
+	return nRead;
+}
+
+/* Lets the data from the last yaffs_read_xip() on the handle move again */
+int yaffs_release_xip(int handle)
+{
+	yaffsfs_FileDes *fd = NULL;
+	int retVal = -1;
+
+	yaffsfs_Lock();
+	fd = yaffsfs_HandleToFileDes(handle);
+	if(!fd)
+		yaffsfs_SetError(-EBADF);
+	else {
+		yaffsfs_ReleaseXip(fd);
+		retVal = 0;
+	}
+	yaffsfs_Unlock();
+
+	return retVal;
+}
+
 int yaffsfs_do_write(int handle, const void *vbuf, unsigned int nbyte, int isPwrite, int offset)
 {
 	yaffsfs_FileDes *fd = NULL;
@@ -1353,6 +1443,7 @@ off_t yaffs_lseek(int handle, off_t offset, int whence)
 	struct yaffs_obj *obj = NULL;
 	int pos = -1;
 	int fSize = -1;
+	int seekError = -EINVAL;
 
 	yaffsfs_Lock();
 	fd = yaffsfs_HandleToFileDes(handle);
@@ -1373,12 +1464,16 @@ off_t yaffs_lseek(int handle, off_t offset, int whence)
 			fSize = yaffs_get_obj_length(obj);
 			if(fSize >= 0 && (fSize + offset) >= 0)
 				pos = fSize + offset;
+		} else if(whence == SEEK_DATA || whence == SEEK_HOLE) {
+			pos = yaffs_seek_data(obj, offset, whence == SEEK_HOLE);
+			if(pos < 0)
+				seekError = -ENXIO; /* No more data */
 		}
 
 		if(pos >= 0 && pos <= YAFFS_MAX_FILE_SIZE)
 			fd->position = pos;
 		else{
-			yaffsfs_SetError(-EINVAL);
+			yaffsfs_SetError(seekError);
 			pos = -1;
 		}
 	}
@@ -1575,21 +1670,21 @@ static int yaffsfs_DoStat(struct yaffs_obj *obj,struct yaffs_stat *buf)
 	    	buf->st_nlink = yaffs_get_obj_link_count(obj);
 	    	buf->st_uid = 0;
 	    	buf->st_gid = 0;;
-	    	buf->st_rdev = obj->yst_rdev;
+	    	buf->st_rdev = yaffs_obj_attr(obj)->yst_rdev;
 	    	buf->st_size = yaffs_get_obj_length(obj);
 	    	buf->st_blksize = obj->my_dev->data_bytes_per_chunk;
 	    	buf->st_blocks = (buf->st_size + buf->st_blksize -1)/buf->st_blksize;
 #if CONFIG_YAFFS_WINCE
-		buf->yst_wince_atime[0] = obj->win_atime[0];
-		buf->yst_wince_atime[1] = obj->win_atime[1];
-		buf->yst_wince_ctime[0] = obj->win_ctime[0];
-		buf->yst_wince_ctime[1] = obj->win_ctime[1];
-		buf->yst_wince_mtime[0] = obj->win_mtime[0];
-		buf->yst_wince_mtime[1] = obj->win_mtime[1];
+		buf->yst_wince_atime[0] = yaffs_obj_attr(obj)->win_atime[0];
+		buf->yst_wince_atime[1] = yaffs_obj_attr(obj)->win_atime[1];
+		buf->yst_wince_ctime[0] = yaffs_obj_attr(obj)->win_ctime[0];
+		buf->yst_wince_ctime[1] = yaffs_obj_attr(obj)->win_ctime[1];
+		buf->yst_wince_mtime[0] = yaffs_obj_attr(obj)->win_mtime[0];
+		buf->yst_wince_mtime[1] = yaffs_obj_attr(obj)->win_mtime[1];
 #else
-    		buf->yst_atime = obj->yst_atime;
-	    	buf->yst_ctime = obj->yst_ctime;
-	    	buf->yst_mtime = obj->yst_mtime;
+    		buf->yst_atime = yaffs_obj_attr(obj)->yst_atime;
+	    	buf->yst_ctime = yaffs_obj_attr(obj)->yst_ctime;
+	    	buf->yst_mtime = yaffs_obj_attr(obj)->yst_mtime;
 #endif
 		retVal = 0;
 	}
@@ -1693,8 +1788,8 @@ static int yaffsfs_DoUtime(struct yaffs_obj *obj,const struct yaffs_utimbuf *buf
 	}
 
 	if(obj){
-		obj->yst_atime = buf->actime;
-		obj->yst_mtime = buf->modtime;
+		yaffs_obj_attr_mod(obj)->yst_atime = buf->actime;
+		yaffs_obj_attr_mod(obj)->yst_mtime = buf->modtime;
 		obj->dirty = 1;
 		result = yaffs_flush_file(obj,0,0);
 		retVal = result == YAFFS_OK ? 0 : -1;
@@ -2118,16 +2213,16 @@ int yaffs_get_wince_times(int fd, unsigned *wctime, unsigned *watime, unsigned *
 	if(obj){
 
 		if(wctime){
-			wctime[0] = obj->win_ctime[0];
-			wctime[1] = obj->win_ctime[1];
+			wctime[0] = yaffs_obj_attr(obj)->win_ctime[0];
+			wctime[1] = yaffs_obj_attr(obj)->win_ctime[1];
 		}
 		if(watime){
-			watime[0] = obj->win_atime[0];
-			watime[1] = obj->win_atime[1];
+			watime[0] = yaffs_obj_attr(obj)->win_atime[0];
+			watime[1] = yaffs_obj_attr(obj)->win_atime[1];
 		}
 		if(wmtime){
-			wmtime[0] = obj->win_mtime[0];
-			wmtime[1] = obj->win_mtime[1];
+			wmtime[0] = yaffs_obj_attr(obj)->win_mtime[0];
+			wmtime[1] = yaffs_obj_attr(obj)->win_mtime[1];
 		}
 
 
@@ -2157,16 +2252,16 @@ int yaffs_set_wince_times(int fd,
 	if(obj){
 
 		if(wctime){
-			obj->win_ctime[0] = wctime[0];
-			obj->win_ctime[1] = wctime[1];
+			yaffs_obj_attr_mod(obj)->win_ctime[0] = wctime[0];
+			yaffs_obj_attr_mod(obj)->win_ctime[1] = wctime[1];
 		}
 		if(watime){
-                        obj->win_atime[0] = watime[0];
-                        obj->win_atime[1] = watime[1];
+                        yaffs_obj_attr_mod(obj)->win_atime[0] = watime[0];
+                        yaffs_obj_attr_mod(obj)->win_atime[1] = watime[1];
                 }
                 if(wmtime){
-                        obj->win_mtime[0] = wmtime[0];
-                        obj->win_mtime[1] = wmtime[1];
+                        yaffs_obj_attr_mod(obj)->win_mtime[0] = wmtime[0];
+                        yaffs_obj_attr_mod(obj)->win_mtime[1] = wmtime[1];
                 }
 
                 obj->dirty = 1;
@@ -2509,6 +2604,38 @@ int yaffs_sync(const YCHAR *path)
         return retVal;
 }
 
+int yaffs_do_background_gc(const YCHAR *path, int urgency)
+{
+	int retVal = -1;
+	struct yaffs_dev *dev=NULL;
+	YCHAR *dummy;
+
+	if(!path){
+		yaffsfs_SetError(-EFAULT);
+		return -1;
+	}
+
+	if(yaffsfs_CheckPath(path) < 0){
+		yaffsfs_SetError(-ENAMETOOLONG);
+		return -1;
+	}
+
+	yaffsfs_Lock();
+	dev = yaffsfs_FindDevice(path,&dummy);
+	if(dev){
+		if(!dev->is_mounted)
+			yaffsfs_SetError(-EINVAL);
+		else if(dev->read_only)
+			yaffsfs_SetError(-EROFS);
+		else
+			retVal = yaffs_bg_gc(dev, urgency) ? 1 : 0;
+	}else
+		yaffsfs_SetError(-ENODEV);
+
+	yaffsfs_Unlock();
+	return retVal;
+}
+
 
 static int yaffsfs_IsDevBusy(struct yaffs_dev * dev)
 {
@@ -3164,3 +3291,79 @@ int yaffs_dump_dev(const YCHAR *path)
 	return 0;
 }
 
+/*
+ * yaffs_dump_trace_buf()
+ * Copies the device's binary trace buffer into buf (see yaffs_tracebuf.h)
+ * and optionally empties it. Returns the number of bytes copied.
+ */
+int yaffs_dump_trace_buf(const YCHAR *path, void *buf, int size, int clear)
+{
+	int retVal = -1;
+	struct yaffs_dev *dev=NULL;
+	YCHAR *dummy;
+
+	if(!path || !buf){
+		yaffsfs_SetError(-EFAULT);
+		return -1;
+	}
+
+	if(yaffsfs_CheckPath(path) < 0){
+		yaffsfs_SetError(-ENAMETOOLONG);
+		return -1;
+	}
+
+	yaffsfs_Lock();
+	dev = yaffsfs_FindDevice(path,&dummy);
+	if(dev && dev->is_mounted && dev->tb_recs){
+		retVal = yaffs_tb_dump(dev, buf, size);
+		if(retVal < 0)
+			yaffsfs_SetError(-ERANGE);
+		else if(clear)
+			yaffs_tb_clear(dev);
+	} else
+		yaffsfs_SetError(-EINVAL);
+
+	yaffsfs_Unlock();
+	return retVal;
+}
+
+/*
+ * yaffs_dump_nand_prof()
+ * Copies the device's NAND access counts into buf (see yaffs_nandprof.h)
+ * and optionally zeroes them. Returns the number of bytes copied.
+ * If buf is NULL just returns the size needed.
+ */
+int yaffs_dump_nand_prof(const YCHAR *path, void *buf, int size, int clear)
+{
+	int retVal = -1;
+	struct yaffs_dev *dev=NULL;
+	YCHAR *dummy;
+
+	if(!path){
+		yaffsfs_SetError(-EFAULT);
+		return -1;
+	}
+
+	if(yaffsfs_CheckPath(path) < 0){
+		yaffsfs_SetError(-ENAMETOOLONG);
+		return -1;
+	}
+
+	yaffsfs_Lock();
+	dev = yaffsfs_FindDevice(path,&dummy);
+	if(dev && dev->is_mounted && dev->np_counts){
+		if(!buf)
+			retVal = yaffs_np_dump_size(dev);
+		else {
+			retVal = yaffs_np_dump(dev, buf, size);
+			if(retVal < 0)
+				yaffsfs_SetError(-ERANGE);
+			else if(clear)
+				yaffs_np_clear(dev);
+		}
+	} else
+		yaffsfs_SetError(-EINVAL);
+
+	yaffsfs_Unlock();
+	return retVal;
+}
@@ -105,6 +105,9 @@ int yaffs_write(int fd, const void *buf, unsigned int nbyte) ;
 int yaffs_pread(int fd, void *buf, unsigned int nbyte, unsigned int offset);
 int yaffs_pwrite(int fd, const void *buf, unsigned int nbyte, unsigned int offset);
 
+int yaffs_read_xip(int fd, const void **ptr, unsigned int nbyte);
+int yaffs_release_xip(int fd);
+
 off_t yaffs_lseek(int fd, off_t offset, int whence) ;
 
 int yaffs_truncate(const YCHAR *path, off_t new_size);
@@ -165,6 +168,11 @@ int yaffs_remount(const YCHAR *path, int force, int read_only);
 
 int yaffs_sync(const YCHAR *path) ;
 
+/* Run one round of background work. Call this from a low priority task.
+ * Returns 1 when there is nothing urgent left to do.
+ */
+int yaffs_do_background_gc(const YCHAR *path, int urgency);
+
 int yaffs_symlink(const YCHAR *oldpath, const YCHAR *newpath);
 int yaffs_readlink(const YCHAR *path, YCHAR *buf, int bufsiz);
 
@@ -196,6 +204,8 @@ const char * yaffs_error_to_str(int err);
 /* Function only for debugging */
 void * yaffs_getdev(const YCHAR *path);
 int yaffs_dump_dev(const YCHAR *path);
+int yaffs_dump_trace_buf(const YCHAR *path, void *buf, int size, int clear);
+int yaffs_dump_nand_prof(const YCHAR *path, void *buf, int size, int clear);
 int yaffs_set_error(int error);
 
 /* Trace control functions */
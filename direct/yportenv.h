@@ -146,6 +146,14 @@ struct iattr {
 #define SEEK_END	2
 #endif
 
+#ifndef SEEK_DATA
+#define SEEK_DATA	3
+#endif
+
+#ifndef SEEK_HOLE
+#define SEEK_HOLE	4
+#endif
+
 #ifndef EBUSY
 #define EBUSY	16
 #endif
@@ -194,6 +202,10 @@ struct iattr {
 #define ENODATA 61
 #endif
 
+#ifndef ENXIO
+#define ENXIO	6
+#endif
+
 #ifndef ENOTEMPTY
 #define ENOTEMPTY 39
 #endif
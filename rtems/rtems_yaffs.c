@@ -162,8 +162,8 @@ static rtems_filesystem_eval_path_generic_status ryfs_eval_token(
 		ctx,
 		RTEMS_FS_PERMS_EXEC,
 		dir->yst_mode,
-		(uid_t) dir->yst_uid,
-		(gid_t) dir->yst_gid
+		(uid_t) yaffs_obj_attr(dir)->yst_uid,
+		(gid_t) yaffs_obj_attr(dir)->yst_gid
 	);
 
 	if (access_ok) {
@@ -275,9 +275,9 @@ static int ryfs_utime(
 	obj = yaffs_get_equivalent_obj(obj);
 	if (obj != NULL) {
 		obj->dirty = 1;
-		obj->yst_atime = (u32) actime;
-		obj->yst_mtime = (u32) modtime;
-		obj->yst_ctime = (u32) time(NULL);
+		yaffs_obj_attr_mod(obj)->yst_atime = (u32) actime;
+		yaffs_obj_attr_mod(obj)->yst_mtime = (u32) modtime;
+		yaffs_obj_attr_mod(obj)->yst_ctime = (u32) time(NULL);
 	} else {
 		errno = EIO;
 		rv = -1;
@@ -377,16 +377,16 @@ static int ryfs_fstat(const rtems_filesystem_location_info_t *loc, struct stat *
 		buf->st_ino = obj->obj_id;
 		buf->st_mode = obj->yst_mode;
 		buf->st_nlink = (nlink_t) yaffs_get_obj_link_count(obj);
-		buf->st_rdev = obj->yst_rdev;
+		buf->st_rdev = yaffs_obj_attr(obj)->yst_rdev;
 		buf->st_size = yaffs_get_obj_length(obj);
 		buf->st_blksize = obj->my_dev->data_bytes_per_chunk;
 		buf->st_blocks = (blkcnt_t)
 			((buf->st_size + buf->st_blksize - 1) / buf->st_blksize);
-		buf->st_uid = (uid_t) obj->yst_uid;
-		buf->st_gid = (gid_t) obj->yst_gid;
-		buf->st_atime = (time_t) obj->yst_atime;
-		buf->st_ctime = (time_t) obj->yst_ctime;
-		buf->st_mtime = (time_t) obj->yst_mtime;
+		buf->st_uid = (uid_t) yaffs_obj_attr(obj)->yst_uid;
+		buf->st_gid = (gid_t) yaffs_obj_attr(obj)->yst_gid;
+		buf->st_atime = (time_t) yaffs_obj_attr(obj)->yst_atime;
+		buf->st_ctime = (time_t) yaffs_obj_attr(obj)->yst_ctime;
+		buf->st_mtime = (time_t) yaffs_obj_attr(obj)->yst_mtime;
 	} else {
 		errno = EIO;
 		rv = -1;
@@ -432,8 +432,8 @@ static int ryfs_chown(
 
 	obj = yaffs_get_equivalent_obj(obj);
 	if (obj != NULL) {
-		obj->yst_uid = owner;
-		obj->yst_gid = group;
+		yaffs_obj_attr_mod(obj)->yst_uid = owner;
+		yaffs_obj_attr_mod(obj)->yst_gid = group;
 		obj->dirty = 1;
 		yc = yaffs_flush_file(obj, 0, 0);
 	} else {
@@ -18,7 +18,21 @@
  * makeyaffs2image.c 
  *
  * Makes a YAFFS2 file system image that can be used to load up a file system.
- * Uses default Linux MTD layout - search for "NAND LAYOUT" to change.
+ * The geometry and tags layout are set on the command line and default to
+ * 2k pages with the Linux MTD layout (tags, with ECC, at the start of the
+ * 64 byte spare). Tags are packed by yaffs_packedtags2.c, as on the target.
+ *
+ * The work is split into a pipeline: a thread walks the directory tree,
+ * reader threads read the files, the main thread packs chunks and tags and
+ * a writer thread writes the image in large writes. Objects are packed in
+ * the order the walk finds them, so the image is the same whatever the
+ * number of threads (-j 0 does everything in the main thread).
+ *
+ * Blocks are laid out the way yaffs writes them: each block has its own
+ * sequence number and a full block ends with a summary of its tags (see
+ * yaffs_summary.c), so the first mount can scan the summaries instead of
+ * every chunk. Optionally a checkpoint is written after the data so that
+ * the first mount is a checkpoint restore and needs no scan at all.
  */
  
 #include <stdlib.h>
@@ -31,6 +45,8 @@
 #include <unistd.h>
 #include <errno.h>
 #include <assert.h>
+#include <getopt.h>
+#include <pthread.h>
 #include "yaffs_guts.h"
 
 #ifndef NOR_MKYAFFS2IMAGE
@@ -38,24 +54,32 @@
 #endif
 
 #include "yaffs_packedtags2.h"
+#include "yaffs_summary.h"
 
 unsigned yaffs_trace_mask=0;
 
-#define MAX_OBJECTS 10000
-
-// Adjust these to match your NAND LAYOUT:
+/*
+ * Geometry. The defaults can be changed on the command line. The NOR build
+ * defaults to the layout used by yaffs_norif1.c: 512+16 byte pages packed
+ * into 128k blocks, tags without ECC.
+ */
 #ifdef NOR_MKYAFFS2IMAGE
-  #define chunkSize 512
-  #define spareSize 16
-  #define blockSize (128*1024)
-  #define pagesPerBlock (blockSize/(chunkSize+spareSize))
-  #define remainderSize (blockSize%(chunkSize+spareSize))
-  static int write_chunk_count = 0;
+static int pageSize = 512;	/* Bytes per page written, excluding spare */
+static int spareSize = 16;
+static int blockSize = 128 * 1024;	/* 0 if pages fill the block */
+static int pagesPerBlock = (128 * 1024) / (512 + 16);
+static int tagsEcc = 0;
 #else
-  #define chunkSize 2048
-  #define spareSize 64
-  #define pagesPerBlock 64
+static int pageSize = 2048;
+static int spareSize = 64;
+static int blockSize = 0;
+static int pagesPerBlock = 64;
+static int tagsEcc = 1;
 #endif
+static int remainderSize;	/* Padding at the end of each block */
+static int tagsOffset;		/* Where the tags go in the spare */
+static int inbandTags;		/* Tags at the end of the page, no spare used */
+static int chunkSize;		/* Data bytes per chunk, as data_bytes_per_chunk */
 
 #define SWAP32(x)   ((((x) & 0x000000FF) << 24) | \
                      (((x) & 0x0000FF00) << 8 ) | \
@@ -65,15 +89,19 @@ unsigned yaffs_trace_mask=0;
 #define SWAP16(x)   ((((x) & 0x00FF) << 8) | \
                      (((x) & 0xFF00) >> 8))
 
-typedef struct
+/* Objects seen so far, hashed on dev and inode, to find hard links */
+typedef struct objItem
 {
+	struct objItem *next;
 	dev_t dev;
 	ino_t ino;
 	int   obj;
 } objItem;
 
+static objItem **objHash;
+static unsigned objHashSize;
+static unsigned nHashed;
 
-static objItem obj_list[MAX_OBJECTS];
 static int obj_id = YAFFS_NOBJECT_BUCKETS + 1;
 
 static int n_obj, nDirectories, nPages;
@@ -85,6 +113,105 @@ static int savedErrno;
 
 static int convert_endian = 0;
 
+/* Block layout */
+static int summaries = 1;
+static int chunksPerSummary;	/* Chunks in a full block before its summary */
+static int blockInImage;	/* Block being written */
+static int chunkInBlock;	/* Next chunk to write in that block */
+static struct yaffs_summary_tags *summary;
+
+/*
+ * Checkpoint. To write one we need to know the size of the target device
+ * and the pointer size of the target as the checkpoint holds tnodes. The
+ * rest of the checkpoint is in native byte order and struct layout, so the
+ * target must otherwise match the build host. The checkpoint holds chunk
+ * locations, so it is only valid if the image is programmed without
+ * skipping bad blocks.
+ */
+static int cpDevBlocks;		/* Device size in blocks, 0 for no checkpoint */
+static int cpStartBlock;	/* The device's param.start_block */
+static int cpPtrSize = sizeof(void *);
+
+typedef struct
+{
+	int obj;
+	int parent;
+	enum yaffs_obj_type type;
+	int hdrChunk;		/* Chunk in the image */
+	u32 sizeOrEquiv;
+	int firstData;		/* Index into dataChunks */
+	int nDataChunks;
+} cpObjItem;
+
+static cpObjItem *cpObjs;
+static int nCpObjs, maxCpObjs;
+static int *dataChunks;
+static int nDataChunks, maxDataChunks;
+
+static struct
+{
+	u8 *buffer;
+	int byteOffs;
+	int pageSeq;
+	int byteCount;
+	u32 sum;
+	u32 xor;
+} cp;
+
+/* Pipeline */
+#define SEG_CHUNKS	64			/* Chunks read at a time */
+#define MAX_JOBS	4096			/* Objects queued for packing */
+#define READ_AHEAD	(64 * 1024 * 1024)	/* File data read ahead */
+#define OUT_BUF_SIZE	(4 * 1024 * 1024)
+#define N_OUT_BUFS	4
+
+typedef struct seg
+{
+	struct seg *next;
+	int nChunks;
+	int n_bytes[SEG_CHUNKS];
+	u8 *data;		/* SEG_CHUNKS chunks, allocated after the seg */
+} seg;
+
+#define segSize		(sizeof(seg) + SEG_CHUNKS * chunkSize)
+#define seg_chunk(sg, i)	((sg)->data + (i) * chunkSize)
+
+/* An object to go in the image: its header and, for a file, its data. */
+typedef struct job
+{
+	struct job *next;
+	u8 *hdr;		/* Allocated after the job */
+	struct yaffs_ext_tags tags;
+	char *path;		/* File to read, NULL if none */
+	seg *segs;		/* Data read but not yet packed */
+	seg *segTail;
+	int readDone;
+	int chunk;		/* Last chunk id packed */
+} job;
+
+static int threaded;
+static int nReaders;
+
+static pthread_mutex_t pipeLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t errLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobCond = PTHREAD_COND_INITIALIZER;	/* Job queued */
+static pthread_cond_t segCond = PTHREAD_COND_INITIALIZER;	/* Data read */
+static pthread_cond_t spaceCond = PTHREAD_COND_INITIALIZER;	/* Room in queue */
+static pthread_cond_t outCond = PTHREAD_COND_INITIALIZER;
+
+static job *jobHead, *jobTail;
+static job *readCursor;		/* Next job for a reader to look at */
+static int nJobs;
+static int walkDone;
+static long readAhead;		/* Bytes in segs */
+
+static struct
+{
+	u8 *data;
+	int len;		/* Non zero when waiting to be written */
+} outBufs[N_OUT_BUFS];
+static int outCur, outFill, outDone;
+
 static void fatal(const char *fn)
 {
 	perror(fn);
@@ -94,101 +221,83 @@ static void fatal(const char *fn)
 
 static int warn(const char *fn)
 {
+	int ret;
+
+	pthread_mutex_lock(&errLock);
 	savedErrno = errno;
 	perror(fn);
 	error |= 2;
-	return error;
+	ret = error;
+	pthread_mutex_unlock(&errLock);
+	return ret;
 }
 
-static int obj_compare(const void *a, const void * b)
+static unsigned obj_hash(dev_t dev, ino_t ino, unsigned size)
 {
-  objItem *oa, *ob;
-  
-  oa = (objItem *)a;
-  ob = (objItem *)b;
-  
-  if(oa->dev < ob->dev) return -1;
-  if(oa->dev > ob->dev) return 1;
-  if(oa->ino < ob->ino) return -1;
-  if(oa->ino > ob->ino) return 1;
-  
-  return 0;
-}
+	unsigned long long h = ((unsigned long long)dev << 32) ^ ino;
 
+	h *= 0x9e3779b97f4a7c15ULL;
+	return (unsigned)(h >> 32) & (size - 1);
+}
 
 static void add_obj_to_list(dev_t dev, ino_t ino, int obj)
 {
-	if(n_obj < MAX_OBJECTS)
-	{
-		obj_list[n_obj].dev = dev;
-		obj_list[n_obj].ino = ino;
-		obj_list[n_obj].obj = obj;
-		n_obj++;
-		qsort(obj_list,n_obj,sizeof(objItem),obj_compare);
-		
-	}
-	else
+	objItem *item;
+	objItem **newHash;
+	unsigned newSize;
+	unsigned h;
+	unsigned i;
+
+	if (nHashed >= objHashSize * 2)
 	{
-		// oops! not enough space in the object array
-		fprintf(stderr,"Not enough space in object array\n");
-		exit(1);
+		/* Grow the table */
+		newSize = objHashSize ? objHashSize * 4 : 1024;
+		newHash = calloc(newSize, sizeof(objItem *));
+		if (!newHash)
+			fatal("calloc");
+		for (i = 0; i < objHashSize; i++)
+		{
+			while ((item = objHash[i]) != NULL)
+			{
+				objHash[i] = item->next;
+				h = obj_hash(item->dev, item->ino, newSize);
+				item->next = newHash[h];
+				newHash[h] = item;
+			}
+		}
+		free(objHash);
+		objHash = newHash;
+		objHashSize = newSize;
 	}
+
+	item = malloc(sizeof(objItem));
+	if (!item)
+		fatal("malloc");
+	item->dev = dev;
+	item->ino = ino;
+	item->obj = obj;
+	h = obj_hash(dev, ino, objHashSize);
+	item->next = objHash[h];
+	objHash[h] = item;
+	nHashed++;
 }
 
 
 static int find_obj_in_list(dev_t dev, ino_t ino)
 {
-	objItem *i = NULL;
-	objItem test;
+	objItem *item;
 
-	test.dev = dev;
-	test.ino = ino;
-	
-	if(n_obj > 0)
-	{
-		i = bsearch(&test,obj_list,n_obj,sizeof(objItem),obj_compare);
-	}
+	if (!objHashSize)
+		return -1;
 
-	if(i)
+	for (item = objHash[obj_hash(dev, ino, objHashSize)]; item; item = item->next)
 	{
-		return i->obj;
+		if (item->dev == dev && item->ino == ino)
+			return item->obj;
 	}
 	return -1;
 }
 
-/* This little function converts a little endian tag to a big endian tag.
- * NOTE: The tag is not usable after this other than calculating the CRC
- * with.
- */
-static void little_to_big_endian(struct yaffs_ext_tags *tagsPtr)
-{
-#if 0 // FIXME NCB
-    union yaffs_tags_union * tags = (union yaffs_tags_union* )tagsPtr; // Work in bytes.
-    union yaffs_tags_union   temp;
-
-    memset(&temp, 0, sizeof(temp));
-    // Ick, I hate magic numbers.
-    temp.as_bytes[0] = ((tags->as_bytes[2] & 0x0F) << 4) | ((tags->as_bytes[1] & 0xF0) >> 4);
-    temp.as_bytes[1] = ((tags->as_bytes[1] & 0x0F) << 4) | ((tags->as_bytes[0] & 0xF0) >> 4);
-    temp.as_bytes[2] = ((tags->as_bytes[0] & 0x0F) << 4) | ((tags->as_bytes[2] & 0x30) >> 2) | ((tags->as_bytes[3] & 0xC0) >> 6);
-    temp.as_bytes[3] = ((tags->as_bytes[3] & 0x3F) << 2) | ((tags->as_bytes[2] & 0xC0) >> 6);
-    temp.as_bytes[4] = ((tags->as_bytes[6] & 0x03) << 6) | ((tags->as_bytes[5] & 0xFC) >> 2);
-    temp.as_bytes[5] = ((tags->as_bytes[5] & 0x03) << 6) | ((tags->as_bytes[4] & 0xFC) >> 2);
-    temp.as_bytes[6] = ((tags->as_bytes[4] & 0x03) << 6) | (tags->as_bytes[7] & 0x3F);
-    temp.as_bytes[7] = (tags->as_bytes[6] & 0xFC) | ((tags->as_bytes[7] & 0xC0) >> 6);
-
-    // Now copy it back.
-    tags->as_bytes[0] = temp.as_bytes[0];
-    tags->as_bytes[1] = temp.as_bytes[1];
-    tags->as_bytes[2] = temp.as_bytes[2];
-    tags->as_bytes[3] = temp.as_bytes[3];
-    tags->as_bytes[4] = temp.as_bytes[4];
-    tags->as_bytes[5] = temp.as_bytes[5];
-    tags->as_bytes[6] = temp.as_bytes[6];
-    tags->as_bytes[7] = temp.as_bytes[7];
-#endif
-}
-
 static void yaffs_packed_tags2_tags_only_to_big_endian(struct yaffs_packed_tags2_tags_only *ptt)
 {
 	ptt->seq_number = SWAP32(ptt->seq_number);
@@ -197,74 +306,511 @@ static void yaffs_packed_tags2_tags_only_to_big_endian(struct yaffs_packed_tags2
 	ptt->n_bytes = SWAP32(ptt->n_bytes);
 }
 
-static void shuffle_oob(char *spareData, struct yaffs_packed_tags2_tags_only *pt)
+/*
+ * Packs the tags as the target would. A big-endian target computes the tags
+ * ECC over its own byte order, so swap before working out the ECC.
+ */
+static void pack_tags(struct yaffs_packed_tags2 *pt, const struct yaffs_ext_tags *t)
 {
-	assert(sizeof(*pt) <= spareSize);
-	// NAND LAYOUT: For non-trivial OOB orderings, here would be a good place to shuffle.
-	memcpy(spareData, pt, sizeof(*pt));
+	memset(pt, 0, sizeof(*pt));
+
+	if (!convert_endian)
+	{
+		yaffs_pack_tags2(pt, t, tagsEcc && !inbandTags);
+		return;
+	}
+
+	yaffs_pack_tags2_tags_only(&pt->t, t);
+	yaffs_packed_tags2_tags_only_to_big_endian(&pt->t);
+#ifndef NOR_MKYAFFS2IMAGE
+	if (tagsEcc && !inbandTags)
+	{
+		yaffs_ecc_calc_other((unsigned char *)&pt->t, sizeof(pt->t), &pt->ecc);
+		pt->ecc.line_parity = SWAP32(pt->ecc.line_parity);
+		pt->ecc.line_parity_prime = SWAP32(pt->ecc.line_parity_prime);
+	}
+#endif
 }
 
-static int write_chunk(u8 *data, u32 id, u32 chunk_id, u32 n_bytes)
+/* Bytes of tags to store: the tags only part is used without ECC */
+static int packed_tags_size(void)
+{
+	if (inbandTags || !tagsEcc)
+		return sizeof(struct yaffs_packed_tags2_tags_only);
+	return sizeof(struct yaffs_packed_tags2);
+}
+
+/* Hands a full output buffer to the writer thread, or writes it. */
+static void out_submit(void)
+{
+	if (!outFill)
+		return;
+
+	if (!threaded)
+	{
+		if (write(outFile, outBufs[0].data, outFill) != outFill)
+			fatal("write");
+		outFill = 0;
+		return;
+	}
+
+	pthread_mutex_lock(&pipeLock);
+	outBufs[outCur].len = outFill;
+	pthread_cond_broadcast(&outCond);
+	outCur = (outCur + 1) % N_OUT_BUFS;
+	while (outBufs[outCur].len)
+		pthread_cond_wait(&outCond, &pipeLock);
+	pthread_mutex_unlock(&pipeLock);
+	outFill = 0;
+}
+
+static void out_put(const void *data, int n)
+{
+	const u8 *bytes = (const u8 *)data;
+	int this_tx;
+
+	while (n > 0)
+	{
+		this_tx = OUT_BUF_SIZE - outFill;
+		if (this_tx > n)
+			this_tx = n;
+		memcpy(outBufs[outCur].data + outFill, bytes, this_tx);
+		outFill += this_tx;
+		bytes += this_tx;
+		n -= this_tx;
+		if (outFill == OUT_BUF_SIZE)
+			out_submit();
+	}
+}
+
+static void *writer_thread(void *arg)
+{
+	int w = 0;
+	int len;
+
+	(void)arg;
+
+	for (;;)
+	{
+		pthread_mutex_lock(&pipeLock);
+		while (!outBufs[w].len && !outDone)
+			pthread_cond_wait(&outCond, &pipeLock);
+		len = outBufs[w].len;
+		pthread_mutex_unlock(&pipeLock);
+
+		if (!len)
+			break;
+		if (write(outFile, outBufs[w].data, len) != len)
+			fatal("write");
+
+		pthread_mutex_lock(&pipeLock);
+		outBufs[w].len = 0;
+		pthread_cond_broadcast(&outCond);
+		pthread_mutex_unlock(&pipeLock);
+		w = (w + 1) % N_OUT_BUFS;
+	}
+	return NULL;
+}
+
+/* Writes one page. At the end of a block moves on to the next block. */
+static void write_page(const u8 *data, const u8 *spareData)
+{
+	u8 ff[256];
+	int n;
+
+	out_put(data, pageSize);
+	out_put(spareData, spareSize);
+
+	chunkInBlock++;
+	if (chunkInBlock == pagesPerBlock) {
+		chunkInBlock = 0;
+		blockInImage++;
+		memset(ff, 0xff, sizeof(ff));
+		for (n = remainderSize; n > 0; n -= sizeof(ff))
+			out_put(ff, n < (int)sizeof(ff) ? n : (int)sizeof(ff));
+	}
+}
+
+/* Packs the tags into the spare area, or after the data, and writes the chunk. */
+static void put_chunk(const u8 *data, struct yaffs_ext_tags *t)
 {
-#ifdef NOR_MKYAFFS2IMAGE
-	u8 remainder[remainderSize];
-#endif
-	struct yaffs_ext_tags t;
-#ifdef NOR_MKYAFFS2IMAGE
-	struct yaffs_packed_tags2_tags_only pt;
-#else
 	struct yaffs_packed_tags2 pt;
-#endif
-	char spareData[spareSize];
+	u8 spareData[spareSize ? spareSize : 1];
+	u8 page[pageSize];
 
-	if (write(outFile,data,chunkSize) != chunkSize)
-		fatal("write");
+	t->chunk_used = 1;
+
+	nPages++;
+
+	pack_tags(&pt, t);
+
+	memset(spareData, 0xff, sizeof(spareData));
+	if (inbandTags)
+	{
+		memcpy(page, data, chunkSize);
+		memcpy(page + chunkSize, &pt.t, sizeof(pt.t));
+		data = page;
+	}
+	else
+	{
+		memcpy(spareData + tagsOffset, &pt, packed_tags_size());
+	}
+
+	write_page(data, spareData);
+}
+
+/* Writes the summary for the block, in the last chunks of the block. */
+static void write_summary(void)
+{
+	u8 bytes[chunkSize];
+	u8 *sumBytes = (u8 *)summary;
+	struct yaffs_ext_tags t;
+	int n_bytes = sizeof(summary[0]) * chunksPerSummary;
+	int this_tx;
+	int i;
+
+	if (convert_endian)
+	{
+		for (i = 0; i < chunksPerSummary; i++)
+		{
+			summary[i].obj_id = SWAP32(summary[i].obj_id);
+			summary[i].chunk_id = SWAP32(summary[i].chunk_id);
+			summary[i].n_bytes = SWAP32(summary[i].n_bytes);
+		}
+	}
+
+	memset(&t, 0, sizeof(t));
+	t.obj_id = YAFFS_OBJECTID_SUMMARY;
+	t.chunk_id = 1;
+	t.seq_number = YAFFS_LOWEST_SEQUENCE_NUMBER + blockInImage;
+
+	while (n_bytes > 0)
+	{
+		this_tx = n_bytes;
+		if (this_tx > chunkSize)
+			this_tx = chunkSize;
+		memset(bytes, 0xff, sizeof(bytes));
+		memcpy(bytes, sumBytes, this_tx);
+		t.n_bytes = this_tx;
+		put_chunk(bytes, &t);
+
+		n_bytes -= this_tx;
+		sumBytes += this_tx;
+		t.chunk_id++;
+	}
+
+	memset(summary, 0, pagesPerBlock * sizeof(summary[0]));
+}
+
+/* Remembers what the checkpoint needs to know about the chunk. */
+static void add_to_checkpoint(struct yaffs_ext_tags *t)
+{
+	int chunk = blockInImage * pagesPerBlock + chunkInBlock;
+	cpObjItem *o;
+
+	if (t->chunk_id == 0)
+	{
+		if (nCpObjs == maxCpObjs)
+		{
+			maxCpObjs = maxCpObjs ? maxCpObjs * 2 : 1024;
+			cpObjs = realloc(cpObjs, maxCpObjs * sizeof(cpObjItem));
+			if (!cpObjs)
+				fatal("realloc");
+		}
+		o = &cpObjs[nCpObjs++];
+		memset(o, 0, sizeof(*o));
+		o->obj = t->obj_id;
+		o->parent = t->extra_parent_id;
+		o->type = t->extra_obj_type;
+		o->hdrChunk = chunk;
+		if (o->type == YAFFS_OBJECT_TYPE_FILE)
+			o->sizeOrEquiv = t->extra_length;
+		else if (o->type == YAFFS_OBJECT_TYPE_HARDLINK)
+			o->sizeOrEquiv = t->extra_equiv_id;
+		o->firstData = nDataChunks;
+	}
+	else
+	{
+		/* Data chunks follow the header of their file. */
+		o = &cpObjs[nCpObjs - 1];
+		assert(nCpObjs > 0 && o->obj == (int)t->obj_id);
+
+		if (nDataChunks == maxDataChunks)
+		{
+			maxDataChunks = maxDataChunks ? maxDataChunks * 2 : 16384;
+			dataChunks = realloc(dataChunks, maxDataChunks * sizeof(int));
+			if (!dataChunks)
+				fatal("realloc");
+		}
+		dataChunks[nDataChunks++] = chunk;
+		o->nDataChunks++;
+	}
+}
+
+static int write_chunk(u8 *data, struct yaffs_ext_tags *t)
+{
+	struct yaffs_packed_tags2_tags_only ptt;
+
+	t->serial_number = 1;	// **CHECK**
+	t->seq_number = YAFFS_LOWEST_SEQUENCE_NUMBER + blockInImage;
+
+	if (cpDevBlocks)
+		add_to_checkpoint(t);
+
+	if (summaries)
+	{
+		yaffs_pack_tags2_tags_only(&ptt, t);
+		summary[chunkInBlock].obj_id = ptt.obj_id;
+		summary[chunkInBlock].chunk_id = ptt.chunk_id;
+		summary[chunkInBlock].n_bytes = ptt.n_bytes;
+	}
+
+	put_chunk(data, t);
+
+	if (summaries && chunkInBlock == chunksPerSummary)
+		write_summary();
+
+	return 0;
+}
+
+static int write_data_chunk(u8 *data, u32 id, u32 chunk_id, u32 n_bytes)
+{
+	struct yaffs_ext_tags t;
 
 	memset(&t, 0, sizeof(t));
-	
 	t.chunk_id = chunk_id;
-//	t.serial_number = 0;
-	t.serial_number = 1;	// **CHECK**
 	t.n_bytes = n_bytes;
 	t.obj_id = id;
-	
-	t.seq_number = YAFFS_LOWEST_SEQUENCE_NUMBER;
 
-// added NCB **CHECK**
-	t.chunk_used = 1;
+	return write_chunk(data, &t);
+}
 
-	nPages++;
+static void pack_seg(job *j, seg *sg)
+{
+	int i;
 
-	memset(&pt, 0, sizeof(pt));
+	for (i = 0; i < sg->nChunks; i++)
+	{
+		j->chunk++;
+		write_data_chunk(seg_chunk(sg, i), j->tags.obj_id, j->chunk, sg->n_bytes[i]);
+	}
+}
 
-#ifdef NOR_MKYAFFS2IMAGE
-	yaffs_pack_tags2_tags_only(&pt,&t);
+static seg *get_seg(job *j)
+{
+	seg *sg;
 
-	if (convert_endian)
-		yaffs_packed_tags2_tags_only_to_big_endian(&pt);
-#else
-	if (convert_endian)
+	if (threaded)
 	{
-    	    little_to_big_endian(&t);
+		/* The job being packed may always read more, so that packing
+		 * can't get stuck behind jobs further down the queue. */
+		pthread_mutex_lock(&pipeLock);
+		while (readAhead + (long)segSize > READ_AHEAD && j != jobHead)
+			pthread_cond_wait(&spaceCond, &pipeLock);
+		readAhead += segSize;
+		pthread_mutex_unlock(&pipeLock);
 	}
-	yaffs_pack_tags2(&pt,&t,1);
-#endif
 
-	memset(spareData, 0xff, sizeof(spareData));
-	shuffle_oob(spareData, &pt);
+	sg = malloc(segSize);
+	if (!sg)
+		fatal("malloc");
+	sg->data = (u8 *)(sg + 1);
+	sg->next = NULL;
+	sg->nChunks = 0;
+	return sg;
+}
 
-	if (write(outFile,spareData,sizeof(spareData)) != sizeof(spareData))
-		fatal("write");
-#ifdef NOR_MKYAFFS2IMAGE
-	write_chunk_count++;
-	if (write_chunk_count == pagesPerBlock) {
-		write_chunk_count = 0;
-		memset(remainder, 0xff, sizeof(remainder));
-		if (write(outFile,remainder,sizeof(remainder)) != sizeof(remainder))
-			fatal("write");
+static void free_seg(seg *sg)
+{
+	free(sg);
+	if (threaded)
+	{
+		pthread_mutex_lock(&pipeLock);
+		readAhead -= segSize;
+		pthread_cond_broadcast(&spaceCond);
+		pthread_mutex_unlock(&pipeLock);
+	}
+}
+
+/* Passes file data on for packing */
+static void put_seg(job *j, seg *sg)
+{
+	if (!threaded)
+	{
+		pack_seg(j, sg);
+		free_seg(sg);
+		return;
+	}
+
+	pthread_mutex_lock(&pipeLock);
+	if (j->segTail)
+		j->segTail->next = sg;
+	else
+		j->segs = sg;
+	j->segTail = sg;
+	pthread_cond_broadcast(&segCond);
+	pthread_mutex_unlock(&pipeLock);
+}
+
+static void read_file(job *j)
+{
+	seg *sg = NULL;
+	int n_bytes;
+	int h;
+
+	h = open(j->path,O_RDONLY);
+	if(h >= 0)
+	{
+		for (;;)
+		{
+			if (!sg)
+				sg = get_seg(j);
+			memset(seg_chunk(sg, sg->nChunks),0xff,chunkSize);
+			n_bytes = read(h,seg_chunk(sg, sg->nChunks),chunkSize);
+			if (n_bytes <= 0)
+			{
+				if(n_bytes < 0) 
+				   warn("read");
+				break;
+			}
+			sg->n_bytes[sg->nChunks++] = n_bytes;
+			if (sg->nChunks == SEG_CHUNKS)
+			{
+				put_seg(j, sg);
+				sg = NULL;
+			}
+		}
+		close(h);
+	}
+	else
+	{
+		warn("open");
+	}
+
+	if (sg && sg->nChunks)
+		put_seg(j, sg);
+	else if (sg)
+		free_seg(sg);
+
+	pthread_mutex_lock(&pipeLock);
+	j->readDone = 1;
+	pthread_cond_broadcast(&segCond);
+	pthread_mutex_unlock(&pipeLock);
+}
+
+static void free_job(job *j)
+{
+	free(j->path);
+	free(j);
+}
+
+/* Queues an object for packing, or packs it now if not threaded. */
+static void emit_job(job *j)
+{
+	if (!threaded)
+	{
+		write_chunk(j->hdr, &j->tags);
+		if (j->path)
+			read_file(j);
+		free_job(j);
+		return;
+	}
+
+	pthread_mutex_lock(&pipeLock);
+	while (nJobs >= MAX_JOBS)
+		pthread_cond_wait(&spaceCond, &pipeLock);
+	if (jobTail)
+		jobTail->next = j;
+	else
+		jobHead = j;
+	jobTail = j;
+	if (!readCursor)
+		readCursor = j;
+	nJobs++;
+	pthread_cond_broadcast(&jobCond);
+	pthread_mutex_unlock(&pipeLock);
+}
+
+static void *reader_thread(void *arg)
+{
+	job *j;
+
+	(void)arg;
+
+	for (;;)
+	{
+		pthread_mutex_lock(&pipeLock);
+		for (;;)
+		{
+			while (readCursor && !readCursor->path)
+				readCursor = readCursor->next;
+			if (readCursor || walkDone)
+				break;
+			pthread_cond_wait(&jobCond, &pipeLock);
+		}
+		j = readCursor;
+		if (j)
+			readCursor = j->next;
+		pthread_mutex_unlock(&pipeLock);
+
+		if (!j)
+			break;
+		read_file(j);
+	}
+	return NULL;
+}
+
+/* Packs the queued objects in order, until the walk is done. */
+static void pack_jobs(void)
+{
+	job *j;
+	seg *sg;
+
+	for (;;)
+	{
+		pthread_mutex_lock(&pipeLock);
+		while (!jobHead && !walkDone)
+			pthread_cond_wait(&jobCond, &pipeLock);
+		j = jobHead;
+		pthread_mutex_unlock(&pipeLock);
+
+		if (!j)
+			break;
+
+		write_chunk(j->hdr, &j->tags);
+
+		while (j->path)
+		{
+			pthread_mutex_lock(&pipeLock);
+			while (!j->segs && !j->readDone)
+				pthread_cond_wait(&segCond, &pipeLock);
+			sg = j->segs;
+			if (sg)
+			{
+				j->segs = sg->next;
+				if (!j->segs)
+					j->segTail = NULL;
+			}
+			pthread_mutex_unlock(&pipeLock);
+
+			if (!sg)
+				break;
+			pack_seg(j, sg);
+			free_seg(sg);
+		}
+
+		pthread_mutex_lock(&pipeLock);
+		jobHead = j->next;
+		if (!jobHead)
+			jobTail = NULL;
+		if (readCursor == j)
+			readCursor = j->next;
+		nJobs--;
+		pthread_cond_broadcast(&spaceCond);
+		pthread_mutex_unlock(&pipeLock);
+
+		free_job(j);
 	}
-#endif
-	return 0;
 }
 
 // This one is easier, since the types are more standard. No funky shifts here.
@@ -305,14 +851,26 @@ static void object_header_little_to_big_endian(struct yaffs_obj_hdr* oh)
 }
 
 
-static int write_object_header(int id, enum yaffs_obj_type t, struct stat *s, int parent, const char *name, int equivalentObj, const char * alias)
+/*
+ * Builds the object header and queues it. path is the file to read for the
+ * data, or NULL.
+ */
+static int write_object_header(int id, enum yaffs_obj_type t, struct stat *s, int parent, const char *name, int equivalentObj, const char * alias, const char *path)
 {
-	u8 bytes[chunkSize];
+	job *j;
+	u8 *bytes;
+	struct yaffs_ext_tags *tags;
+	struct yaffs_obj_hdr *oh;
 	
+	j = calloc(1, sizeof(job) + chunkSize);
+	if (!j || (path && !(j->path = strdup(path))))
+		fatal("malloc");
+	j->hdr = (u8 *)(j + 1);
+	bytes = j->hdr;
+	tags = &j->tags;
+	oh = (struct yaffs_obj_hdr *)bytes;
 	
-	struct yaffs_obj_hdr *oh = (struct yaffs_obj_hdr *)bytes;
-	
-	memset(bytes,0xff,sizeof(bytes));
+	memset(bytes,0xff,chunkSize);
 	
 	oh->type = t;
 
@@ -320,6 +878,7 @@ static int write_object_header(int id, enum yaffs_obj_type t, struct stat *s, in
 	
 	if (strlen(name)+1 > sizeof(oh->name))
 	{
+		free_job(j);
 		errno = ENAMETOOLONG;
 		return warn("object name");
 	}
@@ -353,6 +912,7 @@ static int write_object_header(int id, enum yaffs_obj_type t, struct stat *s, in
 	{
 		if (strlen(alias)+1 > sizeof(oh->alias))
 		{
+			free_job(j);
 			errno = ENAMETOOLONG;
 			return warn("object alias");
 		}
@@ -364,34 +924,282 @@ static int write_object_header(int id, enum yaffs_obj_type t, struct stat *s, in
 	{
     		object_header_little_to_big_endian(oh);
 	}
-	
-	return write_chunk(bytes,id,0,0xffff);
+
+	/* Put the extra header info in the tags, as yaffs does, so that
+	 * scanning need not read the header. */
+	tags->obj_id = id;
+	tags->n_bytes = 0xffff;
+	tags->extra_available = 1;
+	tags->extra_parent_id = parent;
+	tags->extra_obj_type = t;
+	if (t == YAFFS_OBJECT_TYPE_FILE)
+		tags->extra_length = s->st_size;
+	else if (t == YAFFS_OBJECT_TYPE_HARDLINK)
+		tags->extra_equiv_id = equivalentObj;
+
+	emit_job(j);
+	return 0;
 	
 }
 
+/* Pads out the block being written with erased pages. */
 static void pad_image(void)
 {
-	u8 data[chunkSize + spareSize];
-#ifdef NOR_MKYAFFS2IMAGE
-	u8 remainder[remainderSize];
-#endif
-	int padPages = (nPages % pagesPerBlock);
+	u8 data[pageSize];
+	u8 spareData[spareSize ? spareSize : 1];
 
-	if (padPages)
+	memset(data, 0xff, sizeof(data));
+	memset(spareData, 0xff, sizeof(spareData));
+	while (chunkInBlock)
+		write_page(data, spareData);
+}
+
+static void checkpt_flush(void)
+{
+	struct yaffs_ext_tags t;
+	int internalBlock;
+
+	internalBlock = blockInImage + cpStartBlock + (cpStartBlock ? 0 : 1);
+
+	memset(&t, 0, sizeof(t));
+	t.obj_id = internalBlock + 1;	/* Hint to next place to look */
+	t.chunk_id = cp.pageSeq + 1;
+	t.seq_number = YAFFS_SEQUENCE_CHECKPOINT_DATA;
+	t.n_bytes = chunkSize;
+
+	put_chunk(cp.buffer, &t);
+
+	cp.byteOffs = 0;
+	cp.pageSeq++;
+	memset(cp.buffer, 0, chunkSize);
+}
+
+/* Adds to the checkpoint stream, like yaffs2_checkpt_wr() */
+static void checkpt_wr(const void *data, int n_bytes)
+{
+	const u8 *dataBytes = (const u8 *)data;
+
+	while (n_bytes > 0)
 	{
-		memset(data, 0xff, sizeof(data));
-		for (padPages = pagesPerBlock-padPages; padPages; padPages--)
+		cp.buffer[cp.byteOffs] = *dataBytes;
+		cp.sum += *dataBytes;
+		cp.xor ^= *dataBytes;
+		cp.byteOffs++;
+		cp.byteCount++;
+		dataBytes++;
+		n_bytes--;
+
+		if (cp.byteOffs >= chunkSize)
+			checkpt_flush();
+	}
+}
+
+static void checkpt_wr_validity_marker(int head)
+{
+	struct yaffs_checkpt_validity v;
+
+	memset(&v, 0, sizeof(v));
+	v.struct_type = sizeof(v);
+	v.magic = YAFFS_MAGIC;
+	v.version = YAFFS_CHECKPOINT_VERSION;
+	v.head = head;
+	checkpt_wr(&v, sizeof(v));
+}
+
+static void checkpt_wr_obj(int obj, int parent, enum yaffs_obj_type type,
+			   int hdrChunk, int fake, int nChunks,
+			   u32 sizeOrEquiv)
+{
+	struct yaffs_checkpt_obj o;
+
+	memset(&o, 0, sizeof(o));
+	o.struct_type = sizeof(o);
+	o.obj_id = obj;
+	o.parent_id = parent;
+	o.hdr_chunk = hdrChunk;
+	o.variant_type = type;
+	o.fake = fake;
+	o.rename_allowed = !fake;
+	o.unlink_allowed = !fake;
+	o.n_data_chunks = nChunks;
+	o.size_or_equiv_obj = sizeOrEquiv;
+	checkpt_wr(&o, sizeof(o));
+}
+
+/*
+ * Writes the checkpoint after the data, as yaffs2_wr_checkpt_data() would
+ * have written it had the files been written by yaffs and then unmounted.
+ */
+static void write_checkpoint(void)
+{
+	struct yaffs_checkpt_dev d;
+	struct yaffs_checkpt_obj endObj;
+	struct yaffs_block_info *bi;
+	u8 *chunkBits;
+	u32 tn[16];
+	u32 base;
+	u32 endMarker = ~0;
+	u32 sum;
+	int internalStart = cpStartBlock ? cpStartBlock : 1;
+	int chunkBitStride = (pagesPerBlock + 7) / 8;
+	int dataBlocks = blockInImage + (chunkInBlock ? 1 : 0);
+	int chunkOffset = internalStart * pagesPerBlock;
+	int tnodeWidth;
+	int tnodeSize;
+	int grpBits;
+	int bits;
+	int i, j, k;
+	cpObjItem *o;
+
+	/* Work out the tnode geometry as yaffs_guts_initialise() does */
+	for (bits = 0; (1ULL << bits) < (unsigned long long)pagesPerBlock *
+					(internalStart + cpDevBlocks); bits++)
+		;
+	if (bits & 1)
+		bits++;
+	tnodeWidth = (bits < 16) ? 16 : bits;
+	grpBits = (bits <= tnodeWidth) ? 0 : bits - tnodeWidth;
+	tnodeSize = (tnodeWidth * YAFFS_NTNODES_LEVEL0) / 8;
+	if (tnodeSize < YAFFS_NTNODES_INTERNAL * cpPtrSize)
+		tnodeSize = YAFFS_NTNODES_INTERNAL * cpPtrSize;
+	assert(tnodeSize <= (int)sizeof(tn));
+
+	/* Block state as yaffs2_scan_backwards() would find it */
+	bi = calloc(cpDevBlocks, sizeof(*bi));
+	chunkBits = calloc(cpDevBlocks, chunkBitStride);
+	if (!bi || !chunkBits)
+		fatal("calloc");
+
+	memset(&d, 0, sizeof(d));
+	d.struct_type = sizeof(d);
+	d.alloc_block = -1;
+	d.alloc_page = -1;
+	d.seq_number = YAFFS_LOWEST_SEQUENCE_NUMBER + (dataBlocks ? dataBlocks - 1 : 0);
+
+	for (i = 0; i < cpDevBlocks; i++)
+	{
+		int used = 0;
+
+		if (i < blockInImage)
+			used = pagesPerBlock;
+		else if (i == blockInImage)
+			used = chunkInBlock;
+
+		if (used)
 		{
-			if (write(outFile, data, sizeof(data)) != sizeof(data))
-				fatal("write");
+			bi[i].seq_number = YAFFS_LOWEST_SEQUENCE_NUMBER + i;
+			bi[i].pages_in_use = used;
+			for (j = 0; j < used; j++)
+				chunkBits[i * chunkBitStride + j / 8] |= 1 << (j & 7);
+		}
+
+		if (used == pagesPerBlock)
+		{
+			bi[i].block_state = YAFFS_BLOCK_STATE_FULL;
+			bi[i].has_summary = summaries;
+		}
+		else if (used)
+		{
+			bi[i].block_state = YAFFS_BLOCK_STATE_ALLOCATING;
+			d.alloc_block = internalStart + i;
+			d.alloc_page = used;
+			d.n_free_chunks += pagesPerBlock - used;
+		}
+		else
+		{
+			bi[i].block_state = YAFFS_BLOCK_STATE_EMPTY;
+			d.n_erased_blocks++;
+			d.n_free_chunks += pagesPerBlock;
 		}
 	}
 
-#ifdef NOR_MKYAFFS2IMAGE
-	memset(remainder, 0xff, sizeof(remainder));
-	if (write(outFile,remainder,sizeof(remainder)) != sizeof(remainder))
-		fatal("write");
-#endif
+	pad_image();
+
+	memset(&cp, 0, sizeof(cp));
+	cp.buffer = calloc(1, chunkSize);
+	if (!cp.buffer)
+		fatal("calloc");
+	checkpt_wr_validity_marker(1);
+	checkpt_wr(&d, sizeof(d));
+	checkpt_wr(bi, cpDevBlocks * sizeof(*bi));
+	checkpt_wr(chunkBits, cpDevBlocks * chunkBitStride);
+
+	/* The fake directories made by yaffs_create_initial_dir() */
+	checkpt_wr_obj(YAFFS_OBJECTID_ROOT, 0, YAFFS_OBJECT_TYPE_DIRECTORY, 0, 1, 0, 0);
+	checkpt_wr_obj(YAFFS_OBJECTID_LOSTNFOUND, YAFFS_OBJECTID_ROOT, YAFFS_OBJECT_TYPE_DIRECTORY, 0, 1, 0, 0);
+	checkpt_wr_obj(YAFFS_OBJECTID_UNLINKED, 0, YAFFS_OBJECT_TYPE_DIRECTORY, 0, 1, 0, 0);
+	checkpt_wr_obj(YAFFS_OBJECTID_DELETED, 0, YAFFS_OBJECT_TYPE_DIRECTORY, 0, 1, 0, 0);
+
+	for (i = 0; i < nCpObjs; i++)
+	{
+		o = &cpObjs[i];
+		checkpt_wr_obj(o->obj, o->parent, o->type,
+				o->hdrChunk + chunkOffset, 0,
+				o->nDataChunks, o->sizeOrEquiv);
+
+		if (o->type != YAFFS_OBJECT_TYPE_FILE)
+			continue;
+
+		/* Level 0 tnodes, as yaffs2_wr_checkpt_tnodes(). Chunk ids
+		 * start at 1 so the first tnode has an empty slot 0. */
+		for (j = 0; j <= (o->nDataChunks >> YAFFS_TNODES_LEVEL0_BITS); j++)
+		{
+			memset(tn, 0, sizeof(tn));
+			for (k = 0; k < YAFFS_NTNODES_LEVEL0; k++)
+			{
+				int chunk_id = (j << YAFFS_TNODES_LEVEL0_BITS) + k;
+				u32 val;
+				u32 bitInMap;
+				u32 bitInWord;
+				u32 wordInMap;
+
+				if (chunk_id < 1 || chunk_id > o->nDataChunks)
+					continue;
+
+				/* As yaffs_load_tnode_0() */
+				val = dataChunks[o->firstData + chunk_id - 1] + chunkOffset;
+				val >>= grpBits;
+				bitInMap = k * tnodeWidth;
+				wordInMap = bitInMap / 32;
+				bitInWord = bitInMap & 31;
+				tn[wordInMap] |= val << bitInWord;
+				if (tnodeWidth > (int)(32 - bitInWord))
+					tn[wordInMap + 1] |= val >> (32 - bitInWord);
+			}
+			base = j << YAFFS_TNODES_LEVEL0_BITS;
+			checkpt_wr(&base, sizeof(base));
+			checkpt_wr(tn, tnodeSize);
+		}
+		checkpt_wr(&endMarker, sizeof(endMarker));
+	}
+
+	/* End of the object list */
+	memset(&endObj, 0xff, sizeof(endObj));
+	endObj.struct_type = sizeof(endObj);
+	checkpt_wr(&endObj, sizeof(endObj));
+
+	checkpt_wr_validity_marker(0);
+
+	sum = (cp.sum << 8) | (cp.xor & 0xff);
+	checkpt_wr(&sum, sizeof(sum));
+	if (cp.byteOffs)
+		checkpt_flush();
+
+	pad_image();
+
+	printf("Checkpoint of %d bytes in %d blocks\n", cp.byteCount,
+		blockInImage - dataBlocks);
+
+	if (blockInImage > cpDevBlocks)
+	{
+		fprintf(stderr, "Image and checkpoint need %d blocks, device only has %d\n",
+			blockInImage, cpDevBlocks);
+		error |= 2;
+		savedErrno = ENOSPC;
+	}
+
+	free(bi);
+	free(chunkBits);
 }
 
 static int process_directory(int parent, const char *path)
@@ -452,7 +1260,7 @@ static int process_directory(int parent, const char *path)
 					{
 					 	/* we need to make a hard link */
 					 	printf("hard link to object %d\n",equivalentObj);
-						write_object_header(newObj, YAFFS_OBJECT_TYPE_HARDLINK, &stats, parent, entry->d_name, equivalentObj, NULL);
+						write_object_header(newObj, YAFFS_OBJECT_TYPE_HARDLINK, &stats, parent, entry->d_name, equivalentObj, NULL, NULL);
 					}
 					else 
 					{
@@ -473,67 +1281,39 @@ static int process_directory(int parent, const char *path)
 							else
 							{
 								printf("symlink to \"%s\"\n",symname);
-								write_object_header(newObj, YAFFS_OBJECT_TYPE_SYMLINK, &stats, parent, entry->d_name, -1, symname);
+								write_object_header(newObj, YAFFS_OBJECT_TYPE_SYMLINK, &stats, parent, entry->d_name, -1, symname, NULL);
 							}
 						}
 						else if(S_ISREG(stats.st_mode))
 						{
-							printf("file, ");
-							if(write_object_header(newObj, YAFFS_OBJECT_TYPE_FILE, &stats, parent, entry->d_name, -1, NULL) == 0)
-							{
-								int h;
-								u8 bytes[chunkSize];
-								int n_bytes;
-								int chunk = 0;
-								
-								h = open(full_name,O_RDONLY);
-								if(h >= 0)
-								{
-									memset(bytes,0xff,sizeof(bytes));
-									while((n_bytes = read(h,bytes,sizeof(bytes))) > 0)
-									{
-										chunk++;
-										write_chunk(bytes,newObj,chunk,n_bytes);
-										memset(bytes,0xff,sizeof(bytes));
-									}
-									if(n_bytes < 0) 
-									   warn("read");
-									   
-									printf("%d data chunks written\n",chunk);
-									close(h);
-								}
-								else
-								{
-									warn("open");
-								}
-								
-							}							
-														
+							printf("file, %d data chunks\n",
+							       (int)((stats.st_size + chunkSize - 1) / chunkSize));
+							write_object_header(newObj, YAFFS_OBJECT_TYPE_FILE, &stats, parent, entry->d_name, -1, NULL, full_name);
 						}
 						else if(S_ISSOCK(stats.st_mode))
 						{
 							printf("socket\n");
-							write_object_header(newObj, YAFFS_OBJECT_TYPE_SPECIAL, &stats, parent, entry->d_name, -1, NULL);
+							write_object_header(newObj, YAFFS_OBJECT_TYPE_SPECIAL, &stats, parent, entry->d_name, -1, NULL, NULL);
 						}
 						else if(S_ISFIFO(stats.st_mode))
 						{
 							printf("fifo\n");
-							write_object_header(newObj, YAFFS_OBJECT_TYPE_SPECIAL, &stats, parent, entry->d_name, -1, NULL);
+							write_object_header(newObj, YAFFS_OBJECT_TYPE_SPECIAL, &stats, parent, entry->d_name, -1, NULL, NULL);
 						}
 						else if(S_ISCHR(stats.st_mode))
 						{
 							printf("character device\n");
-							write_object_header(newObj, YAFFS_OBJECT_TYPE_SPECIAL, &stats, parent, entry->d_name, -1, NULL);
+							write_object_header(newObj, YAFFS_OBJECT_TYPE_SPECIAL, &stats, parent, entry->d_name, -1, NULL, NULL);
 						}
 						else if(S_ISBLK(stats.st_mode))
 						{
 							printf("block device\n");
-							write_object_header(newObj, YAFFS_OBJECT_TYPE_SPECIAL, &stats, parent, entry->d_name, -1, NULL);
+							write_object_header(newObj, YAFFS_OBJECT_TYPE_SPECIAL, &stats, parent, entry->d_name, -1, NULL, NULL);
 						}
 						else if(S_ISDIR(stats.st_mode))
 						{
 							printf("directory\n");
-							if (write_object_header(newObj, YAFFS_OBJECT_TYPE_DIRECTORY, &stats, parent, entry->d_name, -1, NULL) == 0)
+							if (write_object_header(newObj, YAFFS_OBJECT_TYPE_DIRECTORY, &stats, parent, entry->d_name, -1, NULL, NULL) == 0)
 								process_directory(newObj,full_name);
 						}
 					}
@@ -554,25 +1334,176 @@ static int process_directory(int parent, const char *path)
 }
 
 
+static const char *walkRoot;
+
+static void *walker_thread(void *arg)
+{
+	(void)arg;
+
+	process_directory(YAFFS_OBJECTID_ROOT, walkRoot);
+
+	pthread_mutex_lock(&pipeLock);
+	walkDone = 1;
+	pthread_cond_broadcast(&jobCond);
+	pthread_mutex_unlock(&pipeLock);
+	return NULL;
+}
+
+static void usage(const char *name)
+{
+	printf("usage: %s [options] dir image_file [convert]\n", name);
+	printf("           -p bytes   page size, excluding spare (default %d)\n", pageSize);
+	printf("           -o bytes   spare (oob) size (default %d, 0 with -i)\n", spareSize);
+	printf("           -b pages   pages per block (default %d)\n", pagesPerBlock);
+	printf("           -k bytes   block size, for devices where the pages don't fill\n");
+	printf("                      the block (NOR); sets the pages per block\n");
+	printf("           -t offset  where the tags go in the spare (default 0)\n");
+	printf("           -i         inband tags, stored at the end of each page\n");
+	printf("           -x         no ECC on the tags (param.no_tags_ecc)%s\n",
+	       tagsEcc ? "" : " (always)");
+	printf("           -B         big-endian target, the same as 'convert'\n");
+	printf("           -n         don't write block summaries\n");
+	printf("           -j threads file reading threads, 0 to do everything in one thread\n");
+	printf("                      (default: one per cpu, 0 on a single cpu)\n");
+	printf("           -c blocks  write a checkpoint for a device of this many blocks\n");
+	printf("           -s block   the device's first block (param.start_block)\n");
+	printf("           -w bytes   pointer size on the target, 4 or 8\n");
+	printf("           dir        the directory tree to be converted\n");
+	printf("           image_file the output file to hold the image\n");
+	printf("           'convert'  produce a big-endian image from a little-endian machine\n");
+	printf("Checkpoints are only written for targets of the build machine's endianness.\n");
+	exit(1);
+}
+
 int main(int argc, char *argv[])
 {
 	struct stat stats;
+	int sumChunks;
+	int spareSet = 0;
+	int opt;
+	int i;
+	pthread_t writer;
+	pthread_t walker;
+	pthread_t *readers = NULL;
 	
 	printf("%s: image building tool for YAFFS2 built "__DATE__"\n", argv[0]);
 	
-	if(argc < 3)
+	/* On one cpu the hand offs cost more than the read ahead saves */
+	nReaders = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nReaders < 2)
+		nReaders = 0;
+
+	while ((opt = getopt(argc, argv, "p:o:b:k:t:ixBnj:c:s:w:")) != -1)
 	{
-		printf("usage: %s dir image_file [convert]\n", argv[0]);
-		printf("           dir        the directory tree to be converted\n");
-		printf("           image_file the output file to hold the image\n");
-		printf("           'convert'  produce a big-endian image from a little-endian machine\n");
-		exit(1);
+		switch (opt)
+		{
+		case 'p':
+			pageSize = atoi(optarg);
+			break;
+		case 'o':
+			spareSize = atoi(optarg);
+			spareSet = 1;
+			break;
+		case 'b':
+			pagesPerBlock = atoi(optarg);
+			blockSize = 0;
+			break;
+		case 'k':
+			blockSize = atoi(optarg);
+			break;
+		case 't':
+			tagsOffset = atoi(optarg);
+			break;
+		case 'i':
+			inbandTags = 1;
+			break;
+		case 'x':
+			tagsEcc = 0;
+			break;
+		case 'B':
+			convert_endian = 1;
+			break;
+		case 'n':
+			summaries = 0;
+			break;
+		case 'j':
+			nReaders = atoi(optarg);
+			break;
+		case 'c':
+			cpDevBlocks = atoi(optarg);
+			break;
+		case 's':
+			cpStartBlock = atoi(optarg);
+			break;
+		case 'w':
+			cpPtrSize = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
 	}
+	argc -= optind - 1;
+	argv += optind - 1;
+
+	if(argc < 3)
+		usage(argv[0]);
 
 	if ((argc == 4) && (!strncmp(argv[3], "convert", strlen("convert"))))
 	{
 		convert_endian = 1;
 	}
+
+	if (nReaders < 0 || cpDevBlocks < 0 || cpStartBlock < 0 ||
+	    (cpPtrSize != 4 && cpPtrSize != 8))
+		usage(argv[0]);
+
+	/* Work out the geometry */
+	if (inbandTags && !spareSet)
+		spareSize = 0;
+	if (pageSize <= 0 || spareSize < 0 || blockSize < 0 || tagsOffset < 0)
+		usage(argv[0]);
+	if (blockSize)
+		pagesPerBlock = blockSize / (pageSize + spareSize);
+	remainderSize = blockSize ? blockSize % (pageSize + spareSize) : 0;
+	chunkSize = pageSize;
+	if (inbandTags)
+		chunkSize -= sizeof(struct yaffs_packed_tags2_tags_only);
+
+	if (chunkSize < (int)sizeof(struct yaffs_obj_hdr) || pagesPerBlock < 2)
+	{
+		printf("Pages of %d bytes, %d per block, are too small\n",
+		       pageSize, pagesPerBlock);
+		exit(1);
+	}
+	if (!inbandTags && tagsOffset + packed_tags_size() > spareSize)
+	{
+		printf("%d bytes of tags don't fit at offset %d in a %d byte spare\n",
+		       packed_tags_size(), tagsOffset, spareSize);
+		exit(1);
+	}
+
+	summary = calloc(pagesPerBlock, sizeof(summary[0]));
+	if (!summary)
+		fatal("calloc");
+
+	printf("%d byte pages (%d data), %d byte spare, %d pages per block\n",
+	       pageSize, chunkSize, spareSize, pagesPerBlock);
+	printf("%s tags%s, %s endian, %s\n",
+	       inbandTags ? "inband" : "oob",
+	       (tagsEcc && !inbandTags) ? " with ECC" : "",
+	       convert_endian ? "big" : "native",
+	       summaries ? "with summaries" : "no summaries");
+
+	if (cpDevBlocks && convert_endian)
+	{
+		printf("A checkpoint can't be written for a target of the other endianness\n");
+		exit(1);
+	}
+
+	/* As yaffs_summary_init() */
+	sumChunks = (pagesPerBlock * sizeof(struct yaffs_summary_tags) +
+			chunkSize - 1) / chunkSize;
+	chunksPerSummary = pagesPerBlock - sumChunks;
     
 	if(stat(argv[1],&stats) < 0)
 	{
@@ -595,10 +1526,57 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 	
+	threaded = (nReaders > 0);
+	for (i = 0; i < (threaded ? N_OUT_BUFS : 1); i++)
+	{
+		outBufs[i].data = malloc(OUT_BUF_SIZE);
+		if (!outBufs[i].data)
+			fatal("malloc");
+	}
+
 	printf("Processing directory %s into image file %s\n",argv[1],argv[2]);
-	process_directory(YAFFS_OBJECTID_ROOT,argv[1]);
+	if (threaded)
+	{
+		/*
+		 * The walker queues objects in id order, the readers fetch file
+		 * data ahead and this thread packs everything in order, so the
+		 * image is the same whatever the number of threads.
+		 */
+		readers = malloc(nReaders * sizeof(pthread_t));
+		if (!readers)
+			fatal("malloc");
+		walkRoot = argv[1];
+		if (pthread_create(&writer, NULL, writer_thread, NULL) ||
+		    pthread_create(&walker, NULL, walker_thread, NULL))
+			fatal("pthread_create");
+		for (i = 0; i < nReaders; i++)
+			if (pthread_create(&readers[i], NULL, reader_thread, NULL))
+				fatal("pthread_create");
+
+		pack_jobs();
+
+		pthread_join(walker, NULL);
+		for (i = 0; i < nReaders; i++)
+			pthread_join(readers[i], NULL);
+		free(readers);
+	}
+	else
+		process_directory(YAFFS_OBJECTID_ROOT,argv[1]);
 	
-	pad_image();
+	if (cpDevBlocks)
+		write_checkpoint();
+	else
+		pad_image();
+
+	out_submit();
+	if (threaded)
+	{
+		pthread_mutex_lock(&pipeLock);
+		outDone = 1;
+		pthread_cond_broadcast(&outCond);
+		pthread_mutex_unlock(&pipeLock);
+		pthread_join(writer, NULL);
+	}
 
 	close(outFile);
 	
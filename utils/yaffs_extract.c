@@ -0,0 +1,310 @@
+/*
+ * YAFFS: Yet Another Flash File System. A NAND-flash specific file system.
+ *
+ * Copyright (C) 2002-2011 Aleph One Ltd.
+ *   for Toby Churchill Ltd and Brightstar Engineering
+ *
+ * Created by Charles Manning <charles@aleph1.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/*
+ * yaffs_extract.c
+ *
+ * Lists and extracts files from a raw yaffs2 image or NAND dump without
+ * mounting it, using yaffs_image.c. With -I the index is kept in a file
+ * so that later runs on the same dump start straight away.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <utime.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "yaffs_image.h"
+
+unsigned yaffs_trace_mask = 0;
+
+static struct yimg *img;
+static int error;
+
+/* Extracted objects, so hard links can be linked rather than copied */
+static char **extracted;
+
+static void usage(const char *name)
+{
+	printf("usage: %s [options] image command [args]\n"
+	       "commands:\n"
+	       "   ls [path]            list a directory\n"
+	       "   tree [path]          list recursively\n"
+	       "   stat path            show an object\n"
+	       "   cat path             copy a file to stdout\n"
+	       "   extract [path] dir   copy out a directory tree, or a file\n"
+	       "   index                build the index and show scan statistics\n"
+	       "options:\n"
+	       "   -I file    keep the index in this file, rebuilt if out of date\n"
+	       "   -j threads scanning threads (default: one per cpu)\n",
+	       name);
+	yimg_geometry_usage();
+	exit(1);
+}
+
+static const char *type_name(u32 type)
+{
+	switch (type) {
+	case YAFFS_OBJECT_TYPE_FILE:
+		return "file";
+	case YAFFS_OBJECT_TYPE_SYMLINK:
+		return "symlink";
+	case YAFFS_OBJECT_TYPE_DIRECTORY:
+		return "dir";
+	case YAFFS_OBJECT_TYPE_HARDLINK:
+		return "hardlink";
+	case YAFFS_OBJECT_TYPE_SPECIAL:
+		return "special";
+	default:
+		return "unknown";
+	}
+}
+
+static u32 lookup(const char *path)
+{
+	u32 obj = yimg_lookup(img, path);
+
+	if (obj == YIMG_NONE) {
+		fprintf(stderr, "%s: not found\n", path);
+		exit(1);
+	}
+	return obj;
+}
+
+static void list_one(u32 obj, const char *path)
+{
+	struct yimg_stat st;
+	char alias[YAFFS_MAX_ALIAS_LENGTH + 1];
+	struct yimg_obj *o = &img->objs[obj];
+
+	yimg_stat(img, obj, &st);
+	printf("%06o %5u %5u %10u %6u %-8s %s", st.mode, st.uid, st.gid,
+	       st.size, o->obj_id, type_name(o->type), path);
+	if (o->type == YAFFS_OBJECT_TYPE_SYMLINK &&
+	    yimg_readlink(img, obj, alias, sizeof(alias)) == 0)
+		printf(" -> %s", alias);
+	else if (o->type == YAFFS_OBJECT_TYPE_HARDLINK)
+		printf(" => obj %u", o->equiv_id);
+	printf("\n");
+}
+
+static void list_dir(u32 dir, const char *path, int recurse)
+{
+	char name[YAFFS_MAX_NAME_LENGTH + 1];
+	char child_path[strlen(path) + sizeof(name) + 2];
+	u32 obj;
+
+	for (obj = img->objs[dir].first_child; obj != YIMG_NONE;
+	     obj = img->objs[obj].next_sibling) {
+		yimg_name(img, obj, name, sizeof(name));
+		snprintf(child_path, sizeof(child_path), "%s/%s", path, name);
+		list_one(obj, child_path);
+		if (recurse && img->objs[obj].type == YAFFS_OBJECT_TYPE_DIRECTORY)
+			list_dir(obj, child_path, 1);
+	}
+}
+
+static int copy_file(u32 obj, int h)
+{
+	char buf[64 * 1024];
+	u32 offset = 0;
+	int n;
+
+	while ((n = yimg_read(img, obj, offset, buf, sizeof(buf))) > 0) {
+		if (write(h, buf, n) != n)
+			return -1;
+		offset += n;
+	}
+	return n;
+}
+
+static void warn(const char *what)
+{
+	perror(what);
+	error = 1;
+}
+
+static void set_attribs(const char *path, const struct yimg_stat *st)
+{
+	struct utimbuf times;
+
+	if (chmod(path, st->mode & 07777) < 0)
+		warn(path);
+	times.actime = st->atime;
+	times.modtime = st->mtime;
+	if (utime(path, &times) < 0)
+		warn(path);
+}
+
+static void extract(u32 obj, const char *path)
+{
+	char name[YAFFS_MAX_NAME_LENGTH + 1];
+	char alias[YAFFS_MAX_ALIAS_LENGTH + 1];
+	char child_path[strlen(path) + sizeof(name) + 2];
+	struct yimg_obj *o = &img->objs[obj];
+	struct yimg_stat st;
+	u32 equiv = yimg_equiv(img, obj);
+	u32 child;
+	int h;
+
+	yimg_stat(img, obj, &st);
+
+	if (extracted[equiv]) {
+		/* Another link to something already extracted */
+		if (link(extracted[equiv], path) < 0)
+			warn(path);
+		return;
+	}
+
+	switch (img->objs[equiv].type) {
+	case YAFFS_OBJECT_TYPE_DIRECTORY:
+		if (mkdir(path, 0700) < 0 && errno != EEXIST) {
+			warn(path);
+			return;
+		}
+		for (child = o->first_child; child != YIMG_NONE;
+		     child = img->objs[child].next_sibling) {
+			yimg_name(img, child, name, sizeof(name));
+			snprintf(child_path, sizeof(child_path), "%s/%s",
+				 path, name);
+			extract(child, child_path);
+		}
+		set_attribs(path, &st);
+		return;
+
+	case YAFFS_OBJECT_TYPE_FILE:
+		h = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0600);
+		if (h < 0) {
+			warn(path);
+			return;
+		}
+		if (copy_file(equiv, h) < 0)
+			warn(path);
+		close(h);
+		set_attribs(path, &st);
+		break;
+
+	case YAFFS_OBJECT_TYPE_SYMLINK:
+		if (yimg_readlink(img, equiv, alias, sizeof(alias)) < 0 ||
+		    symlink(alias, path) < 0)
+			warn(path);
+		return;
+
+	case YAFFS_OBJECT_TYPE_SPECIAL:
+		if (mknod(path, st.mode, st.rdev) < 0) {
+			warn(path);
+			return;
+		}
+		set_attribs(path, &st);
+		break;
+
+	default:
+		return;
+	}
+
+	extracted[equiv] = strdup(path);
+}
+
+static void show_stats(void)
+{
+	struct yimg_scan_stats *s = &img->stats;
+
+	printf("%d blocks of %d chunks, %d data bytes per chunk\n",
+	       img->n_blocks, img->g.pages_per_block, img->chunk_size);
+	printf("blocks: %d from summaries, %d from tags, %d checkpoint, %d empty\n",
+	       s->blocks_summary, s->blocks_tags, s->blocks_checkpt,
+	       s->blocks_empty);
+	printf("tags ECC: %d fixed, %d unfixable\n",
+	       s->chunks_ecc_fixed, s->chunks_ecc_bad);
+	printf("%u objects, %u file chunks\n", img->n_objs, img->n_chunk_map);
+	printf("scan %.1f ms, index %.1f ms\n", s->scan_ms, s->index_ms);
+}
+
+int main(int argc, char *argv[])
+{
+	struct yimg_geometry g;
+	const char *index_name = NULL;
+	const char *name = argv[0];
+	const char *cmd;
+	int n_threads = 0;
+	u32 obj;
+	int opt;
+
+	yimg_default_geometry(&g);
+
+	while ((opt = getopt(argc, argv, YIMG_GEOMETRY_OPTS "I:j:")) != -1) {
+		if (yimg_geometry_opt(&g, opt, optarg))
+			continue;
+		switch (opt) {
+		case 'I':
+			index_name = optarg;
+			break;
+		case 'j':
+			n_threads = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind < 2)
+		usage(argv[0]);
+
+	img = yimg_open(argv[optind], &g);
+	if (!img)
+		exit(1);
+	if (yimg_index(img, index_name, n_threads) < 0) {
+		perror("index");
+		exit(1);
+	}
+
+	cmd = argv[optind + 1];
+	argv += optind + 2;
+	argc -= optind + 2;
+
+	if (!strcmp(cmd, "ls") || !strcmp(cmd, "tree")) {
+		const char *path = argc > 0 ? argv[0] : "/";
+
+		obj = lookup(path);
+		if (img->objs[yimg_equiv(img, obj)].type ==
+		    YAFFS_OBJECT_TYPE_DIRECTORY)
+			list_dir(yimg_equiv(img, obj),
+				 strcmp(path, "/") ? path : "", cmd[0] == 't');
+		else
+			list_one(obj, path);
+	} else if (!strcmp(cmd, "stat") && argc == 1) {
+		list_one(lookup(argv[0]), argv[0]);
+	} else if (!strcmp(cmd, "cat") && argc == 1) {
+		if (copy_file(lookup(argv[0]), 1) < 0) {
+			perror(argv[0]);
+			error = 1;
+		}
+	} else if (!strcmp(cmd, "extract") && (argc == 1 || argc == 2)) {
+		extracted = calloc(img->n_objs, sizeof(char *));
+		if (!extracted) {
+			perror("calloc");
+			exit(1);
+		}
+		extract(lookup(argc == 2 ? argv[0] : "/"), argv[argc - 1]);
+	} else if (!strcmp(cmd, "index")) {
+		show_stats();
+	} else {
+		usage(name);
+	}
+
+	yimg_close(img);
+	return error;
+}
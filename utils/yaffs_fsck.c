@@ -0,0 +1,1199 @@
+/*
+ * YAFFS: Yet Another Flash File System. A NAND-flash specific file system.
+ *
+ * Copyright (C) 2002-2011 Aleph One Ltd.
+ *   for Toby Churchill Ltd and Brightstar Engineering
+ *
+ * Created by Charles Manning <charles@aleph1.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/*
+ * yaffs_fsck.c
+ *
+ * Checks a raw yaffs2 image or NAND dump without mounting it. Blocks and
+ * objects are checked in parallel on top of yaffs_image.c, and the
+ * checkpoint, if there is one, is compared with what a scan finds.
+ * Also reports how much of each block is still live and what garbage
+ * collecting the dead chunks would cost.
+ *
+ * Exits with 0 if there were no errors, 1 if there were and 2 if the
+ * image could not be checked.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include "yaffs_image.h"
+
+unsigned yaffs_trace_mask = 0;
+
+#define MAX_REPORTED	100	/* Problems printed without -v */
+#define MAX_DEPTH	64	/* Directory levels shown in paths */
+
+/* What check_block() finds in each block */
+struct fsck_block {
+	int written;		/* Chunks programmed */
+	int live;		/* Chunks in use, as the scan finds them */
+	int summary;		/* Summary chunks, counted in live */
+	int ecc_fixed;
+	int ecc_bad;
+	int wrong_seq;		/* Chunks with another sequence number */
+	int wrong_summary;	/* Summary entries that differ from the tags */
+	int late;		/* Chunks programmed after an erased one */
+	int marked_bad;
+};
+
+/* Problems check_obj() finds, as bits */
+enum {
+	OBJ_NO_HEADER = 1 << 0,
+	OBJ_HANGING = 1 << 1,
+	OBJ_UNREACHABLE = 1 << 2,
+	OBJ_BAD_TYPE = 1 << 3,
+	OBJ_BAD_NAME = 1 << 4,
+	OBJ_TAGS = 1 << 5,
+	OBJ_BAD_EQUIV = 1 << 6,
+	OBJ_BAD_ALIAS = 1 << 7,
+	OBJ_PAST_EOF = 1 << 8,
+	OBJ_SHADOWS_LIVE = 1 << 9,
+	OBJ_DUP_NAME = 1 << 10,
+};
+
+/* Live chunk marks */
+#define LIVE_DATA	1
+#define LIVE_SUMMARY	2
+
+static struct yimg *img;
+static struct fsck_block *fblocks;
+static u8 *live;
+static u32 *obj_problems;
+static int ppb;
+
+static int verbose;
+static int n_errors;
+static int n_warnings;
+static int n_reported;
+
+/* The device, for the checkpoint */
+static int dev_blocks;
+static int ptr_size = sizeof(void *);
+static int internal_start;	/* Internal number of the first image block */
+
+static void usage(const char *name)
+{
+	printf("usage: %s [options] image\n"
+	       "options:\n"
+	       "   -c blocks  device size in blocks, for the checkpoint "
+	       "(default: image size)\n"
+	       "   -w bytes   pointer size of the target (default %d)\n"
+	       "   -j threads checking threads (default: one per cpu)\n"
+	       "   -l         list every block\n"
+	       "   -v         report every problem, not just the first %d\n",
+	       name, (int)sizeof(void *), MAX_REPORTED);
+	yimg_geometry_usage();
+	exit(2);
+}
+
+static void problem(int is_error, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (is_error)
+		n_errors++;
+	else
+		n_warnings++;
+
+	if (!verbose && n_reported >= MAX_REPORTED)
+		return;
+	n_reported++;
+
+	printf("%s: ", is_error ? "error" : "warning");
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	printf("\n");
+}
+
+static const struct yaffs_obj_hdr *hdr(u32 chunk)
+{
+	return (const struct yaffs_obj_hdr *)yimg_chunk_data(img, chunk);
+}
+
+static void obj_path(u32 obj, char *path, int size)
+{
+	char name[YAFFS_MAX_NAME_LENGTH + 1];
+	u32 chain[MAX_DEPTH];
+	int n = 0;
+	int len = 0;
+
+	while (obj != img->root && obj != YIMG_NONE && n < MAX_DEPTH) {
+		chain[n++] = obj;
+		obj = img->obj_index[img->objs[obj].parent_id];
+	}
+
+	path[0] = 0;
+	if (n == MAX_DEPTH)
+		len = snprintf(path, size, "...");
+	while (n-- > 0 && len < size) {
+		/* Erased or missing names are shown as the object id */
+		yimg_name(img, chain[n], name, sizeof(name));
+		if (!name[0] || (u8)name[0] == 0xff)
+			snprintf(name, sizeof(name), "#%u",
+				 img->objs[chain[n]].obj_id);
+		len += snprintf(path + len, size - len, "/%s", name);
+	}
+	if (!path[0])
+		snprintf(path, size, "/");
+}
+
+/*------------------------------ Blocks --------------------------------*/
+
+/* Where the packed tags are in a chunk, whether or not they are inband */
+static const u8 *raw_tags(u32 chunk)
+{
+	const u8 *page = yimg_chunk_data(img, chunk);
+
+	if (img->g.inband_tags)
+		return page + img->chunk_size;
+	return page + img->g.page_size + img->g.tags_offset;
+}
+
+/*
+ * A block is marked bad by a first spare byte other than 0xff in one of
+ * its first two pages, which is what MTD does and can only be seen if the
+ * tags are somewhere else, or by zeroed tags as yflash2_MarkNANDBlockBad()
+ * writes.
+ */
+static int marked_bad(int blk)
+{
+	static const u8 zeros[sizeof(struct yaffs_packed_tags2_tags_only)];
+	u32 chunk;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		chunk = blk * ppb + i;
+		if (!img->g.inband_tags && img->g.tags_offset > 0 &&
+		    yimg_chunk_data(img, chunk)[img->g.page_size] != 0xff)
+			return 1;
+		if (!memcmp(raw_tags(chunk), zeros, sizeof(zeros)))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Reads the tags of every chunk in the block, including those the scan
+ * took from the summary, and counts what it finds.
+ */
+static void check_block(void *arg, int blk)
+{
+	struct yimg_block *b = &img->blocks[blk];
+	struct fsck_block *fb = &fblocks[blk];
+	struct yaffs_packed_tags2_tags_only pt;
+	const struct yaffs_packed_tags2_tags_only *st;
+	enum yimg_chunk_state state;
+	u32 base = blk * ppb;
+	int erased_seen = 0;
+	int i;
+
+	(void)arg;
+	fb->marked_bad = marked_bad(blk);
+
+	for (i = 0; i < ppb; i++) {
+		state = yimg_read_tags(img, base + i, &pt);
+		if (state == YIMG_CHUNK_ERASED) {
+			if (img->chunk_state[base + i] == YIMG_CHUNK_SUMMARY &&
+			    img->tags[base + i].obj_id)
+				fb->wrong_summary++;
+			erased_seen = 1;
+			continue;
+		}
+
+		fb->written++;
+		if (erased_seen)
+			fb->late++;
+		if (state == YIMG_CHUNK_ECC_FIXED)
+			fb->ecc_fixed++;
+		if (state == YIMG_CHUNK_ECC_BAD) {
+			fb->ecc_bad++;
+			continue;
+		}
+		if (b->state != YIMG_BLOCK_DATA)
+			continue;
+
+		if (pt.seq_number != b->seq_number)
+			fb->wrong_seq++;
+		if (live[base + i])
+			fb->live++;
+		if (live[base + i] == LIVE_SUMMARY)
+			fb->summary++;
+
+		if (img->chunk_state[base + i] == YIMG_CHUNK_SUMMARY) {
+			st = &img->tags[base + i];
+			if (st->obj_id != pt.obj_id ||
+			    st->chunk_id != pt.chunk_id ||
+			    st->n_bytes != pt.n_bytes)
+				fb->wrong_summary++;
+		}
+	}
+}
+
+static int cmp_seq(const void *a, const void *b)
+{
+	u32 sa = img->blocks[*(const int *)a].seq_number;
+	u32 sb = img->blocks[*(const int *)b].seq_number;
+
+	return sa < sb ? -1 : sa > sb;
+}
+
+static void report_blocks(void)
+{
+	struct yimg_block *b;
+	struct fsck_block *fb;
+	int *order;
+	int n = 0;
+	int blk;
+	int i;
+
+	for (blk = 0; blk < img->n_blocks; blk++) {
+		b = &img->blocks[blk];
+		fb = &fblocks[blk];
+
+		if (fb->marked_bad) {
+			/* The marker itself may be in the first two pages */
+			if (b->state == YIMG_BLOCK_DATA ||
+			    b->state == YIMG_BLOCK_CHECKPOINT || fb->written > 2)
+				problem(0, "block %d is marked bad but holds "
+					"data", blk);
+			continue;
+		}
+		if (b->state == YIMG_BLOCK_UNKNOWN)
+			problem(1, "block %d has sequence number %u, out of "
+				"range", blk, b->seq_number);
+		if (fb->ecc_bad)
+			problem(1, "block %d: %d chunks with unfixable tags",
+				blk, fb->ecc_bad);
+		if (fb->ecc_fixed)
+			problem(0, "block %d: %d chunks with tags fixed by ECC",
+				blk, fb->ecc_fixed);
+		if (fb->wrong_seq)
+			problem(1, "block %d: %d chunks with a sequence number "
+				"other than %u", blk, fb->wrong_seq,
+				b->seq_number);
+		if (fb->wrong_summary)
+			problem(1, "block %d: summary disagrees with the tags "
+				"of %d chunks", blk, fb->wrong_summary);
+		if (fb->late)
+			problem(0, "block %d: %d chunks written after an "
+				"erased one", blk, fb->late);
+	}
+
+	/* Each block gets its own sequence number */
+	order = malloc((img->n_blocks + 1) * sizeof(int));
+	if (!order)
+		return;
+	for (blk = 0; blk < img->n_blocks; blk++)
+		if (img->blocks[blk].state == YIMG_BLOCK_DATA)
+			order[n++] = blk;
+	qsort(order, n, sizeof(int), cmp_seq);
+	for (i = 1; i < n; i++)
+		if (img->blocks[order[i]].seq_number ==
+		    img->blocks[order[i - 1]].seq_number)
+			problem(1, "blocks %d and %d have the same sequence "
+				"number %u", order[i - 1], order[i],
+				img->blocks[order[i]].seq_number);
+	free(order);
+}
+
+/*------------------------------ Objects -------------------------------*/
+
+static void mark_live(void)
+{
+	struct yimg_obj *o;
+	u32 i, k, chunk;
+	int blk;
+
+	for (i = 0; i < img->n_objs; i++) {
+		o = &img->objs[i];
+		if (o->hdr_chunk != YIMG_NONE)
+			live[o->hdr_chunk] = LIVE_DATA;
+		for (k = 0; k < o->n_chunks; k++) {
+			chunk = img->chunk_map[o->chunk_map + k];
+			if (chunk != YIMG_NONE)
+				live[chunk] = LIVE_DATA;
+		}
+	}
+
+	for (blk = 0; blk < img->n_blocks; blk++) {
+		if (!img->blocks[blk].summary_used)
+			continue;
+		for (k = img->chunks_per_summary; k < (u32)ppb; k++)
+			live[blk * ppb + k] = LIVE_SUMMARY;
+	}
+}
+
+static int bad_name(const char *name)
+{
+	int len = strnlen(name, YAFFS_MAX_NAME_LENGTH + 1);
+
+	return len == 0 || len > YAFFS_MAX_NAME_LENGTH ||
+		(u8)name[0] == 0xff || memchr(name, '/', len);
+}
+
+static void check_obj(void *arg, int i)
+{
+	struct yimg_obj *o = &img->objs[i];
+	const struct yaffs_obj_hdr *oh;
+	struct yaffs_ext_tags t;
+	u32 *p = &obj_problems[i];
+	u32 equiv;
+	u32 shadows;
+	u32 k;
+
+	(void)arg;
+	if (o->hdr_chunk == YIMG_NONE) {
+		if (o->obj_id > YAFFS_OBJECTID_LOSTNFOUND)
+			*p |= OBJ_NO_HEADER;
+		return;
+	}
+
+	oh = hdr(o->hdr_chunk);
+	yaffs_unpack_tags2_tags_only(&t, &img->tags[o->hdr_chunk]);
+	if (img->g.inband_tags)
+		shadows = oh->inband_shadowed_obj_id;
+	else
+		shadows = oh->shadows_obj > 0 ? oh->shadows_obj : 0;
+	/* The header's flags are only used if the tags don't have them */
+	if (t.extra_available && !t.extra_shadows)
+		shadows = 0;
+
+	if (oh->type <= YAFFS_OBJECT_TYPE_UNKNOWN ||
+	    oh->type > YAFFS_OBJECT_TYPE_MAX)
+		*p |= OBJ_BAD_TYPE;
+	if (o->obj_id > YAFFS_OBJECTID_ROOT && bad_name(oh->name))
+		*p |= OBJ_BAD_NAME;
+	if (o->obj_id != YAFFS_OBJECTID_ROOT &&
+	    (u32)oh->parent_obj_id != o->parent_id)
+		*p |= OBJ_HANGING;
+
+	/* The extra tags are a copy of some of the header */
+	if (t.extra_available &&
+	    (t.extra_obj_type != oh->type ||
+	     t.extra_parent_id != (u32)oh->parent_obj_id ||
+	     (oh->type == YAFFS_OBJECT_TYPE_FILE &&
+	      t.extra_length != (u32)oh->file_size) ||
+	     (oh->type == YAFFS_OBJECT_TYPE_HARDLINK &&
+	      t.extra_equiv_id != (u32)oh->equiv_id)))
+		*p |= OBJ_TAGS;
+
+	if (shadows && shadows <= YAFFS_MAX_OBJECT_ID &&
+	    img->obj_index[shadows] != YIMG_NONE)
+		*p |= OBJ_SHADOWS_LIVE;
+
+	switch (o->type) {
+	case YAFFS_OBJECT_TYPE_HARDLINK:
+		equiv = o->equiv_id <= YAFFS_MAX_OBJECT_ID ?
+			img->obj_index[o->equiv_id] : YIMG_NONE;
+		if (equiv == YIMG_NONE ||
+		    img->objs[equiv].type == YAFFS_OBJECT_TYPE_HARDLINK)
+			*p |= OBJ_BAD_EQUIV;
+		break;
+	case YAFFS_OBJECT_TYPE_SYMLINK:
+		if (!oh->alias[0] || (u8)oh->alias[0] == 0xff)
+			*p |= OBJ_BAD_ALIAS;
+		break;
+	case YAFFS_OBJECT_TYPE_FILE:
+		/* Chunks wholly past the end should have been deleted */
+		for (k = 0; k < o->n_chunks; k++)
+			if (img->chunk_map[o->chunk_map + k] != YIMG_NONE &&
+			    (unsigned long long)k * img->chunk_size >= o->size)
+				*p |= OBJ_PAST_EOF;
+		break;
+	default:
+		break;
+	}
+}
+
+static int cmp_name_hash(const void *a, const void *b)
+{
+	u32 ha = img->objs[*(const u32 *)a].name_hash;
+	u32 hb = img->objs[*(const u32 *)b].name_hash;
+
+	return ha < hb ? -1 : ha > hb;
+}
+
+/* Finds names used twice in a directory, and what the root can't reach */
+static void check_tree(void)
+{
+	char name_a[YAFFS_MAX_NAME_LENGTH + 1];
+	char name_b[YAFFS_MAX_NAME_LENGTH + 1];
+	u8 *reached;
+	u32 *stack;
+	u32 *children;
+	u32 n_stack = 0;
+	u32 n_children;
+	u32 dir, obj, i, j;
+
+	reached = calloc(img->n_objs, 1);
+	stack = malloc(img->n_objs * sizeof(u32));
+	children = malloc(img->n_objs * sizeof(u32));
+	if (!reached || !stack || !children)
+		goto out;
+
+	stack[n_stack++] = img->root;
+	reached[img->root] = 1;
+	while (n_stack) {
+		dir = stack[--n_stack];
+		n_children = 0;
+		for (obj = img->objs[dir].first_child; obj != YIMG_NONE;
+		     obj = img->objs[obj].next_sibling) {
+			if (reached[obj])
+				break;
+			reached[obj] = 1;
+			children[n_children++] = obj;
+			if (img->objs[obj].type == YAFFS_OBJECT_TYPE_DIRECTORY)
+				stack[n_stack++] = obj;
+		}
+
+		qsort(children, n_children, sizeof(u32), cmp_name_hash);
+		for (i = 0; i < n_children; i++) {
+			for (j = i + 1; j < n_children &&
+			     img->objs[children[j]].name_hash ==
+			     img->objs[children[i]].name_hash; j++) {
+				yimg_name(img, children[i], name_a,
+					  sizeof(name_a));
+				yimg_name(img, children[j], name_b,
+					  sizeof(name_b));
+				if (!strcmp(name_a, name_b))
+					obj_problems[children[j]] |=
+						OBJ_DUP_NAME;
+			}
+		}
+	}
+
+	for (i = 0; i < img->n_objs; i++)
+		if (!reached[i])
+			obj_problems[i] |= OBJ_UNREACHABLE;
+out:
+	free(reached);
+	free(stack);
+	free(children);
+}
+
+static void report_objs(void)
+{
+	char path[1024];
+	struct yimg_obj *o;
+	u32 p;
+	u32 i;
+
+	for (i = 0; i < img->n_objs; i++) {
+		p = obj_problems[i];
+		if (!p)
+			continue;
+		o = &img->objs[i];
+		obj_path(i, path, sizeof(path));
+
+		if (p & OBJ_NO_HEADER)
+			problem(1, "object %u (%s): data without an object "
+				"header", o->obj_id, path);
+		if (p & OBJ_HANGING)
+			problem(1, "object %u (%s): parent %d is missing or "
+				"not a directory", o->obj_id, path,
+				hdr(o->hdr_chunk)->parent_obj_id);
+		if (p & OBJ_UNREACHABLE)
+			problem(1, "object %u: not reachable from the root",
+				o->obj_id);
+		if (p & OBJ_BAD_TYPE)
+			problem(1, "object %u (%s): bad type %d", o->obj_id,
+				path, hdr(o->hdr_chunk)->type);
+		if (p & OBJ_BAD_NAME)
+			problem(1, "object %u (%s): bad name", o->obj_id, path);
+		if (p & OBJ_TAGS)
+			problem(1, "object %u (%s): header and tags disagree",
+				o->obj_id, path);
+		if (p & OBJ_BAD_EQUIV)
+			problem(1, "object %u (%s): hard link to missing "
+				"object %u", o->obj_id, path, o->equiv_id);
+		if (p & OBJ_BAD_ALIAS)
+			problem(1, "object %u (%s): symlink without an alias",
+				o->obj_id, path);
+		if (p & OBJ_PAST_EOF)
+			problem(0, "object %u (%s): data chunks past the end "
+				"of the file", o->obj_id, path);
+		if (p & OBJ_SHADOWS_LIVE)
+			problem(0, "object %u (%s): shadows an object that is "
+				"still there", o->obj_id, path);
+		if (p & OBJ_DUP_NAME)
+			problem(1, "object %u (%s): name used twice", o->obj_id,
+				path);
+	}
+}
+
+/*----------------------------- Checkpoint -----------------------------*/
+
+/* Reads the checkpoint stream as yaffs2_checkpt_rd() does */
+struct cp_reader {
+	int blk;		/* Image block being read, or -1 */
+	int chunk;		/* Chunk in the block */
+	int next_blk;		/* Where to look for the next block */
+	u32 page_seq;
+	int offs;
+	const u8 *data;
+	u32 sum;
+	u32 xor;
+	int n_blocks;
+	int n_bytes;
+};
+
+static void cp_find_block(struct cp_reader *r)
+{
+	int i;
+
+	for (i = r->next_blk; i >= 0 && i < img->n_blocks; i++) {
+		if (img->blocks[i].state != YIMG_BLOCK_CHECKPOINT)
+			continue;
+		/* The tags' obj_id is a hint of where to look next */
+		r->next_blk = img->tags[i * ppb].obj_id - internal_start;
+		r->blk = i;
+		r->n_blocks++;
+		return;
+	}
+	r->blk = -1;
+}
+
+static int cp_rd(struct cp_reader *r, void *buf, int n)
+{
+	struct yaffs_packed_tags2_tags_only pt;
+	enum yimg_chunk_state state;
+	u8 *dst = buf;
+	u32 chunk;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (r->offs >= img->chunk_size) {
+			if (r->blk < 0) {
+				cp_find_block(r);
+				r->chunk = 0;
+			}
+			if (r->blk < 0)
+				break;
+
+			chunk = r->blk * ppb + r->chunk;
+			state = yimg_read_tags(img, chunk, &pt);
+			if (pt.chunk_id != r->page_seq + 1 ||
+			    state == YIMG_CHUNK_ECC_BAD ||
+			    state == YIMG_CHUNK_ERASED ||
+			    pt.seq_number != YAFFS_SEQUENCE_CHECKPOINT_DATA)
+				break;
+
+			r->data = yimg_chunk_data(img, chunk);
+			r->offs = 0;
+			r->page_seq++;
+			if (++r->chunk >= ppb)
+				r->blk = -1;
+		}
+		dst[i] = r->data[r->offs++];
+		r->sum += dst[i];
+		r->xor ^= dst[i];
+		r->n_bytes++;
+	}
+	return i;
+}
+
+/* Set if the checkpoint may hold files whose tnodes were evicted */
+static int cp_evicted;
+
+static int cp_rd_validity(struct cp_reader *r, int head)
+{
+	struct yaffs_checkpt_validity cv;
+
+	if (cp_rd(r, &cv, sizeof(cv)) != sizeof(cv) ||
+	    cv.struct_type != sizeof(cv) ||
+	    cv.magic != YAFFS_MAGIC ||
+	    (cv.version != YAFFS_CHECKPOINT_VERSION &&
+	     cv.version != YAFFS_CHECKPOINT_VERSION_EVICTED) ||
+	    cv.head != (head ? 1u : 0u))
+		return 0;
+	if (head)
+		cp_evicted = (cv.version == YAFFS_CHECKPOINT_VERSION_EVICTED);
+	return 1;
+}
+
+/* Tnode layout, as yaffs_guts_initialise() works it out */
+static int tnode_width;
+static int tnode_size;
+static int chunk_grp_bits;
+
+static void cp_tnode_geometry(void)
+{
+	int bits;
+
+	for (bits = 0; (1ULL << bits) < (unsigned long long)ppb *
+			(internal_start + dev_blocks); bits++)
+		;
+	if (bits & 1)
+		bits++;
+	tnode_width = bits < 16 ? 16 : bits;
+	chunk_grp_bits = bits <= tnode_width ? 0 : bits - tnode_width;
+	tnode_size = (tnode_width * YAFFS_NTNODES_LEVEL0) / 8;
+	if (tnode_size < YAFFS_NTNODES_INTERNAL * ptr_size)
+		tnode_size = YAFFS_NTNODES_INTERNAL * ptr_size;
+}
+
+/* As yaffs_get_group_base() */
+static u32 tnode_get(const u32 *map, int pos)
+{
+	u32 bit_in_map = pos * tnode_width;
+	u32 word_in_map = bit_in_map / 32;
+	u32 bit_in_word = bit_in_map & 31;
+	u32 val = map[word_in_map] >> bit_in_word;
+
+	if (tnode_width > (int)(32 - bit_in_word))
+		val |= map[word_in_map + 1] << (32 - bit_in_word);
+	val &= (tnode_width < 32) ? (1U << tnode_width) - 1 : 0xffffffff;
+	return val << chunk_grp_bits;
+}
+
+/*
+ * Compares a file's tnodes in the checkpoint with the chunks the scan
+ * found for it. Returns the number that differ, or -1 if the checkpoint
+ * can't be read.
+ */
+static int cp_check_tnodes(struct cp_reader *r, struct yimg_obj *o,
+			   int n_data_chunks)
+{
+	u32 tn[64];
+	u32 base;
+	u32 val;
+	u32 scanned;
+	u32 chunk_id;
+	int n_found = 0;
+	int n_scanned = 0;
+	int n_differ = 0;
+	int k;
+
+	if (tnode_size > (int)sizeof(tn))
+		return -1;
+
+	for (;;) {
+		if (cp_rd(r, &base, sizeof(base)) != sizeof(base))
+			return -1;
+		if (base == 0xffffffff)
+			break;
+		if (cp_rd(r, tn, tnode_size) != tnode_size)
+			return -1;
+		if (!o)
+			continue;
+
+		for (k = 0; k < YAFFS_NTNODES_LEVEL0; k++) {
+			chunk_id = base + k;
+			val = tnode_get(tn, k);
+			if (val)
+				n_found++;
+			scanned = (chunk_id >= 1 && chunk_id <= o->n_chunks) ?
+				img->chunk_map[o->chunk_map + chunk_id - 1] :
+				YIMG_NONE;
+			if (scanned != YIMG_NONE)
+				scanned = ((scanned + internal_start * ppb) >>
+					   chunk_grp_bits) << chunk_grp_bits;
+			else
+				scanned = 0;
+			if (val != scanned)
+				n_differ++;
+		}
+	}
+
+	if (o) {
+		for (k = 0; k < (int)o->n_chunks; k++)
+			if (img->chunk_map[o->chunk_map + k] != YIMG_NONE)
+				n_scanned++;
+		/* Chunks in tnodes the checkpoint didn't have at all */
+		if (n_scanned > n_found)
+			n_differ += n_scanned - n_found;
+		if (n_data_chunks != n_scanned && !n_differ)
+			n_differ = 1;
+	}
+	return n_differ;
+}
+
+static const char *cp_block_state(unsigned state)
+{
+	switch (state) {
+	case YAFFS_BLOCK_STATE_EMPTY:
+		return "empty";
+	case YAFFS_BLOCK_STATE_ALLOCATING:
+		return "allocating";
+	case YAFFS_BLOCK_STATE_FULL:
+		return "full";
+	case YAFFS_BLOCK_STATE_DIRTY:
+		return "dirty";
+	case YAFFS_BLOCK_STATE_CHECKPOINT:
+		return "checkpoint";
+	case YAFFS_BLOCK_STATE_COLLECTING:
+		return "collecting";
+	case YAFFS_BLOCK_STATE_DEAD:
+		return "dead";
+	default:
+		return "unknown";
+	}
+}
+
+/* Compares the checkpoint's block info with the image */
+static void cp_check_blocks(const struct yaffs_block_info *bis,
+			    const u8 *chunk_bits, int stride, u32 max_seq,
+			    u32 cp_seq)
+{
+	const struct yaffs_block_info *bi;
+	struct yimg_block *b;
+	int n_differ;
+	int in_use;
+	int blk;
+	int i;
+
+	if (max_seq > cp_seq)
+		problem(1, "checkpoint: blocks were written after it "
+			"(sequence %u, checkpoint has %u)", max_seq, cp_seq);
+
+	for (blk = 0; blk < img->n_blocks && blk < dev_blocks; blk++) {
+		bi = &bis[blk];
+		b = &img->blocks[blk];
+
+		switch (bi->block_state) {
+		case YAFFS_BLOCK_STATE_EMPTY:
+			if (b->state != YIMG_BLOCK_EMPTY &&
+			    b->state != YIMG_BLOCK_CHECKPOINT)
+				problem(1, "checkpoint: block %d is empty but "
+					"has data", blk);
+			continue;
+		case YAFFS_BLOCK_STATE_ALLOCATING:
+		case YAFFS_BLOCK_STATE_FULL:
+		case YAFFS_BLOCK_STATE_DIRTY:
+		case YAFFS_BLOCK_STATE_COLLECTING:
+			break;
+		case YAFFS_BLOCK_STATE_DEAD:
+			if (!fblocks[blk].marked_bad)
+				problem(0, "checkpoint: block %d is dead but "
+					"not marked bad", blk);
+			continue;
+		default:
+			continue;
+		}
+
+		if (b->state != YIMG_BLOCK_DATA) {
+			problem(1, "checkpoint: block %d is %s but holds no "
+				"data", blk, cp_block_state(bi->block_state));
+			continue;
+		}
+		/*
+		 * A device built with compact block info may renumber its
+		 * blocks, keeping only their order, so the checkpoint can
+		 * hold a later number than the tags but never an earlier one.
+		 */
+		if (bi->seq_number < b->seq_number || bi->seq_number > cp_seq)
+			problem(1, "checkpoint: block %d has sequence number "
+				"%u, not %u", blk, bi->seq_number,
+				b->seq_number);
+
+		n_differ = 0;
+		for (i = 0; i < ppb; i++) {
+			in_use = (chunk_bits[blk * stride + i / 8] >>
+				  (i & 7)) & 1;
+			if (in_use != (live[blk * ppb + i] != 0))
+				n_differ++;
+		}
+		if (n_differ)
+			problem(1, "checkpoint: block %d: %d chunks in use "
+				"differ from the scan", blk, n_differ);
+	}
+}
+
+static int is_fake(u32 obj_id)
+{
+	return obj_id == YAFFS_OBJECTID_ROOT ||
+		obj_id == YAFFS_OBJECTID_LOSTNFOUND ||
+		obj_id == YAFFS_OBJECTID_UNLINKED ||
+		obj_id == YAFFS_OBJECTID_DELETED;
+}
+
+static int cp_check_objs(struct cp_reader *r, u8 *seen)
+{
+	struct yaffs_checkpt_obj co;
+	struct yimg_obj *o;
+	u32 idx;
+	int n_objs = 0;
+	int n;
+
+	for (;;) {
+		if (cp_rd(r, &co, sizeof(co)) != sizeof(co) ||
+		    co.struct_type != sizeof(co))
+			return -1;
+		if (co.obj_id == 0xffffffff)
+			break;
+		n_objs++;
+
+		idx = co.obj_id <= YAFFS_MAX_OBJECT_ID ?
+			img->obj_index[co.obj_id] : YIMG_NONE;
+		o = NULL;
+
+		if (co.deleted || co.soft_del || co.unlinked ||
+		    co.parent_id == YAFFS_OBJECTID_DELETED ||
+		    co.parent_id == YAFFS_OBJECTID_UNLINKED) {
+			/* On its way out, so the scan won't have it */
+		} else if (idx == YIMG_NONE) {
+			if (!is_fake(co.obj_id))
+				problem(1, "checkpoint: object %u is not in "
+					"the image", co.obj_id);
+		} else {
+			o = &img->objs[idx];
+			seen[idx] = 1;
+			if (co.variant_type != o->type)
+				problem(1, "checkpoint: object %u has type "
+					"%d, not %u", co.obj_id,
+					co.variant_type, o->type);
+			else if (co.hdr_chunk > 0 &&
+				 (u32)co.hdr_chunk - internal_start * ppb !=
+				 o->hdr_chunk)
+				problem(1, "checkpoint: object %u header is "
+					"chunk %d, not %u", co.obj_id,
+					co.hdr_chunk - internal_start * ppb,
+					o->hdr_chunk);
+			else if (o->hdr_chunk != YIMG_NONE &&
+				 co.parent_id !=
+				 (u32)hdr(o->hdr_chunk)->parent_obj_id)
+				problem(1, "checkpoint: object %u has parent "
+					"%u, not %d", co.obj_id, co.parent_id,
+					hdr(o->hdr_chunk)->parent_obj_id);
+			else if (o->type == YAFFS_OBJECT_TYPE_FILE &&
+				 co.size_or_equiv_obj != o->size)
+				problem(1, "checkpoint: object %u has size %u, "
+					"not %u", co.obj_id,
+					co.size_or_equiv_obj, o->size);
+			else if (o->type == YAFFS_OBJECT_TYPE_HARDLINK &&
+				 co.size_or_equiv_obj != o->equiv_id)
+				problem(1, "checkpoint: object %u links to %u, "
+					"not %u", co.obj_id,
+					co.size_or_equiv_obj, o->equiv_id);
+		}
+
+		if (co.variant_type != YAFFS_OBJECT_TYPE_FILE)
+			continue;
+		if (o && o->type != YAFFS_OBJECT_TYPE_FILE)
+			o = NULL;
+		/* Evicted files have no tnodes to compare */
+		if (cp_evicted && co.tnodes_evicted)
+			o = NULL;
+		n = cp_check_tnodes(r, o, co.n_data_chunks);
+		if (n < 0)
+			return -1;
+		if (n > 0)
+			problem(1, "checkpoint: object %u: %d chunks differ "
+				"from the tags", co.obj_id, n);
+	}
+	return n_objs;
+}
+
+static void check_checkpoint(void)
+{
+	struct cp_reader r;
+	struct yaffs_checkpt_dev cd;
+	struct yaffs_block_info *bis = NULL;
+	u8 *chunk_bits = NULL;
+	u8 *seen = NULL;
+	int stride = (ppb + 7) / 8;
+	u32 max_seq = 0;
+	u32 sum;
+	u32 cp_sum;
+	int n_objs = -1;
+	int blk;
+	u32 i;
+
+	for (blk = 0; blk < img->n_blocks; blk++)
+		if (img->blocks[blk].state == YIMG_BLOCK_CHECKPOINT)
+			break;
+	if (blk == img->n_blocks) {
+		printf("checkpoint: none\n");
+		return;
+	}
+
+	cp_tnode_geometry();
+	memset(&r, 0, sizeof(r));
+	r.blk = -1;
+	r.offs = img->chunk_size;
+
+	for (blk = 0; blk < img->n_blocks; blk++)
+		if (img->blocks[blk].state == YIMG_BLOCK_DATA &&
+		    img->blocks[blk].seq_number > max_seq)
+			max_seq = img->blocks[blk].seq_number;
+
+	bis = malloc(dev_blocks * sizeof(*bis));
+	chunk_bits = malloc(dev_blocks * stride);
+	seen = calloc(img->n_objs, 1);
+	if (!bis || !chunk_bits || !seen) {
+		perror("malloc");
+		goto out;
+	}
+
+	if (!cp_rd_validity(&r, 1) ||
+	    cp_rd(&r, &cd, sizeof(cd)) != sizeof(cd) ||
+	    cd.struct_type != sizeof(cd) ||
+	    cp_rd(&r, bis, dev_blocks * sizeof(*bis)) !=
+	    dev_blocks * (int)sizeof(*bis) ||
+	    cp_rd(&r, chunk_bits, dev_blocks * stride) != dev_blocks * stride) {
+		problem(1, "checkpoint: can't read the device record, "
+			"check -c, -s and -w");
+		goto out;
+	}
+
+	n_objs = cp_check_objs(&r, seen);
+	if (n_objs < 0 || !cp_rd_validity(&r, 0)) {
+		problem(1, "checkpoint: can't read the objects, check -c and -w");
+		goto out;
+	}
+
+	sum = (r.sum << 8) | (r.xor & 0xff);
+	if (cp_rd(&r, &cp_sum, sizeof(cp_sum)) != sizeof(cp_sum) ||
+	    cp_sum != sum) {
+		problem(1, "checkpoint: bad checksum, yaffs would scan");
+		goto out;
+	}
+
+	cp_check_blocks(bis, chunk_bits, stride, max_seq, cd.seq_number);
+
+	for (i = 0; i < img->n_objs; i++)
+		if (!seen[i] && !is_fake(img->objs[i].obj_id))
+			problem(1, "checkpoint: object %u is not in it",
+				img->objs[i].obj_id);
+
+	printf("checkpoint: %d blocks, %d bytes, %d objects\n",
+	       r.n_blocks, r.n_bytes, n_objs);
+out:
+	free(bis);
+	free(chunk_bits);
+	free(seen);
+}
+
+/*---------------------------- Statistics ------------------------------*/
+
+static const char *block_state(int blk)
+{
+	if (fblocks[blk].marked_bad)
+		return "bad";
+	switch (img->blocks[blk].state) {
+	case YIMG_BLOCK_EMPTY:
+		return "empty";
+	case YIMG_BLOCK_DATA:
+		return "data";
+	case YIMG_BLOCK_CHECKPOINT:
+		return "checkpt";
+	default:
+		return "unknown";
+	}
+}
+
+static void list_blocks(void)
+{
+	struct fsck_block *fb;
+	int blk;
+
+	printf("block        seq  state    written  live  dead  summary  "
+	       "ecc fixed/bad\n");
+	for (blk = 0; blk < img->n_blocks; blk++) {
+		fb = &fblocks[blk];
+		printf("%5d %10u  %-8s %7d %5d %5d %8d  %9d/%d\n", blk,
+		       img->blocks[blk].seq_number, block_state(blk),
+		       fb->written, fb->live, fb->written - fb->live,
+		       fb->summary, fb->ecc_fixed, fb->ecc_bad);
+	}
+}
+
+static int cmp_live(const void *a, const void *b)
+{
+	int la = fblocks[*(const int *)a].live;
+	int lb = fblocks[*(const int *)b].live;
+
+	return la - lb;
+}
+
+/*
+ * Garbage collection copies a block's live chunks and erases it. Taking
+ * the blocks with the fewest live chunks first, shows what it costs to
+ * get back a given share of the dead chunks.
+ */
+static void show_stats(void)
+{
+	static const int shares[] = { 25, 50, 75, 100 };
+	struct fsck_block *fb;
+	struct yimg_block *b;
+	int n_state[4] = { 0, 0, 0, 0 };
+	int n_bad = 0;
+	int n_partial = 0;
+	int n_summary_blocks = 0;
+	int n_free_blocks = 0;
+	long written = 0, n_live = 0, n_summary = 0, dead;
+	long collectable = 0;
+	long copied = 0, freed = 0;
+	u32 max_seq = 0;
+	int alloc_blk = -1;
+	int *order;
+	int n = 0;
+	int blk;
+	int s;
+	int i;
+
+	for (blk = 0; blk < img->n_blocks; blk++) {
+		b = &img->blocks[blk];
+		fb = &fblocks[blk];
+		if (fb->marked_bad) {
+			n_bad++;
+			continue;
+		}
+		n_state[b->state]++;
+		if (b->state != YIMG_BLOCK_DATA)
+			continue;
+		written += fb->written;
+		n_live += fb->live;
+		n_summary += fb->summary;
+		if (b->summary_used)
+			n_summary_blocks++;
+		if (fb->written < ppb)
+			n_partial++;
+		if (b->seq_number > max_seq) {
+			max_seq = b->seq_number;
+			alloc_blk = blk;
+		}
+	}
+
+	printf("%d blocks: %d data (%d partly written, %d with summaries), "
+	       "%d checkpoint, %d empty, %d bad, %d unknown\n",
+	       img->n_blocks, n_state[YIMG_BLOCK_DATA], n_partial,
+	       n_summary_blocks, n_state[YIMG_BLOCK_CHECKPOINT],
+	       n_state[YIMG_BLOCK_EMPTY], n_bad, n_state[YIMG_BLOCK_UNKNOWN]);
+
+	dead = written - n_live;
+	printf("%ld chunks in data blocks: %ld live (%ld summary), %ld dead\n",
+	       written, n_live, n_summary, dead);
+
+	order = malloc((img->n_blocks + 1) * sizeof(int));
+	if (!order || !dead) {
+		free(order);
+		return;
+	}
+
+	/* The block being written to isn't collected */
+	for (blk = 0; blk < img->n_blocks; blk++) {
+		if (img->blocks[blk].state != YIMG_BLOCK_DATA ||
+		    fblocks[blk].marked_bad ||
+		    (blk == alloc_blk && fblocks[blk].written < ppb))
+			continue;
+		if (fblocks[blk].live == fblocks[blk].summary)
+			n_free_blocks++;
+		collectable += fblocks[blk].written - fblocks[blk].live;
+		order[n++] = blk;
+	}
+	qsort(order, n, sizeof(int), cmp_live);
+
+	printf("garbage collection: %d blocks have no live data, %ld dead "
+	       "chunks can be collected\n", n_free_blocks, collectable);
+	for (i = 0, s = 0; collectable && i < n && s < 4; i++) {
+		fb = &fblocks[order[i]];
+		copied += fb->live - fb->summary;
+		freed += fb->written - fb->live;
+		while (s < 4 && freed * 100 >= collectable * shares[s]) {
+			printf("  %3d%% of the dead chunks: %d blocks, "
+			       "copying %ld live chunks (%.2f per chunk "
+			       "freed)\n", shares[s], i + 1, copied,
+			       (double)copied / freed);
+			s++;
+		}
+	}
+	free(order);
+}
+
+int main(int argc, char *argv[])
+{
+	struct yimg_geometry g;
+	int n_threads = 0;
+	int list = 0;
+	int opt;
+
+	yimg_default_geometry(&g);
+
+	while ((opt = getopt(argc, argv, YIMG_GEOMETRY_OPTS "c:w:j:lv")) != -1) {
+		if (yimg_geometry_opt(&g, opt, optarg))
+			continue;
+		switch (opt) {
+		case 'c':
+			dev_blocks = atoi(optarg);
+			break;
+		case 'w':
+			ptr_size = atoi(optarg);
+			break;
+		case 'j':
+			n_threads = atoi(optarg);
+			break;
+		case 'l':
+			list = 1;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 1 || (ptr_size != 4 && ptr_size != 8))
+		usage(argv[0]);
+
+	img = yimg_open(argv[optind], &g);
+	if (!img)
+		exit(2);
+	ppb = img->g.pages_per_block;
+	internal_start = g.start_block ? g.start_block : 1;
+	if (!dev_blocks)
+		dev_blocks = img->n_blocks;
+
+	img->keep_tags = 1;
+	if (yimg_scan(img, n_threads) < 0 || yimg_build_index(img) < 0) {
+		perror("scan");
+		exit(2);
+	}
+
+	fblocks = calloc(img->n_blocks + 1, sizeof(*fblocks));
+	live = calloc((size_t)img->n_blocks * ppb + 1, 1);
+	obj_problems = calloc(img->n_objs, sizeof(u32));
+	if (!fblocks || !live || !obj_problems) {
+		perror("calloc");
+		exit(2);
+	}
+
+	mark_live();
+	if (yimg_parallel(img->n_blocks, n_threads, check_block, NULL) < 0 ||
+	    yimg_parallel(img->n_objs, n_threads, check_obj, NULL) < 0) {
+		perror("check");
+		exit(2);
+	}
+	check_tree();
+
+	report_blocks();
+	report_objs();
+	check_checkpoint();
+
+	if (list)
+		list_blocks();
+	show_stats();
+
+	if (!verbose && n_reported < n_errors + n_warnings)
+		printf("%d more problems not shown, use -v\n",
+		       n_errors + n_warnings - n_reported);
+	printf("%u objects, %d errors, %d warnings\n", img->n_objs, n_errors,
+	       n_warnings);
+
+	yimg_close(img);
+	return n_errors ? 1 : 0;
+}
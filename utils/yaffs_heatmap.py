@@ -0,0 +1,157 @@
+#!/usr/bin/env python3
+##
+## YAFFS: Yet Another Flash File System. A NAND-flash specific file system.
+##
+## Copyright (C) 2002-2011 Aleph One Ltd.
+##   for Toby Churchill Ltd and Brightstar Engineering
+##
+## Created by Charles Manning <charles@aleph1.co.uk>
+##
+## This program is free software; you can redistribute it and/or modify
+## it under the terms of the GNU General Public License version 2 as
+## published by the Free Software Foundation.
+##
+
+##
+## yaffs_heatmap.py
+##
+## Summarises a NAND access profile dump (see yaffs_nandprof.h) and renders
+## one heatmap per operation, one cell per block laid out row by row.
+## Images are PNG if matplotlib is installed, otherwise greyscale PGM.
+##
+## usage: yaffs_heatmap.py [-c cause,...] [-w width] [-o prefix] dump
+##
+
+import sys
+import struct
+import getopt
+
+MAGIC = 0x46504e59
+OPS = ["read", "write", "erase"]
+CAUSES = ["data", "header", "gc", "checkpt", "summary", "scan"]
+
+def load(fname):
+	data = open(fname, "rb").read()
+	for endian in "<>":
+		hdr = struct.unpack(endian + "7I", data[:28])
+		if hdr[0] == MAGIC:
+			break
+	else:
+		sys.exit("%s: not a NAND profile dump" % fname)
+
+	magic, version, first_block, n_blocks, cpb, n_ops, n_causes = hdr
+	if version != 1:
+		sys.exit("%s: unknown version %d" % (fname, version))
+
+	n = n_blocks * n_ops * n_causes
+	counts = struct.unpack_from("%s%dI" % (endian, n), data, 28)
+	pages = struct.unpack_from("%s%dI" % (endian, cpb * 2), data, 28 + n * 4)
+
+	# blocks[b][op][cause]
+	blocks = [[counts[(b * n_ops + op) * n_causes:
+			  (b * n_ops + op + 1) * n_causes]
+		   for op in range(n_ops)] for b in range(n_blocks)]
+	return first_block, cpb, blocks, pages
+
+def summary(first_block, cpb, blocks, pages, causes):
+	print("%d blocks from %d, %d chunks per block" %
+		(len(blocks), first_block, cpb))
+	print("%-8s" % "" + "".join("%10s" % c for c in CAUSES) + "%10s" % "total")
+	for op, name in enumerate(OPS):
+		per_cause = [sum(b[op][c] for b in blocks)
+				for c in range(len(CAUSES))]
+		print("%-8s" % name + "".join("%10d" % x for x in per_cause) +
+			"%10d" % sum(per_cause))
+
+	for op, name in enumerate(OPS):
+		totals = sorted(((sum(b[op][c] for c in causes), i)
+				for i, b in enumerate(blocks)), reverse=True)
+		hot = ["%d:%d" % (first_block + i, t) for t, i in totals[:8] if t]
+		print("hottest %-6s %s" % (name, " ".join(hot) or "-"))
+
+	n_rd = sum(pages[0::2])
+	n_wr = sum(pages[1::2])
+	if n_rd or n_wr:
+		print("page position  reads  writes")
+		for p in range(cpb):
+			print("%13d %6d %7d" % (p, pages[p * 2], pages[p * 2 + 1]))
+
+def write_pgm(fname, grid, scale):
+	rows = len(grid)
+	cols = len(grid[0])
+	top = max(max(r) for r in grid) or 1
+	with open(fname, "wb") as f:
+		f.write(b"P5\n%d %d\n255\n" % (cols * scale, rows * scale))
+		for r in grid:
+			line = bytearray()
+			for v in r:
+				line += bytes([v * 255 // top]) * scale
+			f.write(bytes(line) * scale)
+
+def render(prefix, first_block, blocks, causes, width):
+	try:
+		import matplotlib
+		matplotlib.use("Agg")
+		import matplotlib.pyplot as plt
+	except ImportError:
+		plt = None
+
+	n_rows = (len(blocks) + width - 1) // width
+	for op, name in enumerate(OPS):
+		grid = [[0] * width for r in range(n_rows)]
+		for i, b in enumerate(blocks):
+			grid[i // width][i % width] = sum(b[op][c] for c in causes)
+
+		if plt:
+			fname = "%s-%s.png" % (prefix, name)
+			fig, ax = plt.subplots()
+			im = ax.imshow(grid, cmap="hot", interpolation="nearest",
+					aspect="auto",
+					extent=(0, width, first_block + n_rows * width,
+						first_block))
+			ax.set_title("%s (%s)" % (name,
+				",".join(CAUSES[c] for c in causes)))
+			ax.set_xlabel("block % " + str(width))
+			ax.set_ylabel("block")
+			fig.colorbar(im)
+			fig.savefig(fname)
+			plt.close(fig)
+		else:
+			fname = "%s-%s.pgm" % (prefix, name)
+			write_pgm(fname, grid, 4)
+		print("wrote %s" % fname)
+
+def usage():
+	sys.exit("usage: %s [-c cause,...] [-w width] [-o prefix] dump\n"
+		"causes: %s" % (sys.argv[0], ",".join(CAUSES)))
+
+def main():
+	causes = list(range(len(CAUSES)))
+	width = 64
+	prefix = None
+
+	try:
+		opts, args = getopt.getopt(sys.argv[1:], "c:w:o:")
+	except getopt.GetoptError:
+		usage()
+	if len(args) != 1:
+		usage()
+
+	for o, a in opts:
+		if o == "-c":
+			try:
+				causes = [CAUSES.index(c) for c in a.split(",")]
+			except ValueError:
+				usage()
+		elif o == "-w":
+			width = int(a)
+		elif o == "-o":
+			prefix = a
+
+	first_block, cpb, blocks, pages = load(args[0])
+	summary(first_block, cpb, blocks, pages, causes)
+	if prefix:
+		render(prefix, first_block, blocks, causes, width)
+
+if __name__ == "__main__":
+	main()
@@ -0,0 +1,1154 @@
+/*
+ * YAFFS: Yet Another Flash File System. A NAND-flash specific file system.
+ *
+ * Copyright (C) 2002-2011 Aleph One Ltd.
+ *   for Toby Churchill Ltd and Brightstar Engineering
+ *
+ * Created by Charles Manning <charles@aleph1.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/*
+ * yaffs_image.c
+ *
+ * Read-only yaffs2 image library, see yaffs_image.h.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "yaffs_image.h"
+#include "yaffs_summary.h"
+
+#define YIMG_INDEX_MAGIC	0x58494d59	/* "YMIX" little endian */
+#define YIMG_INDEX_VERSION	1
+
+#define YIMG_BATCH		16	/* Items claimed at a time by yimg_parallel() */
+
+void yimg_default_geometry(struct yimg_geometry *g)
+{
+	memset(g, 0, sizeof(*g));
+	g->page_size = 2048;
+	g->spare_size = 64;
+	g->pages_per_block = 64;
+	g->tags_ecc = 1;
+}
+
+/* Returns 1 if opt is a geometry option, having applied it. */
+int yimg_geometry_opt(struct yimg_geometry *g, int opt, const char *arg)
+{
+	switch (opt) {
+	case 'p':
+		g->page_size = atoi(arg);
+		break;
+	case 'o':
+		g->spare_size = atoi(arg);
+		break;
+	case 'b':
+		g->pages_per_block = atoi(arg);
+		g->block_size = 0;
+		break;
+	case 'k':
+		g->block_size = atoi(arg);
+		break;
+	case 't':
+		g->tags_offset = atoi(arg);
+		break;
+	case 's':
+		g->start_block = atoi(arg);
+		break;
+	case 'i':
+		g->inband_tags = 1;
+		g->spare_size = 0;
+		break;
+	case 'x':
+		g->tags_ecc = 0;
+		break;
+	default:
+		return 0;
+	}
+	return 1;
+}
+
+void yimg_geometry_usage(void)
+{
+	printf("image layout, as for mkyaffs2image:\n"
+	       "   -p bytes   page size, excluding spare (default 2048)\n"
+	       "   -o bytes   spare size (default 64, give it after -i)\n"
+	       "   -b pages   pages per block (default 64)\n"
+	       "   -k bytes   block size, if the pages don't fill the block\n"
+	       "   -t offset  where the tags are in the spare (default 0)\n"
+	       "   -s block   the device's first block (param.start_block)\n"
+	       "   -i         inband tags\n"
+	       "   -x         no ECC on the tags\n");
+}
+
+static double ms_since(const struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) * 1000.0 +
+		(now.tv_usec - start->tv_usec) / 1000.0;
+}
+
+struct yimg *yimg_open(const char *file_name, const struct yimg_geometry *g)
+{
+	struct yimg *img;
+	struct stat st;
+	int sum_chunks;
+
+	img = calloc(1, sizeof(*img));
+	if (!img)
+		return NULL;
+
+	img->g = *g;
+	img->chunk_size = g->page_size;
+	if (g->inband_tags)
+		img->chunk_size -= sizeof(struct yaffs_packed_tags2_tags_only);
+	if (g->block_size)
+		img->g.pages_per_block = g->block_size / (g->page_size + g->spare_size);
+	img->block_bytes = g->block_size ? g->block_size :
+			img->g.pages_per_block * (g->page_size + g->spare_size);
+
+	if (img->chunk_size < (int)sizeof(struct yaffs_obj_hdr) ||
+	    img->g.pages_per_block < 2 ||
+	    (!g->inband_tags && g->tags_offset +
+	     (g->tags_ecc ? (int)sizeof(struct yaffs_packed_tags2) :
+	      (int)sizeof(struct yaffs_packed_tags2_tags_only)) > g->spare_size)) {
+		fprintf(stderr, "%s: bad geometry\n", file_name);
+		free(img);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	/* As yaffs_summary_init() */
+	sum_chunks = (img->g.pages_per_block * sizeof(struct yaffs_summary_tags) +
+			img->chunk_size - 1) / img->chunk_size;
+	img->chunks_per_summary = img->g.pages_per_block - sum_chunks;
+
+	img->fd = open(file_name, O_RDONLY);
+	if (img->fd < 0 || fstat(img->fd, &st) < 0) {
+		perror(file_name);
+		goto fail;
+	}
+	img->image_size = st.st_size;
+	img->image_mtime = st.st_mtime;
+	img->n_blocks = st.st_size / img->block_bytes;
+	img->map_size = st.st_size;
+
+	if (img->map_size) {
+		img->map = mmap(NULL, img->map_size, PROT_READ, MAP_SHARED,
+				img->fd, 0);
+		if (img->map == MAP_FAILED) {
+			perror("mmap");
+			img->map = NULL;
+			goto fail;
+		}
+	}
+	return img;
+
+fail:
+	if (img->fd >= 0)
+		close(img->fd);
+	free(img);
+	return NULL;
+}
+
+static void yimg_free_index(struct yimg *img)
+{
+	free(img->objs);
+	free(img->obj_index);
+	free(img->chunk_map);
+	img->objs = NULL;
+	img->obj_index = NULL;
+	img->chunk_map = NULL;
+	img->n_objs = 0;
+	img->n_chunk_map = 0;
+}
+
+static void yimg_free_tags(struct yimg *img)
+{
+	free(img->blocks);
+	free(img->tags);
+	free(img->chunk_state);
+	img->blocks = NULL;
+	img->tags = NULL;
+	img->chunk_state = NULL;
+}
+
+void yimg_close(struct yimg *img)
+{
+	if (!img)
+		return;
+	yimg_free_tags(img);
+	yimg_free_index(img);
+	if (img->map)
+		munmap((void *)img->map, img->map_size);
+	close(img->fd);
+	free(img);
+}
+
+const u8 *yimg_chunk_data(struct yimg *img, u32 chunk)
+{
+	u32 block = chunk / img->g.pages_per_block;
+	u32 page = chunk % img->g.pages_per_block;
+
+	return img->map + (size_t)block * img->block_bytes +
+		(size_t)page * (img->g.page_size + img->g.spare_size);
+}
+
+enum yimg_chunk_state yimg_read_tags(struct yimg *img, u32 chunk,
+				     struct yaffs_packed_tags2_tags_only *pt)
+{
+	const u8 *page = yimg_chunk_data(img, chunk);
+	struct yaffs_packed_tags2 pt2;
+	struct yaffs_ext_tags t;
+
+	if (img->g.inband_tags) {
+		memcpy(pt, page + img->chunk_size, sizeof(*pt));
+		return (pt->seq_number == 0xffffffff) ?
+			YIMG_CHUNK_ERASED : YIMG_CHUNK_OK;
+	}
+
+	page += img->g.page_size + img->g.tags_offset;
+	if (!img->g.tags_ecc) {
+		memcpy(pt, page, sizeof(*pt));
+		return (pt->seq_number == 0xffffffff) ?
+			YIMG_CHUNK_ERASED : YIMG_CHUNK_OK;
+	}
+
+	/* yaffs_unpack_tags2() corrects the packed tags in place */
+	memcpy(&pt2, page, sizeof(pt2));
+	yaffs_unpack_tags2(&t, &pt2, 1);
+	*pt = pt2.t;
+
+	if (pt->seq_number == 0xffffffff)
+		return YIMG_CHUNK_ERASED;
+	if (t.ecc_result == YAFFS_ECC_RESULT_FIXED)
+		return YIMG_CHUNK_ECC_FIXED;
+	if (t.ecc_result == YAFFS_ECC_RESULT_UNFIXED)
+		return YIMG_CHUNK_ECC_BAD;
+	return YIMG_CHUNK_OK;
+}
+
+/*
+ * Fills in the tags of a full block from its summary. Returns 0 if the
+ * block has no usable summary.
+ */
+static int yimg_scan_summary(struct yimg *img, int blk, u32 seq)
+{
+	struct yaffs_packed_tags2_tags_only pt;
+	struct yaffs_summary_tags sum[img->chunks_per_summary];
+	u32 base = blk * img->g.pages_per_block;
+	u32 chunk = base + img->chunks_per_summary;
+	enum yimg_chunk_state state;
+	u8 *sum_bytes = (u8 *)sum;
+	int n_bytes = sizeof(sum);
+	int this_tx;
+	int chunk_id = 1;
+	int i;
+
+	/* The summary is a byte stream over the last chunks of the block */
+	while (n_bytes > 0) {
+		if (chunk >= base + img->g.pages_per_block)
+			return 0;
+		state = yimg_read_tags(img, chunk, &pt);
+		if ((state != YIMG_CHUNK_OK && state != YIMG_CHUNK_ECC_FIXED) ||
+		    pt.obj_id != YAFFS_OBJECTID_SUMMARY ||
+		    pt.chunk_id != (unsigned)chunk_id ||
+		    pt.seq_number != seq)
+			return 0;
+		this_tx = n_bytes < img->chunk_size ? n_bytes : img->chunk_size;
+		memcpy(sum_bytes, yimg_chunk_data(img, chunk), this_tx);
+		sum_bytes += this_tx;
+		n_bytes -= this_tx;
+		chunk++;
+		chunk_id++;
+	}
+
+	/*
+	 * Entries for chunks written before a remount from checkpoint are left
+	 * zero, so those chunks' tags are read as yaffs2_scan_chunk() does.
+	 */
+	for (i = 0; i < img->chunks_per_summary; i++) {
+		if (sum[i].obj_id == 0) {
+			img->chunk_state[base + i] =
+				yimg_read_tags(img, base + i, &img->tags[base + i]);
+			continue;
+		}
+		img->tags[base + i].seq_number = seq;
+		img->tags[base + i].obj_id = sum[i].obj_id;
+		img->tags[base + i].chunk_id = sum[i].chunk_id;
+		img->tags[base + i].n_bytes = sum[i].n_bytes;
+		img->chunk_state[base + i] = YIMG_CHUNK_SUMMARY;
+	}
+
+	/* The summary chunks themselves */
+	for (i = img->chunks_per_summary; i < img->g.pages_per_block; i++)
+		img->chunk_state[base + i] =
+			yimg_read_tags(img, base + i, &img->tags[base + i]);
+	return 1;
+}
+
+static void yimg_scan_block(void *arg, int blk)
+{
+	struct yimg *img = arg;
+	struct yimg_block *b = &img->blocks[blk];
+	u32 base = blk * img->g.pages_per_block;
+	u32 seq;
+	int i;
+
+	img->chunk_state[base] = yimg_read_tags(img, base, &img->tags[base]);
+	if (img->chunk_state[base] == YIMG_CHUNK_ERASED) {
+		b->state = YIMG_BLOCK_EMPTY;
+		return;
+	}
+
+	seq = img->tags[base].seq_number;
+	b->seq_number = seq;
+	if (seq == YAFFS_SEQUENCE_CHECKPOINT_DATA)
+		b->state = YIMG_BLOCK_CHECKPOINT;
+	else if (seq < YAFFS_LOWEST_SEQUENCE_NUMBER ||
+		 seq > YAFFS_HIGHEST_SEQUENCE_NUMBER)
+		b->state = YIMG_BLOCK_UNKNOWN;
+	else
+		b->state = YIMG_BLOCK_DATA;
+
+	if (b->state == YIMG_BLOCK_DATA && yimg_scan_summary(img, blk, seq)) {
+		b->summary_used = 1;
+		b->n_chunks = img->g.pages_per_block;
+		return;
+	}
+
+	for (i = 1; i < img->g.pages_per_block; i++) {
+		img->chunk_state[base + i] =
+			yimg_read_tags(img, base + i, &img->tags[base + i]);
+		if (img->chunk_state[base + i] == YIMG_CHUNK_ERASED)
+			break;
+	}
+	b->n_chunks = i;
+}
+
+struct yimg_parallel_ctx {
+	void (*fn)(void *arg, int i);
+	void *arg;
+	int n;
+	pthread_mutex_t lock;
+	int next;
+};
+
+static void *yimg_parallel_thread(void *arg)
+{
+	struct yimg_parallel_ctx *ctx = arg;
+	int i, end;
+
+	for (;;) {
+		pthread_mutex_lock(&ctx->lock);
+		i = ctx->next;
+		ctx->next += YIMG_BATCH;
+		pthread_mutex_unlock(&ctx->lock);
+
+		if (i >= ctx->n)
+			break;
+		end = i + YIMG_BATCH;
+		if (end > ctx->n)
+			end = ctx->n;
+		for (; i < end; i++)
+			ctx->fn(ctx->arg, i);
+	}
+	return NULL;
+}
+
+/*
+ * Calls fn(arg, i) for each i from 0 to n - 1, spread over n_threads
+ * (0 for one per cpu) that take YIMG_BATCH items at a time.
+ */
+int yimg_parallel(int n, int n_threads, void (*fn)(void *arg, int i),
+		  void *arg)
+{
+	struct yimg_parallel_ctx ctx;
+	pthread_t *threads;
+	int i;
+
+	if (n_threads <= 0)
+		n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n_threads > n / YIMG_BATCH + 1)
+		n_threads = n / YIMG_BATCH + 1;
+	if (n_threads < 1)
+		n_threads = 1;
+
+	threads = malloc(n_threads * sizeof(pthread_t));
+	if (!threads) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	ctx.fn = fn;
+	ctx.arg = arg;
+	ctx.n = n;
+	ctx.next = 0;
+	pthread_mutex_init(&ctx.lock, NULL);
+
+	/* The calling thread is one of the workers */
+	for (i = 1; i < n_threads; i++)
+		if (pthread_create(&threads[i], NULL, yimg_parallel_thread, &ctx))
+			break;
+	n_threads = i;
+	yimg_parallel_thread(&ctx);
+	for (i = 1; i < n_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	pthread_mutex_destroy(&ctx.lock);
+	free(threads);
+	return 0;
+}
+
+/* Reads the tags of every block, n_threads at a time (0 for one per cpu). */
+int yimg_scan(struct yimg *img, int n_threads)
+{
+	struct timeval start;
+	size_t n_chunks = (size_t)img->n_blocks * img->g.pages_per_block;
+	int i;
+
+	gettimeofday(&start, NULL);
+
+	yimg_free_tags(img);
+	img->blocks = calloc(img->n_blocks ? img->n_blocks : 1,
+			     sizeof(*img->blocks));
+	img->tags = malloc((n_chunks ? n_chunks : 1) * sizeof(*img->tags));
+	img->chunk_state = calloc(n_chunks ? n_chunks : 1, 1);
+	if (!img->blocks || !img->tags || !img->chunk_state) {
+		yimg_free_tags(img);
+		errno = ENOMEM;
+		return -1;
+	}
+	memset(img->tags, 0xff, n_chunks * sizeof(*img->tags));
+
+	if (yimg_parallel(img->n_blocks, n_threads, yimg_scan_block, img) < 0)
+		return -1;
+
+	memset(&img->stats, 0, sizeof(img->stats));
+	for (i = 0; i < img->n_blocks; i++) {
+		switch (img->blocks[i].state) {
+		case YIMG_BLOCK_EMPTY:
+			img->stats.blocks_empty++;
+			break;
+		case YIMG_BLOCK_CHECKPOINT:
+			img->stats.blocks_checkpt++;
+			break;
+		case YIMG_BLOCK_DATA:
+			if (img->blocks[i].summary_used)
+				img->stats.blocks_summary++;
+			else
+				img->stats.blocks_tags++;
+			break;
+		}
+	}
+	for (i = 0; i < (int)n_chunks; i++) {
+		if (img->chunk_state[i] == YIMG_CHUNK_ECC_FIXED)
+			img->stats.chunks_ecc_fixed++;
+		else if (img->chunk_state[i] == YIMG_CHUNK_ECC_BAD)
+			img->stats.chunks_ecc_bad++;
+	}
+
+	img->stats.scan_ms = ms_since(&start);
+	return 0;
+}
+
+/* Object state while building the index, as struct yaffs_obj in the scan */
+struct yimg_scan_obj {
+	u8 valid;
+	u32 type;
+	u32 parent_id;
+	u32 hdr_chunk;
+	u32 file_size;
+	u32 scanned_size;
+	u32 shrink_size;
+	u32 equiv_id;
+	u32 *map;		/* Image chunk for each chunk id - 1 */
+	u32 map_len;
+	u32 map_alloc;
+};
+
+static struct yimg_scan_obj *yimg_get_obj(struct yimg_scan_obj **sobjs,
+					  u32 obj_id, u32 type)
+{
+	struct yimg_scan_obj *o = sobjs[obj_id];
+
+	if (!o) {
+		o = calloc(1, sizeof(*o));
+		if (!o)
+			return NULL;
+		o->type = type;
+		o->hdr_chunk = YIMG_NONE;
+		o->shrink_size = 0xffffffff;
+		sobjs[obj_id] = o;
+	}
+	return o;
+}
+
+static int yimg_put_chunk(struct yimg_scan_obj *o, u32 chunk_id, u32 chunk)
+{
+	u32 *map;
+	u32 n;
+
+	if (chunk_id > o->map_alloc) {
+		n = o->map_alloc ? o->map_alloc : 16;
+		while (n < chunk_id)
+			n *= 2;
+		map = realloc(o->map, n * sizeof(u32));
+		if (!map)
+			return -1;
+		memset(map + o->map_alloc, 0xff, (n - o->map_alloc) * sizeof(u32));
+		o->map = map;
+		o->map_alloc = n;
+	}
+	/* Newest first, so keep what is there */
+	if (o->map[chunk_id - 1] == YIMG_NONE)
+		o->map[chunk_id - 1] = chunk;
+	if (chunk_id > o->map_len)
+		o->map_len = chunk_id;
+	return 0;
+}
+
+static const struct yaffs_obj_hdr *yimg_hdr(struct yimg *img, u32 chunk)
+{
+	return (const struct yaffs_obj_hdr *)yimg_chunk_data(img, chunk);
+}
+
+static u32 yimg_hash(const char *name)
+{
+	u32 h = 5381;
+
+	while (*name)
+		h = h * 33 + (u8)*name++;
+	return h;
+}
+
+/* Handles one chunk, newest first, as yaffs2_scan_chunk() does */
+static int yimg_index_chunk(struct yimg *img, struct yimg_scan_obj **sobjs,
+			    u32 chunk, struct yimg_block *b)
+{
+	struct yaffs_packed_tags2_tags_only pt = img->tags[chunk];
+	const struct yaffs_obj_hdr *oh = NULL;
+	struct yimg_scan_obj *o;
+	struct yimg_scan_obj *sh;
+	struct yaffs_ext_tags t;
+	u32 shadowed;
+	u32 this_size;
+	u32 parent_id;
+	u32 type;
+	int is_shrink;
+	int shadows;
+
+	if (img->chunk_state[chunk] == YIMG_CHUNK_ERASED ||
+	    img->chunk_state[chunk] == YIMG_CHUNK_ECC_BAD)
+		return 0;
+
+	yaffs_unpack_tags2_tags_only(&t, &pt);
+
+	if (t.obj_id > YAFFS_MAX_OBJECT_ID ||
+	    t.chunk_id > YAFFS_MAX_CHUNK_ID ||
+	    t.obj_id == YAFFS_OBJECTID_SUMMARY ||
+	    t.obj_id == 0 ||
+	    (t.chunk_id > 0 && t.n_bytes > (u32)img->chunk_size) ||
+	    t.seq_number != b->seq_number)
+		return 0;
+
+	if (t.chunk_id > 0) {
+		u32 chunk_base = (t.chunk_id - 1) * img->chunk_size;
+		u32 endpos = chunk_base + t.n_bytes;
+
+		o = yimg_get_obj(sobjs, t.obj_id, YAFFS_OBJECT_TYPE_FILE);
+		if (!o)
+			return -1;
+		if (o->type != YAFFS_OBJECT_TYPE_FILE ||
+		    chunk_base >= o->shrink_size)
+			return 0;
+		if (yimg_put_chunk(o, t.chunk_id, chunk) < 0)
+			return -1;
+		if (!o->valid && o->scanned_size < endpos) {
+			o->scanned_size = endpos;
+			o->file_size = endpos;
+		}
+		return 0;
+	}
+
+	/* Object header. The extra tags give most of what we need. */
+	if (t.extra_available) {
+		type = t.extra_obj_type;
+		parent_id = t.extra_parent_id;
+		this_size = t.extra_length;
+		is_shrink = t.extra_is_shrink;
+		shadows = t.extra_shadows;
+	} else {
+		oh = yimg_hdr(img, chunk);
+		type = oh->type;
+		parent_id = oh->parent_obj_id;
+		this_size = oh->file_size;
+		if (img->g.inband_tags) {
+			/* As yaffs2_scan_backwards() fixes up the header */
+			is_shrink = oh->inband_is_shrink;
+			shadows = oh->inband_shadowed_obj_id > 0;
+		} else {
+			is_shrink = oh->is_shrink;
+			shadows = oh->shadows_obj > 0;
+		}
+	}
+
+	o = yimg_get_obj(sobjs, t.obj_id, type);
+	if (!o)
+		return -1;
+
+	if (o->valid) {
+		/* An older header, only resizes matter */
+		if (o->type == YAFFS_OBJECT_TYPE_FILE &&
+		    type == YAFFS_OBJECT_TYPE_FILE) {
+			if (parent_id == YAFFS_OBJECTID_DELETED ||
+			    parent_id == YAFFS_OBJECTID_UNLINKED) {
+				this_size = 0;
+				is_shrink = 1;
+			}
+			if (is_shrink && o->shrink_size > this_size)
+				o->shrink_size = this_size;
+		}
+		return 0;
+	}
+
+	o->valid = 1;
+	o->type = type;
+	o->parent_id = parent_id;
+	o->hdr_chunk = chunk;
+
+	if (shadows) {
+		/* A rename over an object, which is then gone. */
+		oh = yimg_hdr(img, chunk);
+		shadowed = img->g.inband_tags ?
+			oh->inband_shadowed_obj_id : (u32)oh->shadows_obj;
+
+		if (shadowed > 0 && shadowed <= YAFFS_MAX_OBJECT_ID) {
+			sh = yimg_get_obj(sobjs, shadowed,
+					  YAFFS_OBJECT_TYPE_FILE);
+			if (!sh)
+				return -1;
+			if (!sh->valid) {
+				sh->valid = 1;
+				sh->parent_id = YAFFS_OBJECTID_DELETED;
+				sh->shrink_size = 0;
+			}
+		}
+	}
+
+	if (type == YAFFS_OBJECT_TYPE_FILE) {
+		if (o->scanned_size < this_size) {
+			o->file_size = this_size;
+			o->scanned_size = this_size;
+		}
+		if (o->shrink_size > this_size)
+			o->shrink_size = this_size;
+	} else if (type == YAFFS_OBJECT_TYPE_HARDLINK) {
+		o->equiv_id = t.extra_available ? t.extra_equiv_id :
+			(u32)oh->equiv_id;
+	}
+	return 0;
+}
+
+static int yimg_cmp_seq(const void *a, const void *b)
+{
+	const struct yimg_block *ba = *(const struct yimg_block * const *)a;
+	const struct yimg_block *bb = *(const struct yimg_block * const *)b;
+
+	if (ba->seq_number != bb->seq_number)
+		return ba->seq_number < bb->seq_number ? 1 : -1;
+	return 0;
+}
+
+static u32 yimg_add_obj(struct yimg *img, u32 obj_id, u32 parent_id, u32 type)
+{
+	struct yimg_obj *o = &img->objs[img->n_objs];
+
+	memset(o, 0, sizeof(*o));
+	o->obj_id = obj_id;
+	o->parent_id = parent_id;
+	o->type = type;
+	o->hdr_chunk = YIMG_NONE;
+	o->chunk_map = YIMG_NONE;
+	o->first_child = YIMG_NONE;
+	o->next_sibling = YIMG_NONE;
+	img->obj_index[obj_id] = img->n_objs;
+	return img->n_objs++;
+}
+
+/* Works out the objects from the tags read by yimg_scan() */
+int yimg_build_index(struct yimg *img)
+{
+	struct yimg_scan_obj **sobjs;
+	struct yimg_scan_obj *so;
+	struct yimg_block **order;
+	struct yimg_obj *o;
+	struct yimg_obj *p;
+	struct timeval start;
+	char name[YAFFS_MAX_NAME_LENGTH + 1];
+	u32 n_valid = 0;
+	u32 n_map = 0;
+	u32 id, i, idx;
+	int n_order = 0;
+	int blk;
+	int c;
+	int ret = -1;
+
+	if (!img->blocks) {
+		errno = EINVAL;
+		return -1;
+	}
+	gettimeofday(&start, NULL);
+	yimg_free_index(img);
+
+	sobjs = calloc(YAFFS_MAX_OBJECT_ID + 1, sizeof(*sobjs));
+	order = malloc((img->n_blocks + 1) * sizeof(*order));
+	if (!sobjs || !order)
+		goto out;
+
+	/* Newest block first, newest chunk first */
+	for (blk = 0; blk < img->n_blocks; blk++)
+		if (img->blocks[blk].state == YIMG_BLOCK_DATA)
+			order[n_order++] = &img->blocks[blk];
+	qsort(order, n_order, sizeof(*order), yimg_cmp_seq);
+
+	for (i = 0; i < (u32)n_order; i++) {
+		blk = order[i] - img->blocks;
+		for (c = order[i]->n_chunks - 1; c >= 0; c--)
+			if (yimg_index_chunk(img, sobjs,
+					blk * img->g.pages_per_block + c,
+					order[i]) < 0)
+				goto out;
+	}
+
+	/* Count what goes in the index */
+	for (id = 1; id <= YAFFS_MAX_OBJECT_ID; id++) {
+		so = sobjs[id];
+		if (!so)
+			continue;
+		if (so->valid && (so->parent_id == YAFFS_OBJECTID_DELETED ||
+				  so->parent_id == YAFFS_OBJECTID_UNLINKED))
+			continue;
+		if (!so->valid && !so->map_len)
+			continue;
+		n_valid++;
+		n_map += so->map_len;
+	}
+
+	img->objs = calloc(n_valid + 2, sizeof(*img->objs));
+	img->obj_index = malloc((YAFFS_MAX_OBJECT_ID + 1) * sizeof(u32));
+	img->chunk_map = malloc((n_map ? n_map : 1) * sizeof(u32));
+	if (!img->objs || !img->obj_index || !img->chunk_map)
+		goto out;
+	memset(img->obj_index, 0xff, (YAFFS_MAX_OBJECT_ID + 1) * sizeof(u32));
+
+	/* Root and lost+found always exist, see yaffs_create_initial_dir() */
+	img->root = yimg_add_obj(img, YAFFS_OBJECTID_ROOT, 0,
+				 YAFFS_OBJECT_TYPE_DIRECTORY);
+	img->lost_n_found = yimg_add_obj(img, YAFFS_OBJECTID_LOSTNFOUND,
+					 YAFFS_OBJECTID_ROOT,
+					 YAFFS_OBJECT_TYPE_DIRECTORY);
+
+	for (id = 1; id <= YAFFS_MAX_OBJECT_ID; id++) {
+		so = sobjs[id];
+		if (!so)
+			continue;
+		if (so->valid && (so->parent_id == YAFFS_OBJECTID_DELETED ||
+				  so->parent_id == YAFFS_OBJECTID_UNLINKED))
+			continue;
+		if (!so->valid && !so->map_len)
+			continue;
+
+		if (id == YAFFS_OBJECTID_ROOT || id == YAFFS_OBJECTID_LOSTNFOUND) {
+			idx = img->obj_index[id];
+		} else {
+			/* Data without a header is put in lost+found */
+			idx = yimg_add_obj(img, id, so->valid ?
+				so->parent_id : YAFFS_OBJECTID_LOSTNFOUND,
+				so->type);
+		}
+		o = &img->objs[idx];
+		o->hdr_chunk = so->hdr_chunk;
+		o->equiv_id = so->equiv_id;
+		if (o->type == YAFFS_OBJECT_TYPE_FILE) {
+			o->size = so->file_size;
+			o->chunk_map = img->n_chunk_map;
+			o->n_chunks = so->map_len;
+			memcpy(img->chunk_map + img->n_chunk_map, so->map,
+			       so->map_len * sizeof(u32));
+			img->n_chunk_map += so->map_len;
+		}
+	}
+
+	/* Hook up the directory tree */
+	for (i = 0; i < img->n_objs; i++) {
+		o = &img->objs[i];
+		if (i == img->root)
+			continue;
+
+		if (o->hdr_chunk != YIMG_NONE) {
+			yimg_name(img, i, name, sizeof(name));
+			o->name_hash = yimg_hash(name);
+		}
+
+		idx = img->obj_index[o->parent_id];
+		if (idx == YIMG_NONE || idx == i ||
+		    img->objs[idx].type != YAFFS_OBJECT_TYPE_DIRECTORY) {
+			/* Hanging object, as yaffs_fix_hanging_objs() */
+			o->parent_id = YAFFS_OBJECTID_LOSTNFOUND;
+			idx = img->lost_n_found;
+		}
+		p = &img->objs[idx];
+		o->next_sibling = p->first_child;
+		p->first_child = i;
+	}
+
+	img->stats.index_ms = ms_since(&start);
+	ret = 0;
+
+out:
+	if (sobjs) {
+		for (id = 0; id <= YAFFS_MAX_OBJECT_ID; id++) {
+			if (sobjs[id]) {
+				free(sobjs[id]->map);
+				free(sobjs[id]);
+			}
+		}
+	}
+	free(sobjs);
+	free(order);
+	if (ret < 0) {
+		yimg_free_index(img);
+		errno = ENOMEM;
+	}
+	if (!img->keep_tags)
+		yimg_free_tags(img);
+	return ret;
+}
+
+/*
+ * Index file: this header, the objects and then the chunk map, in host
+ * byte order. The image size and time tell if it is still current.
+ */
+struct yimg_index_hdr {
+	u32 magic;
+	u32 version;
+	struct yimg_geometry g;
+	u32 image_size_lo;
+	u32 image_size_hi;
+	u32 image_mtime;
+	u32 n_objs;
+	u32 n_chunk_map;
+	u32 root;
+	u32 lost_n_found;
+	struct yimg_scan_stats stats;
+};
+
+int yimg_save_index(struct yimg *img, const char *file_name)
+{
+	struct yimg_index_hdr h;
+	FILE *f;
+	int ok;
+
+	if (!img->objs) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memset(&h, 0, sizeof(h));
+	h.magic = YIMG_INDEX_MAGIC;
+	h.version = YIMG_INDEX_VERSION;
+	h.g = img->g;
+	h.image_size_lo = (u32)img->image_size;
+	h.image_size_hi = (u32)((unsigned long long)img->image_size >> 32);
+	h.image_mtime = (u32)img->image_mtime;
+	h.n_objs = img->n_objs;
+	h.n_chunk_map = img->n_chunk_map;
+	h.root = img->root;
+	h.lost_n_found = img->lost_n_found;
+	h.stats = img->stats;
+
+	f = fopen(file_name, "wb");
+	if (!f)
+		return -1;
+	ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+		fwrite(img->objs, sizeof(*img->objs), img->n_objs, f) ==
+			img->n_objs &&
+		fwrite(img->chunk_map, sizeof(u32), img->n_chunk_map, f) ==
+			img->n_chunk_map;
+	if (fclose(f) != 0)
+		ok = 0;
+	return ok ? 0 : -1;
+}
+
+/* Returns 0 if loaded, -1 if missing, stale or unreadable. */
+int yimg_load_index(struct yimg *img, const char *file_name)
+{
+	struct yimg_index_hdr h;
+	FILE *f;
+	u32 i;
+	int ok = 0;
+
+	f = fopen(file_name, "rb");
+	if (!f)
+		return -1;
+
+	if (fread(&h, sizeof(h), 1, f) != 1 ||
+	    h.magic != YIMG_INDEX_MAGIC ||
+	    h.version != YIMG_INDEX_VERSION ||
+	    memcmp(&h.g, &img->g, sizeof(h.g)) ||
+	    h.image_size_lo != (u32)img->image_size ||
+	    h.image_size_hi != (u32)((unsigned long long)img->image_size >> 32) ||
+	    h.image_mtime != (u32)img->image_mtime)
+		goto out;
+
+	yimg_free_index(img);
+	img->objs = malloc((h.n_objs ? h.n_objs : 1) * sizeof(*img->objs));
+	img->chunk_map = malloc((h.n_chunk_map ? h.n_chunk_map : 1) * sizeof(u32));
+	img->obj_index = malloc((YAFFS_MAX_OBJECT_ID + 1) * sizeof(u32));
+	if (!img->objs || !img->chunk_map || !img->obj_index)
+		goto out;
+
+	if (fread(img->objs, sizeof(*img->objs), h.n_objs, f) != h.n_objs ||
+	    fread(img->chunk_map, sizeof(u32), h.n_chunk_map, f) != h.n_chunk_map)
+		goto out;
+
+	memset(img->obj_index, 0xff, (YAFFS_MAX_OBJECT_ID + 1) * sizeof(u32));
+	for (i = 0; i < h.n_objs; i++) {
+		if (img->objs[i].obj_id > YAFFS_MAX_OBJECT_ID)
+			goto out;
+		img->obj_index[img->objs[i].obj_id] = i;
+	}
+	img->n_objs = h.n_objs;
+	img->n_chunk_map = h.n_chunk_map;
+	img->root = h.root;
+	img->lost_n_found = h.lost_n_found;
+	img->stats = h.stats;
+	ok = 1;
+
+out:
+	fclose(f);
+	if (!ok) {
+		yimg_free_index(img);
+		return -1;
+	}
+	return 0;
+}
+
+int yimg_index(struct yimg *img, const char *index_name, int n_threads)
+{
+	if (index_name && yimg_load_index(img, index_name) == 0)
+		return 0;
+
+	if (yimg_scan(img, n_threads) < 0 || yimg_build_index(img) < 0)
+		return -1;
+
+	if (index_name && yimg_save_index(img, index_name) < 0)
+		perror(index_name);
+	return 0;
+}
+
+/* Follows a hard link to the object it links to */
+u32 yimg_equiv(struct yimg *img, u32 obj)
+{
+	u32 idx;
+
+	if (obj < img->n_objs &&
+	    img->objs[obj].type == YAFFS_OBJECT_TYPE_HARDLINK) {
+		idx = img->objs[obj].equiv_id <= YAFFS_MAX_OBJECT_ID ?
+			img->obj_index[img->objs[obj].equiv_id] : YIMG_NONE;
+		if (idx != YIMG_NONE &&
+		    img->objs[idx].type != YAFFS_OBJECT_TYPE_HARDLINK)
+			return idx;
+	}
+	return obj;
+}
+
+int yimg_name(struct yimg *img, u32 obj, char *name, int size)
+{
+	const struct yaffs_obj_hdr *oh;
+	struct yimg_obj *o = &img->objs[obj];
+
+	if (obj == img->root) {
+		snprintf(name, size, "%s", "");
+	} else if (obj == img->lost_n_found) {
+		snprintf(name, size, "%s", "lost+found");
+	} else if (o->hdr_chunk == YIMG_NONE) {
+		snprintf(name, size, "obj%u", o->obj_id);
+	} else {
+		oh = yimg_hdr(img, o->hdr_chunk);
+		snprintf(name, size, "%.*s", YAFFS_MAX_NAME_LENGTH, oh->name);
+	}
+	return 0;
+}
+
+/* Returns the index of the object at path, relative to the root, or YIMG_NONE */
+u32 yimg_lookup(struct yimg *img, const char *path)
+{
+	char name[YAFFS_MAX_NAME_LENGTH + 1];
+	char part[YAFFS_MAX_NAME_LENGTH + 1];
+	u32 dir = img->root;
+	u32 obj;
+	u32 h;
+	int len;
+
+	for (;;) {
+		while (*path == '/')
+			path++;
+		if (!*path)
+			return dir;
+
+		len = strcspn(path, "/");
+		if (len > YAFFS_MAX_NAME_LENGTH)
+			return YIMG_NONE;
+		memcpy(part, path, len);
+		part[len] = 0;
+		path += len;
+
+		dir = yimg_equiv(img, dir);
+		if (img->objs[dir].type != YAFFS_OBJECT_TYPE_DIRECTORY)
+			return YIMG_NONE;
+
+		if (!strcmp(part, "."))
+			continue;
+		if (!strcmp(part, "..")) {
+			if (dir != img->root)
+				dir = img->obj_index[img->objs[dir].parent_id];
+			continue;
+		}
+
+		h = yimg_hash(part);
+		for (obj = img->objs[dir].first_child; obj != YIMG_NONE;
+		     obj = img->objs[obj].next_sibling) {
+			if (obj != img->lost_n_found &&
+			    img->objs[obj].hdr_chunk != YIMG_NONE &&
+			    img->objs[obj].name_hash != h)
+				continue;
+			yimg_name(img, obj, name, sizeof(name));
+			if (!strcmp(name, part))
+				break;
+		}
+		if (obj == YIMG_NONE)
+			return YIMG_NONE;
+		dir = obj;
+	}
+}
+
+int yimg_stat(struct yimg *img, u32 obj, struct yimg_stat *st)
+{
+	const struct yaffs_obj_hdr *oh = NULL;
+	struct yimg_obj *o;
+
+	obj = yimg_equiv(img, obj);
+	o = &img->objs[obj];
+
+	memset(st, 0, sizeof(*st));
+	st->obj_id = o->obj_id;
+	st->type = o->type;
+	st->size = o->size;
+
+	if (o->hdr_chunk != YIMG_NONE) {
+		oh = yimg_hdr(img, o->hdr_chunk);
+		st->mode = oh->yst_mode;
+		st->uid = oh->yst_uid;
+		st->gid = oh->yst_gid;
+		st->atime = oh->yst_atime;
+		st->mtime = oh->yst_mtime;
+		st->ctime = oh->yst_ctime;
+		st->rdev = oh->yst_rdev;
+	} else {
+		st->mode = o->type == YAFFS_OBJECT_TYPE_DIRECTORY ? 0755 : 0644;
+	}
+
+	/* The core does not always store the type bits, see yaffsfs_do_stat() */
+	switch (o->type) {
+	case YAFFS_OBJECT_TYPE_DIRECTORY:
+		st->mode = (st->mode & ~S_IFMT) | S_IFDIR;
+		break;
+	case YAFFS_OBJECT_TYPE_SYMLINK:
+		st->mode = (st->mode & ~S_IFMT) | S_IFLNK;
+		break;
+	case YAFFS_OBJECT_TYPE_FILE:
+		st->mode = (st->mode & ~S_IFMT) | S_IFREG;
+		break;
+	default:
+		break;
+	}
+
+	if (oh && o->type == YAFFS_OBJECT_TYPE_SYMLINK)
+		st->size = strnlen(oh->alias, YAFFS_MAX_ALIAS_LENGTH);
+	return 0;
+}
+
+int yimg_readlink(struct yimg *img, u32 obj, char *alias, int size)
+{
+	const struct yaffs_obj_hdr *oh;
+	struct yimg_obj *o = &img->objs[obj];
+
+	if (o->type != YAFFS_OBJECT_TYPE_SYMLINK || o->hdr_chunk == YIMG_NONE) {
+		errno = EINVAL;
+		return -1;
+	}
+	oh = yimg_hdr(img, o->hdr_chunk);
+	snprintf(alias, size, "%.*s", YAFFS_MAX_ALIAS_LENGTH, oh->alias);
+	return 0;
+}
+
+/* Reads file data. Holes and missing chunks read as zeros. */
+int yimg_read(struct yimg *img, u32 obj, u32 offset, void *buf, int n)
+{
+	struct yimg_obj *o;
+	u8 *dst = buf;
+	u32 chunk_id;
+	u32 in_chunk;
+	u32 chunk;
+	int this_tx;
+	int done = 0;
+
+	obj = yimg_equiv(img, obj);
+	o = &img->objs[obj];
+	if (o->type != YAFFS_OBJECT_TYPE_FILE) {
+		errno = EISDIR;
+		return -1;
+	}
+
+	if (offset >= o->size)
+		return 0;
+	if (n > (int)(o->size - offset))
+		n = o->size - offset;
+
+	while (done < n) {
+		chunk_id = offset / img->chunk_size;
+		in_chunk = offset % img->chunk_size;
+		this_tx = img->chunk_size - in_chunk;
+		if (this_tx > n - done)
+			this_tx = n - done;
+
+		chunk = (chunk_id < o->n_chunks) ?
+			img->chunk_map[o->chunk_map + chunk_id] : YIMG_NONE;
+		if (chunk == YIMG_NONE)
+			memset(dst, 0, this_tx);
+		else
+			memcpy(dst, yimg_chunk_data(img, chunk) + in_chunk,
+			       this_tx);
+
+		dst += this_tx;
+		offset += this_tx;
+		done += this_tx;
+	}
+	return done;
+}
@@ -0,0 +1,173 @@
+/*
+ * YAFFS: Yet another Flash File System . A NAND-flash specific file system.
+ *
+ * Copyright (C) 2002-2011 Aleph One Ltd.
+ *   for Toby Churchill Ltd and Brightstar Engineering
+ *
+ * Created by Charles Manning <charles@aleph1.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1 as
+ * published by the Free Software Foundation.
+ *
+ * Note: Only YAFFS headers are LGPL, YAFFS C code is covered by GPL.
+ */
+
+/*
+ * Read-only access to raw yaffs2 images and NAND dumps.
+ *
+ * The image is memory mapped. yimg_scan() reads the tags of every block in
+ * parallel, using the block summary instead where there is one, and
+ * yimg_build_index() then works out the objects and their chunks the way
+ * yaffs2_scan_backwards() does. The index can be saved and reloaded so
+ * that repeated queries on the same dump need no scan.
+ *
+ * Only images in the byte order of the host are understood.
+ */
+
+#ifndef __YAFFS_IMAGE_H__
+#define __YAFFS_IMAGE_H__
+
+#include <sys/types.h>
+#include "yaffs_guts.h"
+#include "yaffs_packedtags2.h"
+
+#define YIMG_NONE	0xffffffff
+
+/* Layout of the dump. The defaults match mkyaffs2image. */
+struct yimg_geometry {
+	int page_size;		/* Bytes per page, excluding spare */
+	int spare_size;
+	int pages_per_block;
+	int block_size;		/* Block size if the pages don't fill it, or 0 */
+	int tags_offset;	/* Where the tags are in the spare */
+	int inband_tags;
+	int tags_ecc;
+	int start_block;	/* param.start_block of the device */
+};
+
+/* Geometry options shared by the image tools */
+#define YIMG_GEOMETRY_OPTS	"p:o:b:k:t:s:ix"
+
+void yimg_default_geometry(struct yimg_geometry *g);
+int yimg_geometry_opt(struct yimg_geometry *g, int opt, const char *arg);
+void yimg_geometry_usage(void);
+
+enum yimg_chunk_state {
+	YIMG_CHUNK_ERASED,
+	YIMG_CHUNK_OK,
+	YIMG_CHUNK_ECC_FIXED,
+	YIMG_CHUNK_ECC_BAD,
+	YIMG_CHUNK_SUMMARY,	/* Tags taken from the block summary */
+};
+
+enum yimg_block_state {
+	YIMG_BLOCK_EMPTY,
+	YIMG_BLOCK_DATA,
+	YIMG_BLOCK_CHECKPOINT,
+	YIMG_BLOCK_UNKNOWN,	/* Sequence number out of range */
+};
+
+struct yimg_block {
+	u32 seq_number;
+	int n_chunks;		/* Chunks written, from the start of the block */
+	u8 state;
+	u8 summary_used;
+};
+
+struct yimg_obj {
+	u32 obj_id;
+	u32 parent_id;
+	u32 type;		/* enum yaffs_obj_type */
+	u32 hdr_chunk;		/* Image chunk of the header, or YIMG_NONE */
+	u32 size;		/* File size */
+	u32 equiv_id;		/* Hard links */
+	u32 name_hash;
+	u32 n_chunks;		/* Entries in the chunk map */
+	u32 chunk_map;		/* First entry in img->chunk_map */
+	u32 first_child;	/* Index of object, or YIMG_NONE */
+	u32 next_sibling;
+};
+
+struct yimg_stat {
+	u32 obj_id;
+	u32 type;
+	u32 mode;
+	u32 uid;
+	u32 gid;
+	u32 atime;
+	u32 mtime;
+	u32 ctime;
+	u32 rdev;
+	u32 size;
+};
+
+struct yimg_scan_stats {
+	int blocks_summary;	/* Blocks indexed from their summary */
+	int blocks_tags;	/* Blocks indexed by reading every chunk's tags */
+	int blocks_empty;
+	int blocks_checkpt;
+	int chunks_ecc_fixed;
+	int chunks_ecc_bad;
+	double scan_ms;
+	double index_ms;
+};
+
+struct yimg {
+	struct yimg_geometry g;
+	int chunk_size;		/* Data bytes per chunk */
+	int block_bytes;	/* Bytes per block in the image */
+	int chunks_per_summary;
+	int n_blocks;
+
+	int fd;
+	const u8 *map;
+	size_t map_size;
+	off_t image_size;
+	time_t image_mtime;
+
+	/* From yimg_scan(), freed by yimg_build_index() unless keep_tags */
+	struct yimg_block *blocks;
+	struct yaffs_packed_tags2_tags_only *tags;	/* Per image chunk */
+	u8 *chunk_state;
+	int keep_tags;
+
+	/* The index */
+	struct yimg_obj *objs;
+	u32 n_objs;
+	u32 *obj_index;		/* Object id to index in objs, or YIMG_NONE */
+	u32 *chunk_map;		/* Image chunk for each chunk of each file */
+	u32 n_chunk_map;
+	u32 root;
+	u32 lost_n_found;
+
+	struct yimg_scan_stats stats;
+};
+
+struct yimg *yimg_open(const char *file_name, const struct yimg_geometry *g);
+void yimg_close(struct yimg *img);
+
+/* Raw access. Chunks are numbered from the start of the image. */
+const u8 *yimg_chunk_data(struct yimg *img, u32 chunk);
+enum yimg_chunk_state yimg_read_tags(struct yimg *img, u32 chunk,
+				     struct yaffs_packed_tags2_tags_only *pt);
+
+int yimg_scan(struct yimg *img, int n_threads);
+int yimg_parallel(int n, int n_threads, void (*fn)(void *arg, int i),
+		  void *arg);
+int yimg_build_index(struct yimg *img);
+int yimg_save_index(struct yimg *img, const char *file_name);
+int yimg_load_index(struct yimg *img, const char *file_name);
+
+/* Loads the index if it is up to date, otherwise scans and saves it. */
+int yimg_index(struct yimg *img, const char *index_name, int n_threads);
+
+/* Queries on the index. Objects are referred to by their index in objs. */
+u32 yimg_lookup(struct yimg *img, const char *path);
+u32 yimg_equiv(struct yimg *img, u32 obj);
+int yimg_name(struct yimg *img, u32 obj, char *name, int size);
+int yimg_stat(struct yimg *img, u32 obj, struct yimg_stat *st);
+int yimg_readlink(struct yimg *img, u32 obj, char *alias, int size);
+int yimg_read(struct yimg *img, u32 obj, u32 offset, void *buf, int n);
+
+#endif
@@ -0,0 +1,846 @@
+/*
+ * YAFFS: Yet Another Flash File System. A NAND-flash specific file system.
+ *
+ * Copyright (C) 2002-2011 Aleph One Ltd.
+ *   for Toby Churchill Ltd and Brightstar Engineering
+ *
+ * Created by Charles Manning <charles@aleph1.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/*
+ * yaffs_mkdelta.c
+ *
+ * Makes an update script (see direct/yaffs_delta.h) that turns the old tree
+ * into the new one. Each tree is a directory or a yaffs2 image. Only the
+ * chunks of a file that differ are sent, files that only moved are
+ * renamed, and attributes are only set where they changed.
+ *
+ * The script does things in this order so that every step finds what it
+ * needs: unlink what has gone, make new directories, rename, remove old
+ * directories (deepest first), create and patch files, then set the times
+ * of directories (deepest first) once nothing more is added to them.
+ *
+ * Owners are not carried over as yaffsfs has no way to set them.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "yaffs_image.h"
+#include "yaffs_delta.h"
+
+unsigned yaffs_trace_mask = 0;
+
+/* What is to be done with an entry */
+enum {
+	E_SAME,
+	E_ATTR,		/* Only mode or times changed */
+	E_CHANGED,	/* File contents changed */
+	E_ADDED,	/* New, or replaced by something of another kind */
+	E_REMOVED,
+	E_RENAMED,
+};
+
+struct entry {
+	char *path;		/* Relative to the root of the tree */
+	u32 mode;		/* Including the type bits */
+	u32 atime;
+	u32 mtime;
+	u32 rdev;
+	u32 size;
+	char *alias;		/* Symlink target */
+	dev_t dev;		/* Identifies the object for hard links */
+	ino_t ino;
+	u32 obj;		/* Index in the image */
+	int primary;		/* First path of its hard link group, or -1 */
+	int n_links;		/* Paths in its hard link group */
+	int state;
+	int other;		/* Same path in the other tree, or the rename */
+	u32 hash;
+	int hashed;
+};
+
+struct tree {
+	const char *name;
+	struct yimg *img;	/* Or NULL for a directory */
+	struct entry *e;
+	int n;
+	int size;
+};
+
+static struct tree old_tree;
+static struct tree new_tree;
+
+static struct yimg_geometry geometry;
+static int chunk_size;
+static int check = 1;
+static int verbose;
+
+static FILE *out;
+static unsigned long n_records;
+static unsigned long long out_bytes;
+static unsigned long long data_bytes;
+static unsigned long data_chunks;
+
+static void usage(const char *name)
+{
+	printf("usage: %s [options] old new script\n"
+	       "old and new are directories or yaffs2 images\n"
+	       "options:\n"
+	       "   -C bytes   chunk size writes are aligned to (default: that of\n"
+	       "              the images, or 2048)\n"
+	       "   -n         don't check changed files before patching them\n"
+	       "   -v         list what the script does\n",
+	       name);
+	yimg_geometry_usage();
+	exit(1);
+}
+
+static void *xmalloc(size_t size)
+{
+	void *p = malloc(size ? size : 1);
+
+	if (!p) {
+		perror("malloc");
+		exit(1);
+	}
+	return p;
+}
+
+static u32 hash_data(const u8 *buf, u32 n)
+{
+	u32 h = YAFFS_DELTA_HASH_INIT;
+
+	while (n-- > 0) {
+		h ^= *buf++;
+		h *= YAFFS_DELTA_HASH_PRIME;
+	}
+	return h;
+}
+
+/*------------------------------ Trees ---------------------------------*/
+
+static struct entry *new_entry(struct tree *t, const char *path)
+{
+	struct entry *e;
+
+	if (t->n == t->size) {
+		t->size = t->size ? t->size * 2 : 256;
+		t->e = realloc(t->e, t->size * sizeof(*t->e));
+		if (!t->e) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	e = &t->e[t->n++];
+	memset(e, 0, sizeof(*e));
+	e->path = strdup(path);
+	e->primary = -1;
+	e->n_links = 1;
+	e->other = -1;
+	return e;
+}
+
+static void join(char *out_path, int size, const char *dir, const char *name)
+{
+	int n;
+
+	if (dir[0])
+		n = snprintf(out_path, size, "%s/%s", dir, name);
+	else
+		n = snprintf(out_path, size, "%s", name);
+	if (n >= size) {
+		fprintf(stderr, "%s/%s: path too long\n", dir, name);
+		exit(1);
+	}
+}
+
+static void walk_dir(struct tree *t, const char *rel)
+{
+	char full[PATH_MAX];
+	char path[PATH_MAX];
+	char alias[PATH_MAX];
+	struct dirent *de;
+	struct entry *e;
+	struct stat st;
+	DIR *d;
+	int n;
+
+	join(full, sizeof(full), t->name, rel);
+	d = opendir(full);
+	if (!d) {
+		perror(full);
+		exit(1);
+	}
+
+	while ((de = readdir(d)) != NULL) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..") ||
+		    (!rel[0] && !strcmp(de->d_name, "lost+found")))
+			continue;
+
+		join(path, sizeof(path), rel, de->d_name);
+		join(full, sizeof(full), t->name, path);
+		if (lstat(full, &st) < 0) {
+			perror(full);
+			exit(1);
+		}
+
+		e = new_entry(t, path);
+		e->mode = st.st_mode;
+		e->atime = st.st_atime;
+		e->mtime = st.st_mtime;
+		e->rdev = st.st_rdev;
+		e->dev = st.st_dev;
+		e->ino = st.st_ino;
+		if (S_ISREG(st.st_mode))
+			e->size = st.st_size;
+
+		if (S_ISLNK(st.st_mode)) {
+			n = readlink(full, alias, sizeof(alias) - 1);
+			if (n < 0) {
+				perror(full);
+				exit(1);
+			}
+			alias[n] = 0;
+			e->alias = strdup(alias);
+		} else if (S_ISDIR(st.st_mode)) {
+			walk_dir(t, path);
+		}
+	}
+	closedir(d);
+}
+
+static void walk_img(struct tree *t, u32 dir, const char *rel)
+{
+	char name[YAFFS_MAX_NAME_LENGTH + 1];
+	char alias[YAFFS_MAX_ALIAS_LENGTH + 1];
+	char path[PATH_MAX];
+	struct yimg *img = t->img;
+	struct yimg_stat st;
+	struct entry *e;
+	u32 obj;
+	u32 equiv;
+
+	for (obj = img->objs[dir].first_child; obj != YIMG_NONE;
+	     obj = img->objs[obj].next_sibling) {
+		if (obj == img->lost_n_found)
+			continue;
+		equiv = yimg_equiv(img, obj);
+		yimg_name(img, obj, name, sizeof(name));
+		join(path, sizeof(path), rel, name);
+		if (img->objs[equiv].type == YAFFS_OBJECT_TYPE_HARDLINK) {
+			fprintf(stderr, "%s: %s: broken hard link, skipped\n",
+				t->name, path);
+			continue;
+		}
+
+		yimg_stat(img, obj, &st);
+		e = new_entry(t, path);
+		e->mode = st.mode;
+		e->atime = st.atime;
+		e->mtime = st.mtime;
+		e->rdev = st.rdev;
+		e->ino = equiv;
+		e->obj = equiv;
+		if (S_ISREG(st.mode))
+			e->size = st.size;
+
+		if (S_ISLNK(st.mode)) {
+			yimg_readlink(img, equiv, alias, sizeof(alias));
+			e->alias = strdup(alias);
+		} else if (S_ISDIR(st.mode)) {
+			walk_img(t, equiv, path);
+		}
+	}
+}
+
+static int cmp_path(const void *a, const void *b)
+{
+	return strcmp(((const struct entry *)a)->path,
+		      ((const struct entry *)b)->path);
+}
+
+static struct tree *sort_tree;
+
+static int cmp_object(const void *a, const void *b)
+{
+	const struct entry *ea = &sort_tree->e[*(const int *)a];
+	const struct entry *eb = &sort_tree->e[*(const int *)b];
+
+	if (ea->dev != eb->dev)
+		return ea->dev < eb->dev ? -1 : 1;
+	if (ea->ino != eb->ino)
+		return ea->ino < eb->ino ? -1 : 1;
+	return *(const int *)a - *(const int *)b;
+}
+
+/*
+ * Sorts the entries by path, which puts directories before what is in
+ * them, and finds the hard link groups. The first path of a group is the
+ * one the others are linked to.
+ */
+static void index_tree(struct tree *t)
+{
+	int *order = xmalloc(t->n * sizeof(int));
+	int i;
+	int j;
+	int k;
+
+	qsort(t->e, t->n, sizeof(*t->e), cmp_path);
+
+	for (i = 0; i < t->n; i++)
+		order[i] = i;
+	sort_tree = t;
+	qsort(order, t->n, sizeof(int), cmp_object);
+
+	for (i = 0; i < t->n; i = j) {
+		for (j = i + 1; j < t->n &&
+		     t->e[order[j]].dev == t->e[order[i]].dev &&
+		     t->e[order[j]].ino == t->e[order[i]].ino; j++)
+			t->e[order[j]].primary = order[i];
+		if (S_ISDIR(t->e[order[i]].mode) && j > i + 1) {
+			fprintf(stderr, "%s: %s is in the tree twice\n",
+				t->name, t->e[order[i]].path);
+			exit(1);
+		}
+		for (k = i; k < j; k++)
+			t->e[order[k]].n_links = j - i;
+	}
+	free(order);
+}
+
+static void load_tree(struct tree *t, const char *name)
+{
+	struct stat st;
+
+	t->name = name;
+	if (stat(name, &st) < 0) {
+		perror(name);
+		exit(1);
+	}
+
+	if (S_ISDIR(st.st_mode)) {
+		walk_dir(t, "");
+	} else {
+		t->img = yimg_open(name, &geometry);
+		if (!t->img || yimg_index(t->img, NULL, 0) < 0) {
+			perror(name);
+			exit(1);
+		}
+		walk_img(t, t->img->root, "");
+	}
+	index_tree(t);
+}
+
+/* Reads in a whole file */
+static u8 *load_file(struct tree *t, struct entry *e)
+{
+	char full[PATH_MAX];
+	u8 *buf = xmalloc(e->size);
+	u32 done = 0;
+	int h;
+	int n;
+
+	if (t->img) {
+		while (done < e->size) {
+			n = yimg_read(t->img, e->obj, done, buf + done,
+				      e->size - done);
+			if (n <= 0)
+				break;
+			done += n;
+		}
+	} else {
+		join(full, sizeof(full), t->name, e->path);
+		h = open(full, O_RDONLY);
+		if (h < 0) {
+			perror(full);
+			exit(1);
+		}
+		while (done < e->size &&
+		       (n = read(h, buf + done, e->size - done)) > 0)
+			done += n;
+		close(h);
+	}
+
+	if (done != e->size) {
+		fprintf(stderr, "%s: %s: short read\n", t->name, e->path);
+		exit(1);
+	}
+	return buf;
+}
+
+static u32 file_hash(struct tree *t, struct entry *e)
+{
+	u8 *buf;
+
+	if (!e->hashed) {
+		buf = load_file(t, e);
+		e->hash = hash_data(buf, e->size);
+		e->hashed = 1;
+		free(buf);
+	}
+	return e->hash;
+}
+
+static int same_contents(struct entry *o, struct entry *n)
+{
+	u8 *ob;
+	u8 *nb;
+	int same;
+
+	if (o->size != n->size)
+		return 0;
+	ob = load_file(&old_tree, o);
+	nb = load_file(&new_tree, n);
+	same = !memcmp(ob, nb, o->size);
+	free(ob);
+	free(nb);
+	return same;
+}
+
+/*---------------------------- Comparing -------------------------------*/
+
+static const char *link_target(struct tree *t, struct entry *e)
+{
+	return e->primary >= 0 ? t->e[e->primary].path : NULL;
+}
+
+/* Whether the new entry can be had by changing the old one in place */
+static int same_kind(struct entry *o, struct entry *n)
+{
+	const char *lo = link_target(&old_tree, o);
+	const char *ln = link_target(&new_tree, n);
+
+	if ((o->mode & S_IFMT) != (n->mode & S_IFMT))
+		return 0;
+
+	/* A link stays if it still goes to the same, surviving, object */
+	if (lo || ln)
+		return lo && ln && !strcmp(lo, ln) &&
+		       new_tree.e[n->primary].state != E_ADDED;
+	if (o->n_links > 1 || n->n_links > 1)
+		return o->n_links > 1 && n->n_links > 1;
+
+	if (S_ISLNK(n->mode))
+		return !strcmp(o->alias, n->alias);
+	if (!S_ISREG(n->mode) && !S_ISDIR(n->mode))
+		return o->rdev == n->rdev;
+	return 1;
+}
+
+static int attr_differs(struct entry *o, struct entry *n)
+{
+	if (S_ISLNK(n->mode) || n->primary >= 0)
+		return 0;
+	return (o->mode & 0777) != (n->mode & 0777) ||
+	       (!S_ISDIR(n->mode) && o->mtime != n->mtime);
+}
+
+static void compare(void)
+{
+	struct entry *o;
+	struct entry *n;
+	int i = 0;
+	int j = 0;
+	int c;
+
+	while (i < old_tree.n || j < new_tree.n) {
+		if (i == old_tree.n)
+			c = 1;
+		else if (j == new_tree.n)
+			c = -1;
+		else
+			c = strcmp(old_tree.e[i].path, new_tree.e[j].path);
+
+		if (c < 0) {
+			old_tree.e[i++].state = E_REMOVED;
+			continue;
+		}
+		if (c > 0) {
+			new_tree.e[j++].state = E_ADDED;
+			continue;
+		}
+
+		o = &old_tree.e[i];
+		n = &new_tree.e[j];
+		o->other = j++;
+		n->other = i++;
+
+		if (!same_kind(o, n)) {
+			o->state = E_REMOVED;
+			n->state = E_ADDED;
+		} else if (S_ISREG(n->mode) && n->primary < 0 &&
+			   !same_contents(o, n)) {
+			o->state = E_CHANGED;
+			n->state = E_CHANGED;
+		} else if (attr_differs(o, n)) {
+			o->state = E_ATTR;
+			n->state = E_ATTR;
+		}
+	}
+}
+
+/* Renames files that only moved, rather than sending them again */
+static void find_renames(void)
+{
+	struct entry *o;
+	struct entry *n;
+	int i;
+	int j;
+
+	for (j = 0; j < new_tree.n; j++) {
+		n = &new_tree.e[j];
+		if (n->state != E_ADDED || n->other >= 0 ||
+		    !S_ISREG(n->mode) || n->n_links > 1 || !n->size)
+			continue;
+
+		for (i = 0; i < old_tree.n; i++) {
+			o = &old_tree.e[i];
+			if (o->state != E_REMOVED || o->other >= 0 ||
+			    !S_ISREG(o->mode) || o->n_links > 1 ||
+			    o->size != n->size ||
+			    file_hash(&old_tree, o) != file_hash(&new_tree, n) ||
+			    !same_contents(o, n))
+				continue;
+			o->state = E_RENAMED;
+			n->state = E_RENAMED;
+			o->other = j;
+			n->other = i;
+			break;
+		}
+	}
+}
+
+/*----------------------------- Output ---------------------------------*/
+
+static void put(const void *buf, size_t n)
+{
+	if (n && fwrite(buf, 1, n, out) != n) {
+		perror("write");
+		exit(1);
+	}
+	out_bytes += n;
+}
+
+static const char *op_names[YAFFS_DELTA_N_OPS] = {
+	[YAFFS_DELTA_END] = "end",
+	[YAFFS_DELTA_MKDIR] = "mkdir",
+	[YAFFS_DELTA_CREATE] = "create",
+	[YAFFS_DELTA_OPEN] = "open",
+	[YAFFS_DELTA_WRITE] = "write",
+	[YAFFS_DELTA_TRUNCATE] = "truncate",
+	[YAFFS_DELTA_CLOSE] = "close",
+	[YAFFS_DELTA_ATTR] = "attr",
+	[YAFFS_DELTA_UNLINK] = "unlink",
+	[YAFFS_DELTA_RMDIR] = "rmdir",
+	[YAFFS_DELTA_RENAME] = "rename",
+	[YAFFS_DELTA_SYMLINK] = "symlink",
+	[YAFFS_DELTA_LINK] = "link",
+	[YAFFS_DELTA_MKNOD] = "mknod",
+};
+
+static void emit(int op, int flags, const char *path, const char *path2,
+		 u32 a0, u32 a1, u32 a2, const u8 *data, u32 data_len)
+{
+	struct yaffs_delta_rec rec;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.op = op;
+	rec.flags = flags;
+	rec.path_len = path ? strlen(path) : 0;
+	rec.path2_len = path2 ? strlen(path2) : 0;
+	rec.arg[0] = a0;
+	rec.arg[1] = a1;
+	rec.arg[2] = a2;
+	rec.data_len = data_len;
+
+	if (rec.path_len >= YAFFS_DELTA_MAX_PATH ||
+	    rec.path2_len >= YAFFS_DELTA_MAX_PATH) {
+		fprintf(stderr, "%s: path too long\n", path);
+		exit(1);
+	}
+
+	put(&rec, sizeof(rec));
+	put(path, rec.path_len);
+	put(path2, rec.path2_len);
+	put(data, data_len);
+
+	n_records++;
+	if (op == YAFFS_DELTA_WRITE) {
+		data_bytes += data_len;
+		data_chunks += (a0 + data_len + chunk_size - 1) / chunk_size -
+				a0 / chunk_size;
+	}
+
+	if (verbose) {
+		fprintf(stderr, "%-8s %s%s%s", op_names[op],
+			path ? path : "", path2 ? " " : "", path2 ? path2 : "");
+		if (op == YAFFS_DELTA_WRITE)
+			fprintf(stderr, "%u bytes at %u", data_len, a0);
+		else if (op == YAFFS_DELTA_TRUNCATE)
+			fprintf(stderr, "%u", a0);
+		fprintf(stderr, "\n");
+	}
+}
+
+static void emit_attr(int op, const char *path, struct entry *n, int flags)
+{
+	emit(op, flags, path, NULL, n->mode & 0777, n->atime, n->mtime,
+	     NULL, 0);
+}
+
+/* Sends the chunks of the new file that differ from the old one */
+static void emit_patch(struct entry *o, struct entry *n)
+{
+	u8 *ob = load_file(&old_tree, o);
+	u8 *nb = load_file(&new_tree, n);
+	u32 start;
+	u32 end;
+	u32 len;
+	int flags = YAFFS_DELTA_SET_TIMES;
+
+	/* yaffsfs won't open a file for writing that has no write access */
+	if ((o->mode & 0600) != 0600) {
+		emit(YAFFS_DELTA_ATTR, YAFFS_DELTA_SET_MODE, n->path, NULL,
+		     (o->mode & 0777) | 0600, 0, 0, NULL, 0);
+		flags |= YAFFS_DELTA_SET_MODE;
+	}
+	if ((o->mode & 0777) != (n->mode & 0777))
+		flags |= YAFFS_DELTA_SET_MODE;
+
+	emit(YAFFS_DELTA_OPEN, check ? YAFFS_DELTA_CHECK : 0, n->path, NULL,
+	     o->size, check ? hash_data(ob, o->size) : 0, 0, NULL, 0);
+	if (n->size < o->size)
+		emit(YAFFS_DELTA_TRUNCATE, 0, NULL, NULL, n->size, 0, 0,
+		     NULL, 0);
+
+	for (start = 0; start < n->size; start = end) {
+		len = n->size - start;
+		if (len > (u32)chunk_size)
+			len = chunk_size;
+		end = start + len;
+		if (end <= o->size && !memcmp(ob + start, nb + start, len))
+			continue;
+
+		/* Take in the following chunks that differ too */
+		while (end < n->size) {
+			len = n->size - end;
+			if (len > (u32)chunk_size)
+				len = chunk_size;
+			if (end + len <= o->size &&
+			    !memcmp(ob + end, nb + end, len))
+				break;
+			end += len;
+		}
+		emit(YAFFS_DELTA_WRITE, 0, NULL, NULL, start, 0, 0,
+		     nb + start, end - start);
+	}
+
+	emit_attr(YAFFS_DELTA_CLOSE, NULL, n, flags);
+	free(ob);
+	free(nb);
+}
+
+static void emit_new(struct entry *n)
+{
+	u8 *buf;
+
+	if (n->primary >= 0) {
+		emit(YAFFS_DELTA_LINK, 0, new_tree.e[n->primary].path, n->path,
+		     0, 0, 0, NULL, 0);
+	} else if (S_ISREG(n->mode)) {
+		buf = load_file(&new_tree, n);
+		emit(YAFFS_DELTA_CREATE, 0, n->path, NULL, n->mode & 0777,
+		     0, 0, NULL, 0);
+		if (n->size)
+			emit(YAFFS_DELTA_WRITE, 0, NULL, NULL, 0, 0, 0,
+			     buf, n->size);
+		emit_attr(YAFFS_DELTA_CLOSE, NULL, n, YAFFS_DELTA_SET_TIMES);
+		free(buf);
+	} else if (S_ISLNK(n->mode)) {
+		emit(YAFFS_DELTA_SYMLINK, 0, n->alias, n->path, 0, 0, 0,
+		     NULL, 0);
+	} else {
+		emit(YAFFS_DELTA_MKNOD, 0, n->path, NULL, n->mode, n->rdev, 0,
+		     NULL, 0);
+		emit_attr(YAFFS_DELTA_ATTR, n->path, n, YAFFS_DELTA_SET_TIMES);
+	}
+}
+
+static void emit_script(void)
+{
+	struct yaffs_delta_file_hdr fhdr;
+	struct entry *o;
+	struct entry *n;
+	int i;
+
+	fhdr.magic = YAFFS_DELTA_MAGIC;
+	fhdr.version = YAFFS_DELTA_VERSION;
+	fhdr.chunk_size = chunk_size;
+	fhdr.flags = 0;
+	put(&fhdr, sizeof(fhdr));
+
+	/* Remove what has gone, except directories which may not be empty */
+	for (i = 0; i < old_tree.n; i++) {
+		o = &old_tree.e[i];
+		if (o->state == E_REMOVED && !S_ISDIR(o->mode))
+			emit(YAFFS_DELTA_UNLINK, 0, o->path, NULL, 0, 0, 0,
+			     NULL, 0);
+	}
+
+	for (i = 0; i < new_tree.n; i++) {
+		n = &new_tree.e[i];
+		if (n->state == E_ADDED && S_ISDIR(n->mode))
+			emit(YAFFS_DELTA_MKDIR, 0, n->path, NULL,
+			     n->mode & 0777, 0, 0, NULL, 0);
+	}
+
+	for (i = 0; i < new_tree.n; i++) {
+		n = &new_tree.e[i];
+		if (n->state != E_RENAMED)
+			continue;
+		o = &old_tree.e[n->other];
+		emit(YAFFS_DELTA_RENAME, 0, o->path, n->path, 0, 0, 0, NULL, 0);
+		if (attr_differs(o, n))
+			emit_attr(YAFFS_DELTA_ATTR, n->path, n,
+				  YAFFS_DELTA_SET_MODE | YAFFS_DELTA_SET_TIMES);
+	}
+
+	for (i = old_tree.n - 1; i >= 0; i--) {
+		o = &old_tree.e[i];
+		if (o->state == E_REMOVED && S_ISDIR(o->mode))
+			emit(YAFFS_DELTA_RMDIR, 0, o->path, NULL, 0, 0, 0,
+			     NULL, 0);
+	}
+
+	for (i = 0; i < new_tree.n; i++) {
+		n = &new_tree.e[i];
+		if (S_ISDIR(n->mode))
+			continue;
+		if (n->state == E_ADDED)
+			emit_new(n);
+		else if (n->state == E_CHANGED)
+			emit_patch(&old_tree.e[n->other], n);
+		else if (n->state == E_ATTR)
+			emit_attr(YAFFS_DELTA_ATTR, n->path, n,
+				  S_ISREG(n->mode) ? YAFFS_DELTA_SET_MODE |
+				  YAFFS_DELTA_SET_TIMES : YAFFS_DELTA_SET_TIMES);
+	}
+
+	/* Adding to a directory changes its times, so do them last */
+	for (i = new_tree.n - 1; i >= 0; i--) {
+		n = &new_tree.e[i];
+		if (!S_ISDIR(n->mode))
+			continue;
+		if (n->state == E_ADDED)
+			emit_attr(YAFFS_DELTA_ATTR, n->path, n,
+				  YAFFS_DELTA_SET_TIMES);
+		else if (n->state == E_ATTR)
+			emit_attr(YAFFS_DELTA_ATTR, n->path, n,
+				  YAFFS_DELTA_SET_MODE | YAFFS_DELTA_SET_TIMES);
+	}
+
+	emit(YAFFS_DELTA_END, 0, NULL, NULL, 0, 0, 0, NULL, 0);
+}
+
+static void show_stats(void)
+{
+	unsigned long long full_bytes = 0;
+	unsigned long full_chunks = 0;
+	int counts[E_RENAMED + 1] = { 0 };
+	int removed = 0;
+	struct entry *n;
+	int i;
+
+	for (i = 0; i < new_tree.n; i++) {
+		n = &new_tree.e[i];
+		counts[n->state]++;
+		if (S_ISREG(n->mode) && n->primary < 0) {
+			full_bytes += n->size;
+			full_chunks += (n->size + chunk_size - 1) / chunk_size;
+		}
+	}
+	for (i = 0; i < old_tree.n; i++)
+		if (old_tree.e[i].state == E_REMOVED)
+			removed++;
+
+	fprintf(stderr, "%d objects: %d unchanged, %d added, %d changed, "
+		"%d attributes only, %d renamed, %d removed\n",
+		new_tree.n, counts[E_SAME], counts[E_ADDED], counts[E_CHANGED],
+		counts[E_ATTR], counts[E_RENAMED], removed);
+	fprintf(stderr, "script: %lu records, %llu bytes, %llu bytes of file "
+		"data in %lu chunks\n", n_records, out_bytes, data_bytes,
+		data_chunks);
+	fprintf(stderr, "full copy: %llu bytes of file data in %lu chunks\n",
+		full_bytes, full_chunks);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+
+	yimg_default_geometry(&geometry);
+
+	while ((opt = getopt(argc, argv, YIMG_GEOMETRY_OPTS "C:nv")) != -1) {
+		if (yimg_geometry_opt(&geometry, opt, optarg))
+			continue;
+		switch (opt) {
+		case 'C':
+			chunk_size = atoi(optarg);
+			break;
+		case 'n':
+			check = 0;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 3)
+		usage(argv[0]);
+
+	load_tree(&old_tree, argv[optind]);
+	load_tree(&new_tree, argv[optind + 1]);
+
+	if (chunk_size <= 0) {
+		if (new_tree.img)
+			chunk_size = new_tree.img->chunk_size;
+		else if (old_tree.img)
+			chunk_size = old_tree.img->chunk_size;
+		else
+			chunk_size = 2048;
+	}
+
+	compare();
+	find_renames();
+
+	if (!strcmp(argv[optind + 2], "-")) {
+		out = stdout;
+	} else {
+		out = fopen(argv[optind + 2], "wb");
+		if (!out) {
+			perror(argv[optind + 2]);
+			exit(1);
+		}
+	}
+	emit_script();
+	if (fclose(out) != 0) {
+		perror(argv[optind + 2]);
+		exit(1);
+	}
+
+	show_stats();
+	return 0;
+}
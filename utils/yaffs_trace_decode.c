@@ -0,0 +1,254 @@
+/*
+ * YAFFS: Yet Another Flash File System. A NAND-flash specific file system.
+ *
+ * Copyright (C) 2002-2011 Aleph One Ltd.
+ *   for Toby Churchill Ltd and Brightstar Engineering
+ *
+ * Created by Charles Manning <charles@aleph1.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/*
+ * yaffs_trace_decode.c
+ *
+ * Decodes a binary trace buffer dump (see yaffs_tracebuf.h) into text or
+ * into Chrome trace event JSON that can be loaded in chrome://tracing.
+ * Dumps taken on a target of the other endianness are swapped on the fly.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "yaffs_guts.h"
+#include "yaffs_tracebuf.h"
+
+unsigned yaffs_trace_mask = 0;
+
+#define SWAP32(x)   ((((x) & 0x000000FF) << 24) | \
+                     (((x) & 0x0000FF00) << 8 ) | \
+                     (((x) & 0x00FF0000) >> 8 ) | \
+                     (((x) & 0xFF000000) >> 24))
+
+#define SWAP16(x)   ((((x) & 0x00FF) << 8) | \
+                     (((x) & 0xFF00) >> 8))
+
+struct event_desc {
+	const char *name;
+	char phase;		/* Chrome phase: B(egin), E(nd) or i(nstant) */
+	const char *span;	/* Name of the span for B and E events */
+	const char *arg_names[YAFFS_TB_N_ARGS];
+};
+
+static const struct event_desc events[YAFFS_TB_N_EVENTS] = {
+	[YAFFS_TB_RD_CHUNK] = { "rd_chunk", 'i', NULL,
+		{"chunk", "obj", "chunk_id", "ecc"} },
+	[YAFFS_TB_WR_CHUNK] = { "wr_chunk", 'i', NULL,
+		{"chunk", "obj", "chunk_id", "n_bytes"} },
+	[YAFFS_TB_ERASE] = { "erase", 'i', NULL,
+		{"block", "result"} },
+	[YAFFS_TB_MARK_BAD] = { "mark_bad", 'i', NULL,
+		{"block"} },
+	[YAFFS_TB_ALLOC_BLOCK] = { "alloc_block", 'i', NULL,
+		{"block", "seq", "n_erased"} },
+	[YAFFS_TB_BLOCK_DIRTY] = { "block_dirty", 'i', NULL,
+		{"block", "state", "needs_retiring"} },
+	[YAFFS_TB_GC_SELECT] = { "gc_select", 'i', NULL,
+		{"block", "free", "prioritised", "background"} },
+	[YAFFS_TB_GC_BEGIN] = { "gc_begin", 'B', "gc",
+		{"block", "in_use", "whole_block"} },
+	[YAFFS_TB_GC_END] = { "gc_end", 'E', "gc",
+		{"block", "chunk", "result"} },
+	[YAFFS_TB_GC_COPY] = { "gc_copy", 'i', NULL,
+		{"old_chunk", "new_chunk", "obj", "chunk_id"} },
+	[YAFFS_TB_CHECKPT_WR_BEGIN] = { "checkpt_wr_begin", 'B', "checkpt_wr",
+		{NULL} },
+	[YAFFS_TB_CHECKPT_WR_END] = { "checkpt_wr_end", 'E', "checkpt_wr",
+		{"ok", "n_blocks"} },
+	[YAFFS_TB_CHECKPT_RD_BEGIN] = { "checkpt_rd_begin", 'B', "checkpt_rd",
+		{NULL} },
+	[YAFFS_TB_CHECKPT_RD_END] = { "checkpt_rd_end", 'E', "checkpt_rd",
+		{"ok"} },
+	[YAFFS_TB_MOUNT_BEGIN] = { "mount_begin", 'B', "mount",
+		{NULL} },
+	[YAFFS_TB_MOUNT_END] = { "mount_end", 'E', "mount",
+		{"result"} },
+	[YAFFS_TB_MOUNT_FIXUP_BEGIN] = { "mount_fixup_begin", 'B',
+		"mount_fixup", {NULL} },
+	[YAFFS_TB_MOUNT_FIXUP_END] = { "mount_fixup_end", 'E', "mount_fixup",
+		{"n_hanging"} },
+};
+
+static int swap;
+
+static void swap_hdr(struct yaffs_tb_hdr *hdr)
+{
+	hdr->magic = SWAP32(hdr->magic);
+	hdr->version = SWAP32(hdr->version);
+	hdr->rec_size = SWAP32(hdr->rec_size);
+	hdr->n_recs = SWAP32(hdr->n_recs);
+	hdr->n_lost = SWAP32(hdr->n_lost);
+	hdr->flags = SWAP32(hdr->flags);
+}
+
+static void swap_rec(struct yaffs_tb_rec *rec)
+{
+	int i;
+
+	rec->seq = SWAP32(rec->seq);
+	rec->timestamp = SWAP32(rec->timestamp);
+	rec->event = SWAP16(rec->event);
+	rec->n_args = SWAP16(rec->n_args);
+	for (i = 0; i < YAFFS_TB_N_ARGS; i++)
+		rec->args[i] = SWAP32(rec->args[i]);
+}
+
+static const char *arg_name(const struct event_desc *ed, int i)
+{
+	static char name[10];
+
+	if (ed && ed->arg_names[i])
+		return ed->arg_names[i];
+	sprintf(name, "a%d", i);
+	return name;
+}
+
+static void print_text(const struct yaffs_tb_rec *rec, int time_us)
+{
+	const struct event_desc *ed = NULL;
+	int i;
+
+	if (rec->event < YAFFS_TB_N_EVENTS && events[rec->event].name)
+		ed = &events[rec->event];
+
+	if (time_us)
+		printf("%10u.%06u ", rec->timestamp / 1000000,
+			rec->timestamp % 1000000);
+	else
+		printf("%10u ", rec->timestamp);
+
+	if (ed)
+		printf("%-16s", ed->name);
+	else
+		printf("event_%-10u", rec->event);
+
+	for (i = 0; i < rec->n_args && i < YAFFS_TB_N_ARGS; i++)
+		printf(" %s=%u", arg_name(ed, i), rec->args[i]);
+	printf("\n");
+}
+
+static void print_json(const struct yaffs_tb_rec *rec, int first)
+{
+	const struct event_desc *ed = NULL;
+	char unknown[20];
+	const char *name;
+	char phase = 'i';
+	int i;
+
+	if (rec->event < YAFFS_TB_N_EVENTS && events[rec->event].name)
+		ed = &events[rec->event];
+
+	if (ed) {
+		phase = ed->phase;
+		name = ed->span ? ed->span : ed->name;
+	} else {
+		sprintf(unknown, "event_%u", rec->event);
+		name = unknown;
+	}
+
+	printf("%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%u,"
+		"\"pid\":1,\"tid\":1%s,\"args\":{",
+		first ? "" : ",", name, phase, rec->timestamp,
+		phase == 'i' ? ",\"s\":\"t\"" : "");
+	for (i = 0; i < rec->n_args && i < YAFFS_TB_N_ARGS; i++)
+		printf("%s\"%s\":%u", i ? "," : "",
+			arg_name(ed, i), rec->args[i]);
+	printf("}}");
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-j] dump_file\n"
+		"  -j  output Chrome trace event JSON instead of text\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct yaffs_tb_hdr hdr;
+	struct yaffs_tb_rec rec;
+	int json = 0;
+	int opt;
+	unsigned i;
+	FILE *f;
+
+	while ((opt = getopt(argc, argv, "j")) != -1) {
+		switch (opt) {
+		case 'j':
+			json = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind != argc - 1)
+		usage(argv[0]);
+
+	f = fopen(argv[optind], "rb");
+	if (!f) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1) {
+		fprintf(stderr, "%s: too short for a trace dump\n",
+			argv[optind]);
+		return 1;
+	}
+
+	if (hdr.magic == SWAP32(YAFFS_TB_MAGIC)) {
+		swap = 1;
+		swap_hdr(&hdr);
+	}
+
+	if (hdr.magic != YAFFS_TB_MAGIC ||
+	    hdr.version != YAFFS_TB_VERSION ||
+	    hdr.rec_size != sizeof(rec)) {
+		fprintf(stderr, "%s: not a version %d trace dump\n",
+			argv[optind], YAFFS_TB_VERSION);
+		return 1;
+	}
+
+	if (json)
+		printf("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	else
+		printf("# %u records, %u lost, timestamps in %s\n",
+			hdr.n_recs, hdr.n_lost,
+			(hdr.flags & YAFFS_TB_FLAG_TIME_US) ?
+				"seconds" : "record numbers");
+
+	for (i = 0; i < hdr.n_recs; i++) {
+		if (fread(&rec, sizeof(rec), 1, f) != 1) {
+			fprintf(stderr, "%s: truncated after %u records\n",
+				argv[optind], i);
+			break;
+		}
+		if (swap)
+			swap_rec(&rec);
+		if (json)
+			print_json(&rec, i == 0);
+		else
+			print_text(&rec, hdr.flags & YAFFS_TB_FLAG_TIME_US);
+	}
+
+	if (json)
+		printf("\n]}\n");
+
+	fclose(f);
+	return 0;
+}
@@ -12,32 +12,35 @@
  */
 
 #include "yaffs_bitmap.h"
+#include "yaffs_getblockinfo.h"
 #include "yaffs_trace.h"
 /*
  * Chunk bitmap manipulations
  */
 
-static inline u8 *yaffs_block_bits(struct yaffs_dev *dev, int blk)
+void yaffs_verify_chunk_bit_id(struct yaffs_dev *dev, int blk, int chunk)
 {
-	if (blk < dev->internal_start_block || blk > dev->internal_end_block) {
+	if (blk < dev->internal_start_block || blk > dev->internal_end_block ||
+	    chunk < 0 || chunk >= dev->param.chunks_per_block) {
 		yaffs_trace(YAFFS_TRACE_ERROR,
-			"BlockBits block %d is not valid",
-			blk);
+			"Chunk Id (%d:%d) invalid",
+			blk, chunk);
 		BUG();
 	}
-	return dev->chunk_bits +
-	    (dev->chunk_bit_stride * (blk - dev->internal_start_block));
 }
 
-void yaffs_verify_chunk_bit_id(struct yaffs_dev *dev, int blk, int chunk)
+#ifndef CONFIG_YAFFS_COMPACT_BLOCKS
+
+static inline u8 *yaffs_block_bits(struct yaffs_dev *dev, int blk)
 {
-	if (blk < dev->internal_start_block || blk > dev->internal_end_block ||
-	    chunk < 0 || chunk >= dev->param.chunks_per_block) {
+	if (blk < dev->internal_start_block || blk > dev->internal_end_block) {
 		yaffs_trace(YAFFS_TRACE_ERROR,
-			"Chunk Id (%d:%d) invalid",
-			blk, chunk);
+			"BlockBits block %d is not valid",
+			blk);
 		BUG();
 	}
+	return dev->chunk_bits +
+	    (dev->chunk_bit_stride * (blk - dev->internal_start_block));
 }
 
 void yaffs_clear_chunk_bits(struct yaffs_dev *dev, int blk)
@@ -95,3 +98,318 @@ int yaffs_count_chunk_bits(struct yaffs_dev *dev, int blk)
 
 	return n;
 }
+
+#else
+
+/*
+ * Compact chunk bitmaps.
+ * Blocks with no chunks in use or with every chunk in use don't have a
+ * bitmap, bi->chunk_map says which. The others get a slot from groups of
+ * YAFFS_CHUNK_BITS_GROUP bitmaps. Free slots are chained through their
+ * first two bytes.
+ */
+
+static inline u8 *yaffs_chunk_bit_slot(struct yaffs_dev *dev, u16 slot)
+{
+	slot--;
+	return dev->chunk_bit_groups[slot / YAFFS_CHUNK_BITS_GROUP] +
+	    (slot % YAFFS_CHUNK_BITS_GROUP) * dev->chunk_bit_slot_size;
+}
+
+static inline u16 yaffs_chunk_bit_link(struct yaffs_dev *dev, u16 slot)
+{
+	u16 next;
+
+	memcpy(&next, yaffs_chunk_bit_slot(dev, slot), sizeof(next));
+	return next;
+}
+
+static void yaffs_free_chunk_bit_slot(struct yaffs_dev *dev, u16 slot)
+{
+	memcpy(yaffs_chunk_bit_slot(dev, slot), &dev->chunk_bit_free,
+		sizeof(u16));
+	dev->chunk_bit_free = slot;
+	dev->n_chunk_bit_slots--;
+}
+
+static u16 yaffs_alloc_chunk_bit_slot(struct yaffs_dev *dev)
+{
+	int n_blocks = dev->internal_end_block - dev->internal_start_block + 1;
+	int max_groups = (n_blocks + YAFFS_CHUNK_BITS_GROUP - 1) /
+				YAFFS_CHUNK_BITS_GROUP;
+	u16 slot;
+	u8 *group;
+	int i;
+
+	if (!dev->chunk_bit_free) {
+		if (dev->n_chunk_bit_groups >= max_groups)
+			return 0;
+		group = kmalloc(YAFFS_CHUNK_BITS_GROUP *
+				dev->chunk_bit_slot_size, GFP_NOFS);
+		if (!group)
+			return 0;
+		dev->chunk_bit_groups[dev->n_chunk_bit_groups] = group;
+		slot = dev->n_chunk_bit_groups * YAFFS_CHUNK_BITS_GROUP;
+		dev->n_chunk_bit_groups++;
+		for (i = YAFFS_CHUNK_BITS_GROUP; i > 0; i--) {
+			dev->n_chunk_bit_slots++;
+			yaffs_free_chunk_bit_slot(dev, slot + i);
+		}
+	}
+
+	slot = dev->chunk_bit_free;
+	dev->chunk_bit_free = yaffs_chunk_bit_link(dev, slot);
+	dev->n_chunk_bit_slots++;
+	return slot;
+}
+
+static void yaffs_fill_chunk_bits(struct yaffs_dev *dev, u8 *bits)
+{
+	int n = dev->param.chunks_per_block;
+
+	memset(bits, 0xff, n / 8);
+	if (n & 7)
+		bits[n / 8] = (1 << (n & 7)) - 1;
+}
+
+/*
+ * Gives the bitmap of a block that is about to change, making one if it
+ * doesn't have one. Returns NULL and marks the map unknown if there is no
+ * memory for it.
+ */
+static u8 *yaffs_chunk_bits_for_update(struct yaffs_dev *dev,
+					struct yaffs_block_info *bi, int blk)
+{
+	u16 slot;
+	u8 *bits;
+
+	if (bi->chunk_map != YAFFS_CHUNK_MAP_NONE &&
+	    bi->chunk_map != YAFFS_CHUNK_MAP_ALL)
+		return yaffs_chunk_bit_slot(dev, bi->chunk_map);
+
+	slot = yaffs_alloc_chunk_bit_slot(dev);
+	if (!slot) {
+		yaffs_trace(YAFFS_TRACE_ERROR,
+			"No memory for the chunk bitmap of block %d", blk);
+		bi->chunk_map = YAFFS_CHUNK_MAP_UNKNOWN;
+		dev->n_chunk_map_unknown++;
+		return NULL;
+	}
+
+	bits = yaffs_chunk_bit_slot(dev, slot);
+	memset(bits, 0, dev->chunk_bit_stride);
+	if (bi->chunk_map == YAFFS_CHUNK_MAP_ALL)
+		yaffs_fill_chunk_bits(dev, bits);
+	bi->chunk_map = slot;
+	return bits;
+}
+
+int yaffs_init_chunk_bits(struct yaffs_dev *dev, int n_blocks)
+{
+	int max_groups = (n_blocks + YAFFS_CHUNK_BITS_GROUP - 1) /
+				YAFFS_CHUNK_BITS_GROUP;
+
+	if (n_blocks > YAFFS_COMPACT_MAX_BLOCKS) {
+		yaffs_trace(YAFFS_TRACE_ALWAYS,
+			"Compact block info supports %d blocks, not %d",
+			YAFFS_COMPACT_MAX_BLOCKS, n_blocks);
+		return YAFFS_FAIL;
+	}
+
+	dev->chunk_bit_slot_size = dev->chunk_bit_stride;
+	if (dev->chunk_bit_slot_size < (int)sizeof(u16))
+		dev->chunk_bit_slot_size = sizeof(u16);
+	dev->chunk_bit_free = 0;
+	dev->n_chunk_bit_slots = 0;
+	dev->n_chunk_bit_groups = 0;
+	dev->n_chunk_map_unknown = 0;
+	dev->seq_base = 0;
+	dev->chunk_bit_groups = kmalloc(max_groups * sizeof(u8 *), GFP_NOFS);
+
+	return dev->chunk_bit_groups ? YAFFS_OK : YAFFS_FAIL;
+}
+
+void yaffs_deinit_chunk_bits(struct yaffs_dev *dev)
+{
+	int i;
+
+	for (i = 0; dev->chunk_bit_groups && i < dev->n_chunk_bit_groups; i++)
+		kfree(dev->chunk_bit_groups[i]);
+	kfree(dev->chunk_bit_groups);
+	dev->chunk_bit_groups = NULL;
+	dev->n_chunk_bit_groups = 0;
+	dev->chunk_bit_free = 0;
+	dev->n_chunk_bit_slots = 0;
+}
+
+void yaffs_clear_chunk_bits(struct yaffs_dev *dev, int blk)
+{
+	struct yaffs_block_info *bi = yaffs_get_block_info(dev, blk);
+
+	if (bi->chunk_map == YAFFS_CHUNK_MAP_UNKNOWN)
+		dev->n_chunk_map_unknown--;
+	else if (bi->chunk_map != YAFFS_CHUNK_MAP_NONE &&
+		 bi->chunk_map != YAFFS_CHUNK_MAP_ALL)
+		yaffs_free_chunk_bit_slot(dev, bi->chunk_map);
+	bi->chunk_map = YAFFS_CHUNK_MAP_NONE;
+}
+
+void yaffs_clear_chunk_bit(struct yaffs_dev *dev, int blk, int chunk)
+{
+	struct yaffs_block_info *bi = yaffs_get_block_info(dev, blk);
+	u8 *blk_bits;
+
+	yaffs_verify_chunk_bit_id(dev, blk, chunk);
+	if (bi->chunk_map == YAFFS_CHUNK_MAP_NONE ||
+	    bi->chunk_map == YAFFS_CHUNK_MAP_UNKNOWN)
+		return;
+
+	blk_bits = yaffs_chunk_bits_for_update(dev, bi, blk);
+	if (blk_bits)
+		blk_bits[chunk / 8] &= ~(1 << (chunk & 7));
+}
+
+void yaffs_set_chunk_bit(struct yaffs_dev *dev, int blk, int chunk)
+{
+	struct yaffs_block_info *bi = yaffs_get_block_info(dev, blk);
+	u8 *blk_bits;
+
+	yaffs_verify_chunk_bit_id(dev, blk, chunk);
+	if (bi->chunk_map == YAFFS_CHUNK_MAP_ALL ||
+	    bi->chunk_map == YAFFS_CHUNK_MAP_UNKNOWN)
+		return;
+
+	blk_bits = yaffs_chunk_bits_for_update(dev, bi, blk);
+	if (!blk_bits)
+		return;
+	blk_bits[chunk / 8] |= (1 << (chunk & 7));
+
+	/* Blocks are written in order so this is when they can fill up */
+	if (chunk == dev->param.chunks_per_block - 1)
+		yaffs_tidy_chunk_bits(dev, blk);
+}
+
+int yaffs_check_chunk_bit(struct yaffs_dev *dev, int blk, int chunk)
+{
+	struct yaffs_block_info *bi = yaffs_get_block_info(dev, blk);
+	u8 *blk_bits;
+
+	yaffs_verify_chunk_bit_id(dev, blk, chunk);
+	switch (bi->chunk_map) {
+	case YAFFS_CHUNK_MAP_NONE:
+		return 0;
+	case YAFFS_CHUNK_MAP_ALL:
+	case YAFFS_CHUNK_MAP_UNKNOWN:
+		return 1;
+	}
+	blk_bits = yaffs_chunk_bit_slot(dev, bi->chunk_map);
+	return (blk_bits[chunk / 8] & (1 << (chunk & 7))) ? 1 : 0;
+}
+
+int yaffs_still_some_chunks(struct yaffs_dev *dev, int blk)
+{
+	struct yaffs_block_info *bi = yaffs_get_block_info(dev, blk);
+	u8 *blk_bits;
+	int i;
+
+	switch (bi->chunk_map) {
+	case YAFFS_CHUNK_MAP_NONE:
+		return 0;
+	case YAFFS_CHUNK_MAP_ALL:
+	case YAFFS_CHUNK_MAP_UNKNOWN:
+		return 1;
+	}
+	blk_bits = yaffs_chunk_bit_slot(dev, bi->chunk_map);
+	for (i = 0; i < dev->chunk_bit_stride; i++) {
+		if (*blk_bits)
+			return 1;
+		blk_bits++;
+	}
+	return 0;
+}
+
+int yaffs_count_chunk_bits(struct yaffs_dev *dev, int blk)
+{
+	struct yaffs_block_info *bi = yaffs_get_block_info(dev, blk);
+	u8 *blk_bits;
+	int i;
+	int n = 0;
+
+	switch (bi->chunk_map) {
+	case YAFFS_CHUNK_MAP_NONE:
+		return 0;
+	case YAFFS_CHUNK_MAP_ALL:
+		return dev->param.chunks_per_block;
+	case YAFFS_CHUNK_MAP_UNKNOWN:
+		return bi->pages_in_use;
+	}
+	blk_bits = yaffs_chunk_bit_slot(dev, bi->chunk_map);
+	for (i = 0; i < dev->chunk_bit_stride; i++, blk_bits++)
+		n += hweight8(*blk_bits);
+
+	return n;
+}
+
+int yaffs_chunk_bits_unknown(struct yaffs_dev *dev, int blk)
+{
+	struct yaffs_block_info *bi = yaffs_get_block_info(dev, blk);
+
+	return bi->chunk_map == YAFFS_CHUNK_MAP_UNKNOWN;
+}
+
+/* Drops the bitmap of a block if it is all clear or all set. */
+void yaffs_tidy_chunk_bits(struct yaffs_dev *dev, int blk)
+{
+	struct yaffs_block_info *bi = yaffs_get_block_info(dev, blk);
+	int n;
+
+	if (bi->chunk_map == YAFFS_CHUNK_MAP_NONE ||
+	    bi->chunk_map == YAFFS_CHUNK_MAP_ALL ||
+	    bi->chunk_map == YAFFS_CHUNK_MAP_UNKNOWN)
+		return;
+
+	n = yaffs_count_chunk_bits(dev, blk);
+	if (n == 0) {
+		yaffs_clear_chunk_bits(dev, blk);
+	} else if (n == dev->param.chunks_per_block) {
+		yaffs_free_chunk_bit_slot(dev, bi->chunk_map);
+		bi->chunk_map = YAFFS_CHUNK_MAP_ALL;
+	}
+}
+
+/* Copies a block's bitmap out as chunk_bit_stride bytes */
+void yaffs_get_chunk_bits(struct yaffs_dev *dev, int blk, u8 *bits)
+{
+	struct yaffs_block_info *bi = yaffs_get_block_info(dev, blk);
+
+	memset(bits, 0, dev->chunk_bit_stride);
+	switch (bi->chunk_map) {
+	case YAFFS_CHUNK_MAP_NONE:
+		break;
+	case YAFFS_CHUNK_MAP_ALL:
+	case YAFFS_CHUNK_MAP_UNKNOWN:
+		yaffs_fill_chunk_bits(dev, bits);
+		break;
+	default:
+		memcpy(bits, yaffs_chunk_bit_slot(dev, bi->chunk_map),
+			dev->chunk_bit_stride);
+		break;
+	}
+}
+
+/* Sets a block's bitmap from chunk_bit_stride bytes */
+int yaffs_put_chunk_bits(struct yaffs_dev *dev, int blk, const u8 *bits)
+{
+	struct yaffs_block_info *bi = yaffs_get_block_info(dev, blk);
+	u8 *blk_bits;
+
+	yaffs_clear_chunk_bits(dev, blk);
+	blk_bits = yaffs_chunk_bits_for_update(dev, bi, blk);
+	if (!blk_bits)
+		return YAFFS_FAIL;
+	memcpy(blk_bits, bits, dev->chunk_bit_stride);
+	yaffs_tidy_chunk_bits(dev, blk);
+	return YAFFS_OK;
+}
+
+#endif
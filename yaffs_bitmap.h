@@ -30,4 +30,16 @@ int yaffs_check_chunk_bit(struct yaffs_dev *dev, int blk, int chunk);
 int yaffs_still_some_chunks(struct yaffs_dev *dev, int blk);
 int yaffs_count_chunk_bits(struct yaffs_dev *dev, int blk);
 
+#ifdef CONFIG_YAFFS_COMPACT_BLOCKS
+int yaffs_init_chunk_bits(struct yaffs_dev *dev, int n_blocks);
+void yaffs_deinit_chunk_bits(struct yaffs_dev *dev);
+int yaffs_chunk_bits_unknown(struct yaffs_dev *dev, int blk);
+void yaffs_tidy_chunk_bits(struct yaffs_dev *dev, int blk);
+void yaffs_get_chunk_bits(struct yaffs_dev *dev, int blk, u8 *bits);
+int yaffs_put_chunk_bits(struct yaffs_dev *dev, int blk, const u8 *bits);
+#else
+#define yaffs_chunk_bits_unknown(dev, blk)	0
+#define yaffs_tidy_chunk_bits(dev, blk)		do { } while (0)
+#endif
+
 #endif
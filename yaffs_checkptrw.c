@@ -13,6 +13,7 @@
 
 #include "yaffs_checkptrw.h"
 #include "yaffs_getblockinfo.h"
+#include "yaffs_nandprof.h"
 
 static int yaffs2_checkpt_space_ok(struct yaffs_dev *dev)
 {
@@ -41,6 +42,7 @@ static int yaffs_checkpt_erase(struct yaffs_dev *dev)
 			"erasing checkpt block %d", i);
 
 			dev->n_erasures++;
+			yaffs_np_erase(dev, i);
 
 			if (dev->param.
 			    erase_fn(dev,
@@ -111,6 +113,8 @@ static void yaffs2_checkpt_find_block(struct yaffs_dev *dev)
 
 			dev->param.read_chunk_tags_fn(dev, realigned_chunk,
 						      NULL, &tags);
+			yaffs_np_chunk(dev, YAFFS_NP_READ, chunk,
+				       tags.chunk_id);
 			yaffs_trace(YAFFS_TRACE_CHECKPOINT,
 				"find next checkpt block: search: block %d oid %d seq %d eccr %d",
 				i, tags.obj_id, tags.seq_number,
@@ -242,6 +246,7 @@ static int yaffs2_checkpt_flush_buffer(struct yaffs_dev *dev)
 
 	dev->param.write_chunk_tags_fn(dev, realigned_chunk,
 				       dev->checkpt_buffer, &tags);
+	yaffs_np_chunk(dev, YAFFS_NP_WRITE, chunk, tags.chunk_id);
 	dev->checkpt_byte_offs = 0;
 	dev->checkpt_page_seq++;
 	dev->checkpt_cur_chunk++;
@@ -326,6 +331,8 @@ int yaffs2_checkpt_rd(struct yaffs_dev *dev, void *data, int n_bytes)
 						realigned_chunk,
 						dev->checkpt_buffer,
 						&tags);
+			yaffs_np_chunk(dev, YAFFS_NP_READ, chunk,
+				       tags.chunk_id);
 
 			if (tags.chunk_id != (dev->checkpt_page_seq + 1) ||
 			    tags.ecc_result > YAFFS_ECC_RESULT_FIXED ||
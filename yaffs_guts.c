@@ -22,6 +22,8 @@
 #include "yaffs_yaffs2.h"
 #include "yaffs_bitmap.h"
 #include "yaffs_verify.h"
+#include "yaffs_tracebuf.h"
+#include "yaffs_nandprof.h"
 #include "yaffs_nand.h"
 #include "yaffs_packedtags2.h"
 #include "yaffs_nameval.h"
@@ -33,19 +35,28 @@
 #define YAFFS_GC_GOOD_ENOUGH 2
 #define YAFFS_GC_PASSIVE_THRESHOLD 4
 
+/* Objects deleted per background gc call when lost+found is emptied there */
+#define YAFFS_BG_DEL_BATCH 16
+
 #include "yaffs_ecc.h"
 
 /* Forward declarations */
 
 static int yaffs_wr_data_obj(struct yaffs_obj *in, int inode_chunk,
 			     const u8 *buffer, int n_bytes, int use_reserve);
+static int yaffs_bg_del(struct yaffs_dev *dev, int max_objs);
+
+#ifdef CONFIG_YAFFS_COMPACT_OBJ
+static void yaffs_drop_obj_attr(struct yaffs_obj *obj);
+static void yaffs_free_all_obj_attr(struct yaffs_dev *dev);
+#endif
 
 
 
 /* Function to calculate chunk and offset */
 
-static inline void yaffs_addr_to_chunk(struct yaffs_dev *dev, loff_t addr,
-					int *chunk_out, u32 *offset_out)
+void yaffs_addr_to_chunk(struct yaffs_dev *dev, loff_t addr,
+			 int *chunk_out, u32 *offset_out)
 {
 	int chunk;
 	u32 offset;
@@ -405,12 +416,15 @@ static int yaffs_find_alloc_block(struct yaffs_dev *dev)
 		if (bi->block_state == YAFFS_BLOCK_STATE_EMPTY) {
 			bi->block_state = YAFFS_BLOCK_STATE_ALLOCATING;
 			dev->seq_number++;
-			bi->seq_number = dev->seq_number;
+			yaffs_set_block_seq(dev, bi, dev->seq_number);
 			dev->n_erased_blocks--;
 			yaffs_trace(YAFFS_TRACE_ALLOCATE,
 			  "Allocated block %d, seq  %d, %d left" ,
 			   dev->alloc_block_finder, dev->seq_number,
 			   dev->n_erased_blocks);
+			yaffs_tb_event3(dev, YAFFS_TRACE_ALLOCATE,
+			  YAFFS_TB_ALLOC_BLOCK, dev->alloc_block_finder,
+			  dev->seq_number, dev->n_erased_blocks);
 			return dev->alloc_block_finder;
 		}
 	}
@@ -459,6 +473,7 @@ static int yaffs_alloc_chunk(struct yaffs_dev *dev, int use_reserver,
 		/* If the block is full set the state to full */
 		if (dev->alloc_page >= dev->param.chunks_per_block) {
 			bi->block_state = YAFFS_BLOCK_STATE_FULL;
+			yaffs2_block_became_full(dev, dev->alloc_block, bi);
 			dev->alloc_block = -1;
 		}
 
@@ -499,6 +514,7 @@ void yaffs_skip_rest_of_block(struct yaffs_dev *dev)
 		bi = yaffs_get_block_info(dev, dev->alloc_block);
 		if (bi->block_state == YAFFS_BLOCK_STATE_ALLOCATING) {
 			bi->block_state = YAFFS_BLOCK_STATE_FULL;
+			yaffs2_block_became_full(dev, dev->alloc_block, bi);
 			dev->alloc_block = -1;
 		}
 	}
@@ -727,9 +743,14 @@ static void yaffs_free_tnode(struct yaffs_dev *dev, struct yaffs_tnode *tn)
 
 static void yaffs_deinit_tnodes_and_objs(struct yaffs_dev *dev)
 {
+#ifdef CONFIG_YAFFS_COMPACT_OBJ
+	yaffs_free_all_obj_attr(dev);
+#endif
 	yaffs_deinit_raw_tnodes_and_objs(dev);
 	dev->n_obj = 0;
 	dev->n_tnodes = 0;
+	dev->n_evicted_files = 0;
+	dev->tnode_evict_retry = 0;
 }
 
 void yaffs_load_tnode_0(struct yaffs_dev *dev, struct yaffs_tnode *tn,
@@ -987,6 +1008,300 @@ static int yaffs_find_chunk_in_group(struct yaffs_dev *dev, int the_chunk,
 	return -1;
 }
 
+/* -------------------- Tnode tree eviction ---------------------------------
+ * With param.max_tnodes set, the tnode trees of files that are closed and
+ * clean can be freed when there are too many tnodes, least recently used
+ * first. An evicted tree is rebuilt when the file is next used by looking
+ * for the file's chunks in the chunk bitmaps, reading the summaries or tags
+ * of the blocks that hold any.
+ *
+ * Trees are only evicted from yaffs_tnodes_load() and
+ * yaffs_put_chunk_in_file(), when nothing else is walking a tree, and never
+ * during a scan. A checkpoint records which files were evicted.
+ */
+
+static void yaffs_free_tnode_tree(struct yaffs_dev *dev,
+				  struct yaffs_tnode *tn, int level)
+{
+	int i;
+
+	if (!tn)
+		return;
+
+	if (level > 0) {
+		for (i = 0; i < YAFFS_NTNODES_INTERNAL; i++)
+			yaffs_free_tnode_tree(dev, tn->internal[i], level - 1);
+	}
+	yaffs_free_tnode(dev, tn);
+}
+
+void yaffs_evict_file_tnodes(struct yaffs_obj *obj)
+{
+	struct yaffs_dev *dev = obj->my_dev;
+	struct yaffs_file_var *file_struct = &obj->variant.file_variant;
+
+	if (obj->variant_type != YAFFS_OBJECT_TYPE_FILE ||
+	    obj->tnodes_evicted)
+		return;
+
+	yaffs_free_tnode_tree(dev, file_struct->top, file_struct->top_level);
+	file_struct->top = NULL;
+	file_struct->top_level = 0;
+	obj->tnodes_evicted = 1;
+	dev->n_evicted_files++;
+}
+
+/*
+ * Only closed files are evicted. yaffsfs and the VFS both hook an inode to
+ * the object while the file is open, so has_inode covers open handles.
+ */
+static int yaffs_tnodes_evictable(struct yaffs_obj *obj)
+{
+	return obj->variant_type == YAFFS_OBJECT_TYPE_FILE &&
+	    !obj->tnodes_evicted &&
+	    obj->n_data_chunks > 0 &&
+	    !yaffs_obj_has_inode(obj) &&
+	    !obj->dirty &&
+	    !obj->deleted &&
+	    !obj->unlinked &&
+	    !obj->soft_del &&
+	    !obj->fake &&
+	    !obj->being_created &&
+	    !obj->defered_free;
+}
+
+/* Evicts trees until there are no more than target tnodes left. */
+static void yaffs_evict_tnodes(struct yaffs_dev *dev, struct yaffs_obj *keep,
+			       int target)
+{
+	struct yaffs_obj *obj;
+	struct yaffs_obj *victim;
+	struct list_head *lh;
+	int n_tnodes;
+	int i;
+
+#ifdef CONFIG_YAFFS_COMPACT_BLOCKS
+	/*
+	 * A block whose bitmap is unknown can hold dead chunks that look
+	 * live, and a rebuild could not tell them apart, so don't evict
+	 * until those blocks are erased. A block that goes unknown later is
+	 * fine: it was all in use or all free when its map was lost, and the
+	 * chunks of an evicted file can't die without loading it first.
+	 */
+	if (dev->n_chunk_map_unknown > 0)
+		return;
+#endif
+
+	while (dev->n_tnodes > target) {
+		victim = NULL;
+		for (i = 0; i < YAFFS_NOBJECT_BUCKETS; i++) {
+			list_for_each(lh, &dev->obj_bucket[i].list) {
+				obj = list_entry(lh, struct yaffs_obj,
+						 hash_link);
+				if (obj == keep || !yaffs_tnodes_evictable(obj))
+					continue;
+				if (!victim ||
+				    (int)(obj->variant.file_variant.lru_stamp -
+				     victim->variant.file_variant.lru_stamp) < 0)
+					victim = obj;
+			}
+		}
+		if (!victim)
+			break;
+
+		n_tnodes = dev->n_tnodes;
+		yaffs_evict_file_tnodes(victim);
+		dev->tnode_evictions++;
+		yaffs_trace(YAFFS_TRACE_ALLOCATE,
+			"yaffs: evicted tnodes of object %d, %d tnodes freed",
+			victim->obj_id, n_tnodes - dev->n_tnodes);
+	}
+}
+
+static void yaffs_check_tnode_budget(struct yaffs_dev *dev,
+				     struct yaffs_obj *keep)
+{
+	int max = dev->param.max_tnodes;
+
+	if (max <= 0 || dev->n_tnodes <= max ||
+	    dev->n_tnodes < dev->tnode_evict_retry)
+		return;
+
+	/* Free a little more than needed so this does not run every time */
+	yaffs_evict_tnodes(dev, keep, max - max / 8);
+
+	/* If the open files hold too many, wait for them to grow a bit */
+	if (dev->n_tnodes > max)
+		dev->tnode_evict_retry = dev->n_tnodes + max / 8;
+	else
+		dev->tnode_evict_retry = 0;
+}
+
+/* Is NAND chunk a a newer copy than NAND chunk b? */
+static int yaffs_chunk_is_newer(struct yaffs_dev *dev, int a, int b)
+{
+	int blk_a = a / dev->param.chunks_per_block;
+	int blk_b = b / dev->param.chunks_per_block;
+	u32 seq_a;
+	u32 seq_b;
+
+	if (blk_a == blk_b)
+		return a > b;
+
+	seq_a = yaffs_block_seq(dev, yaffs_get_block_info(dev, blk_a));
+	seq_b = yaffs_block_seq(dev, yaffs_get_block_info(dev, blk_b));
+	return seq_a > seq_b;
+}
+
+static int yaffs_rebuild_put_chunk(struct yaffs_obj *in,
+				   struct yaffs_ext_tags *tags, int nand_chunk)
+{
+	struct yaffs_dev *dev = in->my_dev;
+	struct yaffs_file_var *file_struct = &in->variant.file_variant;
+	struct yaffs_ext_tags existing_tags;
+	struct yaffs_tnode *tn;
+	int existing;
+
+	/* Truncation deletes the chunks beyond the end */
+	if ((loff_t)(tags->chunk_id - 1) * dev->data_bytes_per_chunk >=
+	    file_struct->file_size)
+		return YAFFS_OK;
+
+	/*
+	 * There is only one live copy of each chunk unless a block's bitmap
+	 * is not known, then the newest one wins as in a scan.
+	 */
+	tn = yaffs_find_tnode_0(dev, file_struct, tags->chunk_id);
+	if (tn) {
+		existing = yaffs_find_chunk_in_group(dev,
+				yaffs_get_group_base(dev, tn, tags->chunk_id),
+				&existing_tags, in->obj_id, tags->chunk_id);
+		if (existing > 0 &&
+		    yaffs_chunk_is_newer(dev, existing, nand_chunk))
+			return YAFFS_OK;
+	}
+
+	tn = yaffs_add_find_tnode_0(dev, file_struct, tags->chunk_id, NULL);
+	if (!tn)
+		return YAFFS_FAIL;
+
+	yaffs_load_tnode_0(dev, tn, tags->chunk_id, nand_chunk);
+	return YAFFS_OK;
+}
+
+static int yaffs_rebuild_tnodes(struct yaffs_obj *in)
+{
+	struct yaffs_dev *dev = in->my_dev;
+	struct yaffs_file_var *file_struct = &in->variant.file_variant;
+	struct yaffs_packed_tags2_tags_only tags_only;
+	struct yaffs_summary_tags *st = NULL;
+	struct yaffs_block_info *bi;
+	struct yaffs_ext_tags tags;
+	int n_chunks;
+	int use_summary;
+	int chunk;
+	int blk;
+	int ok = 1;
+	int i;
+
+	file_struct->top = yaffs_get_tnode(dev);
+	file_struct->top_level = 0;
+	if (!file_struct->top)
+		return YAFFS_FAIL;
+
+	if (dev->sum_tags)
+		st = kmalloc(dev->chunks_per_summary *
+			     sizeof(struct yaffs_summary_tags), GFP_NOFS);
+
+	for (blk = dev->internal_start_block;
+	     ok && blk <= dev->internal_end_block; blk++) {
+		bi = yaffs_get_block_info(dev, blk);
+		if ((bi->block_state != YAFFS_BLOCK_STATE_FULL &&
+		     bi->block_state != YAFFS_BLOCK_STATE_ALLOCATING &&
+		     bi->block_state != YAFFS_BLOCK_STATE_COLLECTING) ||
+		    bi->pages_in_use < 1)
+			continue;
+
+		dev->tnode_rebuild_blocks++;
+		use_summary = 0;
+		n_chunks = dev->param.chunks_per_block;
+		if (st && bi->has_summary) {
+			dev->tnode_rebuild_reads++;
+			if (yaffs_summary_read(dev, st, blk) == YAFFS_OK) {
+				use_summary = 1;
+				n_chunks = dev->chunks_per_summary;
+			}
+		}
+
+		for (i = 0; ok && i < n_chunks; i++) {
+			if (!yaffs_check_chunk_bit(dev, blk, i))
+				continue;
+
+			chunk = blk * dev->param.chunks_per_block + i;
+			if (use_summary) {
+				tags_only.seq_number = 0;
+				tags_only.obj_id = st[i].obj_id;
+				tags_only.chunk_id = st[i].chunk_id;
+				tags_only.n_bytes = st[i].n_bytes;
+				yaffs_unpack_tags2_tags_only(&tags,
+							     &tags_only);
+			} else {
+				dev->tnode_rebuild_reads++;
+				yaffs_rd_chunk_tags_nand(dev, chunk, NULL,
+							 &tags);
+				if (!tags.chunk_used || tags.is_deleted)
+					continue;
+			}
+
+			if (tags.obj_id == in->obj_id && tags.chunk_id > 0)
+				ok = yaffs_rebuild_put_chunk(in, &tags, chunk);
+		}
+	}
+
+	kfree(st);
+
+	if (!ok) {
+		yaffs_free_tnode_tree(dev, file_struct->top,
+				      file_struct->top_level);
+		file_struct->top = NULL;
+		file_struct->top_level = 0;
+		return YAFFS_FAIL;
+	}
+	return YAFFS_OK;
+}
+
+/* Makes sure a file's tnode tree is in memory before it is used. */
+static int yaffs_tnodes_load(struct yaffs_obj *in)
+{
+	struct yaffs_dev *dev = in->my_dev;
+
+	if (in->variant_type != YAFFS_OBJECT_TYPE_FILE)
+		return YAFFS_OK;
+
+	in->variant.file_variant.lru_stamp = ++dev->tnode_clock;
+
+	if (!in->tnodes_evicted)
+		return YAFFS_OK;
+
+	yaffs_check_tnode_budget(dev, in);
+
+	if (yaffs_rebuild_tnodes(in) != YAFFS_OK) {
+		/* Try again with every other tree out of the way */
+		yaffs_evict_tnodes(dev, in, 0);
+		if (yaffs_rebuild_tnodes(in) != YAFFS_OK) {
+			yaffs_trace(YAFFS_TRACE_ERROR,
+				"yaffs: could not rebuild tnodes of object %d",
+				in->obj_id);
+			return YAFFS_FAIL;
+		}
+	}
+
+	in->tnodes_evicted = 0;
+	dev->n_evicted_files--;
+	dev->tnode_rebuilds++;
+	return YAFFS_OK;
+}
+
 static int yaffs_find_chunk_in_file(struct yaffs_obj *in, int inode_chunk,
 				    struct yaffs_ext_tags *tags)
 {
@@ -1002,6 +1317,9 @@ static int yaffs_find_chunk_in_file(struct yaffs_obj *in, int inode_chunk,
 		tags = &local_tags;
 	}
 
+	if (yaffs_tnodes_load(in) != YAFFS_OK)
+		return ret_val;
+
 	tn = yaffs_find_tnode_0(dev, &in->variant.file_variant, inode_chunk);
 
 	if (!tn)
@@ -1029,6 +1347,9 @@ static int yaffs_find_del_file_chunk(struct yaffs_obj *in, int inode_chunk,
 		tags = &local_tags;
 	}
 
+	if (yaffs_tnodes_load(in) != YAFFS_OK)
+		return ret_val;
+
 	tn = yaffs_find_tnode_0(dev, &in->variant.file_variant, inode_chunk);
 
 	if (!tn)
@@ -1079,6 +1400,12 @@ int yaffs_put_chunk_in_file(struct yaffs_obj *in, int inode_chunk,
 		return YAFFS_OK;
 	}
 
+	if (!in_scan) {
+		if (yaffs_tnodes_load(in) != YAFFS_OK)
+			return YAFFS_FAIL;
+		yaffs_check_tnode_budget(dev, in);
+	}
+
 	tn = yaffs_add_find_tnode_0(dev,
 				    &in->variant.file_variant,
 				    inode_chunk, NULL);
@@ -1600,6 +1927,247 @@ static void yaffs_invalidate_whole_cache(struct yaffs_obj *in)
 	}
 }
 
+#ifdef CONFIG_YAFFS_COMPACT_OBJ
+/*
+ * Cached object attributes, see struct yaffs_obj_attr.
+ * Records are hashed on the object id and kept on an LRU list. Clean ones
+ * beyond param.n_attr_cache are freed, least recently used first.
+ */
+
+static struct yaffs_obj_attr **yaffs_attr_bucket(struct yaffs_obj *obj)
+{
+	return &obj->my_dev->attr_bucket[obj->obj_id % YAFFS_NATTR_BUCKETS];
+}
+
+static struct yaffs_obj_attr *yaffs_find_obj_attr(struct yaffs_obj *obj)
+{
+	struct yaffs_obj_attr *a;
+
+	for (a = *yaffs_attr_bucket(obj); a; a = a->hash_next)
+		if (a->obj == obj)
+			return a;
+	return NULL;
+}
+
+static void yaffs_unlink_obj_attr(struct yaffs_dev *dev,
+				  struct yaffs_obj_attr *a)
+{
+	struct yaffs_obj_attr **p = yaffs_attr_bucket(a->obj);
+
+	while (*p != a)
+		p = &(*p)->hash_next;
+	*p = a->hash_next;
+	list_del(&a->lru);
+	dev->n_attr--;
+}
+
+static void yaffs_free_obj_attr(struct yaffs_dev *dev,
+				struct yaffs_obj_attr *a)
+{
+	yaffs_unlink_obj_attr(dev, a);
+	if (a == &dev->attr_spare)
+		a->obj = NULL;
+	else
+		kfree(a);
+}
+
+static void yaffs_trim_obj_attr(struct yaffs_dev *dev)
+{
+	int limit = dev->param.n_attr_cache > 0 ?
+			dev->param.n_attr_cache : YAFFS_DEFAULT_ATTR_CACHE;
+	struct list_head *lh = dev->attr_lru.prev;
+	struct list_head *prev;
+	struct yaffs_obj_attr *a;
+
+	while (dev->n_attr >= limit && lh != &dev->attr_lru) {
+		prev = lh->prev;
+		a = list_entry(lh, struct yaffs_obj_attr, lru);
+		/* Only drop what can be read back from the header */
+		if (!a->dirty && a->obj->hdr_chunk > 0)
+			yaffs_free_obj_attr(dev, a);
+		lh = prev;
+	}
+}
+
+/*
+ * Out of memory. Use the spare if it is free, otherwise take over the least
+ * recently used record that can be read back from its header.
+ */
+static struct yaffs_obj_attr *yaffs_reuse_obj_attr(struct yaffs_dev *dev)
+{
+	struct list_head *lh;
+	struct yaffs_obj_attr *a;
+
+	if (!dev->attr_spare.obj)
+		return &dev->attr_spare;
+
+	for (lh = dev->attr_lru.prev; lh != &dev->attr_lru; lh = lh->prev) {
+		a = list_entry(lh, struct yaffs_obj_attr, lru);
+		if (!a->dirty && a->obj->hdr_chunk > 0) {
+			yaffs_unlink_obj_attr(dev, a);
+			return a;
+		}
+	}
+	return NULL;
+}
+
+static struct yaffs_obj_attr *yaffs_new_obj_attr(struct yaffs_obj *obj)
+{
+	struct yaffs_dev *dev = obj->my_dev;
+	struct yaffs_obj_attr **bucket = yaffs_attr_bucket(obj);
+	struct yaffs_obj_attr *a;
+
+	yaffs_trim_obj_attr(dev);
+
+	a = kmalloc(sizeof(*a), GFP_NOFS);
+	if (!a)
+		a = yaffs_reuse_obj_attr(dev);
+	if (!a)
+		return NULL;
+	memset(a, 0, sizeof(*a));
+	a->obj = obj;
+	a->hash_next = *bucket;
+	*bucket = a;
+	list_add(&a->lru, &dev->attr_lru);
+	dev->n_attr++;
+	return a;
+}
+
+/*
+ * No record to be had. Hand out a copy of what the header holds, so that
+ * at least reads are right. Changes made to it are lost, and
+ * yaffs_update_oh() refuses to write a header without a record.
+ */
+static struct yaffs_obj_attr *yaffs_scratch_obj_attr(struct yaffs_obj *obj)
+{
+	struct yaffs_dev *dev = obj->my_dev;
+	struct yaffs_obj_attr *a = &dev->attr_scratch;
+	struct yaffs_obj_hdr *oh;
+	struct yaffs_ext_tags tags;
+	u8 *buf;
+
+	memset(a, 0, sizeof(*a));
+	a->obj = obj;
+
+	if (obj->hdr_chunk <= 0) {
+#ifndef CONFIG_YAFFS_WINCE
+		a->yst_atime = a->yst_mtime = a->yst_ctime = Y_CURRENT_TIME;
+#endif
+		return a;
+	}
+
+	buf = yaffs_get_temp_buffer(dev);
+	oh = (struct yaffs_obj_hdr *)buf;
+	if (yaffs_rd_chunk_tags_nand(dev, obj->hdr_chunk,
+				     buf, &tags) == YAFFS_OK) {
+#ifdef CONFIG_YAFFS_WINCE
+		memcpy(a->win_ctime, oh->win_ctime, sizeof(a->win_ctime));
+		memcpy(a->win_mtime, oh->win_mtime, sizeof(a->win_mtime));
+		memcpy(a->win_atime, oh->win_atime, sizeof(a->win_atime));
+#else
+		a->yst_uid = oh->yst_uid;
+		a->yst_gid = oh->yst_gid;
+		a->yst_atime = oh->yst_atime;
+		a->yst_mtime = oh->yst_mtime;
+		a->yst_ctime = oh->yst_ctime;
+#endif
+		a->yst_rdev = oh->yst_rdev;
+	}
+	yaffs_release_temp_buffer(dev, buf);
+	dev->attr_loads++;
+	return a;
+}
+
+struct yaffs_obj_attr *yaffs_get_obj_attr(struct yaffs_obj *obj, int mod)
+{
+	struct yaffs_dev *dev = obj->my_dev;
+	struct yaffs_obj_attr *a;
+	struct yaffs_ext_tags tags;
+	u8 *buf;
+
+	a = yaffs_find_obj_attr(obj);
+	if (a) {
+		list_del(&a->lru);
+		list_add(&a->lru, &dev->attr_lru);
+	} else {
+		a = yaffs_new_obj_attr(obj);
+		if (!a) {
+			yaffs_trace(YAFFS_TRACE_ERROR,
+				"yaffs: no memory for object %d attributes",
+				obj->obj_id);
+			return yaffs_scratch_obj_attr(obj);
+		}
+
+		/* These find the new record */
+		if (obj->hdr_chunk > 0) {
+			buf = yaffs_get_temp_buffer(dev);
+			if (yaffs_rd_chunk_tags_nand(dev, obj->hdr_chunk,
+						     buf, &tags) == YAFFS_OK)
+				yaffs_load_attribs(obj,
+						   (struct yaffs_obj_hdr *)buf);
+			yaffs_release_temp_buffer(dev, buf);
+			dev->attr_loads++;
+		} else {
+			yaffs_load_current_time(obj, 1, 1);
+		}
+		a->dirty = 0;
+	}
+
+	if (mod)
+		a->dirty = 1;
+	return a;
+}
+
+int yaffs_obj_attr_loaded(struct yaffs_obj *obj)
+{
+	return yaffs_find_obj_attr(obj) != NULL;
+}
+
+/*
+ * Makes sure there is a record before a header is written, taking the
+ * attributes from the header being replaced (if any) to save a read.
+ * Returns 0 if there is none, as the header would then be written from
+ * made up values.
+ */
+static int yaffs_obj_attr_from_oh(struct yaffs_obj *obj,
+				  struct yaffs_obj_hdr *oh)
+{
+	if (yaffs_find_obj_attr(obj))
+		return 1;
+	if (!oh || !yaffs_new_obj_attr(obj))
+		return 0;
+	yaffs_load_attribs(obj, oh);
+	return 1;
+}
+
+/* The header now matches the record */
+static void yaffs_obj_attr_written(struct yaffs_obj *obj)
+{
+	struct yaffs_obj_attr *a = yaffs_find_obj_attr(obj);
+
+	if (a)
+		a->dirty = 0;
+}
+
+static void yaffs_drop_obj_attr(struct yaffs_obj *obj)
+{
+	struct yaffs_obj_attr *a = yaffs_find_obj_attr(obj);
+
+	if (a)
+		yaffs_free_obj_attr(obj->my_dev, a);
+}
+
+static void yaffs_free_all_obj_attr(struct yaffs_dev *dev)
+{
+	struct yaffs_obj_attr *a;
+
+	while (!list_empty(&dev->attr_lru)) {
+		a = list_entry(dev->attr_lru.next, struct yaffs_obj_attr, lru);
+		yaffs_free_obj_attr(dev, a);
+	}
+}
+#endif
+
 static void yaffs_unhash_obj(struct yaffs_obj *obj)
 {
 	int bucket;
@@ -1623,14 +2191,14 @@ static void yaffs_free_obj(struct yaffs_obj *obj)
 		return;
 	}
 	dev = obj->my_dev;
-	yaffs_trace(YAFFS_TRACE_OS, "FreeObject %p inode %p",
-		obj, obj->my_inode);
+	yaffs_trace(YAFFS_TRACE_OS, "FreeObject %p inode %d",
+		obj, yaffs_obj_has_inode(obj));
 	if (obj->parent)
 		BUG();
 	if (!list_empty(&obj->siblings))
 		BUG();
 
-	if (obj->my_inode) {
+	if (yaffs_obj_has_inode(obj)) {
 		/* We're still hooked up to a cached inode.
 		 * Don't delete now, but mark for later deletion
 		 */
@@ -1639,6 +2207,13 @@ static void yaffs_free_obj(struct yaffs_obj *obj)
 	}
 
 	yaffs_unhash_obj(obj);
+#ifdef CONFIG_YAFFS_COMPACT_OBJ
+	yaffs_drop_obj_attr(obj);
+#endif
+	if (obj->tnodes_evicted)
+		dev->n_evicted_files--;
+	if (obj->bg_del)
+		dev->n_bg_del_pending--;
 
 	yaffs_free_raw_obj(dev, obj);
 	dev->n_obj--;
@@ -1688,6 +2263,7 @@ static void yaffs_soft_del_file(struct yaffs_obj *obj)
 			obj->obj_id);
 		yaffs_generic_obj_del(obj);
 	} else {
+		yaffs_tnodes_load(obj);
 		yaffs_soft_del_worker(obj,
 				      obj->variant.file_variant.top,
 				      obj->variant.
@@ -1947,7 +2523,10 @@ struct yaffs_obj *yaffs_new_obj(struct yaffs_dev *dev, int number,
 	the_obj->obj_id = number;
 	yaffs_hash_obj(the_obj);
 	the_obj->variant_type = type;
+#ifndef CONFIG_YAFFS_COMPACT_OBJ
+	/* Compact objects get these when first asked for */
 	yaffs_load_current_time(the_obj, 1, 1);
+#endif
 
 	switch (type) {
 	case YAFFS_OBJECT_TYPE_FILE:
@@ -1956,6 +2535,8 @@ struct yaffs_obj *yaffs_new_obj(struct yaffs_dev *dev, int number,
 		the_obj->variant.file_variant.shrink_size = ~0; /* max */
 		the_obj->variant.file_variant.top_level = 0;
 		the_obj->variant.file_variant.top = tn;
+		/* Anything it had before this was pruned off another life */
+		the_obj->variant.file_variant.pruned_seq = dev->seq_number;
 		break;
 	case YAFFS_OBJECT_TYPE_DIRECTORY:
 		INIT_LIST_HEAD(&the_obj->variant.dir_variant.children);
@@ -2008,6 +2589,13 @@ static void yaffs_init_tnodes_and_objs(struct yaffs_dev *dev)
 		INIT_LIST_HEAD(&dev->obj_bucket[i].list);
 		dev->obj_bucket[i].count = 0;
 	}
+
+#ifdef CONFIG_YAFFS_COMPACT_OBJ
+	memset(dev->attr_bucket, 0, sizeof(dev->attr_bucket));
+	INIT_LIST_HEAD(&dev->attr_lru);
+	dev->n_attr = 0;
+	dev->attr_spare.obj = NULL;
+#endif
 }
 
 struct yaffs_obj *yaffs_find_or_create_by_number(struct yaffs_dev *dev,
@@ -2245,6 +2833,12 @@ struct yaffs_obj *yaffs_link_obj(struct yaffs_obj *parent, const YCHAR * name,
 
 static void yaffs_deinit_blocks(struct yaffs_dev *dev)
 {
+	yaffs2_deinit_block_heaps(dev);
+	yaffs2_deinit_shrink_seqs(dev);
+
+	kfree(dev->xip_pins);
+	dev->xip_pins = NULL;
+
 	if (dev->block_info_alt && dev->block_info)
 		vfree(dev->block_info);
 	else
@@ -2254,12 +2848,16 @@ static void yaffs_deinit_blocks(struct yaffs_dev *dev)
 
 	dev->block_info = NULL;
 
+#ifdef CONFIG_YAFFS_COMPACT_BLOCKS
+	yaffs_deinit_chunk_bits(dev);
+#else
 	if (dev->chunk_bits_alt && dev->chunk_bits)
 		vfree(dev->chunk_bits);
 	else
 		kfree(dev->chunk_bits);
 	dev->chunk_bits_alt = 0;
 	dev->chunk_bits = NULL;
+#endif
 }
 
 static int yaffs_init_blocks(struct yaffs_dev *dev)
@@ -2267,7 +2865,11 @@ static int yaffs_init_blocks(struct yaffs_dev *dev)
 	int n_blocks = dev->internal_end_block - dev->internal_start_block + 1;
 
 	dev->block_info = NULL;
+#ifdef CONFIG_YAFFS_COMPACT_BLOCKS
+	dev->chunk_bit_groups = NULL;
+#else
 	dev->chunk_bits = NULL;
+#endif
 	dev->alloc_block = -1;	/* force it to get a new one */
 
 	/* If the first allocation strategy fails, thry the alternate one */
@@ -2286,6 +2888,13 @@ static int yaffs_init_blocks(struct yaffs_dev *dev)
 
 	/* Set up dynamic blockinfo stuff. Round up bytes. */
 	dev->chunk_bit_stride = (dev->param.chunks_per_block + 7) / 8;
+#ifdef CONFIG_YAFFS_COMPACT_BLOCKS
+	if (yaffs_init_chunk_bits(dev, n_blocks) != YAFFS_OK)
+		goto alloc_error;
+
+	memset(dev->block_info, 0, n_blocks * sizeof(struct yaffs_block_info));
+	return YAFFS_OK;
+#else
 	dev->chunk_bits =
 		kmalloc(dev->chunk_bit_stride * n_blocks, GFP_NOFS);
 	if (!dev->chunk_bits) {
@@ -2302,17 +2911,173 @@ static int yaffs_init_blocks(struct yaffs_dev *dev)
 	memset(dev->block_info, 0, n_blocks * sizeof(struct yaffs_block_info));
 	memset(dev->chunk_bits, 0, dev->chunk_bit_stride * n_blocks);
 	return YAFFS_OK;
+#endif
 
 alloc_error:
 	yaffs_deinit_blocks(dev);
 	return YAFFS_FAIL;
 }
 
-
-void yaffs_block_became_dirty(struct yaffs_dev *dev, int block_no)
+#ifdef CONFIG_YAFFS_COMPACT_BLOCKS
+/*
+ * Block sequence numbers are kept as 16 bit offsets from dev->seq_base.
+ * When a new one does not fit the offsets are moved down. If the oldest
+ * block is too old for that they are renumbered in order instead, keeping
+ * the newest block's number. Only the order of the numbers in RAM matters
+ * once the blocks have been scanned.
+ */
+static void yaffs_rank_block_seqs(struct yaffs_dev *dev)
 {
-	struct yaffs_block_info *bi = yaffs_get_block_info(dev, block_no);
-	int erased_ok = 0;
+	int n_blocks = dev->internal_end_block - dev->internal_start_block + 1;
+	struct yaffs_block_info *bi;
+	u8 present[32];
+	u8 bits[32];
+	u32 newest = 0;
+	u16 rank = 0;
+	u16 v;
+	int h;
+	int i;
+
+	/* Which high bytes are used */
+	memset(present, 0, sizeof(present));
+	for (i = 0, bi = dev->block_info; i < n_blocks; i++, bi++) {
+		v = bi->seq_offset;
+		if (v) {
+			present[v >> 11] |= 1 << ((v >> 8) & 7);
+			if (v > newest)
+				newest = v;
+		}
+	}
+	if (!newest)
+		return;
+	newest += dev->seq_base;
+
+	/* New offsets are never bigger than the old ones so a bucket can't
+	 * pick up blocks that have already been renumbered. */
+	for (h = 0; h < 256; h++) {
+		if (!(present[h >> 3] & (1 << (h & 7))))
+			continue;
+
+		memset(bits, 0, sizeof(bits));
+		for (i = 0, bi = dev->block_info; i < n_blocks; i++, bi++) {
+			v = bi->seq_offset;
+			if (v && (v >> 8) == h)
+				bits[(v & 0xff) >> 3] |= 1 << (v & 7);
+		}
+
+		for (i = 0, bi = dev->block_info; i < n_blocks; i++, bi++) {
+			int lo;
+			int j;
+			u16 r = rank + 1;
+
+			v = bi->seq_offset;
+			if (!v || (v >> 8) != h)
+				continue;
+			lo = v & 0xff;
+			for (j = 0; j < lo / 8; j++)
+				r += hweight8(bits[j]);
+			r += hweight8(bits[lo / 8] & ((1 << (lo & 7)) - 1));
+			bi->seq_offset = r;
+		}
+
+		for (i = 0; i < 32; i++)
+			rank += hweight8(bits[i]);
+	}
+
+	dev->seq_base = newest - rank;
+}
+
+/*
+ * Ranking moves the older blocks' numbers up, so a pruned_seq taken before
+ * it could now be older than blocks that still hold pruned chunks. Start
+ * every file again from the current number, which covers them all. A
+ * pruned_seq of 0 already covers everything.
+ */
+static void yaffs_reset_pruned_seqs(struct yaffs_dev *dev)
+{
+	struct yaffs_obj *obj;
+	struct list_head *lh;
+	int i;
+
+	for (i = 0; i < YAFFS_NOBJECT_BUCKETS; i++) {
+		list_for_each(lh, &dev->obj_bucket[i].list) {
+			obj = list_entry(lh, struct yaffs_obj, hash_link);
+			if (obj->variant_type == YAFFS_OBJECT_TYPE_FILE &&
+			    obj->variant.file_variant.pruned_seq)
+				obj->variant.file_variant.pruned_seq =
+					dev->seq_number;
+		}
+	}
+}
+
+void yaffs_pack_block_seqs(struct yaffs_dev *dev)
+{
+	int n_blocks = dev->internal_end_block - dev->internal_start_block + 1;
+	struct yaffs_block_info *bi;
+	u16 oldest = 0;
+	u16 newest = 0;
+	int i;
+
+	for (i = 0, bi = dev->block_info; i < n_blocks; i++, bi++) {
+		if (bi->seq_offset && (!oldest || bi->seq_offset < oldest))
+			oldest = bi->seq_offset;
+		if (bi->seq_offset > newest)
+			newest = bi->seq_offset;
+	}
+
+	if (!oldest) {
+		/* Nothing is numbered so start again after the newest */
+		dev->seq_base = dev->seq_number;
+	} else if (newest - oldest < YAFFS_MAX_SEQ_OFFSET / 2) {
+		for (i = 0, bi = dev->block_info; i < n_blocks; i++, bi++) {
+			if (bi->seq_offset)
+				bi->seq_offset -= oldest - 1;
+		}
+		dev->seq_base += oldest - 1;
+	} else {
+		yaffs_rank_block_seqs(dev);
+		yaffs_reset_pruned_seqs(dev);
+	}
+
+	/* Sequence numbers may have changed */
+	yaffs2_clear_oldest_dirty_seq(dev, NULL);
+
+	yaffs_trace(YAFFS_TRACE_ALLOCATE,
+		"Packed block sequence numbers, base now %u", dev->seq_base);
+}
+
+void yaffs_set_block_seq(struct yaffs_dev *dev, struct yaffs_block_info *bi,
+			 u32 seq)
+{
+	if (seq < YAFFS_LOWEST_SEQUENCE_NUMBER ||
+	    seq >= YAFFS_HIGHEST_SEQUENCE_NUMBER) {
+		/* Not a data block */
+		bi->seq_offset = 0;
+		return;
+	}
+
+	if (seq > dev->seq_base && seq - dev->seq_base > YAFFS_MAX_SEQ_OFFSET)
+		yaffs_pack_block_seqs(dev);
+
+	if (seq <= dev->seq_base ||
+	    seq - dev->seq_base > YAFFS_MAX_SEQ_OFFSET) {
+		yaffs_trace(YAFFS_TRACE_ERROR,
+			"Block sequence number %u out of range, base %u",
+			seq, dev->seq_base);
+		bi->seq_offset = (seq <= dev->seq_base) ?
+				1 : YAFFS_MAX_SEQ_OFFSET;
+		return;
+	}
+
+	bi->seq_offset = seq - dev->seq_base;
+}
+#endif
+
+
+void yaffs_block_became_dirty(struct yaffs_dev *dev, int block_no)
+{
+	struct yaffs_block_info *bi = yaffs_get_block_info(dev, block_no);
+	int erased_ok = 0;
 	int i;
 
 	/* If the block is still healthy erase it and mark as clean.
@@ -2323,6 +3088,9 @@ void yaffs_block_became_dirty(struct yaffs_dev *dev, int block_no)
 		"yaffs_block_became_dirty block %d state %d %s",
 		block_no, bi->block_state,
 		(bi->needs_retiring) ? "needs retiring" : "");
+	yaffs_tb_event3(dev, YAFFS_TRACE_GC | YAFFS_TRACE_ERASE,
+		YAFFS_TB_BLOCK_DIRTY, block_no, bi->block_state,
+		bi->needs_retiring);
 
 	yaffs2_clear_oldest_dirty_seq(dev, bi);
 
@@ -2339,6 +3107,9 @@ void yaffs_block_became_dirty(struct yaffs_dev *dev, int block_no)
 		dev->gc_pages_in_use = 0;
 	}
 
+	yaffs_discard_chunks(dev, block_no * dev->param.chunks_per_block,
+			     dev->param.chunks_per_block);
+
 	if (!bi->needs_retiring) {
 		yaffs2_checkpt_invalidate(dev);
 		erased_ok = yaffs_erase_block(dev, block_no);
@@ -2374,7 +3145,7 @@ void yaffs_block_became_dirty(struct yaffs_dev *dev, int block_no)
 
 	/* Clean it up... */
 	bi->block_state = YAFFS_BLOCK_STATE_EMPTY;
-	bi->seq_number = 0;
+	yaffs_set_block_seq(dev, bi, 0);
 	dev->n_erased_blocks++;
 	bi->pages_in_use = 0;
 	bi->soft_del_pages = 0;
@@ -2388,6 +3159,22 @@ void yaffs_block_became_dirty(struct yaffs_dev *dev, int block_no)
 	yaffs_trace(YAFFS_TRACE_ERASE, "Erased block %d", block_no);
 }
 
+/*
+ * Checks a chunk against its object. Only needed for blocks whose chunk
+ * bitmap could not be kept, where deleted chunks still look in use.
+ */
+static int yaffs_gc_chunk_live(struct yaffs_obj *object,
+				struct yaffs_ext_tags *tags, int chunk)
+{
+	if (!object || !tags->chunk_used)
+		return 0;
+	if (tags->chunk_id == 0)
+		return object->hdr_chunk == chunk;
+	if (object->variant_type != YAFFS_OBJECT_TYPE_FILE)
+		return 0;
+	return yaffs_find_chunk_in_file(object, tags->chunk_id, NULL) == chunk;
+}
+
 static inline int yaffs_gc_process_chunk(struct yaffs_dev *dev,
 					struct yaffs_block_info *bi,
 					int old_chunk, u8 *buffer)
@@ -2409,11 +3196,17 @@ static inline int yaffs_gc_process_chunk(struct yaffs_dev *dev,
 		dev->gc_chunk, tags.obj_id,
 		tags.chunk_id, tags.n_bytes);
 
+	if (yaffs_chunk_bits_unknown(dev,
+				old_chunk / dev->param.chunks_per_block) &&
+	    !yaffs_gc_chunk_live(object, &tags, old_chunk))
+		/* Already deleted, it is just not in the bitmap */
+		return YAFFS_OK;
+
 	if (object && !yaffs_skip_verification(dev)) {
 		if (tags.chunk_id == 0)
 			matching_chunk =
 			    object->hdr_chunk;
-		else if (object->soft_del)
+		else if (object->soft_del || object->tnodes_evicted)
 			/* Defeat the test */
 			matching_chunk = old_chunk;
 		else
@@ -2512,6 +3305,9 @@ static inline int yaffs_gc_process_chunk(struct yaffs_dev *dev,
 		if (new_chunk < 0) {
 			ret_val = YAFFS_FAIL;
 		} else {
+			yaffs_tb_event4(dev, YAFFS_TRACE_GC_DETAIL,
+				YAFFS_TB_GC_COPY, old_chunk, new_chunk,
+				tags.obj_id, tags.chunk_id);
 
 			/* Now fix up the Tnodes etc. */
 
@@ -2519,8 +3315,10 @@ static inline int yaffs_gc_process_chunk(struct yaffs_dev *dev,
 				/* It's a header */
 				object->hdr_chunk = new_chunk;
 				object->serial = tags.serial_number;
-			} else {
-				/* It's a data chunk */
+			} else if (!object->tnodes_evicted) {
+				/* It's a data chunk. An evicted tree is
+				 * rebuilt from the chunk bits, so it does not
+				 * need to be loaded for this. */
 				yaffs_put_chunk_in_file(object, tags.chunk_id,
 							new_chunk, 0);
 			}
@@ -2531,15 +3329,16 @@ static inline int yaffs_gc_process_chunk(struct yaffs_dev *dev,
 	return ret_val;
 }
 
-static int yaffs_gc_block(struct yaffs_dev *dev, int block, int whole_block)
+static int yaffs_gc_block(struct yaffs_dev *dev, int block, int max_copies)
 {
 	int old_chunk;
 	int ret_val = YAFFS_OK;
 	int i;
 	int is_checkpt_block;
-	int max_copies;
+	int whole_block = (max_copies >= dev->param.chunks_per_block);
 	int chunks_before = yaffs_get_erased_chunks(dev);
 	int chunks_after;
+	int old_np_cause = dev->np_cause;
 	struct yaffs_block_info *bi = yaffs_get_block_info(dev, block);
 
 	is_checkpt_block = (bi->block_state == YAFFS_BLOCK_STATE_CHECKPOINT);
@@ -2548,15 +3347,20 @@ static int yaffs_gc_block(struct yaffs_dev *dev, int block, int whole_block)
 		"Collecting block %d, in use %d, shrink %d, whole_block %d",
 		block, bi->pages_in_use, bi->has_shrink_hdr,
 		whole_block);
+	yaffs_tb_event3(dev, YAFFS_TRACE_GC, YAFFS_TB_GC_BEGIN,
+		block, bi->pages_in_use, whole_block);
 
 	/*yaffs_verify_free_chunks(dev); */
 
 	if (bi->block_state == YAFFS_BLOCK_STATE_FULL)
 		bi->block_state = YAFFS_BLOCK_STATE_COLLECTING;
 
+	if (bi->has_shrink_hdr)
+		dev->n_shrink_gcs++;
 	bi->has_shrink_hdr = 0;	/* clear the flag so that the block can erase */
 
 	dev->gc_disable = 1;
+	dev->np_cause = YAFFS_NP_GC;
 
 	yaffs_summary_gc(dev, block);
 
@@ -2571,7 +3375,6 @@ static int yaffs_gc_block(struct yaffs_dev *dev, int block, int whole_block)
 
 		yaffs_verify_blk(dev, bi, block);
 
-		max_copies = (whole_block) ? dev->param.chunks_per_block : 5;
 		old_chunk = block * dev->param.chunks_per_block + dev->gc_chunk;
 
 		for (/* init already done */ ;
@@ -2628,6 +3431,10 @@ static int yaffs_gc_block(struct yaffs_dev *dev, int block, int whole_block)
 	}
 
 	dev->gc_disable = 0;
+	dev->np_cause = old_np_cause;
+
+	yaffs_tb_event3(dev, YAFFS_TRACE_GC, YAFFS_TB_GC_END,
+		block, dev->gc_chunk, ret_val);
 
 	return ret_val;
 }
@@ -2764,12 +3571,24 @@ static unsigned yaffs_find_gc_block(struct yaffs_dev *dev,
 		}
 	}
 
+	/* The oldest dirty block is taken as it is, it could be held */
+	if (selected &&
+	    yaffs_block_pinned(dev, yaffs_get_block_info(dev, selected))) {
+		if (selected == dev->gc_dirtiest)
+			dev->gc_dirtiest = 0;
+		selected = 0;
+	}
+
 	if (selected) {
 		yaffs_trace(YAFFS_TRACE_GC,
 			"GC Selected block %d with %d free, prioritised:%d",
 			selected,
 			dev->param.chunks_per_block - dev->gc_pages_in_use,
 			prioritised);
+		yaffs_tb_event4(dev, YAFFS_TRACE_GC, YAFFS_TB_GC_SELECT,
+			selected,
+			dev->param.chunks_per_block - dev->gc_pages_in_use,
+			prioritised, background);
 
 		dev->n_gc_blocks++;
 		if (background)
@@ -2792,6 +3611,34 @@ static unsigned yaffs_find_gc_block(struct yaffs_dev *dev,
 	return selected;
 }
 
+/*
+ * yaffs_gc_pace()
+ * How many chunks gc should copy for this write when pacing. Below twice
+ * min_erased erased blocks we are in gc debt: each block short of that costs
+ * the live chunks of a block to win back. The debt is spread over the
+ * chunks that can still be written before aggressive gc has to start, on
+ * top of what it takes to keep up with the writes.
+ */
+static int yaffs_gc_pace(struct yaffs_dev *dev, int min_erased)
+{
+	struct yaffs_block_info *bi = yaffs_get_block_info(dev, dev->gc_block);
+	int live = bi->pages_in_use;
+	int dirty = dev->param.chunks_per_block - live;
+	int debt = (2 * min_erased - dev->n_erased_blocks) * live;
+	int runway = (dev->n_erased_blocks - min_erased + 1) *
+			dev->param.chunks_per_block;
+	int copies;
+
+	if (dirty < 1)
+		return dev->param.gc_pace_copies;
+
+	copies = (live + dirty - 1) / dirty + (debt + runway - 1) / runway;
+
+	if (copies > dev->param.gc_pace_copies)
+		copies = dev->param.gc_pace_copies;
+	return copies;
+}
+
 /* New garbage collector
  * If we're very low on erased blocks then we do aggressive garbage collection
  * otherwise we do "leasurely" garbage collection.
@@ -2804,11 +3651,14 @@ static unsigned yaffs_find_gc_block(struct yaffs_dev *dev,
 static int yaffs_check_gc(struct yaffs_dev *dev, int background)
 {
 	int aggressive = 0;
+	int paced = 0;
+	int max_copies;
 	int gc_ok = YAFFS_OK;
 	int max_tries = 0;
 	int min_erased;
 	int erased_chunks;
 	int checkpt_block_adjust;
+	u32 copies_before = dev->n_gc_copies;
 
 	if (dev->param.gc_control && (dev->param.gc_control(dev) & 1) == 0)
 		return YAFFS_OK;
@@ -2834,6 +3684,9 @@ static int yaffs_check_gc(struct yaffs_dev *dev, int background)
 		/* If we need a block soon then do aggressive gc. */
 		if (dev->n_erased_blocks < min_erased)
 			aggressive = 1;
+		else if (!background && dev->param.gc_pace_copies > 0 &&
+			 dev->n_erased_blocks < 2 * min_erased)
+			paced = 1;
 		else {
 			if (!background
 			    && erased_chunks > (dev->n_free_chunks / 4))
@@ -2862,7 +3715,8 @@ static int yaffs_check_gc(struct yaffs_dev *dev, int background)
 		}
 		if (dev->gc_block < 1) {
 			dev->gc_block =
-			    yaffs_find_gc_block(dev, aggressive, background);
+			    yaffs_find_gc_block(dev, aggressive || paced,
+						background);
 			dev->gc_chunk = 0;
 			dev->n_clean_ups = 0;
 		}
@@ -2872,11 +3726,19 @@ static int yaffs_check_gc(struct yaffs_dev *dev, int background)
 			if (!aggressive)
 				dev->passive_gc_count++;
 
+			if (aggressive)
+				max_copies = dev->param.chunks_per_block;
+			else if (paced) {
+				max_copies = yaffs_gc_pace(dev, min_erased);
+				dev->gc_paced++;
+			} else
+				max_copies = 5;
+
 			yaffs_trace(YAFFS_TRACE_GC,
-				"yaffs: GC n_erased_blocks %d aggressive %d",
-				dev->n_erased_blocks, aggressive);
+				"yaffs: GC n_erased_blocks %d aggressive %d copies %d",
+				dev->n_erased_blocks, aggressive, max_copies);
 
-			gc_ok = yaffs_gc_block(dev, dev->gc_block, aggressive);
+			gc_ok = yaffs_gc_block(dev, dev->gc_block, max_copies);
 		}
 
 		if (dev->n_erased_blocks < (dev->param.n_reserved_blocks) &&
@@ -2889,6 +3751,14 @@ static int yaffs_check_gc(struct yaffs_dev *dev, int background)
 	} while ((dev->n_erased_blocks < dev->param.n_reserved_blocks) &&
 		 (dev->gc_block > 0) && (max_tries < 2));
 
+	if (!background) {
+		if (aggressive)
+			dev->gc_stalls++;
+		if (dev->n_gc_copies - copies_before > dev->gc_max_write_copies)
+			dev->gc_max_write_copies =
+				dev->n_gc_copies - copies_before;
+	}
+
 	return aggressive ? gc_ok : YAFFS_OK;
 }
 
@@ -2903,16 +3773,26 @@ int yaffs_bg_gc(struct yaffs_dev *dev, unsigned urgency)
 
 	yaffs_trace(YAFFS_TRACE_BACKGROUND, "Background gc %u", urgency);
 
+	if (dev->n_bg_del_pending > 0) {
+		/*
+		 * Come back soon if there is more to do, but not if nothing
+		 * could be deleted this time round.
+		 */
+		if (yaffs_bg_del(dev, YAFFS_BG_DEL_BATCH) > 0 &&
+		    dev->n_bg_del_pending > 0)
+			erased_chunks = 0;
+	}
+
 	yaffs_check_gc(dev, 1);
 	return erased_chunks > dev->n_free_chunks / 2;
 }
 
 /*-------------------- Data file manipulation -----------------*/
 
-static int yaffs_rd_data_obj(struct yaffs_obj *in, int inode_chunk, u8 * buffer)
+/* Reads a file's chunk that has already been looked up, -1 being a hole */
+static int yaffs_rd_data_nand(struct yaffs_obj *in, int nand_chunk,
+			      u8 * buffer)
 {
-	int nand_chunk = yaffs_find_chunk_in_file(in, inode_chunk, NULL);
-
 	if (nand_chunk >= 0)
 		return yaffs_rd_chunk_tags_nand(in->my_dev, nand_chunk,
 						buffer, NULL);
@@ -2927,6 +3807,13 @@ static int yaffs_rd_data_obj(struct yaffs_obj *in, int inode_chunk, u8 * buffer)
 
 }
 
+static int yaffs_rd_data_obj(struct yaffs_obj *in, int inode_chunk, u8 * buffer)
+{
+	return yaffs_rd_data_nand(in,
+				  yaffs_find_chunk_in_file(in, inode_chunk, NULL),
+				  buffer);
+}
+
 void yaffs_chunk_del(struct yaffs_dev *dev, int chunk_id, int mark_flash,
 		     int lyn)
 {
@@ -2976,8 +3863,11 @@ void yaffs_chunk_del(struct yaffs_dev *dev, int chunk_id, int mark_flash,
 		yaffs_clear_chunk_bit(dev, block, page);
 		bi->pages_in_use--;
 
+		/* A block held by an execute in place mapping is left for
+		 * yaffs_file_unmap() */
 		if (bi->pages_in_use == 0 &&
 		    !bi->has_shrink_hdr &&
+		    !yaffs_block_pinned(dev, bi) &&
 		    bi->block_state != YAFFS_BLOCK_STATE_ALLOCATING &&
 		    bi->block_state != YAFFS_BLOCK_STATE_NEEDS_SCAN) {
 			yaffs_block_became_dirty(dev, block);
@@ -2985,6 +3875,46 @@ void yaffs_chunk_del(struct yaffs_dev *dev, int chunk_id, int mark_flash,
 	}
 }
 
+/*
+ * Deletes a file's data chunk and in chunk discard mode tells the driver
+ * it is dead. Until its block is erased a chunk can only go if no scan will
+ * read it. With a summary the scan reads chunk 0, the summary and the object
+ * headers but takes the tags of data chunks from the summary. Without one it
+ * reads every chunk, so those blocks wait. Dead chunks in a block with a
+ * shrink header stay until the block goes, as for gc, and so do those of a
+ * block held for execute in place or whose bitmap is unknown, which gc reads.
+ * A pruned chunk is only dead once the shrink header is on flash, until
+ * then the old header still claims it, so with hold set the discard waits
+ * for yaffs_discard_release().
+ */
+static void yaffs_data_chunk_del(struct yaffs_dev *dev, int chunk_id,
+				 int hold, int lyn)
+{
+	struct yaffs_block_info *bi;
+	int page;
+
+	yaffs_chunk_del(dev, chunk_id, 1, lyn);
+
+	if (!dev->discard_chunks || chunk_id <= 0)
+		return;
+
+	bi = yaffs_get_block_info(dev, chunk_id / dev->param.chunks_per_block);
+	page = chunk_id % dev->param.chunks_per_block;
+
+	if (bi->block_state != YAFFS_BLOCK_STATE_FULL || !bi->has_summary ||
+	    bi->has_shrink_hdr || yaffs_block_pinned(dev, bi) ||
+	    page == 0 || page >= dev->chunks_per_summary)
+		return;
+#ifdef CONFIG_YAFFS_COMPACT_BLOCKS
+	if (bi->chunk_map == YAFFS_CHUNK_MAP_UNKNOWN)
+		return;
+#endif
+	if (hold)
+		yaffs_discard_hold(dev, chunk_id);
+	else
+		yaffs_discard_chunks(dev, chunk_id, 1);
+}
+
 static int yaffs_wr_data_obj(struct yaffs_obj *in, int inode_chunk,
 			     const u8 *buffer, int n_bytes, int use_reserve)
 {
@@ -3033,7 +3963,7 @@ static int yaffs_wr_data_obj(struct yaffs_obj *in, int inode_chunk,
 		yaffs_put_chunk_in_file(in, inode_chunk, new_chunk_id, 0);
 
 		if (prev_chunk_id > 0)
-			yaffs_chunk_del(dev, prev_chunk_id, 1, __LINE__);
+			yaffs_data_chunk_del(dev, prev_chunk_id, 0, __LINE__);
 
 		yaffs_verify_file_sane(in);
 	}
@@ -3270,7 +4200,6 @@ int yaffs_update_oh(struct yaffs_obj *in, const YCHAR *name, int force,
 		    int is_shrink, int shadows, struct yaffs_xattr_mod *xmod)
 {
 
-	struct yaffs_block_info *bi;
 	struct yaffs_dev *dev = in->my_dev;
 	int prev_chunk_id;
 	int ret_val = 0;
@@ -3302,10 +4231,22 @@ int yaffs_update_oh(struct yaffs_obj *in, const YCHAR *name, int force,
 
 		yaffs_verify_oh(in, oh, &old_tags, 0);
 		memcpy(old_name, oh->name, sizeof(oh->name));
+	}
+
+#ifdef CONFIG_YAFFS_COMPACT_OBJ
+	if (!yaffs_obj_attr_from_oh(in, (prev_chunk_id > 0) ? oh : NULL)) {
+		yaffs_trace(YAFFS_TRACE_ERROR,
+			"yaffs: no attributes to write object %d header",
+			in->obj_id);
+		yaffs_release_temp_buffer(dev, buffer);
+		return -1;
+	}
+#endif
+
+	if (prev_chunk_id > 0)
 		memset(buffer, 0xff, sizeof(struct yaffs_obj_hdr));
-	} else {
+	else
 		memset(buffer, 0xff, dev->data_bytes_per_chunk);
-	}
 
 	oh->type = in->variant_type;
 	oh->yst_mode = in->yst_mode;
@@ -3390,6 +4331,9 @@ int yaffs_update_oh(struct yaffs_obj *in, const YCHAR *name, int force,
 		return new_chunk_id;
 
 	in->hdr_chunk = new_chunk_id;
+#ifdef CONFIG_YAFFS_COMPACT_OBJ
+	yaffs_obj_attr_written(in);
+#endif
 
 	if (prev_chunk_id > 0)
 		yaffs_chunk_del(dev, prev_chunk_id, 1, __LINE__);
@@ -3398,18 +4342,288 @@ int yaffs_update_oh(struct yaffs_obj *in, const YCHAR *name, int force,
 		in->dirty = 0;
 
 	/* If this was a shrink, then mark the block
-	 * that the chunk lives on */
-	if (is_shrink) {
-		bi = yaffs_get_block_info(in->my_dev,
-					  new_chunk_id /
-					  in->my_dev->param.chunks_per_block);
-		bi->has_shrink_hdr = 1;
-	}
+	 * that the chunk lives on. A hole only needs to cover the
+	 * chunks pruned off the file, a deletion covers them all.
+	 */
+	if (is_shrink)
+		yaffs2_shrink_hdr_written(dev, new_chunk_id,
+			(in->variant_type == YAFFS_OBJECT_TYPE_FILE &&
+			 new_tags.extra_parent_id != YAFFS_OBJECTID_DELETED &&
+			 new_tags.extra_parent_id != YAFFS_OBJECTID_UNLINKED) ?
+				in->variant.file_variant.pruned_seq : 0);
 
 
 	return new_chunk_id;
 }
 
+/*
+ * Holes.
+ * The holes in a file are the empty parts of its tnode tree, so they are
+ * found a subtree at a time instead of a chunk at a time.
+ */
+
+static int yaffs_next_data_in_tree(struct yaffs_dev *dev,
+				   struct yaffs_tnode *tn, int level,
+				   u32 base, u32 from)
+{
+	u32 span;
+	u32 i;
+	int found;
+
+	if (!tn)
+		return -1;
+
+	if (level == 0) {
+		for (i = (from > base) ? from - base : 0;
+		     i < YAFFS_NTNODES_LEVEL0; i++) {
+			if (yaffs_get_group_base(dev, tn, i))
+				return base + i;
+		}
+		return -1;
+	}
+
+	span = 1 << (YAFFS_TNODES_LEVEL0_BITS +
+		     (level - 1) * YAFFS_TNODES_INTERNAL_BITS);
+	for (i = (from > base) ? (from - base) / span : 0;
+	     i < YAFFS_NTNODES_INTERNAL; i++) {
+		found = yaffs_next_data_in_tree(dev, tn->internal[i],
+						level - 1, base + i * span,
+						from);
+		if (found >= 0)
+			return found;
+	}
+	return -1;
+}
+
+/* Returns the first chunk from inode_chunk on that has data, -1 if none */
+static int yaffs_next_data_chunk(struct yaffs_obj *in, int inode_chunk)
+{
+	struct yaffs_dev *dev = in->my_dev;
+	struct yaffs_file_var *file_var = &in->variant.file_variant;
+	struct yaffs_cache *cache;
+	int next;
+	int i;
+
+	if (yaffs_tnodes_load(in) != YAFFS_OK)
+		return inode_chunk;	/* Can't tell, so read it */
+
+	next = yaffs_next_data_in_tree(dev, file_var->top,
+				       file_var->top_level, 0, inode_chunk);
+
+	/* Chunks in the cache might not have been written yet */
+	for (i = 0; i < dev->param.n_caches; i++) {
+		cache = &dev->cache[i];
+		if (cache->object == in && cache->chunk_id >= inode_chunk &&
+		    (next < 0 || cache->chunk_id < next))
+			next = cache->chunk_id;
+	}
+
+	return next;
+}
+
+/*
+ * yaffs_seek_data()
+ * Returns the start of the data (or the hole if hole is set) at or after
+ * offset, like lseek() with SEEK_DATA and SEEK_HOLE. The end of the file
+ * counts as a hole. Returns -1 if there is no data past offset.
+ */
+loff_t yaffs_seek_data(struct yaffs_obj *in, loff_t offset, int hole)
+{
+	struct yaffs_dev *dev = in->my_dev;
+	loff_t file_size;
+	loff_t pos;
+	int chunk;
+	int next;
+	u32 start;
+
+	if (in->variant_type != YAFFS_OBJECT_TYPE_FILE)
+		return -1;
+
+	file_size = in->variant.file_variant.file_size;
+	if (offset < 0 || offset >= file_size)
+		return -1;
+
+	yaffs_addr_to_chunk(dev, offset, &chunk, &start);
+	chunk++;
+
+	if (!hole) {
+		next = yaffs_next_data_chunk(in, chunk);
+		if (next < 0)
+			return -1;
+		if (next == chunk)
+			return offset;
+		pos = ((loff_t) (next - 1)) * dev->data_bytes_per_chunk;
+		return (pos < file_size) ? pos : -1;
+	}
+
+	while (yaffs_next_data_chunk(in, chunk) == chunk) {
+		chunk++;
+		pos = ((loff_t) (chunk - 1)) * dev->data_bytes_per_chunk;
+		if (pos >= file_size)
+			return file_size;
+		offset = pos;
+	}
+	return offset;
+}
+
+/*
+ * Execute in place mappings pin the blocks they point into. xip_pins counts
+ * the mappings holding each block and is only allocated by the first.
+ */
+int yaffs_block_pinned(struct yaffs_dev *dev, struct yaffs_block_info *bi)
+{
+	return dev->xip_pins && dev->xip_pins[bi - dev->block_info];
+}
+
+static int yaffs_pin_blocks(struct yaffs_dev *dev, struct yaffs_xip_pin *pin,
+			    int first_block, int last_block)
+{
+	int n_blocks = dev->internal_end_block - dev->internal_start_block + 1;
+	u8 *pins;
+	int i;
+
+	if (!dev->xip_pins) {
+		dev->xip_pins = kmalloc(n_blocks, GFP_NOFS);
+		if (!dev->xip_pins)
+			return YAFFS_FAIL;
+		memset(dev->xip_pins, 0, n_blocks);
+	}
+
+	pins = dev->xip_pins - dev->internal_start_block;
+	for (i = first_block; i <= last_block; i++)
+		if (pins[i] == 0xff)
+			return YAFFS_FAIL;
+	for (i = first_block; i <= last_block; i++)
+		pins[i]++;
+
+	pin->first_block = first_block;
+	pin->n_blocks = last_block - first_block + 1;
+	return YAFFS_OK;
+}
+
+/*
+ * yaffs_file_unmap()
+ * Lets go of the blocks a mapping held. Blocks whose chunks all died while
+ * they were held are erased now.
+ */
+void yaffs_file_unmap(struct yaffs_dev *dev, struct yaffs_xip_pin *pin)
+{
+	struct yaffs_block_info *bi;
+	int block_no;
+	int i;
+
+	for (i = 0; i < pin->n_blocks && dev->xip_pins; i++) {
+		block_no = pin->first_block + i;
+		bi = yaffs_get_block_info(dev, block_no);
+		dev->xip_pins[block_no - dev->internal_start_block]--;
+		if (!yaffs_block_pinned(dev, bi) &&
+		    bi->block_state == YAFFS_BLOCK_STATE_FULL &&
+		    bi->pages_in_use == 0 && !bi->has_shrink_hdr)
+			yaffs_block_became_dirty(dev, block_no);
+	}
+	pin->n_blocks = 0;
+}
+
+/*
+ * Does the work for yaffs_file_map(). Readers that have already looked up
+ * the first chunk pass it in first_nand_chunk, -1 otherwise.
+ */
+static const u8 *yaffs_file_map_from(struct yaffs_obj *in, loff_t offset,
+				     int max_bytes, int *n_bytes,
+				     int first_nand_chunk,
+				     struct yaffs_xip_pin *pin)
+{
+	struct yaffs_dev *dev = in->my_dev;
+	struct yaffs_cache *cache;
+	const u8 *data = NULL;
+	const u8 *next;
+	loff_t file_size;
+	int first_block = 0;
+	int last_block = 0;
+	int nand_chunk;
+	int block;
+	int chunk;
+	int n = 0;
+	u32 start;
+
+	if (!dev->param.map_chunk_fn || dev->param.inband_tags ||
+	    dev->chunk_grp_size != 1 ||
+	    in->variant_type != YAFFS_OBJECT_TYPE_FILE)
+		return NULL;
+
+	file_size = in->variant.file_variant.file_size;
+	if (offset < 0 || offset >= file_size || max_bytes < 1)
+		return NULL;
+	if (max_bytes > file_size - offset)
+		max_bytes = file_size - offset;
+
+	yaffs_addr_to_chunk(dev, offset, &chunk, &start);
+	chunk++;
+
+	while (n < max_bytes) {
+		cache = yaffs_find_chunk_cache(in, chunk);
+		if (cache && cache->dirty)
+			break;
+		if (n == 0 && first_nand_chunk >= 0)
+			nand_chunk = first_nand_chunk;
+		else
+			nand_chunk = yaffs_find_chunk_in_file(in, chunk, NULL);
+		if (nand_chunk < 0)
+			break;
+
+		/* gc is already moving it, so it can't be held in place */
+		block = nand_chunk / dev->param.chunks_per_block;
+		if (pin && yaffs_get_block_info(dev, block)->block_state ==
+		    YAFFS_BLOCK_STATE_COLLECTING)
+			break;
+
+		next = dev->param.map_chunk_fn(dev,
+					nand_chunk - dev->chunk_offset);
+		if (!next)
+			break;
+
+		if (!data)
+			data = next + start;
+		else if (next != data + n)
+			break;	/* Not the next thing in memory */
+
+		if (!n || block < first_block)
+			first_block = block;
+		if (!n || block > last_block)
+			last_block = block;
+
+		n += (n ? dev->data_bytes_per_chunk :
+			  dev->data_bytes_per_chunk - start);
+		chunk++;
+	}
+
+	if (!data)
+		return NULL;
+
+	if (pin && yaffs_pin_blocks(dev, pin, first_block, last_block) !=
+	    YAFFS_OK)
+		return NULL;
+
+	*n_bytes = (n < max_bytes) ? n : max_bytes;
+	return data;
+}
+
+/*
+ * yaffs_file_map()
+ * Execute in place access for devices with map_chunk_fn. Returns where the
+ * file's data at offset is in memory and sets n_bytes to how much of it,
+ * up to max_bytes, follows on there. Returns NULL if it can't be read in
+ * place, eg. a hole or data that is only in the cache.
+ * If pin is given the blocks holding the data are kept in place, even if
+ * the file is written or deleted, until yaffs_file_unmap() is called with
+ * it. Otherwise the data can move on the next write or gc.
+ */
+const u8 *yaffs_file_map(struct yaffs_obj *in, loff_t offset, int max_bytes,
+			 int *n_bytes, struct yaffs_xip_pin *pin)
+{
+	return yaffs_file_map_from(in, offset, max_bytes, n_bytes, -1, pin);
+}
+
 /*--------------------- File read/write ------------------------
  * Read and write have very similar structures.
  * In general the read/write has three parts to it
@@ -3429,6 +4643,11 @@ int yaffs_file_rd(struct yaffs_obj *in, u8 * buffer, loff_t offset, int n_bytes)
 	int n_done = 0;
 	struct yaffs_cache *cache;
 	struct yaffs_dev *dev;
+	int nand_chunk;
+	int next;
+	loff_t hole_end;
+	const u8 *xip;
+	int n_xip;
 
 	dev = in->my_dev;
 
@@ -3445,6 +4664,43 @@ int yaffs_file_rd(struct yaffs_obj *in, u8 * buffer, loff_t offset, int n_bytes)
 			n_copy = dev->data_bytes_per_chunk - start;
 
 		cache = yaffs_find_chunk_cache(in, chunk);
+		nand_chunk = cache ? -1 :
+			yaffs_find_chunk_in_file(in, chunk, NULL);
+
+		/* Only look ahead for the end of a hole once we're in one */
+		next = (cache || nand_chunk >= 0) ? chunk :
+			yaffs_next_data_chunk(in, chunk);
+		if (next != chunk) {
+			/* A hole, zero it all the way to the next data */
+			n_copy = n;
+			if (next > 0) {
+				hole_end = ((loff_t) (next - 1)) *
+					dev->data_bytes_per_chunk;
+				if (hole_end - offset < n)
+					n_copy = hole_end - offset;
+			}
+			memset(buffer, 0, n_copy);
+			dev->n_hole_bytes_read += n_copy;
+			n -= n_copy;
+			offset += n_copy;
+			buffer += n_copy;
+			n_done += n_copy;
+			continue;
+		}
+
+		xip = cache ? NULL :
+			yaffs_file_map_from(in, offset, n, &n_xip, nand_chunk,
+					    NULL);
+		if (xip) {
+			/* Straight from flash, as much as is there */
+			memcpy(buffer, xip, n_xip);
+			dev->n_xip_bytes_read += n_xip;
+			n -= n_xip;
+			offset += n_xip;
+			buffer += n_xip;
+			n_done += n_xip;
+			continue;
+		}
 
 		/* If the chunk is already in the cache or it is less than
 		 * a whole chunk or we're using inband tags then use the cache
@@ -3464,8 +4720,8 @@ int yaffs_file_rd(struct yaffs_obj *in, u8 * buffer, loff_t offset, int n_bytes)
 					cache->chunk_id = chunk;
 					cache->dirty = 0;
 					cache->locked = 0;
-					yaffs_rd_data_obj(in, chunk,
-							  cache->data);
+					yaffs_rd_data_nand(in, nand_chunk,
+							   cache->data);
 					cache->n_bytes = 0;
 				}
 
@@ -3481,7 +4737,8 @@ int yaffs_file_rd(struct yaffs_obj *in, u8 * buffer, loff_t offset, int n_bytes)
 
 				u8 *local_buffer =
 				    yaffs_get_temp_buffer(dev);
-				yaffs_rd_data_obj(in, chunk, local_buffer);
+				yaffs_rd_data_nand(in, nand_chunk,
+						   local_buffer);
 
 				memcpy(buffer, &local_buffer[start], n_copy);
 
@@ -3489,7 +4746,7 @@ int yaffs_file_rd(struct yaffs_obj *in, u8 * buffer, loff_t offset, int n_bytes)
 			}
 		} else {
 			/* A full chunk. Read directly into the buffer. */
-			yaffs_rd_data_obj(in, chunk, buffer);
+			yaffs_rd_data_nand(in, nand_chunk, buffer);
 		}
 		n -= n_copy;
 		offset += n_copy;
@@ -3677,6 +4934,22 @@ int yaffs_wr_file(struct yaffs_obj *in, const u8 *buffer, loff_t offset,
 
 /* ---------------------- File resizing stuff ------------------ */
 
+/* Remember which block a pruned chunk was in for shrink headers */
+static void yaffs_note_pruned_chunk(struct yaffs_obj *in, int chunk_id)
+{
+	struct yaffs_dev *dev = in->my_dev;
+	struct yaffs_file_var *file_var = &in->variant.file_variant;
+	u32 seq;
+
+	if (!file_var->pruned_seq)
+		return;	/* Not known, so they all count */
+
+	seq = yaffs_block_seq(dev, yaffs_get_block_info(dev,
+				chunk_id / dev->param.chunks_per_block));
+	if (seq > file_var->pruned_seq)
+		file_var->pruned_seq = seq;
+}
+
 static void yaffs_prune_chunks(struct yaffs_obj *in, int new_size)
 {
 
@@ -3712,8 +4985,9 @@ static void yaffs_prune_chunks(struct yaffs_obj *in, int new_size)
 				"Found daft chunk_id %d for %d",
 				chunk_id, i);
 		} else {
+			yaffs_note_pruned_chunk(in, chunk_id);
 			in->n_data_chunks--;
-			yaffs_chunk_del(dev, chunk_id, 1, __LINE__);
+			yaffs_data_chunk_del(dev, chunk_id, 1, __LINE__);
 		}
 	}
 }
@@ -3752,6 +5026,7 @@ int yaffs_resize_file(struct yaffs_obj *in, loff_t new_size)
 {
 	struct yaffs_dev *dev = in->my_dev;
 	int old_size = in->variant.file_variant.file_size;
+	int dead = 0;
 
 	yaffs_flush_file_cache(in);
 	yaffs_invalidate_whole_cache(in);
@@ -3776,12 +5051,18 @@ int yaffs_resize_file(struct yaffs_obj *in, loff_t new_size)
 	 * show we've shrunk the file, if need be
 	 * Do this only if the file is not in the deleted directories
 	 * and is not shadowed.
+	 * The pruned chunks are dead once that header is on flash, or already
+	 * are if the header on flash puts the file in one of those directories.
 	 */
 	if (in->parent &&
 	    !in->is_shadowed &&
 	    in->parent->obj_id != YAFFS_OBJECTID_UNLINKED &&
 	    in->parent->obj_id != YAFFS_OBJECTID_DELETED)
-		yaffs_update_oh(in, NULL, 0, 0, 0, NULL);
+		dead = (yaffs_update_oh(in, NULL, 0, 0, 0, NULL) >= 0);
+	else if (in->parent && !in->is_shadowed)
+		dead = 1;
+
+	yaffs_discard_release(dev, dead);
 
 	return YAFFS_OK;
 }
@@ -3814,7 +5095,7 @@ static int yaffs_unlink_file_if_needed(struct yaffs_obj *in)
 	int del_now = 0;
 	struct yaffs_dev *dev = in->my_dev;
 
-	if (!in->my_inode)
+	if (!yaffs_obj_has_inode(in))
 		del_now = 1;
 
 	if (del_now) {
@@ -3945,7 +5226,7 @@ static int yaffs_unlink_worker(struct yaffs_obj *obj)
 	if (!obj)
 		return YAFFS_FAIL;
 
-	if (!obj->my_inode)
+	if (!yaffs_obj_has_inode(obj))
 		del_now = 1;
 
 	yaffs_update_parent(obj->parent);
@@ -4141,30 +5422,166 @@ void yaffs_handle_shadowed_obj(struct yaffs_dev *dev, int obj_id,
 	obj->valid = 1;		/* So that we don't read any other info. */
 }
 
+static void yaffs_link_attach(struct yaffs_obj *hl, struct yaffs_obj *in)
+{
+	if (in) {
+		/* Add the hardlink pointers */
+		hl->variant.hardlink_variant.equiv_obj = in;
+		list_add(&hl->hard_links, &in->hard_links);
+	} else {
+		/* Todo Need to report/handle this better.
+		 * Got a problem... hardlink to a non-existant object
+		 */
+		hl->variant.hardlink_variant.equiv_obj = NULL;
+		INIT_LIST_HEAD(&hl->hard_links);
+	}
+}
+
+static int yaffs_link_cmp(const void *a, const void *b)
+{
+	u32 aid = (*(struct yaffs_obj **)a)->variant.hardlink_variant.equiv_id;
+	u32 bid = (*(struct yaffs_obj **)b)->variant.hardlink_variant.equiv_id;
+
+	if (aid == bid)
+		return 0;
+	return (aid < bid) ? -1 : 1;
+}
+
+/*
+ * Hook the hard links found by a scan or checkpoint read up to the objects
+ * they point at. The links are sorted by equiv_id so that each target is
+ * only looked up once, however many links it has. If there is no memory
+ * for the sort we just look each one up.
+ */
 void yaffs_link_fixup(struct yaffs_dev *dev, struct list_head *hard_list)
 {
 	struct list_head *lh;
 	struct list_head *save;
 	struct yaffs_obj *hl;
-	struct yaffs_obj *in;
+	struct yaffs_obj *in = NULL;
+	struct yaffs_obj **links = NULL;
+	int alt_links = 0;
+	int n = 0;
+	int i;
+
+	list_for_each(lh, hard_list)
+		n++;
+
+	if (n > 1) {
+		links = kmalloc(n * sizeof(struct yaffs_obj *), GFP_NOFS);
+		if (!links) {
+			links = vmalloc(n * sizeof(struct yaffs_obj *));
+			alt_links = 1;
+		}
+	}
 
-	list_for_each_safe(lh, save, hard_list) {
-		hl = list_entry(lh, struct yaffs_obj, hard_links);
-		in = yaffs_find_by_number(dev,
+	if (!links) {
+		list_for_each_safe(lh, save, hard_list) {
+			hl = list_entry(lh, struct yaffs_obj, hard_links);
+			in = yaffs_find_by_number(dev,
 					hl->variant.hardlink_variant.equiv_id);
+			yaffs_link_attach(hl, in);
+		}
+		return;
+	}
 
-		if (in) {
-			/* Add the hardlink pointers */
-			hl->variant.hardlink_variant.equiv_obj = in;
-			list_add(&hl->hard_links, &in->hard_links);
-		} else {
-			/* Todo Need to report/handle this better.
-			 * Got a problem... hardlink to a non-existant object
+	i = 0;
+	list_for_each(lh, hard_list)
+		links[i++] = list_entry(lh, struct yaffs_obj, hard_links);
+
+	sort(links, n, sizeof(struct yaffs_obj *), yaffs_link_cmp, NULL);
+
+	for (i = 0; i < n; i++) {
+		hl = links[i];
+		if (i == 0 || yaffs_link_cmp(&links[i - 1], &links[i]))
+			in = yaffs_find_by_number(dev,
+					hl->variant.hardlink_variant.equiv_id);
+		yaffs_link_attach(hl, in);
+	}
+
+	if (alt_links)
+		vfree(links);
+	else
+		kfree(links);
+}
+
+/*
+ * Queue an object for background deletion. It is parked in unlinked_dir,
+ * out of the name space, and nothing is written now. If we crash before
+ * yaffs_bg_del() gets to it the next mount finds it orphaned or unlinked
+ * and queues it again. Its object id stays in use until then, so nothing
+ * new can pick up its old chunks.
+ */
+static void yaffs_queue_bg_del(struct yaffs_obj *obj)
+{
+	struct yaffs_dev *dev = obj->my_dev;
+
+	if (obj->parent != dev->unlinked_dir)
+		yaffs_add_obj_to_dir(dev->unlinked_dir, obj);
+	if (!obj->bg_del) {
+		obj->bg_del = 1;
+		dev->n_bg_del_pending++;
+	}
+}
+
+/*
+ * Delete up to max_objs of the queued objects. Each deletion costs what it
+ * would have at mount. Queued objects sit at the head of unlinked_dir, so
+ * anything that survives its deletion (soft deleted files waiting for gc)
+ * is moved to the tail first to keep the search short. An object that
+ * fails to go is queued again and ends the batch. Returns the number of
+ * objects deleted.
+ */
+static int yaffs_bg_del(struct yaffs_dev *dev, int max_objs)
+{
+	struct list_head *children;
+	struct list_head *lh;
+	struct yaffs_obj *obj;
+	int n_deleted = 0;
+
+	children = &dev->unlinked_dir->variant.dir_variant.children;
+
+	while (dev->n_bg_del_pending > 0 && max_objs > 0) {
+		obj = NULL;
+		list_for_each(lh, children) {
+			obj = list_entry(lh, struct yaffs_obj, siblings);
+			if (obj->bg_del)
+				break;
+			obj = NULL;
+		}
+		if (!obj) {
+			/* Should not happen, but don't spin if it does. */
+			dev->n_bg_del_pending = 0;
+			break;
+		}
+
+		obj->bg_del = 0;
+		dev->n_bg_del_pending--;
+		max_objs--;
+
+		list_del(&obj->siblings);
+		list_add_tail(&obj->siblings, children);
+		yaffs_trace(YAFFS_TRACE_BACKGROUND,
+			"Background deletion of object %d", obj->obj_id);
+		if (yaffs_unlink_worker(obj) != YAFFS_OK) {
+			/*
+			 * Still there. Put it back at the head of the queue
+			 * and leave it for a later pass.
 			 */
-			hl->variant.hardlink_variant.equiv_obj = NULL;
-			INIT_LIST_HEAD(&hl->hard_links);
+			yaffs_trace(YAFFS_TRACE_BACKGROUND,
+				"Background deletion of object %d failed",
+				obj->obj_id);
+			if (obj->parent == dev->unlinked_dir) {
+				list_del(&obj->siblings);
+				list_add(&obj->siblings, children);
+			}
+			yaffs_queue_bg_del(obj);
+			break;
 		}
+		dev->n_bg_deletions++;
+		n_deleted++;
 	}
+	return n_deleted;
 }
 
 static void yaffs_strip_deleted_objs(struct yaffs_dev *dev)
@@ -4183,7 +5600,10 @@ static void yaffs_strip_deleted_objs(struct yaffs_dev *dev)
 	list_for_each_safe(i, n,
 			   &dev->unlinked_dir->variant.dir_variant.children) {
 		l = list_entry(i, struct yaffs_obj, siblings);
-		yaffs_del_obj(l);
+		if (dev->param.bg_empty_lost_n_found)
+			yaffs_queue_bg_del(l);
+		else
+			yaffs_del_obj(l);
 	}
 
 	list_for_each_safe(i, n, &dev->del_dir->variant.dir_variant.children) {
@@ -4216,18 +5636,59 @@ static int yaffs_has_null_parent(struct yaffs_dev *dev, struct yaffs_obj *obj)
 		obj == dev->unlinked_dir || obj == dev->root_dir);
 }
 
-static void yaffs_fix_hanging_objs(struct yaffs_dev *dev)
+/*
+ * yaffs_hanging_top()
+ * Returns NULL if obj is rooted, or the object that has to move to
+ * lost+found to root it. That is the highest one in its chain of parents
+ * whose own parent is missing or not a directory, or the one below a
+ * directory in the deleted or unlinked dirs. A chain longer than the number
+ * of objects loops, and the object reached there is taken. Moving the top
+ * roots everything below it, so the order objects are looked at in doesn't
+ * change what ends up in lost+found.
+ * Directories found to be rooted are marked so that later walks stop there,
+ * which makes checking all the objects linear in their number rather than
+ * in the depth of the tree.
+ */
+static struct yaffs_obj *yaffs_hanging_top(struct yaffs_dev *dev,
+					   struct yaffs_obj *obj)
+{
+	struct yaffs_obj *p = obj;
+	struct yaffs_obj *prev = NULL;
+	struct yaffs_obj *parent;
+	int steps = dev->n_obj;
+
+	if (yaffs_has_null_parent(dev, obj))
+		return NULL;
+
+	while (p != dev->root_dir && !p->rooted) {
+		parent = p->parent;
+		if (!parent ||
+		    parent->variant_type != YAFFS_OBJECT_TYPE_DIRECTORY ||
+		    steps-- < 0)
+			return p;
+		if (parent != dev->root_dir &&
+		    yaffs_has_null_parent(dev, parent))
+			return prev;	/* NULL if obj is in there itself */
+		prev = p;
+		p = parent;
+	}
+
+	for (p = obj; p != dev->root_dir && !p->rooted; p = p->parent)
+		p->rooted = 1;
+
+	return NULL;
+}
+
+static int yaffs_fix_hanging_objs(struct yaffs_dev *dev)
 {
 	struct yaffs_obj *obj;
-	struct yaffs_obj *parent;
+	struct yaffs_obj *top;
 	int i;
 	struct list_head *lh;
-	struct list_head *n;
-	int depth_limit;
-	int hanging;
+	int n_hanging = 0;
 
 	if (dev->read_only)
-		return;
+		return 0;
 
 	/* Iterate through the objects in each hash entry,
 	 * looking at each object.
@@ -4235,46 +5696,22 @@ static void yaffs_fix_hanging_objs(struct yaffs_dev *dev)
 	 */
 
 	for (i = 0; i < YAFFS_NOBJECT_BUCKETS; i++) {
-		list_for_each_safe(lh, n, &dev->obj_bucket[i].list) {
+		list_for_each(lh, &dev->obj_bucket[i].list) {
 			obj = list_entry(lh, struct yaffs_obj, hash_link);
-			parent = obj->parent;
-
-			if (yaffs_has_null_parent(dev, obj)) {
-				/* These directories are not hanging */
-				hanging = 0;
-			} else if (!parent ||
-				   parent->variant_type !=
-				   YAFFS_OBJECT_TYPE_DIRECTORY) {
-				hanging = 1;
-			} else if (yaffs_has_null_parent(dev, parent)) {
-				hanging = 0;
-			} else {
-				/*
-				 * Need to follow the parent chain to
-				 * see if it is hanging.
-				 */
-				hanging = 0;
-				depth_limit = 100;
-
-				while (parent != dev->root_dir &&
-				       parent->parent &&
-				       parent->parent->variant_type ==
-				       YAFFS_OBJECT_TYPE_DIRECTORY &&
-				       depth_limit > 0) {
-					parent = parent->parent;
-					depth_limit--;
-				}
-				if (parent != dev->root_dir)
-					hanging = 1;
-			}
-			if (hanging) {
+			top = yaffs_hanging_top(dev, obj);
+			if (top) {
 				yaffs_trace(YAFFS_TRACE_SCAN,
 					"Hanging object %d moved to lost and found",
-					obj->obj_id);
-				yaffs_add_obj_to_dir(dev->lost_n_found, obj);
+					top->obj_id);
+				yaffs_add_obj_to_dir(dev->lost_n_found, top);
+				/* Anything below it is now rooted too. */
+				top->rooted = 1;
+				n_hanging++;
 			}
 		}
 	}
+
+	return n_hanging;
 }
 
 /*
@@ -4300,9 +5737,31 @@ static void yaffs_del_dir_contents(struct yaffs_obj *dir)
 	}
 }
 
+/*
+ * Queue a directory's contents for background deletion. The whole tree is
+ * flattened into unlinked_dir so that every directory is already empty by
+ * the time it gets deleted.
+ */
+static void yaffs_queue_dir_contents(struct yaffs_obj *dir)
+{
+	struct yaffs_obj *obj;
+	struct list_head *lh;
+	struct list_head *n;
+
+	list_for_each_safe(lh, n, &dir->variant.dir_variant.children) {
+		obj = list_entry(lh, struct yaffs_obj, siblings);
+		if (obj->variant_type == YAFFS_OBJECT_TYPE_DIRECTORY)
+			yaffs_queue_dir_contents(obj);
+		yaffs_queue_bg_del(obj);
+	}
+}
+
 static void yaffs_empty_l_n_f(struct yaffs_dev *dev)
 {
-	yaffs_del_dir_contents(dev->lost_n_found);
+	if (dev->param.bg_empty_lost_n_found)
+		yaffs_queue_dir_contents(dev->lost_n_found);
+	else
+		yaffs_del_dir_contents(dev->lost_n_found);
 }
 
 
@@ -4581,6 +6040,7 @@ static int yaffs_create_initial_dir(struct yaffs_dev *dev)
 int yaffs_guts_initialise(struct yaffs_dev *dev)
 {
 	int init_failed = 0;
+	int n_hanging = 0;
 	unsigned x;
 	int bits;
 
@@ -4605,6 +6065,9 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 	dev->block_offset = 0;
 	dev->chunk_offset = 0;
 	dev->n_free_chunks = 0;
+	dev->discard_n = 0;
+	dev->discard_chunks = 0;
+	dev->n_held_discards = 0;
 
 	dev->gc_block = 0;
 
@@ -4734,12 +6197,14 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 	dev->all_gcs = 0;
 	dev->passive_gc_count = 0;
 	dev->oldest_dirty_gc_count = 0;
+	dev->n_shrink_gcs = 0;
 	dev->bg_gcs = 0;
 	dev->gc_block_finder = 0;
 	dev->buffered_block = -1;
 	dev->doing_buffered_block_rewrite = 0;
 	dev->n_deleted_files = 0;
 	dev->n_bg_deletions = 0;
+	dev->n_bg_del_pending = 0;
 	dev->n_unlinked_files = 0;
 	dev->n_ecc_fixed = 0;
 	dev->n_ecc_unfixed = 0;
@@ -4758,6 +6223,14 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 	if (!yaffs_init_tmp_buffers(dev))
 		init_failed = 1;
 
+	if (!init_failed && !yaffs_tb_init(dev))
+		init_failed = 1;
+
+	if (!init_failed && !yaffs_np_init(dev))
+		init_failed = 1;
+
+	yaffs_tb_event0(dev, YAFFS_TRACE_MOUNT, YAFFS_TB_MOUNT_BEGIN);
+
 	dev->cache = NULL;
 	dev->gc_cleanup_list = NULL;
 
@@ -4818,6 +6291,7 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 
 	if (!init_failed) {
 		/* Now scan the flash. */
+		dev->np_cause = YAFFS_NP_SCAN;
 		if (dev->param.is_yaffs2) {
 			if (yaffs2_checkpt_restore(dev)) {
 				yaffs_check_obj_details_loaded(dev->root_dir);
@@ -4841,6 +6315,7 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 				dev->n_deleted_files = 0;
 				dev->n_unlinked_files = 0;
 				dev->n_bg_deletions = 0;
+				dev->n_bg_del_pending = 0;
 
 				if (!init_failed && !yaffs_init_blocks(dev))
 					init_failed = 1;
@@ -4858,10 +6333,16 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 			init_failed = 1;
 		}
 
+		dev->np_cause = YAFFS_NP_DATA;
+
+		yaffs_tb_event0(dev, YAFFS_TRACE_MOUNT,
+				YAFFS_TB_MOUNT_FIXUP_BEGIN);
 		yaffs_strip_deleted_objs(dev);
-		yaffs_fix_hanging_objs(dev);
+		n_hanging = yaffs_fix_hanging_objs(dev);
 		if (dev->param.empty_lost_n_found)
 			yaffs_empty_l_n_f(dev);
+		yaffs_tb_event1(dev, YAFFS_TRACE_MOUNT,
+				YAFFS_TB_MOUNT_FIXUP_END, n_hanging);
 	}
 
 	if (init_failed) {
@@ -4889,6 +6370,21 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 	if (!dev->is_checkpointed && dev->blocks_in_checkpt > 0)
 		yaffs2_checkpt_invalidate(dev);
 
+	/* A scan loads every tree, get back under the tnode budget */
+	yaffs_check_tnode_budget(dev, NULL);
+
+	/* Block states were set up without the block heaps knowing */
+	yaffs2_clear_oldest_dirty_seq(dev, NULL);
+
+	/* Only now, the scan does not know which blocks have shrink headers
+	 * until it has read them.
+	 */
+	dev->discard_chunks = dev->param.discard_fn &&
+			      dev->param.discard_mode == YAFFS_DISCARD_CHUNKS &&
+			      dev->param.is_yaffs2;
+
+	yaffs_tb_event1(dev, YAFFS_TRACE_MOUNT, YAFFS_TB_MOUNT_END, YAFFS_OK);
+
 	yaffs_trace(YAFFS_TRACE_TRACING,
 	  "yaffs: yaffs_guts_initialise() done.");
 	return YAFFS_OK;
@@ -4899,9 +6395,15 @@ void yaffs_deinitialise(struct yaffs_dev *dev)
 	if (dev->is_mounted) {
 		int i;
 
+		yaffs_discard_release(dev, 0);
+		yaffs_discard_flush(dev);
+		dev->discard_chunks = 0;
+
 		yaffs_deinit_blocks(dev);
 		yaffs_deinit_tnodes_and_objs(dev);
 		yaffs_summary_deinit(dev);
+		yaffs_tb_deinit(dev);
+		yaffs_np_deinit(dev);
 
 		if (dev->param.n_caches > 0 && dev->cache) {
 
@@ -61,6 +61,7 @@
 #define YAFFS_MAX_OBJECT_ID		(YAFFS_OBJECT_SPACE - 1)
 
 #define YAFFS_CHECKPOINT_VERSION	4
+#define YAFFS_CHECKPOINT_VERSION_EVICTED 5	/* Has files without tnodes */
 
 #ifdef CONFIG_YAFFS_UNICODE
 #define YAFFS_MAX_NAME_LENGTH		127
@@ -89,6 +90,9 @@
 
 #define YAFFS_N_TEMP_BUFFERS		6
 
+/* Runs of pruned chunks that can wait for their shrink header */
+#define YAFFS_N_HELD_DISCARDS		32
+
 /* We limit the number attempts at sucessfully saving a chunk of data.
  * Small-page devices have 32 pages per block; large-page devices have 64.
  * Default to something in the order of 5 to 10 blocks worth of chunks.
@@ -283,8 +287,55 @@ struct yaffs_block_info {
 	u32 has_summary:1;	/* The block has a summary */
 
 	u32 has_shrink_hdr:1;	/* This block has at least one shrink header */
+#ifdef CONFIG_YAFFS_COMPACT_BLOCKS
+	u16 seq_offset;		/* seq_number - dev->seq_base, 0 for none */
+	u16 chunk_map;		/* YAFFS_CHUNK_MAP_xxx or a bitmap slot */
+#else
 	u32 seq_number;		/* block sequence number for yaffs2 */
+#endif
+
+};
+
+#ifdef CONFIG_YAFFS_COMPACT_BLOCKS
+/*
+ * With CONFIG_YAFFS_COMPACT_BLOCKS the block info keeps the sequence number
+ * as a 16 bit offset from dev->seq_base and the chunk bitmap is only kept
+ * for blocks that are partly in use. chunk_map says which:
+ */
+#define YAFFS_CHUNK_MAP_NONE	0	/* No chunks in use */
+#define YAFFS_CHUNK_MAP_ALL	0xffff	/* Every chunk in use */
+#define YAFFS_CHUNK_MAP_UNKNOWN	0xfffe	/* No memory for the bitmap. Every
+					 * chunk is treated as in use and gc
+					 * checks each one against its object.
+					 */
+					/* Anything else is a bitmap slot */
+
+#define YAFFS_MAX_SEQ_OFFSET	0xffff
+#define YAFFS_CHUNK_BITS_GROUP	64	/* Bitmap slots allocated at a time */
+
+/* The offsets are renumbered when they run out so the blocks must fit */
+#define YAFFS_COMPACT_MAX_BLOCKS	0x8000
+
+#define yaffs_block_seq(dev, bi) \
+	((bi)->seq_offset ? (dev)->seq_base + (bi)->seq_offset : 0)
+#else
+#define yaffs_block_seq(dev, bi)	((bi)->seq_number)
+#define yaffs_set_block_seq(dev, bi, seq)	((bi)->seq_number = (seq))
+#endif
+
+/*
+ * The blocks an execute in place mapping points into. While a mapping holds
+ * them gc leaves them where they are.
+ */
+struct yaffs_xip_pin {
+	int first_block;
+	int n_blocks;		/* 0 if nothing is held */
+};
 
+/* A run of dead chunks that can't be discarded yet */
+struct yaffs_discard_run {
+	int start;
+	int n;
 };
 
 /* -------------------------- Object structure -------------------------------*/
@@ -354,6 +405,10 @@ struct yaffs_file_var {
 	u32 shrink_size;
 	int top_level;
 	struct yaffs_tnode *top;
+	u32 lru_stamp;		/* dev->tnode_clock when the tree was last
+				 * used, for eviction */
+	u32 pruned_seq;		/* Newest block that can hold chunks pruned
+				 * off this file, 0 if not known */
 };
 
 struct yaffs_dir_var {
@@ -408,8 +463,22 @@ struct yaffs_obj {
 				 * or not. */
 	u8 has_xattr:1;		/* This object has xattribs.
 				 * Only valid if xattr_known. */
+	u8 tnodes_evicted:1;	/* File's tnode tree has been freed and
+				 * must be rebuilt before use. */
+	u8 rooted:1;		/* Found to be under root_dir while fixing
+				 * up after a scan. Not kept up to date
+				 * afterwards, so only that uses it. */
+	u8 bg_del:1;		/* Waiting in unlinked_dir to be deleted
+				 * by background gc. */
+#ifdef CONFIG_YAFFS_COMPACT_OBJ
+	u8 has_inode:1;		/* Hooked up to an inode, in place of
+				 * my_inode. */
+#endif
 
 	u8 serial;		/* serial number of chunk in NAND.*/
+#ifdef CONFIG_YAFFS_COMPACT_OBJ
+	u8 variant_type;	/* enum yaffs_obj_type */
+#endif
 	u16 sum;		/* sum of the name to speed searching */
 
 	struct yaffs_dev *my_dev;	/* The device I'm on */
@@ -434,6 +503,7 @@ struct yaffs_obj {
 
 	YCHAR short_name[YAFFS_SHORT_NAME_LENGTH + 1];
 
+#ifndef CONFIG_YAFFS_COMPACT_OBJ
 #ifdef CONFIG_YAFFS_WINCE
 	u32 win_ctime[2];
 	u32 win_mtime[2];
@@ -451,11 +521,61 @@ struct yaffs_obj {
 	void *my_inode;
 
 	enum yaffs_obj_type variant_type;
+#endif
 
 	union yaffs_obj_var variant;
 
 };
 
+#ifdef CONFIG_YAFFS_COMPACT_OBJ
+/*
+ * With CONFIG_YAFFS_COMPACT_OBJ the attributes that are only needed by stat
+ * and when writing the header are kept out of struct yaffs_obj. They are
+ * read from the object header when needed and cached in a small per-device
+ * table. Records that match the header may be dropped at any time; changed
+ * ones are kept until the header has been written.
+ *
+ * Use yaffs_obj_attr(obj)->field to read them and yaffs_obj_attr_mod(obj)
+ * to change them. Without CONFIG_YAFFS_COMPACT_OBJ both are just obj.
+ */
+#define YAFFS_NATTR_BUCKETS		64
+#define YAFFS_DEFAULT_ATTR_CACHE	64
+
+struct yaffs_obj_attr {
+	struct yaffs_obj_attr *hash_next;
+	struct list_head lru;		/* Most recently used first */
+	struct yaffs_obj *obj;
+	int dirty;			/* Changed since the header was
+					 * written */
+#ifdef CONFIG_YAFFS_WINCE
+	u32 win_ctime[2];
+	u32 win_mtime[2];
+	u32 win_atime[2];
+#else
+	u32 yst_uid;
+	u32 yst_gid;
+	u32 yst_atime;
+	u32 yst_mtime;
+	u32 yst_ctime;
+#endif
+	u32 yst_rdev;
+};
+
+#ifdef __KERNEL__
+#error CONFIG_YAFFS_COMPACT_OBJ is not supported by the Linux glue
+#endif
+
+#define yaffs_obj_attr(obj)		yaffs_get_obj_attr(obj, 0)
+#define yaffs_obj_attr_mod(obj)		yaffs_get_obj_attr(obj, 1)
+#define yaffs_obj_has_inode(obj)	((obj)->has_inode)
+#define yaffs_obj_set_inode(obj, inode)	((obj)->has_inode = ((inode) != NULL))
+#else
+#define yaffs_obj_attr(obj)		(obj)
+#define yaffs_obj_attr_mod(obj)		(obj)
+#define yaffs_obj_has_inode(obj)	((obj)->my_inode != NULL)
+#define yaffs_obj_set_inode(obj, inode)	((obj)->my_inode = (inode))
+#endif
+
 struct yaffs_obj_bucket {
 	struct list_head list;
 	int count;
@@ -477,11 +597,20 @@ struct yaffs_checkpt_obj {
 	u8 fake:1;
 	u8 rename_allowed:1;
 	u8 unlink_allowed:1;
+	u8 tnodes_evicted:1;	/* Only valid in VERSION_EVICTED */
 	u8 serial;
 	int n_data_chunks;
 	u32 size_or_equiv_obj;
 };
 
+/* A min-heap of blocks on sequence number (see yaffs_yaffs2.c) */
+struct yaffs_block_heap {
+	u32 *blk;		/* Block numbers, oldest at [0] */
+	u32 *pos;		/* Index + 1 in blk of each block, 0 if not
+				 * in the heap */
+	int n;
+};
+
 /*--------------------- Temporary buffers ----------------
  *
  * These are chunk-sized working buffers. Each device has a few.
@@ -494,6 +623,12 @@ struct yaffs_buffer {
 
 /*----------------- Device ---------------------------------*/
 
+/* discard_mode values */
+#define YAFFS_DISCARD_BLOCKS	0	/* Blocks as they become dirty */
+#define YAFFS_DISCARD_CHUNKS	1	/* Also dead data chunks that a scan
+					 * won't read, ie. in full blocks
+					 * with a summary. yaffs2 only. */
+
 struct yaffs_param {
 	const YCHAR *name;
 
@@ -525,9 +660,18 @@ struct yaffs_param {
 	int is_yaffs2;		/* Use yaffs2 mode on this device */
 
 	int empty_lost_n_found;	/* Auto-empty lost+found directory on mount */
+	int bg_empty_lost_n_found;	/* Hand lost+found and leftover unlinked
+					 * objects to background gc to delete
+					 * rather than deleting them at mount */
 
 	int refresh_period;	/* How often to check for a block refresh */
 
+	int gc_pace_copies;	/* Write pacing: once erased blocks run low,
+				 * spread gc over writes, copying at most this
+				 * many chunks per paced step. Writes that
+				 * still run out of erased blocks gc
+				 * aggressively. 0 to disable. */
+
 	/* Checkpoint control. Can be set before or after initialisation */
 	u8 skip_checkpt_rd;
 	u8 skip_checkpt_wr;
@@ -544,6 +688,12 @@ struct yaffs_param {
 			      struct yaffs_spare *spare);
 	int (*erase_fn) (struct yaffs_dev *dev, int flash_block);
 	int (*initialise_flash_fn) (struct yaffs_dev *dev);
+	/* Reads the spares of n_chunks chunks in one go (optional).
+	 * Used by the yaffs1 scan when there is no read_chunk_tags_fn.
+	 */
+	int (*read_spares_fn) (struct yaffs_dev *dev,
+			       int nand_chunk, int n_chunks,
+			       struct yaffs_spare *spares);
 	int (*deinitialise_flash_fn) (struct yaffs_dev *dev);
 
 	/* yaffs2 mode functions */
@@ -558,6 +708,23 @@ struct yaffs_param {
 			       enum yaffs_block_state *state,
 			       u32 *seq_number);
 
+	/* Execute in place reads for memory mapped flash (optional).
+	 * Returns where the data of nand_chunk can be read in memory, or
+	 * NULL. Data read through it is used as it is, without ECC.
+	 */
+	const u8 *(*map_chunk_fn) (struct yaffs_dev *dev, int nand_chunk);
+
+	/* Discard (optional). Tells the driver that a run of chunks holds
+	 * no live data any more, eg. for an FTL underneath yaffs.
+	 * discard_mode is one of YAFFS_DISCARD_xxx. Runs are merged until
+	 * they are discard_batch chunks long (0 passes each on at once) and
+	 * are always passed on before an erase.
+	 */
+	int (*discard_fn) (struct yaffs_dev *dev, int nand_chunk,
+			   int n_chunks);
+	int discard_mode;
+	int discard_batch;
+
 	/* The remove_obj_fn function must be supplied by OS flavours that
 	 * need it.
 	 * yaffs direct uses it to implement the faster readdir.
@@ -587,6 +754,23 @@ struct yaffs_param {
 	int always_check_erased;	/* Force chunk erased check always on */
 
 	int disable_summary;
+
+	/* Binary trace buffer (see yaffs_tracebuf.h) */
+	int trace_buf_records;	/* Number of records to keep, 0 to disable */
+	u32 trace_buf_mask;	/* YAFFS_TRACE_XXX bits to record */
+	u32 (*trace_time_fn) (struct yaffs_dev *dev);	/* Timestamp in us.
+							 * Optional. */
+
+	int nand_prof;		/* Count NAND accesses (see yaffs_nandprof.h) */
+
+	int max_tnodes;		/* Evict the tnode trees of closed files to
+				 * stay under this many tnodes. 0 for no
+				 * limit */
+
+#ifdef CONFIG_YAFFS_COMPACT_OBJ
+	int n_attr_cache;	/* Attribute records to keep cached,
+				 * 0 for YAFFS_DEFAULT_ATTR_CACHE */
+#endif
 };
 
 struct yaffs_dev {
@@ -648,9 +832,23 @@ struct yaffs_dev {
 
 	/* Block Info */
 	struct yaffs_block_info *block_info;
+#ifdef CONFIG_YAFFS_COMPACT_BLOCKS
+	u8 **chunk_bit_groups;	/* Bitmap slots, YAFFS_CHUNK_BITS_GROUP in
+				 * each group */
+	int n_chunk_bit_groups;
+	int chunk_bit_slot_size;
+	u16 chunk_bit_free;	/* Free slot list, 0 terminated */
+	int n_chunk_bit_slots;	/* Slots in use */
+	int n_chunk_map_unknown;	/* Blocks whose bitmap is unknown */
+	u32 seq_base;		/* Block sequence numbers are offsets
+				 * from this */
+#else
 	u8 *chunk_bits;		/* bitmap of chunks in use */
+#endif
 	unsigned block_info_alt:1;	/* allocated using alternative alloc */
 	unsigned chunk_bits_alt:1;	/* allocated using alternative alloc */
+	unsigned block_heaps_alt:1;	/* allocated using alternative alloc */
+	unsigned shrink_seqs_alt:1;	/* allocated using alternative alloc */
 	int chunk_bit_stride;	/* Number of bytes of chunk_bits per block.
 				 * Must be consistent with chunks_per_block.
 				 */
@@ -664,6 +862,11 @@ struct yaffs_dev {
 	void *allocator;
 	int n_obj;
 	int n_tnodes;
+	u32 tnode_clock;	/* Ticks on every tnode tree use */
+	int n_evicted_files;	/* Files whose tnode trees are evicted */
+	int tnode_evict_retry;	/* Don't try to evict again below this */
+	u8 checkpt_evicted;	/* Checkpoint being read may have evicted
+				 * files */
 
 	int n_hardlinks;
 
@@ -708,6 +911,7 @@ struct yaffs_dev {
 	int n_deleted_files;	/* Count of files awaiting deletion; */
 	int n_unlinked_files;	/* Count of unlinked files. */
 	int n_bg_deletions;	/* Count of background deletions. */
+	int n_bg_del_pending;	/* Objects queued for background deletion */
 
 	/* Temporary buffer management */
 	struct yaffs_buffer temp_buffer[YAFFS_N_TEMP_BUFFERS];
@@ -721,6 +925,14 @@ struct yaffs_dev {
 					allocating block */
 	unsigned oldest_dirty_seq;
 	unsigned oldest_dirty_block;
+	struct yaffs_block_heap full_heap;	/* FULL blocks */
+	struct yaffs_block_heap dirty_heap;	/* FULL blocks with space to
+						 * reclaim */
+	int block_heaps_valid;
+	u32 *shrink_seqs;	/* Per block, the newest block its shrink
+				 * headers protect. 0 if not known */
+	u8 *xip_pins;		/* Per block, how many execute in place
+				 * mappings hold it. NULL until the first */
 
 	/* Block refreshing */
 	int refresh_skip;	/* A skip down counter.
@@ -733,6 +945,35 @@ struct yaffs_dev {
 	int chunks_per_summary;
 	struct yaffs_summary_tags *sum_tags;
 
+	/* Binary trace buffer */
+	struct yaffs_tb_rec *tb_recs;
+	u32 tb_n_recs;		/* Always a power of 2 */
+	u32 tb_head;		/* Sequence number of next record */
+
+	/* NAND access profile */
+	u32 *np_counts;
+	u32 *np_page_counts;
+	int np_cause;		/* What the current NAND accesses are for */
+
+	/* Run of dead chunks waiting to be passed to discard_fn */
+	int discard_start;
+	int discard_n;
+	unsigned discard_chunks:1;	/* Discard chunks as they are deleted */
+
+	/* Pruned chunks held back until the shrink header is written */
+	struct yaffs_discard_run held_discards[YAFFS_N_HELD_DISCARDS];
+	int n_held_discards;
+
+#ifdef CONFIG_YAFFS_COMPACT_OBJ
+	/* Cached object attributes (see struct yaffs_obj_attr) */
+	struct yaffs_obj_attr *attr_bucket[YAFFS_NATTR_BUCKETS];
+	struct list_head attr_lru;
+	int n_attr;
+	struct yaffs_obj_attr attr_spare;	/* Used if allocation fails */
+	struct yaffs_obj_attr attr_scratch;	/* Copy of the header if even
+						 * that is in use */
+#endif
+
 	/* Statistics */
 	u32 n_page_writes;
 	u32 n_page_reads;
@@ -742,6 +983,7 @@ struct yaffs_dev {
 	u32 all_gcs;
 	u32 passive_gc_count;
 	u32 oldest_dirty_gc_count;
+	u32 n_shrink_gcs;	/* Blocks with shrink headers collected */
 	u32 n_gc_blocks;
 	u32 bg_gcs;
 	u32 n_retried_writes;
@@ -756,6 +998,20 @@ struct yaffs_dev {
 	u32 cache_hits;
 	u32 tags_used;
 	u32 summary_used;
+#ifdef CONFIG_YAFFS_COMPACT_OBJ
+	u32 attr_loads;		/* Headers read to load attributes */
+#endif
+	u32 tnode_evictions;	/* Tnode trees evicted */
+	u32 tnode_rebuilds;	/* Tnode trees rebuilt from flash */
+	u32 tnode_rebuild_blocks;	/* Blocks looked at by rebuilds */
+	u32 tnode_rebuild_reads;	/* Tags and summary reads by rebuilds */
+	u32 n_hole_bytes_read;	/* Read as zeros without looking at flash */
+	u32 n_xip_bytes_read;	/* Copied straight from mapped flash */
+	u32 gc_paced;		/* Paced gc steps */
+	u32 gc_stalls;		/* Writes that had to gc aggressively */
+	u32 gc_max_write_copies;	/* Most chunks copied by gc in a write */
+	u32 n_discards;		/* discard_fn calls */
+	u32 n_discarded_chunks;
 
 };
 
@@ -827,6 +1083,11 @@ int yaffs_file_rd(struct yaffs_obj *obj, u8 * buffer, loff_t offset,
 int yaffs_wr_file(struct yaffs_obj *obj, const u8 * buffer, loff_t offset,
 		  int n_bytes, int write_trhrough);
 int yaffs_resize_file(struct yaffs_obj *obj, loff_t new_size);
+loff_t yaffs_seek_data(struct yaffs_obj *obj, loff_t offset, int hole);
+const u8 *yaffs_file_map(struct yaffs_obj *obj, loff_t offset, int max_bytes,
+			 int *n_bytes, struct yaffs_xip_pin *pin);
+void yaffs_file_unmap(struct yaffs_dev *dev, struct yaffs_xip_pin *pin);
+int yaffs_block_pinned(struct yaffs_dev *dev, struct yaffs_block_info *bi);
 
 struct yaffs_obj *yaffs_create_file(struct yaffs_obj *parent,
 				    const YCHAR *name, u32 mode, u32 uid,
@@ -877,6 +1138,18 @@ struct yaffs_obj *yaffs_lost_n_found(struct yaffs_dev *dev);
 
 void yaffs_handle_defered_free(struct yaffs_obj *obj);
 
+#ifdef CONFIG_YAFFS_COMPACT_OBJ
+/* Cached object attributes. Use yaffs_obj_attr() and yaffs_obj_attr_mod() */
+struct yaffs_obj_attr *yaffs_get_obj_attr(struct yaffs_obj *obj, int mod);
+int yaffs_obj_attr_loaded(struct yaffs_obj *obj);
+#endif
+
+#ifdef CONFIG_YAFFS_COMPACT_BLOCKS
+void yaffs_set_block_seq(struct yaffs_dev *dev, struct yaffs_block_info *bi,
+			 u32 seq);
+void yaffs_pack_block_seqs(struct yaffs_dev *dev);
+#endif
+
 void yaffs_update_dirty_dirs(struct yaffs_dev *dev);
 
 int yaffs_bg_gc(struct yaffs_dev *dev, unsigned urgency);
@@ -927,12 +1200,15 @@ void yaffs_skip_rest_of_block(struct yaffs_dev *dev);
 
 int yaffs_count_free_chunks(struct yaffs_dev *dev);
 
+void yaffs_evict_file_tnodes(struct yaffs_obj *obj);
 struct yaffs_tnode *yaffs_find_tnode_0(struct yaffs_dev *dev,
 				       struct yaffs_file_var *file_struct,
 				       u32 chunk_id);
 
 u32 yaffs_get_group_base(struct yaffs_dev *dev, struct yaffs_tnode *tn,
 			 unsigned pos);
+void yaffs_addr_to_chunk(struct yaffs_dev *dev, loff_t addr,
+			 int *chunk_out, u32 *offset_out);
 
 int yaffs_is_non_empty_dir(struct yaffs_obj *obj);
 #endif
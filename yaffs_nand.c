@@ -16,6 +16,8 @@
 
 #include "yaffs_getblockinfo.h"
 #include "yaffs_summary.h"
+#include "yaffs_tracebuf.h"
+#include "yaffs_nandprof.h"
 
 int yaffs_rd_chunk_tags_nand(struct yaffs_dev *dev, int nand_chunk,
 			     u8 *buffer, struct yaffs_ext_tags *tags)
@@ -45,6 +47,43 @@ int yaffs_rd_chunk_tags_nand(struct yaffs_dev *dev, int nand_chunk,
 					  dev->param.chunks_per_block);
 		yaffs_handle_chunk_error(dev, bi);
 	}
+	yaffs_tb_event4(dev, YAFFS_TRACE_NANDACCESS, YAFFS_TB_RD_CHUNK,
+			nand_chunk, tags->obj_id, tags->chunk_id,
+			tags->ecc_result);
+	yaffs_np_chunk(dev, YAFFS_NP_READ, nand_chunk, tags->chunk_id);
+	return result;
+}
+
+/*
+ * yaffs1 only, needs read_spares_fn. Reads the tags of n_chunks chunks
+ * without their data, see yaffs_tags_compat_rd_spares().
+ */
+int yaffs_rd_spares_tags_nand(struct yaffs_dev *dev, int nand_chunk,
+			      int n_chunks, struct yaffs_spare *spares,
+			      struct yaffs_ext_tags *tags)
+{
+	int result;
+	int i;
+	int flash_chunk = nand_chunk - dev->chunk_offset;
+
+	if (dev->param.is_yaffs2 || dev->param.read_chunk_tags_fn ||
+	    !dev->param.read_spares_fn)
+		return YAFFS_FAIL;
+
+	dev->n_page_reads += n_chunks;
+
+	result = yaffs_tags_compat_rd_spares(dev, flash_chunk, n_chunks,
+					     spares, tags);
+	if (result != YAFFS_OK)
+		return result;
+
+	for (i = 0; i < n_chunks; i++) {
+		yaffs_tb_event4(dev, YAFFS_TRACE_NANDACCESS, YAFFS_TB_RD_CHUNK,
+				nand_chunk + i, tags[i].obj_id,
+				tags[i].chunk_id, tags[i].ecc_result);
+		yaffs_np_chunk(dev, YAFFS_NP_READ, nand_chunk + i,
+			       tags[i].chunk_id);
+	}
 	return result;
 }
 
@@ -77,11 +116,18 @@ int yaffs_wr_chunk_tags_nand(struct yaffs_dev *dev,
 
 	yaffs_summary_add(dev, tags, nand_chunk);
 
+	yaffs_tb_event4(dev, YAFFS_TRACE_NANDACCESS, YAFFS_TB_WR_CHUNK,
+			nand_chunk, tags->obj_id, tags->chunk_id,
+			tags->n_bytes);
+	yaffs_np_chunk(dev, YAFFS_NP_WRITE, nand_chunk, tags->chunk_id);
+
 	return result;
 }
 
 int yaffs_mark_bad(struct yaffs_dev *dev, int block_no)
 {
+	yaffs_tb_event1(dev, YAFFS_TRACE_BAD_BLOCKS, YAFFS_TB_MARK_BAD,
+			block_no);
 	block_no -= dev->block_offset;
 	if (dev->param.bad_block_fn)
 		return dev->param.bad_block_fn(dev, block_no);
@@ -102,13 +148,115 @@ int yaffs_query_init_block_state(struct yaffs_dev *dev,
 	return yaffs_tags_compat_query_block(dev, block_no, state, seq_number);
 }
 
+/*
+ * Discards. Dead chunks are gathered into a run that is passed to
+ * discard_fn when it can't be extended, when it is discard_batch long
+ * and before any erase, so that nothing written later gets discarded.
+ */
+void yaffs_discard_flush(struct yaffs_dev *dev)
+{
+	if (dev->discard_n < 1)
+		return;
+
+	dev->param.discard_fn(dev, dev->discard_start - dev->chunk_offset,
+			      dev->discard_n);
+	dev->n_discards++;
+	dev->n_discarded_chunks += dev->discard_n;
+	dev->discard_n = 0;
+}
+
+void yaffs_discard_chunks(struct yaffs_dev *dev, int nand_chunk, int n_chunks)
+{
+	if (!dev->param.discard_fn)
+		return;
+
+	if (dev->discard_n > 0 &&
+	    dev->discard_start + dev->discard_n == nand_chunk) {
+		dev->discard_n += n_chunks;
+	} else {
+		yaffs_discard_flush(dev);
+		dev->discard_start = nand_chunk;
+		dev->discard_n = n_chunks;
+	}
+
+	if (dev->discard_n >= dev->param.discard_batch)
+		yaffs_discard_flush(dev);
+}
+
+/*
+ * Held discards are for chunks that a scan could still read until some
+ * later write lands, eg. those pruned before their shrink header is
+ * written. They are passed on, or dropped if that write failed, by
+ * yaffs_discard_release(). If there is no room to hold a chunk it is not
+ * discarded at all and waits for its block to be erased.
+ */
+void yaffs_discard_hold(struct yaffs_dev *dev, int nand_chunk)
+{
+	struct yaffs_discard_run *run;
+
+	if (!dev->param.discard_fn)
+		return;
+
+	if (dev->n_held_discards > 0) {
+		run = &dev->held_discards[dev->n_held_discards - 1];
+		if (run->start + run->n == nand_chunk) {
+			run->n++;
+			return;
+		}
+		if (run->start - 1 == nand_chunk) {
+			run->start--;
+			run->n++;
+			return;
+		}
+	}
+
+	if (dev->n_held_discards >= YAFFS_N_HELD_DISCARDS)
+		return;
+
+	run = &dev->held_discards[dev->n_held_discards++];
+	run->start = nand_chunk;
+	run->n = 1;
+}
+
+void yaffs_discard_release(struct yaffs_dev *dev, int pass_on)
+{
+	int i;
+
+	for (i = 0; pass_on && i < dev->n_held_discards; i++)
+		yaffs_discard_chunks(dev, dev->held_discards[i].start,
+				     dev->held_discards[i].n);
+	dev->n_held_discards = 0;
+}
+
+/* Forget held chunks in a block that is about to be erased */
+static void yaffs_discard_drop_block(struct yaffs_dev *dev, int flash_block)
+{
+	int first = flash_block * dev->param.chunks_per_block;
+	int last = first + dev->param.chunks_per_block;
+	struct yaffs_discard_run *run;
+	int i;
+
+	for (i = 0; i < dev->n_held_discards; i++) {
+		run = &dev->held_discards[i];
+		if (run->start < last && run->start + run->n > first) {
+			*run = dev->held_discards[--dev->n_held_discards];
+			i--;
+		}
+	}
+}
+
 int yaffs_erase_block(struct yaffs_dev *dev, int flash_block)
 {
 	int result;
 
+	yaffs_discard_flush(dev);
+	yaffs_discard_drop_block(dev, flash_block);
+	yaffs_np_erase(dev, flash_block);
 	flash_block -= dev->block_offset;
 	dev->n_erasures++;
 	result = dev->param.erase_fn(dev, flash_block);
+	yaffs_tb_event2(dev, YAFFS_TRACE_ERASE, YAFFS_TB_ERASE,
+			flash_block + dev->block_offset, result);
 	return result;
 }
 
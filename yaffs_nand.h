@@ -20,6 +20,10 @@
 int yaffs_rd_chunk_tags_nand(struct yaffs_dev *dev, int nand_chunk,
 			     u8 *buffer, struct yaffs_ext_tags *tags);
 
+int yaffs_rd_spares_tags_nand(struct yaffs_dev *dev, int nand_chunk,
+			      int n_chunks, struct yaffs_spare *spares,
+			      struct yaffs_ext_tags *tags);
+
 int yaffs_wr_chunk_tags_nand(struct yaffs_dev *dev,
 			     int nand_chunk,
 			     const u8 *buffer, struct yaffs_ext_tags *tags);
@@ -31,6 +35,11 @@ int yaffs_query_init_block_state(struct yaffs_dev *dev,
 				 enum yaffs_block_state *state,
 				 unsigned *seq_number);
 
+void yaffs_discard_chunks(struct yaffs_dev *dev, int nand_chunk, int n_chunks);
+void yaffs_discard_flush(struct yaffs_dev *dev);
+void yaffs_discard_hold(struct yaffs_dev *dev, int nand_chunk);
+void yaffs_discard_release(struct yaffs_dev *dev, int pass_on);
+
 int yaffs_erase_block(struct yaffs_dev *dev, int flash_block);
 
 int yaffs_init_nand(struct yaffs_dev *dev);
@@ -0,0 +1,135 @@
+/*
+ * YAFFS: Yet Another Flash File System. A NAND-flash specific file system.
+ *
+ * Copyright (C) 2002-2011 Aleph One Ltd.
+ *   for Toby Churchill Ltd and Brightstar Engineering
+ *
+ * Created by Charles Manning <charles@aleph1.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include "yaffs_nandprof.h"
+#include "yaffs_trace.h"
+
+static int yaffs_np_n_blocks(struct yaffs_dev *dev)
+{
+	return dev->internal_end_block - dev->internal_start_block + 1;
+}
+
+static int yaffs_np_n_counts(struct yaffs_dev *dev)
+{
+	return yaffs_np_n_blocks(dev) * YAFFS_NP_N_OPS * YAFFS_NP_N_CAUSES +
+		dev->param.chunks_per_block * 2;
+}
+
+int yaffs_np_init(struct yaffs_dev *dev)
+{
+	int n;
+
+	dev->np_counts = NULL;
+	dev->np_page_counts = NULL;
+	dev->np_cause = YAFFS_NP_DATA;
+
+	if (!dev->param.nand_prof)
+		return YAFFS_OK;
+
+	n = yaffs_np_n_counts(dev);
+	dev->np_counts = vmalloc(n * sizeof(u32));
+	if (!dev->np_counts) {
+		yaffs_trace(YAFFS_TRACE_ERROR,
+			"Could not allocate %d NAND profile counters", n);
+		return YAFFS_FAIL;
+	}
+
+	/* The page position counts go after the block counts. */
+	dev->np_page_counts = dev->np_counts +
+		yaffs_np_n_blocks(dev) * YAFFS_NP_N_OPS * YAFFS_NP_N_CAUSES;
+
+	yaffs_np_clear(dev);
+
+	return YAFFS_OK;
+}
+
+void yaffs_np_deinit(struct yaffs_dev *dev)
+{
+	vfree(dev->np_counts);
+	dev->np_counts = NULL;
+	dev->np_page_counts = NULL;
+}
+
+void yaffs_np_clear(struct yaffs_dev *dev)
+{
+	if (dev->np_counts)
+		memset(dev->np_counts, 0, yaffs_np_n_counts(dev) * sizeof(u32));
+}
+
+static u32 *yaffs_np_counter(struct yaffs_dev *dev, int block,
+			     enum yaffs_np_op op, int cause)
+{
+	block -= dev->internal_start_block;
+	return &dev->np_counts[(block * YAFFS_NP_N_OPS + op) *
+				YAFFS_NP_N_CAUSES + cause];
+}
+
+void yaffs_np_add_chunk(struct yaffs_dev *dev, enum yaffs_np_op op,
+			int nand_chunk, int chunk_id)
+{
+	int block = nand_chunk / dev->param.chunks_per_block;
+	int in_block = nand_chunk % dev->param.chunks_per_block;
+	int cause = dev->np_cause;
+
+	if (block < dev->internal_start_block ||
+	    block > dev->internal_end_block)
+		return;
+
+	if (cause == YAFFS_NP_DATA && chunk_id == 0)
+		cause = YAFFS_NP_HEADER;
+
+	(*yaffs_np_counter(dev, block, op, cause))++;
+	dev->np_page_counts[in_block * 2 + op]++;
+}
+
+void yaffs_np_add_erase(struct yaffs_dev *dev, int block)
+{
+	if (block < dev->internal_start_block ||
+	    block > dev->internal_end_block)
+		return;
+
+	(*yaffs_np_counter(dev, block, YAFFS_NP_ERASE, dev->np_cause))++;
+}
+
+int yaffs_np_dump_size(struct yaffs_dev *dev)
+{
+	if (!dev->np_counts)
+		return -1;
+	return sizeof(struct yaffs_np_hdr) + yaffs_np_n_counts(dev) * sizeof(u32);
+}
+
+/*
+ * yaffs_np_dump() copies a header and the counts into buffer.
+ * Returns the number of bytes used or -1 if profiling is off or the buffer
+ * is too small (see yaffs_np_dump_size()).
+ */
+int yaffs_np_dump(struct yaffs_dev *dev, u8 *buffer, int buffer_size)
+{
+	struct yaffs_np_hdr *hdr = (struct yaffs_np_hdr *)buffer;
+	int size = yaffs_np_dump_size(dev);
+
+	if (size < 0 || buffer_size < size)
+		return -1;
+
+	hdr->magic = YAFFS_NP_MAGIC;
+	hdr->version = YAFFS_NP_VERSION;
+	hdr->first_block = dev->internal_start_block - dev->block_offset;
+	hdr->n_blocks = yaffs_np_n_blocks(dev);
+	hdr->chunks_per_block = dev->param.chunks_per_block;
+	hdr->n_ops = YAFFS_NP_N_OPS;
+	hdr->n_causes = YAFFS_NP_N_CAUSES;
+
+	memcpy(hdr + 1, dev->np_counts, size - sizeof(*hdr));
+
+	return size;
+}
@@ -0,0 +1,93 @@
+/*
+ * YAFFS: Yet another Flash File System . A NAND-flash specific file system.
+ *
+ * Copyright (C) 2002-2011 Aleph One Ltd.
+ *   for Toby Churchill Ltd and Brightstar Engineering
+ *
+ * Created by Charles Manning <charles@aleph1.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1 as
+ * published by the Free Software Foundation.
+ *
+ * Note: Only YAFFS headers are LGPL, YAFFS C code is covered by GPL.
+ */
+
+/*
+ * NAND access profiler.
+ *
+ * Counts reads, writes and erases per block, split by the part of yaffs
+ * that caused them, plus reads and writes per page position within a block.
+ * Enabled with param.nand_prof. The counts are dumped with yaffs_np_dump()
+ * and can be turned into heatmaps with utils/yaffs_heatmap.py.
+ */
+
+#ifndef __YAFFS_NANDPROF_H__
+#define __YAFFS_NANDPROF_H__
+
+#include "yaffs_guts.h"
+
+#define YAFFS_NP_MAGIC		0x46504e59	/* "YNPF" little endian */
+#define YAFFS_NP_VERSION	1
+
+enum yaffs_np_op {
+	YAFFS_NP_READ,
+	YAFFS_NP_WRITE,
+	YAFFS_NP_ERASE,
+	YAFFS_NP_N_OPS
+};
+
+/*
+ * Causes. dev->np_cause is set to one of these around GC, checkpointing,
+ * summaries and scanning. Anything else is user data or an object header,
+ * going by the chunk id. Erases outside of GC and checkpointing happen when
+ * deletes or overwrites leave a block with nothing in use, so are counted
+ * as data. Don't renumber these, dumps depend on them.
+ */
+enum yaffs_np_cause {
+	YAFFS_NP_DATA,
+	YAFFS_NP_HEADER,
+	YAFFS_NP_GC,
+	YAFFS_NP_CHECKPT,
+	YAFFS_NP_SUMMARY,
+	YAFFS_NP_SCAN,
+	YAFFS_NP_N_CAUSES
+};
+
+/*
+ * Dump header. It is followed by the block counts,
+ * u32 [n_blocks][YAFFS_NP_N_OPS][YAFFS_NP_N_CAUSES], and then the page
+ * position counts, u32 [chunks_per_block][2] (reads, writes).
+ */
+struct yaffs_np_hdr {
+	u32 magic;
+	u32 version;
+	u32 first_block;
+	u32 n_blocks;
+	u32 chunks_per_block;
+	u32 n_ops;
+	u32 n_causes;
+};
+
+int yaffs_np_init(struct yaffs_dev *dev);
+void yaffs_np_deinit(struct yaffs_dev *dev);
+void yaffs_np_clear(struct yaffs_dev *dev);
+
+void yaffs_np_add_chunk(struct yaffs_dev *dev, enum yaffs_np_op op,
+			int nand_chunk, int chunk_id);
+void yaffs_np_add_erase(struct yaffs_dev *dev, int block);
+
+int yaffs_np_dump_size(struct yaffs_dev *dev);
+int yaffs_np_dump(struct yaffs_dev *dev, u8 *buffer, int buffer_size);
+
+#define yaffs_np_chunk(dev, op, nand_chunk, chunk_id) do { \
+	if ((dev)->np_counts) \
+		yaffs_np_add_chunk(dev, op, nand_chunk, chunk_id); \
+} while (0)
+
+#define yaffs_np_erase(dev, block) do { \
+	if ((dev)->np_counts) \
+		yaffs_np_add_erase(dev, block); \
+} while (0)
+
+#endif
@@ -28,13 +28,7 @@
 #include "yaffs_nand.h"
 #include "yaffs_getblockinfo.h"
 #include "yaffs_bitmap.h"
-
-/* Summary tags don't need the sequence number because that is redundant. */
-struct yaffs_summary_tags {
-	unsigned obj_id;
-	unsigned chunk_id;
-	unsigned n_bytes;
-};
+#include "yaffs_nandprof.h"
 
 static void yaffs_summary_clear(struct yaffs_dev *dev)
 {
@@ -89,8 +83,10 @@ static int yaffs_summary_write(struct yaffs_dev *dev, int blk)
 	int chunk_in_block;
 	int result;
 	int this_tx;
+	int old_np_cause = dev->np_cause;
 	struct yaffs_block_info *bi = yaffs_get_block_info(dev, blk);
 
+	dev->np_cause = YAFFS_NP_SUMMARY;
 	buffer = yaffs_get_temp_buffer(dev);
 	n_bytes = sizeof(struct yaffs_summary_tags) * dev->chunks_per_summary;
 	memset(&tags, 0, sizeof(struct yaffs_ext_tags));
@@ -121,6 +117,7 @@ static int yaffs_summary_write(struct yaffs_dev *dev, int blk)
 		tags.chunk_id++;
 	} while (result == YAFFS_OK && n_bytes > 0);
 	yaffs_release_temp_buffer(dev, buffer);
+	dev->np_cause = old_np_cause;
 
 
 	if (result == YAFFS_OK)
@@ -143,8 +140,10 @@ int yaffs_summary_read(struct yaffs_dev *dev,
 	int chunk_in_block;
 	int result;
 	int this_tx;
+	int old_np_cause = dev->np_cause;
 	struct yaffs_block_info *bi = yaffs_get_block_info(dev, blk);
 
+	dev->np_cause = YAFFS_NP_SUMMARY;
 	buffer = yaffs_get_temp_buffer(dev);
 	n_bytes = sizeof(struct yaffs_summary_tags) * dev->chunks_per_summary;
 	chunk_in_block = dev->chunks_per_summary;
@@ -181,6 +180,7 @@ int yaffs_summary_read(struct yaffs_dev *dev,
 		chunk_id++;
 	} while (result == YAFFS_OK && n_bytes > 0);
 	yaffs_release_temp_buffer(dev, buffer);
+	dev->np_cause = old_np_cause;
 
 	if (st == dev->sum_tags && result == YAFFS_OK)
 		bi->has_summary = 1;
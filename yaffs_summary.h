@@ -18,6 +18,15 @@
 
 #include "yaffs_packedtags2.h"
 
+/* Summary tags don't need the sequence number because that is redundant.
+ * Each field holds the matching field of the packed tags, so header chunks
+ * keep their extra header info.
+ */
+struct yaffs_summary_tags {
+	unsigned obj_id;
+	unsigned chunk_id;
+	unsigned n_bytes;
+};
 
 int yaffs_summary_init(struct yaffs_dev *dev);
 void yaffs_summary_deinit(struct yaffs_dev *dev);
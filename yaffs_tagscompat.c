@@ -309,16 +309,41 @@ int yaffs_tags_compat_wr(struct yaffs_dev *dev,
 	return yaffs_wr_nand(dev, nand_chunk, data, &spare);
 }
 
+static void yaffs_spare_to_ext_tags(struct yaffs_dev *dev,
+				    struct yaffs_spare *spare, int used,
+				    enum yaffs_ecc_result ecc_result,
+				    struct yaffs_ext_tags *ext_tags)
+{
+	struct yaffs_tags tags;
+
+	ext_tags->is_deleted = (hweight8(spare->page_status) < 7) ? 1 : 0;
+	ext_tags->ecc_result = ecc_result;
+	ext_tags->block_bad = 0;	/* We're reading it */
+	/* therefore it is not a bad block */
+	ext_tags->chunk_used = used;
+
+	if (ext_tags->chunk_used) {
+		yaffs_get_tags_from_spare(dev, spare, &tags);
+		ext_tags->obj_id = tags.obj_id;
+		ext_tags->chunk_id = tags.chunk_id;
+		ext_tags->n_bytes = tags.n_bytes_lsb;
+
+		if (dev->data_bytes_per_chunk >= 1024)
+			ext_tags->n_bytes |=
+				(((unsigned)tags.n_bytes_msb) << 10);
+
+		ext_tags->serial_number = tags.serial_number;
+	}
+}
+
 int yaffs_tags_compat_rd(struct yaffs_dev *dev,
 			 int nand_chunk,
 			 u8 *data, struct yaffs_ext_tags *ext_tags)
 {
 	struct yaffs_spare spare;
-	struct yaffs_tags tags;
 	enum yaffs_ecc_result ecc_result = YAFFS_ECC_RESULT_UNKNOWN;
 	static struct yaffs_spare spare_ff;
 	static int init;
-	int deleted;
 
 	if (!init) {
 		memset(&spare_ff, 0xff, sizeof(spare_ff));
@@ -333,26 +358,40 @@ int yaffs_tags_compat_rd(struct yaffs_dev *dev,
 	if (!ext_tags)
 		return YAFFS_OK;
 
-	deleted = (hweight8(spare.page_status) < 7) ? 1 : 0;
+	yaffs_spare_to_ext_tags(dev, &spare,
+				memcmp(&spare_ff, &spare, sizeof(spare_ff)) ?
+				1 : 0, ecc_result, ext_tags);
 
-	ext_tags->is_deleted = deleted;
-	ext_tags->ecc_result = ecc_result;
-	ext_tags->block_bad = 0;	/* We're reading it */
-	/* therefore it is not a bad block */
-	ext_tags->chunk_used =
-		memcmp(&spare_ff, &spare, sizeof(spare_ff)) ? 1 : 0;
+	return YAFFS_OK;
+}
 
-	if (ext_tags->chunk_used) {
-		yaffs_get_tags_from_spare(dev, &spare, &tags);
-		ext_tags->obj_id = tags.obj_id;
-		ext_tags->chunk_id = tags.chunk_id;
-		ext_tags->n_bytes = tags.n_bytes_lsb;
+/*
+ * Reads the tags of n_chunks chunks from nand_chunk on with one
+ * read_spares_fn call. spares is room for n_chunks spares, word aligned,
+ * so that unused spares can be spotted a word at a time.
+ */
+int yaffs_tags_compat_rd_spares(struct yaffs_dev *dev, int nand_chunk,
+				int n_chunks, struct yaffs_spare *spares,
+				struct yaffs_ext_tags *ext_tags)
+{
+	const u32 *w;
+	int used;
+	int i;
+	int j;
 
-		if (dev->data_bytes_per_chunk >= 1024)
-			ext_tags->n_bytes |=
-				(((unsigned)tags.n_bytes_msb) << 10);
+	if (!dev->param.read_spares_fn(dev, nand_chunk, n_chunks, spares))
+		return YAFFS_FAIL;
 
-		ext_tags->serial_number = tags.serial_number;
+	for (i = 0; i < n_chunks; i++) {
+		w = (const u32 *)&spares[i];
+		used = 0;
+		for (j = 0; j < (int)(sizeof(struct yaffs_spare) / 4); j++)
+			if (w[j] != 0xffffffff)
+				used = 1;
+
+		memset(&ext_tags[i], 0, sizeof(ext_tags[i]));
+		yaffs_spare_to_ext_tags(dev, &spares[i], used,
+					YAFFS_ECC_RESULT_UNKNOWN, &ext_tags[i]);
 	}
 
 	return YAFFS_OK;
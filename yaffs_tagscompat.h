@@ -23,6 +23,9 @@ int yaffs_tags_compat_wr(struct yaffs_dev *dev,
 int yaffs_tags_compat_rd(struct yaffs_dev *dev,
 			 int nand_chunk,
 			 u8 *data, struct yaffs_ext_tags *tags);
+int yaffs_tags_compat_rd_spares(struct yaffs_dev *dev, int nand_chunk,
+				int n_chunks, struct yaffs_spare *spares,
+				struct yaffs_ext_tags *ext_tags);
 int yaffs_tags_compat_mark_bad(struct yaffs_dev *dev, int block_no);
 int yaffs_tags_compat_query_block(struct yaffs_dev *dev,
 				  int block_no,
@@ -0,0 +1,160 @@
+/*
+ * YAFFS: Yet Another Flash File System. A NAND-flash specific file system.
+ *
+ * Copyright (C) 2002-2011 Aleph One Ltd.
+ *   for Toby Churchill Ltd and Brightstar Engineering
+ *
+ * Created by Charles Manning <charles@aleph1.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/*
+ * The trace buffer is a power of 2 sized ring of records indexed by a free
+ * running sequence number (dev->tb_head).
+ *
+ * Records are only added from within yaffs, so there is never more than one
+ * writer per device (the caller already holds the yaffs lock). Nothing
+ * needs to be locked to take a dump though: each record carries its own
+ * sequence number which is invalidated while the record is being filled
+ * in, so a reader can tell whether the copy it took is intact and skips
+ * any record that was overwritten under it.
+ */
+
+#include "yaffs_tracebuf.h"
+#include "yaffs_trace.h"
+
+int yaffs_tb_init(struct yaffs_dev *dev)
+{
+	u32 n_recs = 1;
+
+	dev->tb_recs = NULL;
+	dev->tb_n_recs = 0;
+	dev->tb_head = 0;
+
+	if (dev->param.trace_buf_records <= 0)
+		return YAFFS_OK;
+
+	/* Round down to a power of 2 so that wrapping is just a mask. */
+	while (n_recs * 2 <= (u32)dev->param.trace_buf_records)
+		n_recs *= 2;
+
+	dev->tb_recs = vmalloc(n_recs * sizeof(struct yaffs_tb_rec));
+	if (!dev->tb_recs) {
+		yaffs_trace(YAFFS_TRACE_ERROR,
+			"Could not allocate %d trace records", n_recs);
+		return YAFFS_FAIL;
+	}
+
+	dev->tb_n_recs = n_recs;
+	yaffs_tb_clear(dev);
+
+	return YAFFS_OK;
+}
+
+void yaffs_tb_deinit(struct yaffs_dev *dev)
+{
+	vfree(dev->tb_recs);
+	dev->tb_recs = NULL;
+	dev->tb_n_recs = 0;
+	dev->tb_head = 0;
+}
+
+void yaffs_tb_clear(struct yaffs_dev *dev)
+{
+	u32 i;
+
+	if (!dev->tb_recs)
+		return;
+
+	/* Set each record to a sequence number it can't be looked up by. */
+	for (i = 0; i < dev->tb_n_recs; i++)
+		dev->tb_recs[i].seq = ~i;
+	dev->tb_head = 0;
+}
+
+void yaffs_tb_add(struct yaffs_dev *dev, unsigned event, int n_args,
+		  u32 a0, u32 a1, u32 a2, u32 a3)
+{
+	u32 seq = dev->tb_head;
+	volatile struct yaffs_tb_rec *rec;
+
+	rec = &dev->tb_recs[seq & (dev->tb_n_recs - 1)];
+
+	rec->seq = ~seq;
+	rec->timestamp = dev->param.trace_time_fn ?
+			dev->param.trace_time_fn(dev) : seq;
+	rec->event = event;
+	rec->n_args = n_args;
+	rec->args[0] = a0;
+	rec->args[1] = a1;
+	rec->args[2] = a2;
+	rec->args[3] = a3;
+	rec->seq = seq;
+
+	dev->tb_head = seq + 1;
+}
+
+/*
+ * yaffs_tb_dump() copies a header and the records into buffer, oldest
+ * first. If the buffer is too small then only the newest records are kept.
+ * Returns the number of bytes used or -1 if there is no trace buffer.
+ */
+int yaffs_tb_dump(struct yaffs_dev *dev, u8 *buffer, int buffer_size)
+{
+	struct yaffs_tb_hdr *hdr = (struct yaffs_tb_hdr *)buffer;
+	struct yaffs_tb_rec *out;
+	volatile struct yaffs_tb_rec *rec;
+	u32 head;
+	u32 seq;
+	u32 n;
+	u32 max_recs;
+
+	if (!dev->tb_recs || buffer_size < (int)sizeof(*hdr))
+		return -1;
+
+	max_recs = (buffer_size - sizeof(*hdr)) / sizeof(struct yaffs_tb_rec);
+
+	head = dev->tb_head;
+	n = head;
+	if (n > dev->tb_n_recs)
+		n = dev->tb_n_recs;
+	if (n > max_recs)
+		n = max_recs;
+
+	hdr->magic = YAFFS_TB_MAGIC;
+	hdr->version = YAFFS_TB_VERSION;
+	hdr->rec_size = sizeof(struct yaffs_tb_rec);
+	hdr->n_recs = 0;
+	hdr->n_lost = head - n;
+	hdr->flags = dev->param.trace_time_fn ? YAFFS_TB_FLAG_TIME_US : 0;
+
+	out = (struct yaffs_tb_rec *)(hdr + 1);
+
+	for (seq = head - n; seq != head; seq++) {
+		rec = &dev->tb_recs[seq & (dev->tb_n_recs - 1)];
+		if (rec->seq != seq) {
+			hdr->n_lost++;
+			continue;
+		}
+		out->seq = seq;
+		out->timestamp = rec->timestamp;
+		out->event = rec->event;
+		out->n_args = rec->n_args;
+		out->args[0] = rec->args[0];
+		out->args[1] = rec->args[1];
+		out->args[2] = rec->args[2];
+		out->args[3] = rec->args[3];
+		/* Overwritten while we were copying it? */
+		if (rec->seq != seq) {
+			hdr->n_lost++;
+			continue;
+		}
+		out++;
+		hdr->n_recs++;
+	}
+
+	return (u8 *)out - buffer;
+}
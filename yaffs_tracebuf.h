@@ -0,0 +1,116 @@
+/*
+ * YAFFS: Yet another Flash File System . A NAND-flash specific file system.
+ *
+ * Copyright (C) 2002-2011 Aleph One Ltd.
+ *   for Toby Churchill Ltd and Brightstar Engineering
+ *
+ * Created by Charles Manning <charles@aleph1.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1 as
+ * published by the Free Software Foundation.
+ *
+ * Note: Only YAFFS headers are LGPL, YAFFS C code is covered by GPL.
+ */
+
+/*
+ * Binary trace buffer.
+ *
+ * A cheap alternative to yaffs_trace() for timing sensitive problems.
+ * Events are written as fixed size records into a per-device ring buffer
+ * without any formatting. The buffer is dumped with yaffs_tb_dump() and
+ * decoded offline (see utils/yaffs_trace_decode.c).
+ */
+
+#ifndef __YAFFS_TRACEBUF_H__
+#define __YAFFS_TRACEBUF_H__
+
+#include "yaffs_guts.h"
+
+#define YAFFS_TB_MAGIC		0x46425459	/* "YTBF" little endian */
+#define YAFFS_TB_VERSION	1
+#define YAFFS_TB_N_ARGS		4
+
+/* Dump header flags */
+#define YAFFS_TB_FLAG_TIME_US	0x00000001	/* Timestamps are in us.
+						 * Otherwise they are just
+						 * record sequence numbers. */
+
+/*
+ * Event ids. Each event is recorded if its trace mask bit (shown in
+ * brackets, either will do where there are two) is set in
+ * param.trace_buf_mask. The arguments are listed in order. Don't renumber
+ * these, dumps depend on them.
+ */
+enum yaffs_tb_event {
+	YAFFS_TB_NONE = 0,
+	YAFFS_TB_RD_CHUNK,	/* [NANDACCESS] chunk, obj, chunk_id, ecc */
+	YAFFS_TB_WR_CHUNK,	/* [NANDACCESS] chunk, obj, chunk_id, n_bytes */
+	YAFFS_TB_ERASE,		/* [ERASE] block, result */
+	YAFFS_TB_MARK_BAD,	/* [BAD_BLOCKS] block */
+	YAFFS_TB_ALLOC_BLOCK,	/* [ALLOCATE] block, seq, n_erased_blocks */
+	YAFFS_TB_BLOCK_DIRTY,	/* [GC|ERASE] block, state, needs_retiring */
+	YAFFS_TB_GC_SELECT,	/* [GC] block, free, prioritised, background */
+	YAFFS_TB_GC_BEGIN,	/* [GC] block, pages_in_use, whole_block */
+	YAFFS_TB_GC_END,	/* [GC] block, chunk, result */
+	YAFFS_TB_GC_COPY,	/* [GC_DETAIL] old chunk, new chunk, obj, id */
+	YAFFS_TB_CHECKPT_WR_BEGIN,	/* [CHECKPOINT] */
+	YAFFS_TB_CHECKPT_WR_END,	/* [CHECKPOINT] result, n_blocks */
+	YAFFS_TB_CHECKPT_RD_BEGIN,	/* [CHECKPOINT] */
+	YAFFS_TB_CHECKPT_RD_END,	/* [CHECKPOINT] result */
+	YAFFS_TB_MOUNT_BEGIN,	/* [MOUNT] */
+	YAFFS_TB_MOUNT_END,	/* [MOUNT] result */
+	YAFFS_TB_MOUNT_FIXUP_BEGIN,	/* [MOUNT] */
+	YAFFS_TB_MOUNT_FIXUP_END,	/* [MOUNT] n_hanging */
+	YAFFS_TB_N_EVENTS
+};
+
+/* A trace record. All records are the same size. */
+struct yaffs_tb_rec {
+	u32 seq;		/* Sequence number of the record */
+	u32 timestamp;
+	u16 event;
+	u16 n_args;
+	u32 args[YAFFS_TB_N_ARGS];
+};
+
+/* Header at the start of a dump, followed by n_recs records oldest first */
+struct yaffs_tb_hdr {
+	u32 magic;
+	u32 version;
+	u32 rec_size;
+	u32 n_recs;
+	u32 n_lost;		/* Records overwritten before the dump */
+	u32 flags;
+};
+
+int yaffs_tb_init(struct yaffs_dev *dev);
+void yaffs_tb_deinit(struct yaffs_dev *dev);
+void yaffs_tb_clear(struct yaffs_dev *dev);
+
+void yaffs_tb_add(struct yaffs_dev *dev, unsigned event, int n_args,
+		  u32 a0, u32 a1, u32 a2, u32 a3);
+
+int yaffs_tb_dump(struct yaffs_dev *dev, u8 *buffer, int buffer_size);
+
+/*
+ * Trace points. The mask test is done here so that a disabled trace
+ * point costs no more than a disabled yaffs_trace().
+ */
+#define yaffs_tb_event(dev, msk, ev, n, a0, a1, a2, a3) do { \
+	if ((dev)->tb_recs && ((dev)->param.trace_buf_mask & (msk))) \
+		yaffs_tb_add(dev, ev, n, a0, a1, a2, a3); \
+} while (0)
+
+#define yaffs_tb_event0(dev, msk, ev) \
+	yaffs_tb_event(dev, msk, ev, 0, 0, 0, 0, 0)
+#define yaffs_tb_event1(dev, msk, ev, a0) \
+	yaffs_tb_event(dev, msk, ev, 1, a0, 0, 0, 0)
+#define yaffs_tb_event2(dev, msk, ev, a0, a1) \
+	yaffs_tb_event(dev, msk, ev, 2, a0, a1, 0, 0)
+#define yaffs_tb_event3(dev, msk, ev, a0, a1, a2) \
+	yaffs_tb_event(dev, msk, ev, 3, a0, a1, a2, 0)
+#define yaffs_tb_event4(dev, msk, ev, a0, a1, a2, a3) \
+	yaffs_tb_event(dev, msk, ev, 4, a0, a1, a2, a3)
+
+#endif
@@ -179,6 +179,7 @@ unsigned int yaffs_auto_checkpoint = 1;
 unsigned int yaffs_gc_control = 1;
 unsigned int yaffs_bg_enable = 1;
 unsigned int yaffs_auto_select = 1;
+unsigned int yaffs_gc_pace;	/* gc_pace_copies for new mounts */
 /* Module Parameters */
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 5, 0))
 module_param(yaffs_trace_mask, uint, 0644);
@@ -186,11 +187,13 @@ module_param(yaffs_wr_attempts, uint, 0644);
 module_param(yaffs_auto_checkpoint, uint, 0644);
 module_param(yaffs_gc_control, uint, 0644);
 module_param(yaffs_bg_enable, uint, 0644);
+module_param(yaffs_gc_pace, uint, 0644);
 #else
 MODULE_PARM(yaffs_trace_mask, "i");
 MODULE_PARM(yaffs_wr_attempts, "i");
 MODULE_PARM(yaffs_auto_checkpoint, "i");
 MODULE_PARM(yaffs_gc_control, "i");
+MODULE_PARM(yaffs_gc_pace, "i");
 #endif
 
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 25))
@@ -2530,6 +2533,7 @@ struct yaffs_options {
 	int lazy_loading_overridden;
 	int empty_lost_and_found;
 	int empty_lost_and_found_overridden;
+	int bg_empty_lost_and_found;
 	int disable_summary;
 };
 
@@ -2580,6 +2584,10 @@ static int yaffs_parse_options(struct yaffs_options *options,
 		} else if (!strcmp(cur_opt, "empty-lost-and-found-on")) {
 			options->empty_lost_and_found = 1;
 			options->empty_lost_and_found_overridden = 1;
+		} else if (!strcmp(cur_opt, "empty-lost-and-found-bg")) {
+			options->empty_lost_and_found = 1;
+			options->empty_lost_and_found_overridden = 1;
+			options->bg_empty_lost_and_found = 1;
 		} else if (!strcmp(cur_opt, "no-cache")) {
 			options->no_cache = 1;
 		} else if (!strcmp(cur_opt, "no-checkpoint-read")) {
@@ -2846,10 +2854,12 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 
 	param->empty_lost_n_found = 1;
 	param->refresh_period = 500;
+	param->gc_pace_copies = yaffs_gc_pace;
 	param->disable_summary = options.disable_summary;
 
 	if (options.empty_lost_and_found_overridden)
 		param->empty_lost_n_found = options.empty_lost_and_found;
+	param->bg_empty_lost_n_found = options.bg_empty_lost_and_found;
 
 	/* ... and the functions. */
 	if (yaffs_version == 2) {
@@ -3099,10 +3109,14 @@ static char *yaffs_dump_dev_part0(char *buf, struct yaffs_dev *dev)
 	buf += sprintf(buf, "inband_tags.......... %d\n", param->inband_tags);
 	buf += sprintf(buf, "empty_lost_n_found... %d\n",
 				param->empty_lost_n_found);
+	buf += sprintf(buf, "bg_empty_lost_n_found %d\n",
+				param->bg_empty_lost_n_found);
 	buf += sprintf(buf, "disable_lazy_load.... %d\n",
 				param->disable_lazy_load);
 	buf += sprintf(buf, "refresh_period....... %d\n",
 				param->refresh_period);
+	buf += sprintf(buf, "gc_pace_copies....... %d\n",
+				param->gc_pace_copies);
 	buf += sprintf(buf, "n_caches............. %d\n", param->n_caches);
 	buf += sprintf(buf, "n_reserved_blocks.... %d\n",
 				param->n_reserved_blocks);
@@ -3136,6 +3150,7 @@ static char *yaffs_dump_dev_part1(char *buf, struct yaffs_dev *dev)
 				dev->passive_gc_count);
 	buf += sprintf(buf, "oldest_dirty_gc_count %u\n",
 				dev->oldest_dirty_gc_count);
+	buf += sprintf(buf, "n_shrink_gcs......... %u\n", dev->n_shrink_gcs);
 	buf += sprintf(buf, "n_gc_blocks.......... %u\n", dev->n_gc_blocks);
 	buf += sprintf(buf, "bg_gcs............... %u\n", dev->bg_gcs);
 	buf += sprintf(buf, "n_retried_writes..... %u\n",
@@ -3154,8 +3169,28 @@ static char *yaffs_dump_dev_part1(char *buf, struct yaffs_dev *dev)
 				dev->n_unlinked_files);
 	buf += sprintf(buf, "refresh_count........ %u\n", dev->refresh_count);
 	buf += sprintf(buf, "n_bg_deletions....... %u\n", dev->n_bg_deletions);
+	buf += sprintf(buf, "n_bg_del_pending..... %d\n",
+				dev->n_bg_del_pending);
 	buf += sprintf(buf, "tags_used............ %u\n", dev->tags_used);
 	buf += sprintf(buf, "summary_used......... %u\n", dev->summary_used);
+	buf += sprintf(buf, "n_evicted_files...... %d\n", dev->n_evicted_files);
+	buf += sprintf(buf, "tnode_evictions...... %u\n", dev->tnode_evictions);
+	buf += sprintf(buf, "tnode_rebuilds....... %u\n", dev->tnode_rebuilds);
+	buf += sprintf(buf, "tnode_rebuild_blocks. %u\n",
+				dev->tnode_rebuild_blocks);
+	buf += sprintf(buf, "tnode_rebuild_reads.. %u\n",
+				dev->tnode_rebuild_reads);
+	buf += sprintf(buf, "n_hole_bytes_read.... %u\n",
+				dev->n_hole_bytes_read);
+	buf += sprintf(buf, "n_xip_bytes_read..... %u\n",
+				dev->n_xip_bytes_read);
+	buf += sprintf(buf, "gc_paced............. %u\n", dev->gc_paced);
+	buf += sprintf(buf, "gc_stalls............ %u\n", dev->gc_stalls);
+	buf += sprintf(buf, "gc_max_write_copies.. %u\n",
+				dev->gc_max_write_copies);
+	buf += sprintf(buf, "n_discards........... %u\n", dev->n_discards);
+	buf += sprintf(buf, "n_discarded_chunks... %u\n",
+				dev->n_discarded_chunks);
 
 	return buf;
 }
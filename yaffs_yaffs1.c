@@ -19,6 +19,29 @@
 #include "yaffs_nand.h"
 #include "yaffs_attribs.h"
 
+/* A header found to be stale by the scan. Deleting it means writing to
+ * flash, so that is left until all the reading is done.
+ */
+struct yaffs1_stale_hdr {
+	int chunk;
+	struct yaffs1_stale_hdr *next;
+};
+
+static void yaffs1_stale_hdr(struct yaffs_dev *dev,
+			     struct yaffs1_stale_hdr **list, int chunk)
+{
+	struct yaffs1_stale_hdr *stale;
+
+	stale = kmalloc(sizeof(struct yaffs1_stale_hdr), GFP_NOFS);
+	if (!stale) {
+		yaffs_chunk_del(dev, chunk, 1, __LINE__);
+		return;
+	}
+	stale->chunk = chunk;
+	stale->next = *list;
+	*list = stale;
+}
+
 int yaffs1_scan(struct yaffs_dev *dev)
 {
 	struct yaffs_ext_tags tags;
@@ -36,6 +59,10 @@ int yaffs1_scan(struct yaffs_dev *dev)
 	struct yaffs_obj *parent;
 	int alloc_failed = 0;
 	struct yaffs_shadow_fixer *shadow_fixers = NULL;
+	struct yaffs1_stale_hdr *stale_hdrs = NULL;
+	struct yaffs_spare *spares = NULL;
+	struct yaffs_ext_tags *block_tags = NULL;
+	int batched;
 	u8 *chunk_data;
 
 	yaffs_trace(YAFFS_TRACE_SCAN,
@@ -44,6 +71,20 @@ int yaffs1_scan(struct yaffs_dev *dev)
 
 	chunk_data = yaffs_get_temp_buffer(dev);
 
+	/* If the driver can, read each block's tags in one go */
+	if (dev->param.read_spares_fn && !dev->param.read_chunk_tags_fn) {
+		spares = kmalloc(dev->param.chunks_per_block *
+				 sizeof(struct yaffs_spare), GFP_NOFS);
+		block_tags = kmalloc(dev->param.chunks_per_block *
+				     sizeof(struct yaffs_ext_tags), GFP_NOFS);
+		if (!spares || !block_tags) {
+			kfree(spares);
+			kfree(block_tags);
+			spares = NULL;
+			block_tags = NULL;
+		}
+	}
+
 	dev->seq_number = YAFFS_LOWEST_SEQUENCE_NUMBER;
 
 	/* Scan all the blocks to determine their state */
@@ -57,9 +98,9 @@ int yaffs1_scan(struct yaffs_dev *dev)
 		yaffs_query_init_block_state(dev, blk, &state, &seq_number);
 
 		bi->block_state = state;
-		bi->seq_number = seq_number;
+		yaffs_set_block_seq(dev, bi, seq_number);
 
-		if (bi->seq_number == YAFFS_SEQUENCE_BAD_BLOCK)
+		if (seq_number == YAFFS_SEQUENCE_BAD_BLOCK)
 			bi->block_state = state = YAFFS_BLOCK_STATE_DEAD;
 
 		yaffs_trace(YAFFS_TRACE_SCAN_DEBUG,
@@ -88,6 +129,12 @@ int yaffs1_scan(struct yaffs_dev *dev)
 
 		deleted = 0;
 
+		batched = block_tags && state == YAFFS_BLOCK_STATE_NEEDS_SCAN &&
+			yaffs_rd_spares_tags_nand(dev,
+				blk * dev->param.chunks_per_block,
+				dev->param.chunks_per_block,
+				spares, block_tags) == YAFFS_OK;
+
 		/* For each chunk in each block that needs scanning.... */
 		for (c = 0;
 			!alloc_failed && c < dev->param.chunks_per_block &&
@@ -95,8 +142,11 @@ int yaffs1_scan(struct yaffs_dev *dev)
 			/* Read the tags and decide what to do */
 			chunk = blk * dev->param.chunks_per_block + c;
 
-			result = yaffs_rd_chunk_tags_nand(dev, chunk, NULL,
-							  &tags);
+			if (batched)
+				tags = block_tags[c];
+			else
+				result = yaffs_rd_chunk_tags_nand(dev, chunk,
+								  NULL, &tags);
 
 			/* Let's have a good look at this chunk... */
 
@@ -242,15 +292,15 @@ int yaffs1_scan(struct yaffs_dev *dev)
 					    new_serial) {
 						/* Use new one - destroy the
 						 * exisiting one */
-						yaffs_chunk_del(dev,
-								in->hdr_chunk,
-								1, __LINE__);
+						yaffs1_stale_hdr(dev,
+							&stale_hdrs,
+							in->hdr_chunk);
 						in->valid = 0;
 					} else {
 						/* Use existing - destroy
 						 * this one. */
-						yaffs_chunk_del(dev, chunk, 1,
-								__LINE__);
+						yaffs1_stale_hdr(dev,
+							&stale_hdrs, chunk);
 					}
 				}
 
@@ -377,8 +427,21 @@ int yaffs1_scan(struct yaffs_dev *dev)
 			yaffs_block_became_dirty(dev, blk);
 	}
 
+	kfree(spares);
+	kfree(block_tags);
+
 	/* Ok, we've done all the scanning.
-	 * Fix up the hard link chains.
+	 * Delete the stale headers.
+	 */
+	while (stale_hdrs) {
+		struct yaffs1_stale_hdr *stale = stale_hdrs;
+
+		stale_hdrs = stale->next;
+		yaffs_chunk_del(dev, stale->chunk, 1, __LINE__);
+		kfree(stale);
+	}
+
+	/* Fix up the hard link chains.
 	 * We should now have scanned all the objects, now it's time to add
 	 * these hardlinks.
 	 */
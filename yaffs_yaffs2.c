@@ -21,6 +21,8 @@
 #include "yaffs_verify.h"
 #include "yaffs_attribs.h"
 #include "yaffs_summary.h"
+#include "yaffs_tracebuf.h"
+#include "yaffs_nandprof.h"
 
 /*
  * Checkpoints are really no benefit on very small partitions.
@@ -29,7 +31,209 @@
  * the partition is at least this big.
  */
 #define YAFFS_CHECKPOINT_MIN_BLOCKS 60
-#define YAFFS_SMALL_HOLE_THRESHOLD 4
+
+#ifdef CONFIG_YAFFS_COMPACT_BLOCKS
+/* Block info as checkpointed, the layout of the normal yaffs_block_info */
+struct yaffs_checkpt_block_info {
+	int soft_del_pages:10;
+	int pages_in_use:10;
+	unsigned block_state:4;
+	u32 needs_retiring:1;
+	u32 skip_erased_check:1;
+	u32 gc_prioritise:1;
+	u32 chunk_error_strikes:3;
+	u32 has_summary:1;
+	u32 has_shrink_hdr:1;
+	u32 seq_number;
+};
+#else
+#define yaffs_checkpt_block_info yaffs_block_info
+#endif
+
+/*
+ * Sequence ordered block heaps.
+ *
+ * full_heap holds the blocks that are FULL, dirty_heap those of them that
+ * have chunks that are deleted or were never written. Both are min-heaps
+ * on block sequence number so the oldest of each is at the top. Blocks
+ * are added as they fill up or get dirty and taken out when they are
+ * erased or retired. A block being collected stays in them.
+ *
+ * The heaps are built from the block infos the first time they are needed
+ * after a mount, or after the sequence numbers were changed. If they can't
+ * be allocated the block infos are searched instead.
+ */
+
+static inline u32 yaffs2_heap_seq(struct yaffs_dev *dev, u32 blk)
+{
+	return yaffs_block_seq(dev, yaffs_get_block_info(dev, blk));
+}
+
+static inline void yaffs2_heap_set(struct yaffs_dev *dev,
+				   struct yaffs_block_heap *h, int i, u32 blk)
+{
+	h->blk[i] = blk;
+	h->pos[blk - dev->internal_start_block] = i + 1;
+}
+
+static void yaffs2_heap_up(struct yaffs_dev *dev, struct yaffs_block_heap *h,
+			   int i)
+{
+	u32 blk = h->blk[i];
+	u32 seq = yaffs2_heap_seq(dev, blk);
+	int parent;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (yaffs2_heap_seq(dev, h->blk[parent]) <= seq)
+			break;
+		yaffs2_heap_set(dev, h, i, h->blk[parent]);
+		i = parent;
+	}
+	yaffs2_heap_set(dev, h, i, blk);
+}
+
+static void yaffs2_heap_down(struct yaffs_dev *dev, struct yaffs_block_heap *h,
+			     int i)
+{
+	u32 blk = h->blk[i];
+	u32 seq = yaffs2_heap_seq(dev, blk);
+	int child;
+
+	while ((child = 2 * i + 1) < h->n) {
+		if (child + 1 < h->n &&
+		    yaffs2_heap_seq(dev, h->blk[child + 1]) <
+		    yaffs2_heap_seq(dev, h->blk[child]))
+			child++;
+		if (seq <= yaffs2_heap_seq(dev, h->blk[child]))
+			break;
+		yaffs2_heap_set(dev, h, i, h->blk[child]);
+		i = child;
+	}
+	yaffs2_heap_set(dev, h, i, blk);
+}
+
+static void yaffs2_heap_add(struct yaffs_dev *dev, struct yaffs_block_heap *h,
+			    u32 blk)
+{
+	if (h->pos[blk - dev->internal_start_block])
+		return;
+	h->blk[h->n] = blk;
+	h->n++;
+	yaffs2_heap_up(dev, h, h->n - 1);
+}
+
+static void yaffs2_heap_remove(struct yaffs_dev *dev,
+			       struct yaffs_block_heap *h, u32 blk)
+{
+	int i = h->pos[blk - dev->internal_start_block] - 1;
+	u32 last;
+
+	if (i < 0)
+		return;
+	h->pos[blk - dev->internal_start_block] = 0;
+	h->n--;
+	if (i == h->n)
+		return;
+
+	last = h->blk[h->n];
+	yaffs2_heap_set(dev, h, i, last);
+	if (i > 0 && yaffs2_heap_seq(dev, h->blk[(i - 1) / 2]) >
+	    yaffs2_heap_seq(dev, last))
+		yaffs2_heap_up(dev, h, i);
+	else
+		yaffs2_heap_down(dev, h, i);
+}
+
+static int yaffs2_block_is_dirty(struct yaffs_dev *dev, int blk,
+				 struct yaffs_block_info *bi)
+{
+	int n_written = dev->param.chunks_per_block;
+
+	if (blk == dev->alloc_block)
+		n_written = dev->alloc_page;
+	return (bi->pages_in_use - bi->soft_del_pages) < n_written;
+}
+
+void yaffs2_deinit_block_heaps(struct yaffs_dev *dev)
+{
+	if (dev->block_heaps_alt && dev->full_heap.blk)
+		vfree(dev->full_heap.blk);
+	else
+		kfree(dev->full_heap.blk);
+	memset(&dev->full_heap, 0, sizeof(dev->full_heap));
+	memset(&dev->dirty_heap, 0, sizeof(dev->dirty_heap));
+	dev->block_heaps_alt = 0;
+	dev->block_heaps_valid = 0;
+}
+
+static int yaffs2_build_block_heaps(struct yaffs_dev *dev)
+{
+	int n_blocks = dev->internal_end_block - dev->internal_start_block + 1;
+	int n_bytes = n_blocks * 4 * sizeof(u32);
+	struct yaffs_block_info *bi;
+	u32 *mem = dev->full_heap.blk;
+	int blk;
+	int i;
+
+	if (!mem) {
+		mem = kmalloc(n_bytes, GFP_NOFS);
+		dev->block_heaps_alt = 0;
+		if (!mem) {
+			mem = vmalloc(n_bytes);
+			dev->block_heaps_alt = 1;
+		}
+		if (!mem)
+			return 0;
+	}
+	memset(mem, 0, n_bytes);
+	dev->full_heap.blk = mem;
+	dev->full_heap.pos = mem + n_blocks;
+	dev->dirty_heap.blk = mem + 2 * n_blocks;
+	dev->dirty_heap.pos = mem + 3 * n_blocks;
+	dev->full_heap.n = 0;
+	dev->dirty_heap.n = 0;
+
+	for (blk = dev->internal_start_block, bi = dev->block_info;
+	     blk <= dev->internal_end_block; blk++, bi++) {
+		if (bi->block_state == YAFFS_BLOCK_STATE_FULL ||
+		    bi->block_state == YAFFS_BLOCK_STATE_COLLECTING)
+			yaffs2_heap_set(dev, &dev->full_heap,
+					dev->full_heap.n++, blk);
+		else if (bi->block_state != YAFFS_BLOCK_STATE_ALLOCATING)
+			continue;
+		if (yaffs2_block_is_dirty(dev, blk, bi))
+			yaffs2_heap_set(dev, &dev->dirty_heap,
+					dev->dirty_heap.n++, blk);
+	}
+	for (i = dev->full_heap.n / 2 - 1; i >= 0; i--)
+		yaffs2_heap_down(dev, &dev->full_heap, i);
+	for (i = dev->dirty_heap.n / 2 - 1; i >= 0; i--)
+		yaffs2_heap_down(dev, &dev->dirty_heap, i);
+
+	dev->block_heaps_valid = 1;
+	return 1;
+}
+
+static int yaffs2_block_heaps_ok(struct yaffs_dev *dev)
+{
+	return dev->block_heaps_valid || yaffs2_build_block_heaps(dev);
+}
+
+/*
+ * yaffs2_block_became_full()
+ * Called when the allocator is done with a block.
+ */
+void yaffs2_block_became_full(struct yaffs_dev *dev, int block_no,
+			      struct yaffs_block_info *bi)
+{
+	if (!dev->param.is_yaffs2 || !dev->block_heaps_valid)
+		return;
+
+	yaffs2_heap_add(dev, &dev->full_heap, block_no);
+	if (yaffs2_block_is_dirty(dev, block_no, bi))
+		yaffs2_update_oldest_dirty_seq(dev, block_no, bi);
+}
 
 /*
  * Oldest Dirty Sequence Number handling.
@@ -49,6 +253,19 @@ void yaffs_calc_oldest_dirty_seq(struct yaffs_dev *dev)
 	if (!dev->param.is_yaffs2)
 		return;
 
+	if (yaffs2_block_heaps_ok(dev)) {
+		if (dev->dirty_heap.n < 1)
+			return;
+		block_no = dev->dirty_heap.blk[0];
+		b = yaffs_get_block_info(dev, block_no);
+		/* An allocating or collecting block isn't a candidate */
+		if (b->block_state == YAFFS_BLOCK_STATE_FULL) {
+			dev->oldest_dirty_seq = yaffs_block_seq(dev, b);
+			dev->oldest_dirty_block = block_no;
+		}
+		return;
+	}
+
 	/* Find the oldest dirty sequence number. */
 	seq = dev->seq_number + 1;
 	b = dev->block_info;
@@ -56,8 +273,8 @@ void yaffs_calc_oldest_dirty_seq(struct yaffs_dev *dev)
 		if (b->block_state == YAFFS_BLOCK_STATE_FULL &&
 		    (b->pages_in_use - b->soft_del_pages) <
 		    dev->param.chunks_per_block &&
-		    b->seq_number < seq) {
-			seq = b->seq_number;
+		    yaffs_block_seq(dev, b) < seq) {
+			seq = yaffs_block_seq(dev, b);
 			block_no = i;
 		}
 		b++;
@@ -83,6 +300,7 @@ void yaffs2_find_oldest_dirty_seq(struct yaffs_dev *dev)
  * Called when a block is erased or marked bad. (ie. when its seq_number
  * becomes invalid). If the value matches the oldest then we clear
  * dev->oldest_dirty_seq to force its recomputation.
+ * A NULL bi means that any sequence numbers may have changed.
  */
 void yaffs2_clear_oldest_dirty_seq(struct yaffs_dev *dev,
 				   struct yaffs_block_info *bi)
@@ -91,7 +309,18 @@ void yaffs2_clear_oldest_dirty_seq(struct yaffs_dev *dev,
 	if (!dev->param.is_yaffs2)
 		return;
 
-	if (!bi || bi->seq_number == dev->oldest_dirty_seq) {
+	if (!bi) {
+		dev->block_heaps_valid = 0;
+		yaffs2_deinit_shrink_seqs(dev);
+	} else if (dev->block_heaps_valid) {
+		u32 block_no = dev->internal_start_block +
+				(bi - dev->block_info);
+
+		yaffs2_heap_remove(dev, &dev->full_heap, block_no);
+		yaffs2_heap_remove(dev, &dev->dirty_heap, block_no);
+	}
+
+	if (!bi || yaffs_block_seq(dev, bi) == dev->oldest_dirty_seq) {
 		dev->oldest_dirty_seq = 0;
 		dev->oldest_dirty_block = 0;
 	}
@@ -108,16 +337,88 @@ void yaffs2_update_oldest_dirty_seq(struct yaffs_dev *dev, unsigned block_no,
 	if (!dev->param.is_yaffs2)
 		return;
 
+	if (dev->block_heaps_valid)
+		yaffs2_heap_add(dev, &dev->dirty_heap, block_no);
+
 	if (dev->oldest_dirty_seq) {
-		if (dev->oldest_dirty_seq > bi->seq_number) {
-			dev->oldest_dirty_seq = bi->seq_number;
+		if (dev->oldest_dirty_seq > yaffs_block_seq(dev, bi)) {
+			dev->oldest_dirty_seq = yaffs_block_seq(dev, bi);
 			dev->oldest_dirty_block = block_no;
 		}
 	}
 }
 
+/*
+ * Shrink headers.
+ *
+ * A shrink header stops chunks pruned off its file from coming back on the
+ * next scan, so its block must not be erased while they are on flash. All
+ * of them are in blocks up to the file's pruned_seq when the header was
+ * written. shrink_seqs keeps the highest of these for each block so that
+ * the block can be collected once every block up to there is clean,
+ * rather than every block older than itself.
+ */
+
+void yaffs2_deinit_shrink_seqs(struct yaffs_dev *dev)
+{
+	if (dev->shrink_seqs_alt && dev->shrink_seqs)
+		vfree(dev->shrink_seqs);
+	else
+		kfree(dev->shrink_seqs);
+	dev->shrink_seqs = NULL;
+	dev->shrink_seqs_alt = 0;
+}
+
+static u32 *yaffs2_get_shrink_seqs(struct yaffs_dev *dev)
+{
+	int n_bytes = (dev->internal_end_block - dev->internal_start_block + 1) *
+			sizeof(u32);
+
+	if (dev->shrink_seqs)
+		return dev->shrink_seqs;
+
+	dev->shrink_seqs = kmalloc(n_bytes, GFP_NOFS);
+	dev->shrink_seqs_alt = 0;
+	if (!dev->shrink_seqs) {
+		dev->shrink_seqs = vmalloc(n_bytes);
+		dev->shrink_seqs_alt = 1;
+	}
+	if (dev->shrink_seqs)
+		memset(dev->shrink_seqs, 0, n_bytes);
+	return dev->shrink_seqs;
+}
+
+/*
+ * yaffs2_shrink_hdr_written()
+ * A shrink header was written to nand_chunk. protect_seq is the newest
+ * block it protects, 0 for any block older than its own.
+ */
+void yaffs2_shrink_hdr_written(struct yaffs_dev *dev, int nand_chunk,
+			       u32 protect_seq)
+{
+	int block_no = nand_chunk / dev->param.chunks_per_block;
+	struct yaffs_block_info *bi = yaffs_get_block_info(dev, block_no);
+	u32 *seqs = NULL;
+
+	if (protect_seq || dev->shrink_seqs)
+		seqs = yaffs2_get_shrink_seqs(dev);
+
+	if (seqs) {
+		seqs += block_no - dev->internal_start_block;
+		if (!protect_seq || (bi->has_shrink_hdr && !*seqs))
+			*seqs = 0;
+		else if (!bi->has_shrink_hdr || protect_seq > *seqs)
+			*seqs = protect_seq;
+	}
+	bi->has_shrink_hdr = 1;
+}
+
 int yaffs_block_ok_for_gc(struct yaffs_dev *dev, struct yaffs_block_info *bi)
 {
+	u32 protect_seq = 0;
+
+	if (yaffs_block_pinned(dev, bi))
+		return 0;	/* Mapped for execute in place */
 
 	if (!dev->param.is_yaffs2)
 		return 1;	/* disqualification only applies to yaffs2. */
@@ -130,7 +431,13 @@ int yaffs_block_ok_for_gc(struct yaffs_dev *dev, struct yaffs_block_info *bi)
 	/* Can't do gc of this block if there are any blocks older than this
 	 * one that have discarded pages.
 	 */
-	return (bi->seq_number <= dev->oldest_dirty_seq);
+	if (yaffs_block_seq(dev, bi) <= dev->oldest_dirty_seq)
+		return 1;
+
+	/* Unless they are all newer than the blocks it protects */
+	if (dev->shrink_seqs)
+		protect_seq = dev->shrink_seqs[bi - dev->block_info];
+	return protect_seq && protect_seq < dev->oldest_dirty_seq;
 }
 
 /*
@@ -170,17 +477,30 @@ u32 yaffs2_find_refresh_block(struct yaffs_dev *dev)
 	 */
 	dev->refresh_skip = dev->param.refresh_period;
 	dev->refresh_count++;
-	bi = dev->block_info;
-	for (b = dev->internal_start_block; b <= dev->internal_end_block; b++) {
+	if (yaffs2_block_heaps_ok(dev)) {
+		if (dev->full_heap.n > 0) {
+			b = dev->full_heap.blk[0];
+			bi = yaffs_get_block_info(dev, b);
+			if (bi->block_state == YAFFS_BLOCK_STATE_FULL) {
+				oldest = b;
+				oldest_seq = yaffs_block_seq(dev, bi);
+			}
+		}
+	} else {
+		bi = dev->block_info;
+		for (b = dev->internal_start_block;
+		     b <= dev->internal_end_block; b++) {
 
-		if (bi->block_state == YAFFS_BLOCK_STATE_FULL) {
+			if (bi->block_state == YAFFS_BLOCK_STATE_FULL) {
 
-			if (oldest < 1 || bi->seq_number < oldest_seq) {
-				oldest = b;
-				oldest_seq = bi->seq_number;
+				if (oldest < 1 ||
+				    yaffs_block_seq(dev, bi) < oldest_seq) {
+					oldest = b;
+					oldest_seq = yaffs_block_seq(dev, bi);
+				}
 			}
+			bi++;
 		}
-		bi++;
 	}
 
 	if (oldest > 0) {
@@ -220,7 +540,7 @@ int yaffs_calc_checkpt_blocks_required(struct yaffs_dev *dev)
 		dev_blocks = dev->param.end_block - dev->param.start_block + 1;
 		n_bytes += sizeof(struct yaffs_checkpt_validity);
 		n_bytes += sizeof(struct yaffs_checkpt_dev);
-		n_bytes += dev_blocks * sizeof(struct yaffs_block_info);
+		n_bytes += dev_blocks * sizeof(struct yaffs_checkpt_block_info);
 		n_bytes += dev_blocks * dev->chunk_bit_stride;
 		n_bytes +=
 		    (sizeof(struct yaffs_checkpt_obj) + sizeof(u32)) *
@@ -256,7 +576,10 @@ static int yaffs2_wr_checkpt_validity_marker(struct yaffs_dev *dev, int head)
 
 	cp.struct_type = sizeof(cp);
 	cp.magic = YAFFS_MAGIC;
-	cp.version = YAFFS_CHECKPOINT_VERSION;
+	/* Older code must not take an evicted file for an empty one */
+	cp.version = dev->n_evicted_files ?
+			YAFFS_CHECKPOINT_VERSION_EVICTED :
+			YAFFS_CHECKPOINT_VERSION;
 	cp.head = (head) ? 1 : 0;
 
 	return (yaffs2_checkpt_wr(dev, &cp, sizeof(cp)) == sizeof(cp)) ? 1 : 0;
@@ -272,11 +595,157 @@ static int yaffs2_rd_checkpt_validity_marker(struct yaffs_dev *dev, int head)
 	if (ok)
 		ok = (cp.struct_type == sizeof(cp)) &&
 		    (cp.magic == YAFFS_MAGIC) &&
-		    (cp.version == YAFFS_CHECKPOINT_VERSION) &&
+		    (cp.version == YAFFS_CHECKPOINT_VERSION ||
+		     cp.version == YAFFS_CHECKPOINT_VERSION_EVICTED) &&
 		    (cp.head == ((head) ? 1 : 0));
+	if (ok && head)
+		dev->checkpt_evicted =
+			(cp.version == YAFFS_CHECKPOINT_VERSION_EVICTED);
 	return ok ? 1 : 0;
 }
 
+#ifdef CONFIG_YAFFS_COMPACT_BLOCKS
+/*
+ * Compact block info is written to the checkpoint in the layout of the
+ * normal struct yaffs_block_info, with the chunk bitmap of every block.
+ */
+static int yaffs2_wr_checkpt_blocks(struct yaffs_dev *dev)
+{
+	struct yaffs_checkpt_block_info cbi;
+	struct yaffs_block_info *bi;
+	u8 *bits;
+	int blk;
+	int ok = 1;
+
+	memset(&cbi, 0, sizeof(cbi));
+	for (blk = dev->internal_start_block;
+	     ok && blk <= dev->internal_end_block; blk++) {
+		bi = yaffs_get_block_info(dev, blk);
+		cbi.soft_del_pages = bi->soft_del_pages;
+		cbi.pages_in_use = bi->pages_in_use;
+		cbi.block_state = bi->block_state;
+		cbi.needs_retiring = bi->needs_retiring;
+		cbi.skip_erased_check = bi->skip_erased_check;
+		cbi.gc_prioritise = bi->gc_prioritise;
+		cbi.chunk_error_strikes = bi->chunk_error_strikes;
+		cbi.has_summary = bi->has_summary;
+		cbi.has_shrink_hdr = bi->has_shrink_hdr;
+		cbi.seq_number = yaffs_block_seq(dev, bi);
+		ok = (yaffs2_checkpt_wr(dev, &cbi, sizeof(cbi)) ==
+			sizeof(cbi));
+	}
+
+	bits = yaffs_get_temp_buffer(dev);
+	for (blk = dev->internal_start_block;
+	     ok && blk <= dev->internal_end_block; blk++) {
+		yaffs_get_chunk_bits(dev, blk, bits);
+		ok = (yaffs2_checkpt_wr(dev, bits, dev->chunk_bit_stride) ==
+			dev->chunk_bit_stride);
+	}
+	yaffs_release_temp_buffer(dev, bits);
+
+	return ok;
+}
+
+static int yaffs2_rd_checkpt_blocks(struct yaffs_dev *dev)
+{
+	struct yaffs_checkpt_block_info cbi;
+	struct yaffs_block_info *bi;
+	u32 seq_min = 0;
+	u8 *bits;
+	int blk;
+	int ok = 1;
+
+	/* Every sequence number must fit below the checkpoint's. If the
+	 * checkpoint came from a normal build they might not, then the
+	 * device gets scanned instead. */
+	if (dev->seq_number > YAFFS_MAX_SEQ_OFFSET)
+		seq_min = dev->seq_number - YAFFS_MAX_SEQ_OFFSET + 1;
+	dev->seq_base = seq_min ? seq_min - 1 : 0;
+
+	for (blk = dev->internal_start_block;
+	     ok && blk <= dev->internal_end_block; blk++) {
+		ok = (yaffs2_checkpt_rd(dev, &cbi, sizeof(cbi)) ==
+			sizeof(cbi));
+		if (!ok)
+			break;
+		bi = yaffs_get_block_info(dev, blk);
+		bi->soft_del_pages = cbi.soft_del_pages;
+		bi->pages_in_use = cbi.pages_in_use;
+		bi->block_state = cbi.block_state;
+		bi->needs_retiring = cbi.needs_retiring;
+		bi->skip_erased_check = cbi.skip_erased_check;
+		bi->gc_prioritise = cbi.gc_prioritise;
+		bi->chunk_error_strikes = cbi.chunk_error_strikes;
+		bi->has_summary = cbi.has_summary;
+		bi->has_shrink_hdr = cbi.has_shrink_hdr;
+		if (bi->block_state == YAFFS_BLOCK_STATE_DEAD ||
+		    cbi.seq_number < YAFFS_LOWEST_SEQUENCE_NUMBER ||
+		    cbi.seq_number >= YAFFS_HIGHEST_SEQUENCE_NUMBER)
+			bi->seq_offset = 0;
+		else if (cbi.seq_number < seq_min ||
+			 cbi.seq_number > dev->seq_number)
+			ok = 0;
+		else
+			bi->seq_offset = cbi.seq_number - dev->seq_base;
+	}
+
+	bits = yaffs_get_temp_buffer(dev);
+	for (blk = dev->internal_start_block;
+	     ok && blk <= dev->internal_end_block; blk++) {
+		ok = (yaffs2_checkpt_rd(dev, bits, dev->chunk_bit_stride) ==
+			dev->chunk_bit_stride) &&
+		     yaffs_put_chunk_bits(dev, blk, bits) == YAFFS_OK;
+	}
+	yaffs_release_temp_buffer(dev, bits);
+
+	if (ok)
+		yaffs_pack_block_seqs(dev);
+
+	return ok;
+}
+#else
+static int yaffs2_wr_checkpt_blocks(struct yaffs_dev *dev)
+{
+	u32 n_bytes;
+	u32 n_blocks = dev->internal_end_block - dev->internal_start_block + 1;
+	int ok;
+
+	/* Write block info */
+	n_bytes = n_blocks * sizeof(struct yaffs_block_info);
+	ok = (yaffs2_checkpt_wr(dev, dev->block_info, n_bytes) == n_bytes);
+	if (!ok)
+		return 0;
+
+	/* Write chunk bits */
+	n_bytes = n_blocks * dev->chunk_bit_stride;
+	ok = (yaffs2_checkpt_wr(dev, dev->chunk_bits, n_bytes) == n_bytes);
+
+	return ok ? 1 : 0;
+}
+
+static int yaffs2_rd_checkpt_blocks(struct yaffs_dev *dev)
+{
+	u32 n_bytes;
+	u32 n_blocks =
+	    (dev->internal_end_block - dev->internal_start_block + 1);
+	int ok;
+
+	n_bytes = n_blocks * sizeof(struct yaffs_block_info);
+
+	ok = (yaffs2_checkpt_rd(dev, dev->block_info, n_bytes) == n_bytes);
+
+	if (!ok)
+		return 0;
+
+	n_bytes = n_blocks * dev->chunk_bit_stride;
+
+	ok = (yaffs2_checkpt_rd(dev, dev->chunk_bits, n_bytes) == n_bytes);
+
+	return ok ? 1 : 0;
+}
+#endif
+
 static void yaffs2_dev_to_checkpt_dev(struct yaffs_checkpt_dev *cp,
 				      struct yaffs_dev *dev)
 {
@@ -309,8 +778,6 @@ static void yaffs_checkpt_dev_to_dev(struct yaffs_dev *dev,
 static int yaffs2_wr_checkpt_dev(struct yaffs_dev *dev)
 {
 	struct yaffs_checkpt_dev cp;
-	u32 n_bytes;
-	u32 n_blocks = dev->internal_end_block - dev->internal_start_block + 1;
 	int ok;
 
 	/* Write device runtime values */
@@ -321,25 +788,12 @@ static int yaffs2_wr_checkpt_dev(struct yaffs_dev *dev)
 	if (!ok)
 		return 0;
 
-	/* Write block info */
-	n_bytes = n_blocks * sizeof(struct yaffs_block_info);
-	ok = (yaffs2_checkpt_wr(dev, dev->block_info, n_bytes) == n_bytes);
-	if (!ok)
-		return 0;
-
-	/* Write chunk bits */
-	n_bytes = n_blocks * dev->chunk_bit_stride;
-	ok = (yaffs2_checkpt_wr(dev, dev->chunk_bits, n_bytes) == n_bytes);
-
-	return ok ? 1 : 0;
+	return yaffs2_wr_checkpt_blocks(dev);
 }
 
 static int yaffs2_rd_checkpt_dev(struct yaffs_dev *dev)
 {
 	struct yaffs_checkpt_dev cp;
-	u32 n_bytes;
-	u32 n_blocks =
-	    (dev->internal_end_block - dev->internal_start_block + 1);
 	int ok;
 
 	ok = (yaffs2_checkpt_rd(dev, &cp, sizeof(cp)) == sizeof(cp));
@@ -351,18 +805,7 @@ static int yaffs2_rd_checkpt_dev(struct yaffs_dev *dev)
 
 	yaffs_checkpt_dev_to_dev(dev, &cp);
 
-	n_bytes = n_blocks * sizeof(struct yaffs_block_info);
-
-	ok = (yaffs2_checkpt_rd(dev, dev->block_info, n_bytes) == n_bytes);
-
-	if (!ok)
-		return 0;
-
-	n_bytes = n_blocks * dev->chunk_bit_stride;
-
-	ok = (yaffs2_checkpt_rd(dev, dev->chunk_bits, n_bytes) == n_bytes);
-
-	return ok ? 1 : 0;
+	return yaffs2_rd_checkpt_blocks(dev);
 }
 
 static void yaffs2_obj_checkpt_obj(struct yaffs_checkpt_obj *cp,
@@ -378,6 +821,7 @@ static void yaffs2_obj_checkpt_obj(struct yaffs_checkpt_obj *cp,
 	cp->fake = obj->fake;
 	cp->rename_allowed = obj->rename_allowed;
 	cp->unlink_allowed = obj->unlink_allowed;
+	cp->tnodes_evicted = obj->tnodes_evicted;
 	cp->serial = obj->serial;
 	cp->n_data_chunks = obj->n_data_chunks;
 
@@ -619,6 +1063,9 @@ static int yaffs2_rd_checkpt_objs(struct yaffs_dev *dev)
 				if (obj->variant_type ==
 					YAFFS_OBJECT_TYPE_FILE) {
 					ok = yaffs2_rd_checkpt_tnodes(obj);
+					if (ok && dev->checkpt_evicted &&
+					    cp.tnodes_evicted)
+						yaffs_evict_file_tnodes(obj);
 				} else if (obj->variant_type ==
 					YAFFS_OBJECT_TYPE_HARDLINK) {
 					list_add(&obj->hard_links, &hard_list);
@@ -775,9 +1222,13 @@ static int yaffs2_rd_checkpt_data(struct yaffs_dev *dev)
 
 void yaffs2_checkpt_invalidate(struct yaffs_dev *dev)
 {
+	int old_np_cause = dev->np_cause;
+
 	if (dev->is_checkpointed || dev->blocks_in_checkpt > 0) {
 		dev->is_checkpointed = 0;
+		dev->np_cause = YAFFS_NP_CHECKPT;
 		yaffs2_checkpt_invalidate_stream(dev);
+		dev->np_cause = old_np_cause;
 	}
 	if (dev->param.sb_dirty_fn)
 		dev->param.sb_dirty_fn(dev);
@@ -785,6 +1236,8 @@ void yaffs2_checkpt_invalidate(struct yaffs_dev *dev)
 
 int yaffs_checkpoint_save(struct yaffs_dev *dev)
 {
+	int old_np_cause = dev->np_cause;
+
 	yaffs_trace(YAFFS_TRACE_CHECKPOINT,
 		"save entry: is_checkpointed %d",
 		dev->is_checkpointed);
@@ -793,9 +1246,18 @@ int yaffs_checkpoint_save(struct yaffs_dev *dev)
 	yaffs_verify_blocks(dev);
 	yaffs_verify_free_chunks(dev);
 
+	yaffs_discard_flush(dev);
+
 	if (!dev->is_checkpointed) {
+		yaffs_tb_event0(dev, YAFFS_TRACE_CHECKPOINT,
+				YAFFS_TB_CHECKPT_WR_BEGIN);
+		dev->np_cause = YAFFS_NP_CHECKPT;
 		yaffs2_checkpt_invalidate(dev);
 		yaffs2_wr_checkpt_data(dev);
+		dev->np_cause = old_np_cause;
+		yaffs_tb_event2(dev, YAFFS_TRACE_CHECKPOINT,
+				YAFFS_TB_CHECKPT_WR_END,
+				dev->is_checkpointed, dev->blocks_in_checkpt);
 	}
 
 	yaffs_trace(YAFFS_TRACE_CHECKPOINT | YAFFS_TRACE_MOUNT,
@@ -808,12 +1270,18 @@ int yaffs_checkpoint_save(struct yaffs_dev *dev)
 int yaffs2_checkpt_restore(struct yaffs_dev *dev)
 {
 	int retval;
+	int old_np_cause = dev->np_cause;
 
 	yaffs_trace(YAFFS_TRACE_CHECKPOINT,
 		"restore entry: is_checkpointed %d",
 		dev->is_checkpointed);
 
+	yaffs_tb_event0(dev, YAFFS_TRACE_CHECKPOINT, YAFFS_TB_CHECKPT_RD_BEGIN);
+	dev->np_cause = YAFFS_NP_CHECKPT;
 	retval = yaffs2_rd_checkpt_data(dev);
+	dev->np_cause = old_np_cause;
+	yaffs_tb_event1(dev, YAFFS_TRACE_CHECKPOINT, YAFFS_TB_CHECKPT_RD_END,
+			retval);
 
 	if (dev->is_checkpointed) {
 		yaffs_verify_objects(dev);
@@ -831,17 +1299,14 @@ int yaffs2_checkpt_restore(struct yaffs_dev *dev)
 int yaffs2_handle_hole(struct yaffs_obj *obj, loff_t new_size)
 {
 	/* if new_size > old_file_size.
-	 * We're going to be writing a hole.
-	 * If the hole is small then write zeros otherwise write a start
-	 * of hole marker.
+	 * We're going to be writing a hole. Nothing is written for the hole
+	 * itself, instead a start of hole marker stops chunks from before
+	 * it coming back.
 	 */
-	loff_t old_file_size;
-	int increase;
-	int small_hole;
-	int result = YAFFS_OK;
 	struct yaffs_dev *dev = NULL;
-	u8 *local_buffer = NULL;
-	int small_increase_ok = 0;
+	int first_chunk;
+	int last_chunk;
+	u32 offset;
 
 	if (!obj)
 		return YAFFS_FAIL;
@@ -855,61 +1320,28 @@ int yaffs2_handle_hole(struct yaffs_obj *obj, loff_t new_size)
 	if (!dev->param.is_yaffs2)
 		return YAFFS_OK;
 
-	old_file_size = obj->variant.file_variant.file_size;
-
-	if (new_size <= old_file_size)
+	if (new_size <= obj->variant.file_variant.file_size)
 		return YAFFS_OK;
 
-	increase = new_size - old_file_size;
-
-	if (increase < YAFFS_SMALL_HOLE_THRESHOLD * dev->data_bytes_per_chunk &&
-	    yaffs_check_alloc_available(dev, YAFFS_SMALL_HOLE_THRESHOLD + 1))
-		small_hole = 1;
-	else
-		small_hole = 0;
-
-	if (small_hole)
-		local_buffer = yaffs_get_temp_buffer(dev);
-
-	if (local_buffer) {
-		/* fill hole with zero bytes */
-		int pos = old_file_size;
-		int this_write;
-		int written;
-		memset(local_buffer, 0, dev->data_bytes_per_chunk);
-		small_increase_ok = 1;
-
-		while (increase > 0 && small_increase_ok) {
-			this_write = increase;
-			if (this_write > dev->data_bytes_per_chunk)
-				this_write = dev->data_bytes_per_chunk;
-			written =
-			    yaffs_do_file_wr(obj, local_buffer, pos, this_write,
-					     0);
-			if (written == this_write) {
-				pos += this_write;
-				increase -= this_write;
-			} else {
-				small_increase_ok = 0;
-			}
-		}
-
-		yaffs_release_temp_buffer(dev, local_buffer);
-
-		/* If out of space then reverse any chunks we've added */
-		if (!small_increase_ok)
-			yaffs_resize_file_down(obj, old_file_size);
-	}
+	/* A hole inside the last chunk needs nothing, that chunk is zero
+	 * past the end of the file.
+	 */
+	yaffs_addr_to_chunk(dev, obj->variant.file_variant.file_size,
+			    &first_chunk, &offset);
+	if (offset)
+		first_chunk++;
+	yaffs_addr_to_chunk(dev, new_size - 1, &last_chunk, &offset);
+	if (first_chunk > last_chunk)
+		return YAFFS_OK;
 
-	if (!small_increase_ok &&
-	    obj->parent &&
+	if (obj->parent &&
 	    obj->parent->obj_id != YAFFS_OBJECTID_UNLINKED &&
 	    obj->parent->obj_id != YAFFS_OBJECTID_DELETED) {
 		/* Write a hole start header with the old file size */
 		yaffs_update_oh(obj, NULL, 0, 1, 0, NULL);
 	}
 
-	return result;
+	return YAFFS_OK;
 }
 
 struct yaffs_block_index {
@@ -930,8 +1362,51 @@ static int yaffs2_ybicmp(const void *a, const void *b)
 	return aseq - bseq;
 }
 
+/*
+ * Gives the blocks to be scanned their sequence numbers once they have been
+ * sorted. Compact block info only holds 16 bit offsets so if the blocks are
+ * spread wider than that they are numbered in order instead.
+ */
+static void yaffs2_set_scan_seqs(struct yaffs_dev *dev,
+				 struct yaffs_block_index *block_index, int n)
+{
+	struct yaffs_block_info *bi;
+	int i;
+#ifdef CONFIG_YAFFS_COMPACT_BLOCKS
+	u32 rank = 0;
+
+	if (n < 1) {
+		dev->seq_base = dev->seq_number;
+		return;
+	}
+
+	if ((u32)(block_index[n - 1].seq - block_index[0].seq) <
+	    YAFFS_MAX_SEQ_OFFSET) {
+		dev->seq_base = block_index[0].seq - 1;
+		for (i = 0; i < n; i++) {
+			bi = yaffs_get_block_info(dev, block_index[i].block);
+			bi->seq_offset = block_index[i].seq - dev->seq_base;
+		}
+		return;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (i == 0 || block_index[i].seq != block_index[i - 1].seq)
+			rank++;
+		bi = yaffs_get_block_info(dev, block_index[i].block);
+		bi->seq_offset = rank;
+	}
+	dev->seq_base = block_index[n - 1].seq - rank;
+#else
+	for (i = 0; i < n; i++) {
+		bi = yaffs_get_block_info(dev, block_index[i].block);
+		bi->seq_number = block_index[i].seq;
+	}
+#endif
+}
+
 static inline int yaffs2_scan_chunk(struct yaffs_dev *dev,
-		struct yaffs_block_info *bi,
+		struct yaffs_block_info *bi, u32 seq,
 		int blk, int chunk_in_block,
 		int *found_chunks,
 		u8 *chunk_data,
@@ -955,7 +1430,7 @@ static inline int yaffs2_scan_chunk(struct yaffs_dev *dev,
 
 	if (summary_available) {
 		result = yaffs_summary_fetch(dev, &tags, chunk_in_block);
-		tags.seq_number = bi->seq_number;
+		tags.seq_number = seq;
 	}
 
 	if (!summary_available || tags.obj_id == 0) {
@@ -990,7 +1465,7 @@ static inline int yaffs2_scan_chunk(struct yaffs_dev *dev,
 		} else {
 			if (bi->block_state == YAFFS_BLOCK_STATE_NEEDS_SCAN ||
 			    bi->block_state == YAFFS_BLOCK_STATE_ALLOCATING) {
-				if (dev->seq_number == bi->seq_number) {
+				if (dev->seq_number == seq) {
 					/* Allocating from this block*/
 					yaffs_trace(YAFFS_TRACE_SCAN,
 					    " Allocating from %d %d",
@@ -1026,7 +1501,7 @@ static inline int yaffs2_scan_chunk(struct yaffs_dev *dev,
 		   tags.obj_id == YAFFS_OBJECTID_SUMMARY ||
 		   (tags.chunk_id > 0 &&
 		     tags.n_bytes > dev->data_bytes_per_chunk) ||
-		   tags.seq_number != bi->seq_number) {
+		   tags.seq_number != seq) {
 		yaffs_trace(YAFFS_TRACE_SCAN,
 			"Chunk (%d:%d) with bad tags:obj = %d, chunk_id = %d, n_bytes = %d, ignored",
 			blk, chunk_in_block, tags.obj_id,
@@ -1398,11 +1873,12 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 		yaffs_query_init_block_state(dev, blk, &state, &seq_number);
 
 		bi->block_state = state;
-		bi->seq_number = seq_number;
+		/* Set once the blocks to scan have been sorted */
+		yaffs_set_block_seq(dev, bi, 0);
 
-		if (bi->seq_number == YAFFS_SEQUENCE_CHECKPOINT_DATA)
+		if (seq_number == YAFFS_SEQUENCE_CHECKPOINT_DATA)
 			bi->block_state = YAFFS_BLOCK_STATE_CHECKPOINT;
-		if (bi->seq_number == YAFFS_SEQUENCE_BAD_BLOCK)
+		if (seq_number == YAFFS_SEQUENCE_BAD_BLOCK)
 			bi->block_state = YAFFS_BLOCK_STATE_DEAD;
 
 		yaffs_trace(YAFFS_TRACE_SCAN_DEBUG,
@@ -1447,6 +1923,8 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 	sort(block_index, n_to_scan, sizeof(struct yaffs_block_index),
 		   yaffs2_ybicmp, NULL);
 
+	yaffs2_set_scan_seqs(dev, block_index, n_to_scan);
+
 	cond_resched();
 
 	yaffs_trace(YAFFS_TRACE_SCAN, "...done");
@@ -1486,7 +1964,8 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 			/* Scan backwards...
 			 * Read the tags and decide what to do
 			 */
-			if (yaffs2_scan_chunk(dev, bi, blk, c,
+			if (yaffs2_scan_chunk(dev, bi,
+					block_index[block_iter].seq, blk, c,
 					&found_chunks, chunk_data,
 					&hard_list, summary_available) ==
 					YAFFS_FAIL)
@@ -1499,6 +1978,8 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 			bi->block_state = YAFFS_BLOCK_STATE_FULL;
 		}
 
+		yaffs_tidy_chunk_bits(dev, blk);
+
 		/* Now let's see if it was dirty */
 		if (bi->pages_in_use == 0 &&
 		    !bi->has_shrink_hdr &&
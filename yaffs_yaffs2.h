@@ -24,6 +24,12 @@ void yaffs2_clear_oldest_dirty_seq(struct yaffs_dev *dev,
 				   struct yaffs_block_info *bi);
 void yaffs2_update_oldest_dirty_seq(struct yaffs_dev *dev, unsigned block_no,
 				    struct yaffs_block_info *bi);
+void yaffs2_block_became_full(struct yaffs_dev *dev, int block_no,
+			      struct yaffs_block_info *bi);
+void yaffs2_deinit_block_heaps(struct yaffs_dev *dev);
+void yaffs2_shrink_hdr_written(struct yaffs_dev *dev, int nand_chunk,
+			       u32 protect_seq);
+void yaffs2_deinit_shrink_seqs(struct yaffs_dev *dev);
 int yaffs_block_ok_for_gc(struct yaffs_dev *dev, struct yaffs_block_info *bi);
 u32 yaffs2_find_refresh_block(struct yaffs_dev *dev);
 int yaffs2_checkpt_required(struct yaffs_dev *dev);